@@ -0,0 +1,150 @@
+#!/bin/sh
+# Times dxdasm and dxreasm --source in both output formats, and dxreasm of the
+# recompiled classes when a Java toolchain is around, on synthetic dex files
+# from gendex.  Prints one JSON object per line for every phase of every run:
+#
+#   {"tool":"dxdasm","case":"small","version":"0.2.0","run":1,
+#    "classes":200,"bytes":81234,"phase":"emit","wall_s":0.0123,
+#    "cpu_s":0.0121,"classes_per_s":16260.2,"mb_per_s":6.60}
+#
+# The phases come from the tools' --times option.  Rates are computed from
+# the wall time of the phase against the whole input.
+#
+# Usage: bench.sh [name=gendex_args]...
+#
+# Without arguments a fixed set of cases is run.  Environment:
+#   BENCH_RUNS  runs per case (default 3)
+#   BENCH_JOBS  dxdasm and dxreasm -j (default 1)
+#   BENCH_DIR   scratch directory (default a fresh one under /tmp)
+#   VERSION     version string for the report
+#   GENDEX, DXDASM, DXREASM  tools to run (default ./gendex etc.)
+#   JAVAC, D8   compilers for the recompiled cases (default javac, d8)
+
+GENDEX=${GENDEX:-./gendex}
+DXDASM=${DXDASM:-./dxdasm}
+DXREASM=${DXREASM:-./dxreasm}
+JAVAC=${JAVAC:-javac}
+D8=${D8:-d8}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_JOBS=${BENCH_JOBS:-1}
+VERSION=${VERSION:-unknown}
+
+if [ $# -eq 0 ]; then
+  set -- \
+    "small=-c 200 -m 4 -i 16" \
+    "wide=-c 2000 -m 2 -i 8" \
+    "big-methods=-c 50 -m 16 -i 2000" \
+    "switches=-c 200 -m 4 -i 16 -s 256" \
+    "nested=-c 100 -m 4 -i 16 -d 6" \
+    "strings=-c 200 -m 8 -i 64 -S 60"
+fi
+
+if [ -z "$BENCH_DIR" ]; then
+  BENCH_DIR=$(mktemp -d /tmp/dxdasm-bench.XXXXXX) || exit 1
+  trap 'rm -rf "$BENCH_DIR"' EXIT
+fi
+
+reasm=1
+if ! command -v "$JAVAC" >/dev/null 2>&1 ||
+   ! command -v "$D8" >/dev/null 2>&1; then
+  echo "bench.sh: $JAVAC or $D8 not found, skipping recompiled dxreasm" >&2
+  reasm=
+fi
+
+# Counts the classes gendex writes for the given arguments.
+count_classes() {
+  classes=100
+  depth=0
+  while [ $# -gt 0 ]; do
+    case $1 in
+      -c) classes=$2; shift ;;
+      -d) depth=$2; shift ;;
+    esac
+    shift
+  done
+  echo $((classes * (depth + 1)))
+}
+
+# report tool case run classes bytes times_file
+report() {
+  awk -v tool="$1" -v name="$2" -v run="$3" -v classes="$4" -v bytes="$5" \
+      -v version="$VERSION" '{
+    wall = $2 > 0 ? $2 : 1e-9
+    printf("{\"tool\":\"%s\",\"case\":\"%s\",\"version\":\"%s\"," \
+           "\"run\":%d,\"classes\":%d,\"bytes\":%d,\"phase\":\"%s\"," \
+           "\"wall_s\":%.6f,\"cpu_s\":%.6f,\"classes_per_s\":%.1f," \
+           "\"mb_per_s\":%.3f}\n", tool, name, version, run, classes, bytes,
+           $1, $2, $3, classes / wall, bytes / wall / 1048576)
+  }' "$6"
+}
+
+status=0
+for spec in "$@"; do
+  name=${spec%%=*}
+  args=${spec#*=}
+  dex=$BENCH_DIR/$name.dex
+  # Word splitting of $args is intended.
+  if ! "$GENDEX" $args "$dex"; then
+    echo "bench.sh: gendex failed for $name" >&2
+    status=1
+    continue
+  fi
+  classes=$(count_classes $args)
+  bytes=$(wc -c < "$dex")
+
+  run=1
+  while [ $run -le "$BENCH_RUNS" ]; do
+    out=$BENCH_DIR/$name.out
+    rm -rf "$out"
+    if ! "$DXDASM" -j "$BENCH_JOBS" --times="$BENCH_DIR/times" \
+                   "$dex" "$out"; then
+      echo "bench.sh: dxdasm failed for $name" >&2
+      status=1
+      break
+    fi
+    report dxdasm "$name" $run $classes $bytes "$BENCH_DIR/times"
+
+    if "$DXREASM" -j "$BENCH_JOBS" --times="$BENCH_DIR/times" \
+                  --source="$out" "$dex" "$BENCH_DIR/reasm.dex"; then
+      report dxreasm-source "$name" $run $classes $bytes "$BENCH_DIR/times"
+    else
+      echo "bench.sh: source reassembly failed for $name" >&2
+      status=1
+    fi
+
+    rm -rf "$out.dxasm"
+    if "$DXDASM" -j "$BENCH_JOBS" --times="$BENCH_DIR/times" \
+                 --format=dxasm "$dex" "$out.dxasm"; then
+      report dxdasm-dxasm "$name" $run $classes $bytes "$BENCH_DIR/times"
+      if "$DXREASM" -j "$BENCH_JOBS" --times="$BENCH_DIR/times" \
+                    --source="$out.dxasm" "$dex" "$BENCH_DIR/reasm.dex"; then
+        report dxreasm-dxasm "$name" $run $classes $bytes "$BENCH_DIR/times"
+      else
+        echo "bench.sh: dxasm reassembly failed for $name" >&2
+        status=1
+      fi
+    else
+      echo "bench.sh: dxdasm --format=dxasm failed for $name" >&2
+      status=1
+    fi
+
+    if [ -n "$reasm" ]; then
+      rm -rf "$BENCH_DIR/classes" "$BENCH_DIR/d8"
+      mkdir -p "$BENCH_DIR/classes" "$BENCH_DIR/d8"
+      if find "$out" -name '*.java' > "$BENCH_DIR/sources" &&
+         "$JAVAC" -nowarn -d "$BENCH_DIR/classes" @"$BENCH_DIR/sources" &&
+         "$D8" --output "$BENCH_DIR/d8" \
+               $(find "$BENCH_DIR/classes" -name '*.class') &&
+         "$DXREASM" -j "$BENCH_JOBS" --times="$BENCH_DIR/times" \
+                    "$BENCH_DIR/d8/classes.dex" "$BENCH_DIR/reasm.dex"; then
+        report dxreasm "$name" $run $classes \
+               $(wc -c < "$BENCH_DIR/d8/classes.dex") "$BENCH_DIR/times"
+      else
+        echo "bench.sh: reassembly failed for $name" >&2
+        status=1
+      fi
+    fi
+    run=$((run + 1))
+  done
+done
+exit $status
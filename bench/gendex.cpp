@@ -0,0 +1,394 @@
+#include <dxcut/dxcut.h>
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Generates a synthetic dex file for benchmarking.  The output only depends
+// on the options so every run of a benchmark case decompiles the same input.
+//
+// Every top level class gets a chain of 'depth' inner classes.  Each class
+// has a constructor, four int fields and 'methods' virtual methods of the
+// form int mNNNN(int) made of roughly 'insns' instructions.  'strings' is
+// the percentage of those instructions that load a string constant.  When
+// 'switch_size' is non-zero every method also starts with a packed-switch,
+// a sparse-switch and a fill-array-data of that many entries.
+struct GenOptions {
+  int classes;
+  int methods;
+  int insns;
+  int switch_size;
+  int depth;
+  int strings;
+  unsigned seed;
+};
+
+// Registers used by the generated methods.  v0-v4 hold ints, v5 strings and
+// v6, v7 are 'this' and the int parameter.
+#define INT_REGS 5
+#define STR_REG 5
+#define THIS_REG 6
+#define PARAM_REG 7
+#define NUM_FIELDS 4
+
+static unsigned rng_state;
+
+static unsigned rng() {
+  rng_state = rng_state * 1103515245U + 12345U;
+  return rng_state >> 8;
+}
+
+static DexAnnotation* empty_annotations() {
+  DexAnnotation* annon = (DexAnnotation*)calloc(1, sizeof(DexAnnotation));
+  dxc_make_sentinel_annotation(annon);
+  return annon;
+}
+
+static ref_strstr* make_proto(const char* ret, const char* param) {
+  ref_strstr* proto = dxc_create_strstr(param ? 2 : 1);
+  proto->s[0] = dxc_induct_str(ret);
+  if(param) proto->s[1] = dxc_induct_str(param);
+  return proto;
+}
+
+struct CodeBuilder {
+  vector<DexInstruction> insns;
+  // Branches to patch once the layout is known, as (branch, target) pairs of
+  // instruction indices.
+  vector<pair<size_t, size_t> > branches;
+
+  DexInstruction& add(dx_ubyte op, dx_uint nregs, dx_uint r0 = 0,
+                      dx_uint r1 = 0, dx_uint r2 = 0) {
+    DexInstruction in;
+    memset(&in, 0, sizeof(in));
+    in.opcode = op;
+    dxc_set_num_registers(&in, nregs);
+    dx_uint regs[3] = {r0, r1, r2};
+    for(dx_uint i = 0; i < nregs; i++) dxc_set_register(&in, i, regs[i]);
+    insns.push_back(in);
+    return insns.back();
+  }
+
+  DexInstruction& add_payload(dx_ubyte kind) {
+    DexInstruction in;
+    memset(&in, 0, sizeof(in));
+    in.opcode = OP_PSUEDO;
+    in.hi_byte = kind;
+    insns.push_back(in);
+    return insns.back();
+  }
+
+  // Payloads have to start on an even code unit.
+  void align() {
+    dx_uint addr = 0;
+    for(size_t i = 0; i < insns.size(); i++) {
+      addr += dxc_insn_width(&insns[i]);
+    }
+    if(addr & 1) add_payload(PSUEDO_OP_NOP);
+  }
+};
+
+static void set_method_ref(ref_method* mtd, const string& cls, int index) {
+  char name[16];
+  sprintf(name, "m%04d", index);
+  mtd->defining_class = dxc_induct_str(cls.c_str());
+  mtd->name = dxc_induct_str(name);
+  mtd->prototype = make_proto("I", "I");
+}
+
+static void set_field_ref(ref_field* fld, const string& cls, int index) {
+  char name[16];
+  sprintf(name, "f%d", index);
+  fld->defining_class = dxc_induct_str(cls.c_str());
+  fld->name = dxc_induct_str(name);
+  fld->type = dxc_induct_str("I");
+}
+
+static void gen_body(CodeBuilder& code, const GenOptions& opts,
+                     const string& cls) {
+  for(int i = 0; i < opts.insns; i++) {
+    dx_uint a = rng() % INT_REGS;
+    dx_uint b = rng() % INT_REGS;
+    if(rng() % 100 < (unsigned)opts.strings) {
+      char str[32];
+      sprintf(str, "bench string %u", rng() % 1024);
+      code.add(OP_CONST_STRING, 1, STR_REG).special.str =
+          dxc_induct_str(str);
+      continue;
+    }
+    switch(rng() % 8) {
+      case 0:
+        code.add(OP_CONST_4, 1, a).special.constant =
+            (dx_int)(rng() % 16) - 8;
+        break;
+      case 1:
+        code.add(OP_ADD_INT, 3, a, b, PARAM_REG);
+        break;
+      case 2:
+        code.add(OP_MUL_INT, 3, a, a, b);
+        break;
+      case 3:
+        code.add(OP_ADD_INT_LIT8, 2, a, b).special.constant = rng() % 128;
+        break;
+      case 4:
+        set_field_ref(&code.add(OP_IGET, 2, a, THIS_REG).special.field, cls,
+                      rng() % NUM_FIELDS);
+        break;
+      case 5:
+        set_field_ref(&code.add(OP_IPUT, 2, a, THIS_REG).special.field, cls,
+                      rng() % NUM_FIELDS);
+        break;
+      case 6:
+        set_method_ref(&code.add(OP_INVOKE_VIRTUAL, 2, THIS_REG,
+                                 a).special.method, cls,
+                       rng() % opts.methods);
+        break;
+      case 7:
+        // Skip over the next instruction when a is zero.
+        code.branches.push_back(make_pair(code.insns.size(),
+                                          code.insns.size() + 2));
+        code.add(OP_IF_EQZ, 1, a);
+        code.add(OP_CONST_4, 1, b).special.constant = 1;
+        i++;
+        break;
+    }
+  }
+}
+
+static DexCode* gen_method_code(const GenOptions& opts, const string& cls) {
+  CodeBuilder code;
+  size_t packed = 0, sparse = 0, fill = 0;
+  if(opts.switch_size) {
+    packed = code.insns.size();
+    code.add(OP_PACKED_SWITCH, 1, PARAM_REG);
+    sparse = code.insns.size();
+    code.add(OP_SPARSE_SWITCH, 1, PARAM_REG);
+    code.add(OP_NEW_ARRAY, 2, 0, PARAM_REG).special.type =
+        dxc_induct_str("[I");
+    fill = code.insns.size();
+    code.add(OP_FILL_ARRAY_DATA, 1, 0);
+  }
+  gen_body(code, opts, cls);
+  size_t ret = code.insns.size();
+  code.add(OP_RETURN, 1, 0);
+
+  if(opts.switch_size) {
+    dx_uint n = opts.switch_size;
+    code.align();
+    code.branches.push_back(make_pair(packed, code.insns.size()));
+    DexInstruction& ps = code.add_payload(PSUEDO_OP_PACKED_SWITCH);
+    ps.special.packed_switch.size = n;
+    ps.special.packed_switch.first_key = -(dx_int)n / 2;
+    ps.special.packed_switch.targets = (dx_int*)malloc(n * sizeof(dx_int));
+
+    code.align();
+    code.branches.push_back(make_pair(sparse, code.insns.size()));
+    DexInstruction& ss = code.add_payload(PSUEDO_OP_SPARSE_SWITCH);
+    ss.special.sparse_switch.size = n;
+    ss.special.sparse_switch.keys = (dx_int*)malloc(n * sizeof(dx_int));
+    ss.special.sparse_switch.targets = (dx_int*)malloc(n * sizeof(dx_int));
+    for(dx_uint i = 0; i < n; i++) {
+      ss.special.sparse_switch.keys[i] = i * 7 - n;
+    }
+
+    code.align();
+    code.branches.push_back(make_pair(fill, code.insns.size()));
+    DexInstruction& fd = code.add_payload(PSUEDO_OP_FILL_DATA_ARRAY);
+    fd.special.fill_data_array.element_width = 4;
+    fd.special.fill_data_array.size = n;
+    fd.special.fill_data_array.data = (dx_ubyte*)malloc(n * 4);
+    for(dx_uint i = 0; i < n * 4; i++) {
+      fd.special.fill_data_array.data[i] = rng();
+    }
+  }
+
+  vector<dx_uint> addr(code.insns.size() + 1);
+  for(size_t i = 0; i < code.insns.size(); i++) {
+    addr[i + 1] = addr[i] + dxc_insn_width(&code.insns[i]);
+  }
+  for(size_t i = 0; i < code.branches.size(); i++) {
+    size_t from = code.branches[i].first;
+    size_t to = code.branches[i].second;
+    code.insns[from].special.target = addr[to] - addr[from];
+    DexInstruction& payload = code.insns[to];
+    if(payload.opcode != OP_PSUEDO) continue;
+    dx_int* targets = NULL;
+    if(payload.hi_byte == PSUEDO_OP_PACKED_SWITCH) {
+      targets = payload.special.packed_switch.targets;
+    } else if(payload.hi_byte == PSUEDO_OP_SPARSE_SWITCH) {
+      targets = payload.special.sparse_switch.targets;
+    }
+    // Every case jumps to the return.
+    for(dx_uint j = 0; targets && j < opts.switch_size; j++) {
+      targets[j] = addr[ret] - addr[from];
+    }
+  }
+
+  DexCode* body = (DexCode*)calloc(1, sizeof(DexCode));
+  body->registers_size = PARAM_REG + 1;
+  body->ins_size = 2;
+  body->outs_size = 2;
+  body->debug_information = NULL;
+  body->insns_count = code.insns.size();
+  body->insns = (DexInstruction*)malloc((code.insns.size() + 1) *
+                                        sizeof(DexInstruction));
+  memcpy(body->insns, &code.insns[0],
+         code.insns.size() * sizeof(DexInstruction));
+  body->tries = (DexTryBlock*)malloc(sizeof(DexTryBlock));
+  dxc_make_sentinel_try_block(body->tries);
+  return body;
+}
+
+static DexCode* gen_constructor_code() {
+  CodeBuilder code;
+  ref_method& super = code.add(OP_INVOKE_DIRECT, 1, 0).special.method;
+  super.defining_class = dxc_induct_str("Ljava/lang/Object;");
+  super.name = dxc_induct_str("<init>");
+  super.prototype = make_proto("V", NULL);
+  code.add(OP_RETURN_VOID, 0);
+
+  DexCode* body = (DexCode*)calloc(1, sizeof(DexCode));
+  body->registers_size = 1;
+  body->ins_size = 1;
+  body->outs_size = 1;
+  body->insns_count = code.insns.size();
+  body->insns = (DexInstruction*)malloc((code.insns.size() + 1) *
+                                        sizeof(DexInstruction));
+  memcpy(body->insns, &code.insns[0],
+         code.insns.size() * sizeof(DexInstruction));
+  body->tries = (DexTryBlock*)malloc(sizeof(DexTryBlock));
+  dxc_make_sentinel_try_block(body->tries);
+  return body;
+}
+
+static void init_method(DexMethod* mtd, DexAccessFlags flags,
+                        const char* name, ref_strstr* proto) {
+  mtd->access_flags = flags;
+  mtd->name = dxc_induct_str(name);
+  mtd->prototype = proto;
+  mtd->annotations = empty_annotations();
+  mtd->parameter_annotations =
+      (DexAnnotation**)calloc(1, sizeof(DexAnnotation*));
+}
+
+static void gen_class(DexClass* cl, const GenOptions& opts,
+                      const string& name) {
+  cl->name = dxc_induct_str(name.c_str());
+  cl->access_flags = ACC_PUBLIC;
+  cl->super_class = dxc_induct_str("Ljava/lang/Object;");
+  cl->interfaces = dxc_create_strstr(0);
+  cl->source_file = NULL;
+  cl->annotations = empty_annotations();
+  cl->static_values = NULL;
+
+  cl->static_fields = (DexField*)calloc(1, sizeof(DexField));
+  dxc_make_sentinel_field(cl->static_fields);
+  cl->instance_fields = (DexField*)calloc(NUM_FIELDS + 1, sizeof(DexField));
+  for(int i = 0; i < NUM_FIELDS; i++) {
+    char fname[16];
+    sprintf(fname, "f%d", i);
+    cl->instance_fields[i].access_flags = ACC_PRIVATE;
+    cl->instance_fields[i].name = dxc_induct_str(fname);
+    cl->instance_fields[i].type = dxc_induct_str("I");
+    cl->instance_fields[i].annotations = empty_annotations();
+  }
+  dxc_make_sentinel_field(cl->instance_fields + NUM_FIELDS);
+
+  cl->direct_methods = (DexMethod*)calloc(2, sizeof(DexMethod));
+  init_method(cl->direct_methods,
+              (DexAccessFlags)(ACC_PUBLIC | ACC_CONSTRUCTOR), "<init>",
+              make_proto("V", NULL));
+  cl->direct_methods->code_body = gen_constructor_code();
+  dxc_make_sentinel_method(cl->direct_methods + 1);
+
+  cl->virtual_methods = (DexMethod*)calloc(opts.methods + 1,
+                                           sizeof(DexMethod));
+  for(int i = 0; i < opts.methods; i++) {
+    char mname[16];
+    sprintf(mname, "m%04d", i);
+    init_method(cl->virtual_methods + i, ACC_PUBLIC, mname,
+                make_proto("I", "I"));
+    cl->virtual_methods[i].code_body = gen_method_code(opts, name);
+  }
+  dxc_make_sentinel_method(cl->virtual_methods + opts.methods);
+}
+
+static DexFile* gen_file(const GenOptions& opts) {
+  rng_state = opts.seed;
+  int total = opts.classes * (opts.depth + 1);
+  DexFile* dx = (DexFile*)calloc(1, sizeof(DexFile));
+  dx->classes = (DexClass*)calloc(total + 1, sizeof(DexClass));
+  DexClass* cl = dx->classes;
+  for(int i = 0; i < opts.classes; i++) {
+    char name[64];
+    sprintf(name, "Lbench/p%d/C%d", i / 64, i);
+    string base = name;
+    for(int j = 0; j <= opts.depth; j++) {
+      if(j) {
+        sprintf(name, "$I%d", j);
+        base += name;
+      }
+      gen_class(cl++, opts, base + ";");
+    }
+  }
+  dxc_make_sentinel_class(cl);
+  return dx;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "Usage %s [-c classes] [-m methods] [-i insns] "
+                  "[-s switch_size] [-d inner_depth] [-S string_percent] "
+                  "[-r seed] output.dex\n", prog);
+}
+
+int main(int argc, char** argv) {
+  GenOptions opts;
+  opts.classes = 100;
+  opts.methods = 8;
+  opts.insns = 32;
+  opts.switch_size = 0;
+  opts.depth = 0;
+  opts.strings = 10;
+  opts.seed = 1;
+  int opt;
+  while((opt = getopt(argc, argv, "c:m:i:s:d:S:r:")) != -1) {
+    switch(opt) {
+      case 'c': opts.classes = atoi(optarg); break;
+      case 'm': opts.methods = atoi(optarg); break;
+      case 'i': opts.insns = atoi(optarg); break;
+      case 's': opts.switch_size = atoi(optarg); break;
+      case 'd': opts.depth = atoi(optarg); break;
+      case 'S': opts.strings = atoi(optarg); break;
+      case 'r': opts.seed = strtoul(optarg, NULL, 10); break;
+      default:
+        usage(*argv);
+        return 1;
+    }
+  }
+  if(argc - optind != 1 || opts.classes < 0 || opts.methods < 1 ||
+     opts.insns < 0 || opts.switch_size < 0 || opts.switch_size > 0xFFFF ||
+     opts.depth < 0 || opts.strings < 0 || opts.strings > 100) {
+    usage(*argv);
+    return 1;
+  }
+
+  DexFile* dx = gen_file(opts);
+  FILE* fout = fopen(argv[optind], "wb");
+  if(!fout) {
+    perror(argv[optind]);
+    return 1;
+  }
+  dxc_write_file(dx, fout);
+  if(fclose(fout) != 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  dxc_free_file(dx);
+  return 0;
+}
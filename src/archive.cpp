@@ -0,0 +1,312 @@
+#include "archive.h"
+
+#include <cstring>
+#include <ctime>
+
+#include <zlib.h>
+
+using namespace std;
+
+#define ZIP_LOCAL_SIG 0x04034b50U
+#define ZIP_CENTRAL_SIG 0x02014b50U
+#define ZIP_END_SIG 0x06054b50U
+#define ZIP64_END_SIG 0x06064b50U
+#define ZIP64_LOCATOR_SIG 0x07064b50U
+
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+// General purpose flag bit 11: file names are UTF-8.
+#define ZIP_FLAG_UTF8 0x800
+
+#define TAR_BLOCK 512
+
+static void put_u16(string& s, unsigned int v) {
+  s += (char)(v & 0xFF);
+  s += (char)(v >> 8 & 0xFF);
+}
+
+static void put_u32(string& s, unsigned long v) {
+  put_u16(s, v & 0xFFFF);
+  put_u16(s, v >> 16 & 0xFFFF);
+}
+
+static void put_u64(string& s, unsigned long long v) {
+  put_u32(s, v & 0xFFFFFFFFU);
+  put_u32(s, v >> 32);
+}
+
+// Writes 'v' as a zero padded, NUL terminated octal number filling 'len'
+// bytes.
+static void put_octal(char* field, size_t len, unsigned long long v) {
+  field[len - 1] = 0;
+  for(size_t i = len - 1; i-- > 0; v >>= 3) {
+    field[i] = '0' + (v & 7);
+  }
+}
+
+static void tar_header(string& out, const string& name, const string& prefix,
+                       unsigned long long size, long long mtime, char type) {
+  char hdr[TAR_BLOCK];
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, name.data(), min<size_t>(name.size(), 100));
+  put_octal(hdr + 100, 8, 0644);
+  put_octal(hdr + 108, 8, 0);
+  put_octal(hdr + 116, 8, 0);
+  put_octal(hdr + 124, 12, size);
+  put_octal(hdr + 136, 12, mtime);
+  memset(hdr + 148, ' ', 8);
+  hdr[156] = type;
+  memcpy(hdr + 257, "ustar", 6);
+  memcpy(hdr + 263, "00", 2);
+  memcpy(hdr + 345, prefix.data(), min<size_t>(prefix.size(), 155));
+
+  unsigned int sum = 0;
+  for(int i = 0; i < TAR_BLOCK; i++) sum += (unsigned char)hdr[i];
+  put_octal(hdr + 148, 7, sum);
+  out.append(hdr, sizeof(hdr));
+}
+
+static void tar_pad(string& out) {
+  out.append((TAR_BLOCK - out.size() % TAR_BLOCK) % TAR_BLOCK, '\0');
+}
+
+ArchiveWriter::ArchiveWriter()
+    : format(TAR), fout(NULL), failed(false), offset(0), dos_time(0),
+      dos_date(0), mtime(0), next_seq(0) {
+}
+
+ArchiveWriter::~ArchiveWriter() {
+  if(fout && fout != stdout) fclose(fout);
+}
+
+bool ArchiveWriter::open(const char* path) {
+  name = path;
+  size_t len = name.size();
+  if(name == "-") {
+    format = TAR;
+    fout = stdout;
+  } else if(len > 4 && !name.compare(len - 4, 4, ".tar")) {
+    format = TAR;
+    fout = fopen(path, "wb");
+  } else if(len > 4 && !name.compare(len - 4, 4, ".zip")) {
+    format = ZIP;
+    fout = fopen(path, "wb");
+  } else {
+    fprintf(stderr, "Unknown archive type %s, expected .tar or .zip\n", path);
+    return false;
+  }
+  if(!fout) {
+    perror(path);
+    return false;
+  }
+  setvbuf(fout, NULL, _IOFBF, 1 << 20);
+
+  time_t now = time(NULL);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  mtime = now;
+  dos_time = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+  dos_date = (tm.tm_year > 80 ? tm.tm_year - 80 : 0) << 9 |
+             (tm.tm_mon + 1) << 5 | tm.tm_mday;
+  return true;
+}
+
+void ArchiveWriter::encode(const string& path, const string& data,
+                           ArchiveEntry& entry) const {
+  entry.path = path;
+  entry.size = data.size();
+  entry.bytes.clear();
+
+  if(format == TAR) {
+    string prefix, base = path;
+    if(path.size() > 100) {
+      // Try the ustar prefix field first, otherwise fall back to a pax
+      // extended header carrying the full path.
+      size_t split = path.find('/', path.size() - 101);
+      if(split != string::npos && split <= 155 && split > 0) {
+        prefix = path.substr(0, split);
+        base = path.substr(split + 1);
+      } else {
+        string rec = " path=" + path + "\n";
+        size_t reclen = rec.size();
+        for(;;) {
+          size_t total = rec.size() + to_string(reclen).size();
+          if(total == reclen) break;
+          reclen = total;
+        }
+        rec = to_string(reclen) + rec;
+        tar_header(entry.bytes, "PaxHeader", "", rec.size(), mtime, 'x');
+        entry.bytes += rec;
+        tar_pad(entry.bytes);
+      }
+    }
+    tar_header(entry.bytes, base, prefix, data.size(), mtime, '0');
+    entry.bytes += data;
+    tar_pad(entry.bytes);
+    return;
+  }
+
+  entry.crc = crc32(crc32(0, NULL, 0), (const Bytef*)data.data(), data.size());
+  entry.method = ZIP_STORED;
+  string body;
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                  Z_DEFAULT_STRATEGY) == Z_OK) {
+    body.resize(deflateBound(&strm, data.size()));
+    strm.next_in = (Bytef*)data.data();
+    strm.avail_in = data.size();
+    strm.next_out = (Bytef*)&body[0];
+    strm.avail_out = body.size();
+    if(deflate(&strm, Z_FINISH) == Z_STREAM_END &&
+       strm.total_out < data.size()) {
+      body.resize(strm.total_out);
+      entry.method = ZIP_DEFLATED;
+    }
+    deflateEnd(&strm);
+  }
+  if(entry.method == ZIP_STORED) body = data;
+  entry.comp_size = body.size();
+
+  string& out = entry.bytes;
+  put_u32(out, ZIP_LOCAL_SIG);
+  put_u16(out, 20);
+  put_u16(out, ZIP_FLAG_UTF8);
+  put_u16(out, entry.method);
+  put_u16(out, dos_time);
+  put_u16(out, dos_date);
+  put_u32(out, entry.crc);
+  put_u32(out, entry.comp_size);
+  put_u32(out, entry.size);
+  put_u16(out, path.size());
+  put_u16(out, 0);
+  out += path;
+  out += body;
+}
+
+bool ArchiveWriter::write_bytes(const void* data, size_t len) {
+  if(fwrite(data, 1, len, fout) != len) {
+    if(!failed) perror(name.c_str());
+    failed = true;
+    return false;
+  }
+  offset += len;
+  return true;
+}
+
+bool ArchiveWriter::write_entry(ArchiveEntry& entry) {
+  if(format == ZIP) {
+    if(offset > 0xFFFFFFFFU) {
+      fprintf(stderr, "%s: archive is larger than 4GB\n", name.c_str());
+      failed = true;
+      return false;
+    }
+    CentralEntry ce;
+    ce.path = entry.path;
+    ce.crc = entry.crc;
+    ce.size = entry.size;
+    ce.comp_size = entry.comp_size;
+    ce.method = entry.method;
+    ce.offset = offset;
+    central.push_back(ce);
+  }
+  return write_bytes(entry.bytes.data(), entry.bytes.size());
+}
+
+bool ArchiveWriter::add(size_t seq, ArchiveEntry& entry) {
+  lock_guard<mutex> guard(lock);
+  if(failed) return false;
+  if(seq != next_seq) {
+    swap(pending[seq], entry);
+    return true;
+  }
+  if(!write_entry(entry)) return false;
+  for(++next_seq; !pending.empty() && pending.begin()->first == next_seq;
+      ++next_seq) {
+    if(!write_entry(pending.begin()->second)) return false;
+    pending.erase(pending.begin());
+  }
+  return true;
+}
+
+bool ArchiveWriter::finish() {
+  if(!failed && !pending.empty()) {
+    fprintf(stderr, "%s: archive is missing entries\n", name.c_str());
+    failed = true;
+  }
+  if(!failed && format == TAR) {
+    string trailer(2 * TAR_BLOCK, '\0');
+    write_bytes(trailer.data(), trailer.size());
+  } else if(!failed && format == ZIP) {
+    unsigned long long cd_offset = offset;
+    string cd;
+    for(size_t i = 0; i < central.size(); i++) {
+      CentralEntry& ce = central[i];
+      put_u32(cd, ZIP_CENTRAL_SIG);
+      put_u16(cd, 3 << 8 | 20);
+      put_u16(cd, 20);
+      put_u16(cd, ZIP_FLAG_UTF8);
+      put_u16(cd, ce.method);
+      put_u16(cd, dos_time);
+      put_u16(cd, dos_date);
+      put_u32(cd, ce.crc);
+      put_u32(cd, ce.comp_size);
+      put_u32(cd, ce.size);
+      put_u16(cd, ce.path.size());
+      put_u16(cd, 0);
+      put_u16(cd, 0);
+      put_u16(cd, 0);
+      put_u16(cd, 0);
+      put_u32(cd, 0100644UL << 16);
+      put_u32(cd, ce.offset);
+      cd += ce.path;
+    }
+    unsigned long long count = central.size();
+    if(count >= 0xFFFF || cd_offset + cd.size() > 0xFFFFFFFFU) {
+      // Too many entries for the classic end record, add the zip64 ones.
+      unsigned long long end64 = cd_offset + cd.size();
+      put_u32(cd, ZIP64_END_SIG);
+      put_u64(cd, 44);
+      put_u16(cd, 3 << 8 | 45);
+      put_u16(cd, 45);
+      put_u32(cd, 0);
+      put_u32(cd, 0);
+      put_u64(cd, count);
+      put_u64(cd, count);
+      put_u64(cd, end64 - cd_offset);
+      put_u64(cd, cd_offset);
+      put_u32(cd, ZIP64_LOCATOR_SIG);
+      put_u32(cd, 0);
+      put_u64(cd, end64);
+      put_u32(cd, 1);
+      put_u32(cd, ZIP_END_SIG);
+      put_u16(cd, 0);
+      put_u16(cd, 0);
+      put_u16(cd, 0xFFFF);
+      put_u16(cd, 0xFFFF);
+      put_u32(cd, 0xFFFFFFFFU);
+      put_u32(cd, 0xFFFFFFFFU);
+    } else {
+      size_t cd_size = cd.size();
+      put_u32(cd, ZIP_END_SIG);
+      put_u16(cd, 0);
+      put_u16(cd, 0);
+      put_u16(cd, count);
+      put_u16(cd, count);
+      put_u32(cd, cd_size);
+      put_u32(cd, cd_offset);
+    }
+    put_u16(cd, 0);
+    write_bytes(cd.data(), cd.size());
+  }
+
+  if(fout) {
+    if((fout == stdout ? fflush(fout) : fclose(fout)) != 0 && !failed) {
+      perror(name.c_str());
+      failed = true;
+    }
+    fout = NULL;
+  }
+  return !failed;
+}
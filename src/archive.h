@@ -0,0 +1,76 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// One encoded archive member.  For tar this is the header, data and padding;
+// for zip it is the local header and (deflated) data.
+struct ArchiveEntry {
+  std::string path;
+  std::string bytes;
+  unsigned long crc;
+  size_t size;
+  size_t comp_size;
+  int method;
+};
+
+// Writes files into a single tar or zip archive in one sequential pass.
+// Entries are encoded by the caller with encode(), which may run on any
+// thread, and handed to add() with a sequence number.  add() writes entries
+// strictly in sequence order so the archive is the same for any number of
+// threads.
+class ArchiveWriter {
+ public:
+  enum Format { TAR, ZIP };
+
+  ArchiveWriter();
+  ~ArchiveWriter();
+
+  // Opens 'path' for writing.  The format follows the extension (.tar or
+  // .zip); "-" writes a tar stream to stdout.
+  bool open(const char* path);
+
+  void encode(const std::string& path, const std::string& data,
+              ArchiveEntry& entry) const;
+
+  // Sequence numbers must start at zero and have no gaps.  The entry may be
+  // swapped out.
+  bool add(size_t seq, ArchiveEntry& entry);
+
+  // Writes the trailer and closes the archive.  Fails if any sequence number
+  // was never added.
+  bool finish();
+
+ private:
+  bool write_entry(ArchiveEntry& entry);
+  bool write_bytes(const void* data, size_t len);
+
+  struct CentralEntry {
+    std::string path;
+    unsigned long crc;
+    size_t size;
+    size_t comp_size;
+    int method;
+    unsigned long long offset;
+  };
+
+  Format format;
+  FILE* fout;
+  std::string name;
+  bool failed;
+  unsigned long long offset;
+  unsigned int dos_time;
+  unsigned int dos_date;
+  long long mtime;
+
+  std::mutex lock;
+  size_t next_seq;
+  std::map<size_t, ArchiveEntry> pending;
+  std::vector<CentralEntry> central;
+};
+
+#endif // ARCHIVE_H
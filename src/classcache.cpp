@@ -0,0 +1,419 @@
+#include "classcache.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Bump whenever the emitted text changes for the same input so that old
+// caches get thrown away.
+#define CACHE_VERSION 1
+#define CACHE_FILE ".dxdasm-cache"
+
+// 64-bit FNV-1a.
+struct Hasher {
+  Hasher() : h(0xcbf29ce484222325ULL) {}
+
+  void add(const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    for(size_t i = 0; i < len; i++) {
+      h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+  }
+  void add_int(dx_ulong v) { add(&v, sizeof(v)); }
+  // Strings are added with their terminator so adjacent strings can't run
+  // together.  NULL is kept distinct from the empty string.
+  void add_str(const char* s) {
+    if(!s) {
+      add_int(~0ULL);
+    } else {
+      add(s, strlen(s) + 1);
+    }
+  }
+  void add_str(ref_str* s) { add_str(s ? s->s : NULL); }
+  void add_strstr(ref_strstr* s) {
+    if(!s) {
+      add_int(~0ULL);
+      return;
+    }
+    dx_ulong n = 0;
+    for(ref_str** p = s->s; *p; ++p, ++n) add_str(*p);
+    add_int(n);
+  }
+
+  dx_ulong h;
+};
+
+static void hash_annotation(Hasher& hs, DexAnnotation* annon);
+
+static void hash_value(Hasher& hs, DexValue* val) {
+  hs.add_int(val->type);
+  switch(val->type) {
+    case VALUE_STRING:
+      hs.add_str(val->value.val_str);
+      break;
+    case VALUE_TYPE:
+      hs.add_str(val->value.val_type);
+      break;
+    case VALUE_FIELD:
+    case VALUE_ENUM: {
+      ref_field* fld = val->type == VALUE_FIELD ? val->value.val_field :
+                                                  val->value.val_enum;
+      hs.add_str(fld->defining_class);
+      hs.add_str(fld->name);
+      hs.add_str(fld->type);
+      break;
+    } case VALUE_METHOD:
+      hs.add_str(val->value.val_method->defining_class);
+      hs.add_str(val->value.val_method->name);
+      hs.add_strstr(val->value.val_method->prototype);
+      break;
+    case VALUE_ARRAY: {
+      dx_ulong n = 0;
+      for(DexValue* v = val->value.val_array; !dxc_is_sentinel_value(v);
+          ++v, ++n) {
+        hash_value(hs, v);
+      }
+      hs.add_int(n);
+      break;
+    } case VALUE_ANNOTATION:
+      hash_annotation(hs, val->value.val_annotation);
+      break;
+    default:
+      // Scalars are hashed through their printed form, which is exactly what
+      // ends up in the output.
+      hs.add_str(value_nice(val).c_str());
+  }
+}
+
+static void hash_annotation(Hasher& hs, DexAnnotation* annon) {
+  hs.add_int(annon->visibility);
+  hs.add_str(annon->type);
+  dx_ulong n = 0;
+  for(DexNameValuePair* p = annon->parameters;
+      !dxc_is_sentinel_parameter(p); ++p, ++n) {
+    hs.add_str(p->name);
+    hash_value(hs, &p->value);
+  }
+  hs.add_int(n);
+}
+
+static void hash_annotations(Hasher& hs, DexAnnotation* annons) {
+  dx_ulong n = 0;
+  if(annons) {
+    for(; !dxc_is_sentinel_annotation(annons); ++annons, ++n) {
+      hash_annotation(hs, annons);
+    }
+  }
+  hs.add_int(n);
+}
+
+static void hash_debug(Hasher& hs, DexDebugInfo* dbg) {
+  hs.add_int(dbg->line_start);
+  hs.add_strstr(dbg->parameter_names);
+  for(DexDebugInstruction* insn = dbg->insns; ; insn++) {
+    hs.add_int(insn->opcode);
+    switch(insn->opcode) {
+      case DBG_END_SEQUENCE:
+        return;
+      case DBG_ADVANCE_PC:
+        hs.add_int(insn->p.addr_diff);
+        break;
+      case DBG_ADVANCE_LINE:
+        hs.add_int(insn->p.line_diff);
+        break;
+      case DBG_START_LOCAL:
+      case DBG_START_LOCAL_EXTENDED:
+        hs.add_int(insn->p.start_local->register_num);
+        hs.add_str(insn->p.start_local->name);
+        hs.add_str(insn->p.start_local->type);
+        break;
+      case DBG_END_LOCAL:
+      case DBG_RESTART_LOCAL:
+        hs.add_int(insn->p.register_num);
+        break;
+    }
+  }
+}
+
+static void hash_insn(Hasher& hs, DexInstruction* in) {
+  hs.add_int(in->opcode);
+  hs.add_int(in->hi_byte);
+  if(in->opcode == OP_PSUEDO) {
+    switch(in->hi_byte) {
+      case PSUEDO_OP_PACKED_SWITCH:
+        hs.add_int(in->special.packed_switch.size);
+        hs.add_int(in->special.packed_switch.first_key);
+        hs.add(in->special.packed_switch.targets,
+               in->special.packed_switch.size * sizeof(dx_int));
+        return;
+      case PSUEDO_OP_SPARSE_SWITCH:
+        hs.add_int(in->special.sparse_switch.size);
+        hs.add(in->special.sparse_switch.keys,
+               in->special.sparse_switch.size * sizeof(dx_int));
+        hs.add(in->special.sparse_switch.targets,
+               in->special.sparse_switch.size * sizeof(dx_int));
+        return;
+      case PSUEDO_OP_FILL_DATA_ARRAY:
+        hs.add_int(in->special.fill_data_array.element_width);
+        hs.add_int(in->special.fill_data_array.size);
+        hs.add(in->special.fill_data_array.data,
+               (size_t)in->special.fill_data_array.element_width *
+               in->special.fill_data_array.size);
+        return;
+    }
+  }
+  dx_uint nregs = dxc_num_registers(in);
+  hs.add_int(nregs);
+  for(dx_uint j = 0; j < nregs; j++) {
+    hs.add_int(dxc_get_register(in, j));
+  }
+  switch(dex_opcode_formats[in->opcode].specialType) {
+    case SPECIAL_CONSTANT:
+      hs.add_int(in->special.constant);
+      break;
+    case SPECIAL_TARGET:
+      hs.add_int(in->special.target);
+      break;
+    case SPECIAL_STRING:
+      hs.add_str(in->special.str);
+      break;
+    case SPECIAL_TYPE:
+      hs.add_str(in->special.type);
+      break;
+    case SPECIAL_FIELD:
+      hs.add_str(in->special.field.defining_class);
+      hs.add_str(in->special.field.name);
+      hs.add_str(in->special.field.type);
+      break;
+    case SPECIAL_METHOD:
+      hs.add_str(in->special.method.defining_class);
+      hs.add_str(in->special.method.name);
+      hs.add_strstr(in->special.method.prototype);
+      break;
+  }
+}
+
+static void hash_code(Hasher& hs, DexCode* code) {
+  if(!code) {
+    hs.add_int(~0ULL);
+    return;
+  }
+  hs.add_int(code->registers_size);
+  hs.add_int(code->ins_size);
+  hs.add_int(code->outs_size);
+  hs.add_int(code->insns_count);
+  for(dx_uint i = 0; i < code->insns_count; i++) {
+    hash_insn(hs, code->insns + i);
+  }
+  dx_ulong n = 0;
+  for(DexTryBlock* tb = code->tries; !dxc_is_sentinel_try_block(tb);
+      ++tb, ++n) {
+    hs.add_int(tb->start_addr);
+    hs.add_int(tb->insn_count);
+    dx_ulong m = 0;
+    for(DexHandler* hndlr = tb->handlers; !dxc_is_sentinel_handler(hndlr);
+        ++hndlr, ++m) {
+      hs.add_str(hndlr->type);
+      hs.add_int(hndlr->addr);
+    }
+    hs.add_int(m);
+    hs.add_int(tb->catch_all_handler ? tb->catch_all_handler->addr : ~0U);
+  }
+  hs.add_int(n);
+  if(code->debug_information) {
+    hash_debug(hs, code->debug_information);
+  } else {
+    hs.add_int(~0ULL);
+  }
+}
+
+static void hash_dex_class(Hasher& hs, DexClass* cl) {
+  hs.add_str(cl->name);
+  hs.add_int(cl->access_flags);
+  hs.add_str(cl->super_class);
+  hs.add_strstr(cl->interfaces);
+  hs.add_str(cl->source_file);
+  hash_annotations(hs, cl->annotations);
+
+  dx_ulong n = 0;
+  if(cl->static_values) {
+    for(DexValue* val = cl->static_values; !dxc_is_sentinel_value(val);
+        ++val, ++n) {
+      hash_value(hs, val);
+    }
+  }
+  hs.add_int(n);
+
+  for(int iter = 0; iter < 2; iter++) {
+    n = 0;
+    for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
+        !dxc_is_sentinel_field(fld); ++fld, ++n) {
+      hs.add_int(fld->access_flags);
+      hs.add_str(fld->name);
+      hs.add_str(fld->type);
+      hash_annotations(hs, fld->annotations);
+    }
+    hs.add_int(n);
+  }
+
+  for(int iter = 0; iter < 2; iter++) {
+    n = 0;
+    for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
+        !dxc_is_sentinel_method(mtd); ++mtd, ++n) {
+      hs.add_int(mtd->access_flags);
+      hs.add_str(mtd->name);
+      hs.add_strstr(mtd->prototype);
+      hash_annotations(hs, mtd->annotations);
+      dx_ulong m = 0;
+      if(mtd->parameter_annotations) {
+        for(DexAnnotation** pa = mtd->parameter_annotations; *pa; ++pa, ++m) {
+          hash_annotations(hs, *pa);
+        }
+      }
+      hs.add_int(m);
+      hash_code(hs, mtd->code_body);
+    }
+    hs.add_int(n);
+  }
+}
+
+static void hash_dasmcl(Hasher& hs, dasmcl* dcl) {
+  hash_dex_class(hs, dcl->cl);
+  hs.add_int(dcl->inner_classes.size());
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    hash_dasmcl(hs, dcl->inner_classes[i]);
+  }
+}
+
+dx_ulong hash_class(dasmcl* dcl) {
+  Hasher hs;
+  hs.add_int(CACHE_VERSION);
+  hash_dasmcl(hs, dcl);
+  return hs.h;
+}
+
+dx_ulong hash_dex_class(DexClass* cl) {
+  Hasher hs;
+  hash_dex_class(hs, cl);
+  return hs.h;
+}
+
+dx_ulong hash_declarations(DexClass* cl) {
+  Hasher hs;
+  hs.add_str(cl->name);
+  for(int iter = 0; iter < 2; iter++) {
+    dx_ulong n = 0;
+    for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
+        !dxc_is_sentinel_field(fld); ++fld, ++n) {
+      hs.add_str(fld->name);
+      hs.add_str(fld->type);
+    }
+    hs.add_int(n);
+  }
+  for(int iter = 0; iter < 2; iter++) {
+    dx_ulong n = 0;
+    for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
+        !dxc_is_sentinel_method(mtd); ++mtd, ++n) {
+      hs.add_int(mtd->access_flags);
+      hs.add_str(mtd->name);
+      hs.add_strstr(mtd->prototype);
+    }
+    hs.add_int(n);
+  }
+  return hs.h;
+}
+
+static bool stat_file(const string& path, long long* size, long long* mtime) {
+  struct stat st;
+  if(stat(path.c_str(), &st) == -1) return false;
+  *size = st.st_size;
+  *mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+bool ClassCache::load(const string& output_dir) {
+  entries.clear();
+  string cache_path = output_dir + "/" CACHE_FILE;
+  FILE* fin = fopen(cache_path.c_str(), "r");
+  if(!fin) return errno == ENOENT;
+
+  int version;
+  if(fscanf(fin, "dxdasm-cache %d\n", &version) != 1 ||
+     version != CACHE_VERSION) {
+    // Written by a different version, start over.
+    fclose(fin);
+    return true;
+  }
+
+  bool ok = true;
+  char* line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while((len = getline(&line, &cap, fin)) != -1) {
+    if(len && line[len - 1] == '\n') line[--len] = 0;
+    unsigned long long hash;
+    CacheEntry entry;
+    int pos;
+    if(sscanf(line, "%llx %lld %lld %n", &hash, &entry.size, &entry.mtime,
+              &pos) != 3 || !line[pos]) {
+      fprintf(stderr, "Ignoring corrupt cache %s\n", cache_path.c_str());
+      entries.clear();
+      ok = false;
+      break;
+    }
+    entry.hash = hash;
+    entries[line + pos] = entry;
+  }
+  free(line);
+  fclose(fin);
+  return ok;
+}
+
+bool ClassCache::save(const string& output_dir) const {
+  // Write to a temporary file and rename over the old cache so that an
+  // interrupted run never leaves a half written cache behind.
+  string cache_path = output_dir + "/" CACHE_FILE;
+  string tmp_path = cache_path + ".tmp";
+  FILE* fout = fopen(tmp_path.c_str(), "w");
+  if(!fout) {
+    perror("fopen");
+    return false;
+  }
+  fprintf(fout, "dxdasm-cache %d\n", CACHE_VERSION);
+  for(map<string, CacheEntry>::const_iterator it = entries.begin();
+      it != entries.end(); ++it) {
+    fprintf(fout, "%016llx %lld %lld %s\n", (unsigned long long)it->second.hash,
+            it->second.size, it->second.mtime, it->first.c_str());
+  }
+  if(fclose(fout) != 0 || rename(tmp_path.c_str(), cache_path.c_str()) == -1) {
+    fprintf(stderr, "Failed to write %s\n", cache_path.c_str());
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ClassCache::is_current(const string& output_dir, const string& path,
+                            dx_ulong hash) const {
+  map<string, CacheEntry>::const_iterator it = entries.find(path);
+  if(it == entries.end() || it->second.hash != hash) return false;
+  long long size, mtime;
+  return stat_file(output_dir + "/" + path, &size, &mtime) &&
+         size == it->second.size && mtime == it->second.mtime;
+}
+
+bool ClassCache::update(const string& output_dir, const string& path,
+                        dx_ulong hash) {
+  CacheEntry entry;
+  entry.hash = hash;
+  if(!stat_file(output_dir + "/" + path, &entry.size, &entry.mtime)) {
+    return false;
+  }
+  entries[path] = entry;
+  return true;
+}
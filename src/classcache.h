@@ -0,0 +1,50 @@
+#ifndef CLASSCACHE_H
+#define CLASSCACHE_H
+
+#include <map>
+#include <string>
+
+#include <dxcut/dxcut.h>
+
+#include "dasmcl.h"
+
+// Structural hash of a top-level class and all of its inner classes.  This
+// covers everything the emitter reads so two classes with the same hash
+// produce the same output.  Call it after prep_classes so that sanitized
+// names are included.
+dx_ulong hash_class(dasmcl* dcl);
+
+// The same for a single class as it is in the dex, without inner classes.
+dx_ulong hash_dex_class(DexClass* cl);
+
+// Hash of just the names and signatures a class declares, and the method
+// flags; everything strip_classes() bases its renames on.
+dx_ulong hash_declarations(DexClass* cl);
+
+struct CacheEntry {
+  dx_ulong hash;
+  long long size;
+  long long mtime;
+};
+
+// Remembers which output files were produced from which class hashes.  The
+// cache lives in the output directory and lets reruns skip classes that have
+// not changed since the last run.
+struct ClassCache {
+  std::map<std::string, CacheEntry> entries;
+
+  bool load(const std::string& output_dir);
+  bool save(const std::string& output_dir) const;
+
+  // Returns true if 'path' (relative to the output directory) was produced
+  // from 'hash' and the file on disk hasn't been touched since.
+  bool is_current(const std::string& output_dir, const std::string& path,
+                  dx_ulong hash) const;
+
+  // Records the hash along with the size and modification time of the file
+  // that was just written.
+  bool update(const std::string& output_dir, const std::string& path,
+              dx_ulong hash);
+};
+
+#endif // CLASSCACHE_H
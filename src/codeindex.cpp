@@ -0,0 +1,91 @@
+#include "codeindex.h"
+
+#include <cstring>
+
+using namespace std;
+
+void CodeIndex::build(DexInstruction* code, dx_uint count) {
+  dx_uint pos = 0;
+  for(dx_uint i = 0; i < count; i++) {
+    DexInstruction* in = code + i;
+    dx_uint width = dxc_insn_width(in);
+    int entry;
+    if(in->opcode == OP_PSUEDO && in->hi_byte != PSUEDO_OP_NOP) {
+      entry = -2 - (int)payloads.size();
+      payloads.push_back(in);
+    } else {
+      entry = insns.size();
+      insns.push_back(in);
+      insn_offsets.push_back(pos);
+    }
+    int last = entry;
+    if(entry < 0) last = last_insn.empty() ? -1 : last_insn.back();
+    units.push_back(entry);
+    last_insn.push_back(last);
+    for(dx_uint j = 1; j < width; j++) {
+      units.push_back(-1);
+      last_insn.push_back(last);
+    }
+    pos += width;
+  }
+}
+
+int CodeIndex::add_insn(dx_uint offset) {
+  insn_offsets.push_back(offset);
+  return insn_offsets.size() - 1;
+}
+
+// Returns the number of a label of the form "L" followed by at least two
+// digits and no extra leading zeros, or -1.
+static long long label_number(const char* label, size_t size) {
+  if(size < 3 || size > 10 || label[0] != 'L') return -1;
+  if(size > 3 && label[1] == '0') return -1;
+  long long n = 0;
+  for(size_t i = 1; i < size; i++) {
+    if(label[i] < '0' || label[i] > '9') return -1;
+    n = n * 10 + label[i] - '0';
+  }
+  return n;
+}
+
+void CodeIndex::add_label(const char* label, size_t size, int insn) {
+  long long n = label_number(label, size);
+  // Keep the table dense; labels far past the instruction count go by name.
+  if(n < 0 || n > 2 * (long long)insn_offsets.size() + 64) {
+    named_labels[string(label, size)] = insn;
+    return;
+  }
+  if(n >= numbered_labels.size()) numbered_labels.resize(n + 1, -1);
+  numbered_labels[n] = insn;
+}
+
+int CodeIndex::find_label(const char* label, size_t size) const {
+  long long n = label_number(label, size);
+  if(n >= 0 && n < numbered_labels.size() && numbered_labels[n] != -1) {
+    return numbered_labels[n];
+  }
+  if(named_labels.empty()) return -1;
+  map<string, int>::const_iterator it =
+      named_labels.find(string(label, size));
+  return it == named_labels.end() ? -1 : it->second;
+}
+
+int CodeIndex::find_label(const char* label) const {
+  return find_label(label, strlen(label));
+}
+
+int CodeIndex::insn_at(long long off) const {
+  if(off < 0 || off >= units.size()) return -1;
+  return units[off] >= 0 ? units[off] : -1;
+}
+
+int CodeIndex::payload_at(long long off) const {
+  if(off < 0 || off >= units.size()) return -1;
+  return units[off] <= -2 ? -2 - units[off] : -1;
+}
+
+int CodeIndex::insn_before(long long off) const {
+  if(off <= 0 || last_insn.empty()) return -1;
+  if(off > last_insn.size()) off = last_insn.size();
+  return last_insn[off - 1];
+}
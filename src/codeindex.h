@@ -0,0 +1,60 @@
+#ifndef CODEINDEX_H
+#define CODEINDEX_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <dxcut/dxcut.h>
+
+// Index of the code of one method by code unit offset and by label.  Both
+// are array lookups so methods with thousands of instructions or huge switch
+// tables don't spend their time searching trees.
+//
+// dxdasm indexes decoded code with build().  dxreasm lays code out itself and
+// records each instruction with add_insn() and its label with add_label().
+class CodeIndex {
+ public:
+  // Indexes 'count' instructions.  Payloads (switch and array data tables)
+  // are kept apart from the other instructions and numbered separately.
+  void build(DexInstruction* insns, dx_uint count);
+
+  // Records the next instruction, which starts at 'offset'.  Returns its
+  // index.
+  int add_insn(dx_uint offset);
+
+  // Points the 'n' character label at 'label' to instruction 'insn'.  A later
+  // label with the same name replaces it.
+  void add_label(const char* label, size_t n, int insn);
+
+  // The instruction 'label' points to, or -1.
+  int find_label(const char* label, size_t n) const;
+  int find_label(const char* label) const;
+
+  // Instructions other than payloads, in order, with their offsets.  Only
+  // build() fills in 'insns'.
+  std::vector<DexInstruction*> insns;
+  std::vector<dx_uint> insn_offsets;
+  std::vector<DexInstruction*> payloads;
+
+  // The instruction or payload starting at code unit 'off', or -1.
+  int insn_at(long long off) const;
+  int payload_at(long long off) const;
+
+  // The last instruction starting before code unit 'off', or -1.
+  int insn_before(long long off) const;
+
+ private:
+  // Per code unit: the index of the instruction starting there, -2 - the
+  // index of the payload starting there, or -1.
+  std::vector<int> units;
+  // Per code unit: the last instruction starting at or before it.
+  std::vector<int> last_insn;
+
+  // Labels of the form dxdasm writes ("L00", "L123") are looked up by their
+  // number, anything else by name.
+  std::vector<int> numbered_labels;
+  std::map<std::string, int> named_labels;
+};
+
+#endif // CODEINDEX_H
@@ -1,4 +1,7 @@
 #include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -8,118 +11,202 @@
 
 using namespace std;
 
-string get_package_name(const string& name) {
-  int pos = name.find_last_of('.');
-  if(pos == -1) return "";
-  return name.substr(0, pos);
+static mutex nice_lock;
+
+string type_nice(const char* type) {
+  lock_guard<mutex> lock(nice_lock);
+  return dxc_type_nice(type);
 }
 
-string type_brief(const string& type) {
-  string ret = dxc_type_nice(type.c_str());
-  int dot_pos = ret.find_last_of('.');
-  int dollar_pos = ret.find_last_of('$');
-  if(dot_pos == -1 && dollar_pos == -1) return ret;
-  if(dot_pos == -1) return ret.substr(dollar_pos + 1);
-  if(dollar_pos == -1) return ret.substr(dot_pos + 1);
-  return ret.substr(max(dot_pos, dollar_pos) + 1);
+string access_flags_nice(DexAccessFlags flags) {
+  lock_guard<mutex> lock(nice_lock);
+  return dxc_access_flags_nice(flags);
 }
 
-static const char* strip_array(const char* s) {
-  while(*s == '[') ++s;
-  return s;
+string value_nice(DexValue* value) {
+  lock_guard<mutex> lock(nice_lock);
+  return dxc_value_nice(value);
 }
 
-static
-void build_import_table(dasmcl* dcl) {
-  DexClass* cl = dcl->cl;
+const char* strip_array(const char* type) {
+  while(*type == '[') ++type;
+  return type;
+}
+
+static const char* primitive_name(char c) {
+  switch(c) {
+    case 'Z': return "boolean";
+    case 'B': return "byte";
+    case 'S': return "short";
+    case 'C': return "char";
+    case 'I': return "int";
+    case 'J': return "long";
+    case 'F': return "float";
+    case 'D': return "double";
+    case 'V': return "void";
+  }
+  return NULL;
+}
 
-  vector<string> refdescs;
-  refdescs.push_back("Lorg/dxcut/dxdasm/DxdasmMethod;");
+void append_type_name(string& out, const char* type, bool dots) {
+  size_t start = out.size();
+  const char* base = strip_array(type);
+  const char* prim = base[0] && !base[1] ? primitive_name(base[0]) : NULL;
+  const char* end = *base == 'L' ? strchr(base, ';') : NULL;
+  if(end && !end[1]) {
+    out.append(base + 1, end - base - 1);
+    for(size_t i = start; i < out.size(); i++) {
+      if(out[i] == '/' || (dots && out[i] == '$')) out[i] = '.';
+    }
+  } else if(prim) {
+    out += prim;
+  } else {
+    // Nothing dxdasm writes; leave it to libdxcut.
+    out += type_nice(type);
+    if(dots) replace(out.begin() + start, out.end(), '$', '.');
+    return;
+  }
+  for(; type < base; type++) out += "[]";
+}
+
+void append_type_brief(string& out, const char* type) {
+  size_t start = out.size();
+  append_type_name(out, type);
+  size_t pos = out.find_last_of(".$");
+  if(pos != string::npos && pos >= start) out.erase(start, pos + 1 - start);
+}
+
+const char* class_brief(const char* type, size_t* len) {
+  const char* end = strchr(type, ';');
+  if(!end) end = type + strlen(type);
+  const char* start = *type == 'L' ? type + 1 : type;
+  for(const char* p = start; p < end; p++) {
+    if(*p == '/' || *p == '$') start = p + 1;
+  }
+  *len = end - start;
+  return start;
+}
+
+void append_package_name(string& out, const char* type) {
+  type = strip_array(type);
+  if(*type != 'L') return;
+  const char* slash = strrchr(type, '/');
+  if(!slash) return;
+  size_t start = out.size();
+  out.append(type + 1, slash - type - 1);
+  replace(out.begin() + start, out.end(), '/', '.');
+}
+
+static void share_import_table(dasmcl* dcl,
+                               const shared_ptr<const ImportTable>& table) {
+  dcl->imports = table;
   for(int i = 0; i < dcl->inner_classes.size(); i++) {
-    build_import_table(dcl->inner_classes[i]);
-    set<string>& descst = dcl->inner_classes[i]->import_table;
-    for(set<string>::iterator it = descst.begin(); it != descst.end(); ++it) {
-      refdescs.push_back(*it);
+    share_import_table(dcl->inner_classes[i], table);
+  }
+}
+
+// Descriptor chosen for each simple name used in a class and its inner
+// classes.
+typedef unordered_map<string, string> ImportChoices;
+
+// Offers class descriptor 'desc' for its simple name.  The longest descriptor
+// wins and ties go to the one that sorts first, so the choice doesn't depend
+// on the order they are offered in.
+static void offer_import(ImportChoices& choices, string& brief,
+                         const char* desc) {
+  if(*desc != 'L') return;
+  brief.clear();
+  append_type_brief(brief, desc);
+  string& name = choices[brief];
+  size_t n = strlen(desc);
+  if(name.size() < n || (name.size() == n && name.compare(desc) > 0)) {
+    name = desc;
+  }
+}
+
+static void choose_imports(dasmcl* dcl, ImportChoices& choices) {
+  DexClass* cl = dcl->cl;
+  string brief;
+  offer_import(choices, brief, "Lorg/dxcut/dxdasm/DxdasmMethod;");
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    // An inner class's own choices compete with the rest, which keeps its
+    // own name from being shadowed by something it doesn't use.
+    ImportChoices inner;
+    choose_imports(dcl->inner_classes[i], inner);
+    for(ImportChoices::iterator it = inner.begin(); it != inner.end(); ++it) {
+      offer_import(choices, brief, it->second.c_str());
     }
   }
 
   if(cl->super_class) {
-    refdescs.push_back(cl->super_class->s);
+    offer_import(choices, brief, cl->super_class->s);
   }
   for(ref_str** interfaces = cl->interfaces->s; *interfaces; interfaces++) {
-    refdescs.push_back((*interfaces)->s);
+    offer_import(choices, brief, (*interfaces)->s);
   }
 
   for(int iter = 0; iter < 2; iter++)
   for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
       !dxc_is_sentinel_field(fld); ++fld) {
-    refdescs.push_back(strip_array(fld->type->s));
+    offer_import(choices, brief, strip_array(fld->type->s));
   }
   for(int iter = 0; iter < 2; iter++)
   for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
         !dxc_is_sentinel_method(mtd); ++mtd) {
     for(ref_str** proto = mtd->prototype->s; *proto; ++proto) {
-      refdescs.push_back(strip_array((*proto)->s));
+      offer_import(choices, brief, strip_array((*proto)->s));
     }
   }
 
-  sort(refdescs.begin(), refdescs.end());
-  refdescs.resize(unique(refdescs.begin(), refdescs.end()) - refdescs.begin());
-
-  map<string, string> import_map;
-  for(int i = 0; i < refdescs.size(); i++) {
-    if(refdescs[i][0] != 'L') continue;
-    string brief = type_brief(refdescs[i]);
-    string& name = import_map[brief];
-    if(name.size() < refdescs[i].size()) {
-      name = refdescs[i];
-    }
-  }
-  string self_brief = type_brief(cl->name->s);
-  import_map[self_brief] = cl->name->s;
-  for(map<string, string>::iterator it = import_map.begin();
-      it != import_map.end(); ++it) {
-    dcl->import_table.insert(it->second);
-  }
+  brief.clear();
+  append_type_brief(brief, cl->name->s);
+  choices[brief] = cl->name->s;
 }
 
-static void add_method_alias(set<string>& mtd_aliases, dasmcl* dcl,
-                             ref_method* mtd) {
-  if(dcl->method_alias_map.find(mtd) != dcl->method_alias_map.end()) return;
-  for(int i = 0; ; i++) {
-    string name = type_brief(mtd->defining_class->s) + "." + mtd->name->s;
-    if(i) {
-      char buf[20];
-      sprintf(buf, "_%d", i);
-      name += buf;
-    }
-    if(mtd_aliases.insert(name).second) {
-      dcl->method_alias_map[mtd] = name;
-      break;
-    }
+// Builds the import table of top-level class 'dcl' and hands it to every
+// class in the nest.
+static void build_import_table(dasmcl* dcl) {
+  ImportChoices choices;
+  choose_imports(dcl, choices);
+  ImportTable* table = new ImportTable;
+  table->descs.reserve(choices.size());
+  for(ImportChoices::iterator it = choices.begin(); it != choices.end();
+      ++it) {
+    table->descs.push_back(it->second);
   }
+  sort(table->descs.begin(), table->descs.end());
+  for(int i = 0; i < table->descs.size(); i++) {
+    table->lookup.insert(table->descs[i].c_str());
+  }
+  share_import_table(dcl, shared_ptr<const ImportTable>(table));
 }
 
-static void add_field_alias(set<string>& fld_aliases, dasmcl* dcl,
-                            ref_field* fld) {
-  if(dcl->field_alias_map.find(fld) != dcl->field_alias_map.end()) return;
-  for(int i = 0; ; i++) {
-    string name = type_brief(fld->defining_class->s) + "." + fld->name->s;
-    if(i) {
-      char buf[20];
-      sprintf(buf, "_%d", i);
-      name += buf;
-    }
-    if(fld_aliases.insert(name).second) {
-      dcl->field_alias_map[fld] = name;
-      break;
-    }
+// Gives the reference with symbol 'id' an alias unique among 'names' unless
+// it already has one.  Returns its position in the table.
+template<typename Ref>
+static int add_alias(unordered_set<string>& names, AliasTable<Ref>& table,
+                     dx_uint id, Ref* ref) {
+  typeof(table.by_symbol.begin()) it = table.by_symbol.find(id);
+  if(it != table.by_symbol.end()) return it->second;
+  string base;
+  append_type_brief(base, ref->defining_class->s);
+  base += '.';
+  base += ref->name->s;
+  string name = base;
+  for(int i = 1; !names.insert(name).second; i++) {
+    char buf[20];
+    sprintf(buf, "_%d", i);
+    name = base + buf;
   }
+  int pos = table.entries.size();
+  table.entries.push_back(make_pair(ref, name));
+  table.by_symbol[id] = pos;
+  return pos;
 }
 
-static void build_alias_tables(dasmcl* dcl) {
+static void build_alias_tables(dasmcl* dcl, SymbolTable& symbols) {
   DexClass* cl = dcl->cl;
-  set<string> mtd_aliases, fld_aliases;
+  unordered_set<string> mtd_aliases, fld_aliases;
   for(int iter = 0; iter < 2; iter++)
   for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
       !dxc_is_sentinel_method(mtd); ++mtd) {
@@ -128,27 +215,29 @@ static void build_alias_tables(dasmcl* dcl) {
     for(int i = 0; i < code->insns_count; i++) {
       DexInstruction* in = code->insns + i;
       if(dex_opcode_formats[in->opcode].specialType == SPECIAL_METHOD) {
-        add_method_alias(mtd_aliases, dcl, &in->special.method);
+        ref_method* ref = &in->special.method;
+        dcl->insn_aliases[in] = add_alias(mtd_aliases, dcl->method_aliases,
+                                          symbols.method_id(ref), ref);
       } else if(dex_opcode_formats[in->opcode].specialType == SPECIAL_FIELD) {
-        add_field_alias(fld_aliases, dcl, &in->special.field);
+        ref_field* ref = &in->special.field;
+        dcl->insn_aliases[in] = add_alias(fld_aliases, dcl->field_aliases,
+                                          symbols.field_id(ref), ref);
       }
     }
   }
 
   for(int i = 0; i < dcl->inner_classes.size(); i++) {
     dasmcl* idcl = dcl->inner_classes[i];
-    build_alias_tables(idcl);
+    build_alias_tables(idcl, symbols);
 /* TODO: It might be nice to just have alias tables in outer classes but this
  * will requrie mroe work in the reassembler than I want to do right now.
-    for(typeof(idcl->method_alias_map.begin()) it =
-        idcl->method_alias_map.begin(); it != idcl->method_alias_map.end();
-        it++) {
-      add_method_alias(mtd_aliases, dcl, it->first);
+    for(int j = 0; j < idcl->method_aliases.entries.size(); j++) {
+      ref_method* ref = idcl->method_aliases.entries[j].first;
+      add_alias(mtd_aliases, dcl->method_aliases, symbols.method_id(ref), ref);
     }
-    for(typeof(idcl->field_alias_map.begin()) it =
-        idcl->field_alias_map.begin(); it != idcl->field_alias_map.end();
-        it++) {
-      add_field_alias(fld_aliases, dcl, it->first);
+    for(int j = 0; j < idcl->field_aliases.entries.size(); j++) {
+      ref_field* ref = idcl->field_aliases.entries[j].first;
+      add_alias(fld_aliases, dcl->field_aliases, symbols.field_id(ref), ref);
     }
 */
   }
@@ -172,92 +261,156 @@ string filter_name(const string& s) {
   return ret;
 }
 
-static
-string sanitize_identifier(string id, int token = -1) {
-  if(token < -1 || !is_java_identifier(id.c_str())) {
-    if(token == -1) {
-      return string("_dxdasm_") + id;
-    } else {
+// Appends 'id' (n bytes), prefixed so it can't clash with a keyword or
+// another name if it isn't a usable Java identifier or 'token' asks for a
+// unique renaming.
+static void append_identifier(string& out, const char* id, size_t n,
+                              int token = -1) {
+  if(token < -1 || !is_java_identifier(id, n)) {
+    out += "_dxdasm";
+    if(token != -1) {
       char buf[32];
       sprintf(buf, "%s%d", token < 0 ? "x" : "",
                            token < 0 ? -token - 2 : token);
-      return string("_dxdasm") + buf + "_" + id;
+      out += buf;
     }
+    out += '_';
   }
-  return id;
+  out.append(id, n);
 }
 
-static
-string desanitize_identifier(string id) {
-  if(id.size() > 8 && id.substr(0, 7) == "_dxdasm") {
-    return id.substr(id.find('_', 7) + 1);
+static void sanitize_identifier(string& out, const char* id, int token = -1) {
+  out.clear();
+  append_identifier(out, id, strlen(id), token);
+}
+
+// Where the name sanitize_identifier() was given starts in id[0, n), which
+// is 'id' itself if it wasn't renamed.
+static const char* desanitize_identifier(const char* id, size_t n) {
+  if(n > 8 && !strncmp(id, "_dxdasm", 7)) {
+    const char* sep = (const char*)memchr(id + 7, '_', n - 7);
+    if(sep) return sep + 1;
   }
   return id;
 }
 
-static
-string sanitize_type(string type) {
+static bool is_type_separator(char c) {
+  return c == '/' || c == '$' || c == ';';
+}
+
+static void sanitize_type(string& out, const char* type) {
   /* Sanitize all of the tokens.  Additionally make sure all the non-namespace
-   * tokens are unique. */
-  int last = 1;
-  set<string> toks;
-  for(int i = 1; i < type.size(); i++) {
-    if(type[i] == '/' || type[i] == '$' || type[i] == ';') {
-      string ntok = sanitize_identifier(type.substr(last, i - last), i);
-      for(int j = -2; !toks.insert(ntok).second; j--) {
-        ntok = sanitize_identifier(type.substr(last, i - last), j);
+   * tokens are unique.  Tokens are numbered by where they end up in 'out'. */
+  out.assign(type, 1);
+  size_t last = 1;
+  size_t n = strlen(type);
+  for(size_t i = 1; i < n; i++) {
+    if(!is_type_separator(type[i])) continue;
+    size_t start = out.size();
+    append_identifier(out, type + last, i - last, start + i - last);
+    for(int j = -2; ; j--) {
+      // Compare against the tokens already in 'out'.
+      size_t len = out.size() - start;
+      bool dup = false;
+      for(size_t k = 1, tok = 1; k < start && !dup; k++) {
+        if(!is_type_separator(out[k])) continue;
+        dup = k - tok == len && !out.compare(tok, len, out, start, len);
+        tok = k + 1;
       }
-      type.replace(last, i - last, ntok);
-      i += ntok.size() - (i - last);
-      last = i + 1;
+      if(!dup) break;
+      out.resize(start);
+      append_identifier(out, type + last, i - last, j);
     }
+    out += type[i];
+    last = i + 1;
   }
+  out.append(type + last, n - last);
 
-  if(type.find('/') == string::npos) {
+  if(out.find('/') == string::npos) {
     /* I want to put everything in a package to make things simpler.  We'll
      * strip it out of the package later or reassembly. */
-    type = string("Ldxdasm_default/") + type.substr(1);
+    out.replace(0, 1, "Ldxdasm_default/");
   }
-  return type;
 }
 
-static
-string desanitize_type(string type) {
-  int last = type.size() - 1;
-  for(int i = type.size() - 2; i >= 1; i--) {
-    if(i == 1 || type[i - 1] == '/' || type[i - 1] == '$') {
-      type.replace(i, last - i,
-                   desanitize_identifier(type.substr(i, last - i)));
-      last = i - 1;
-    }
+static void desanitize_type(string& out, const char* type) {
+  size_t n = strlen(type);
+  if(n < 2) {
+    out = type;
+    return;
   }
-  string prefix = "Ldxdasm_default/";
-  if(type.size() > prefix.size() && prefix == type.substr(0, prefix.size())) {
-    type = string("L") + type.substr(prefix.size());
+  out.assign(type, 1);
+  size_t last = 1;
+  for(size_t i = 1; i <= n - 1; i++) {
+    if(i < n - 1 && type[i] != '/' && type[i] != '$') continue;
+    const char* tok = desanitize_identifier(type + last, i - last);
+    out.append(tok, type + i - tok);
+    out += type[i];
+    last = i + 1;
   }
-  return type;
+  const char prefix[] = "Ldxdasm_default/";
+  if(out.size() > sizeof(prefix) - 1 &&
+     !out.compare(0, sizeof(prefix) - 1, prefix)) {
+    out.erase(1, sizeof(prefix) - 2);
+  }
+}
+
+RenameTables::~RenameTables() {
+  for(int i = 0; i < source_classes.size(); i++) {
+    dxc_free_str(source_classes[i]);
+    dxc_free_str(dest_classes[i]);
+  }
+  for(int i = 0; i < source_fields.size(); i++) {
+    dxc_free_str(source_fields[i].defining_class);
+    dxc_free_str(source_fields[i].name);
+    dxc_free_str(source_fields[i].type);
+    dxc_free_str(dest_fields[i].defining_class);
+    dxc_free_str(dest_fields[i].name);
+    dxc_free_str(dest_fields[i].type);
+  }
+  for(int i = 0; i < source_methods.size(); i++) {
+    dxc_free_str(source_methods[i].defining_class);
+    dxc_free_str(source_methods[i].name);
+    dxc_free_strstr(source_methods[i].prototype);
+    dxc_free_str(dest_methods[i].defining_class);
+    dxc_free_str(dest_methods[i].name);
+    dxc_free_strstr(dest_methods[i].prototype);
+  }
+}
+
+static void rename_identifiers(DexFile* dxfile, RenameTables& t) {
+  dxc_rename_identifiers(dxfile,
+      t.source_fields.size(), &t.source_fields[0], &t.dest_fields[0],
+      t.source_methods.size(), &t.source_methods[0], &t.dest_methods[0],
+      t.source_classes.size(), &t.source_classes[0], &t.dest_classes[0]);
 }
 
 void prep_classes(DexFile* dxfile, std::vector<dasmcl>& clist,
-                  map<string, dasmcl*>& clmap) {
-  vector<ref_field> source_fields; vector<ref_field> dest_fields;
-  vector<ref_method> source_methods; vector<ref_method> dest_methods;
-  vector<ref_str*> source_classes; vector<ref_str*> dest_classes;
+                  map<string, dasmcl*>& clmap, const set<string>* keep,
+                  RenameTables* lazy) {
+  RenameTables own_tables;
+  RenameTables& tables = lazy ? *lazy : own_tables;
+  vector<ref_field>& source_fields = tables.source_fields;
+  vector<ref_field>& dest_fields = tables.dest_fields;
+  vector<ref_method>& source_methods = tables.source_methods;
+  vector<ref_method>& dest_methods = tables.dest_methods;
+  vector<ref_str*>& source_classes = tables.source_classes;
+  vector<ref_str*>& dest_classes = tables.dest_classes;
   source_classes.push_back(dxc_induct_str("Ljava/lang/Enum;"));
   dest_classes.push_back(dxc_induct_str("Lorg/dxcut/dxdasm/DxdasmEnum;"));
 
+  // Reused for every class so renaming doesn't allocate per name.
+  string stype, sfield, smethod, params;
   for(DexClass* cl = dxfile->classes; !dxc_is_sentinel_class(cl); ++cl) {
-    string type = cl->name->s;
-    string stype = sanitize_type(type);
-    string tbrief = type_brief(type);
-    if(type != stype) {
+    sanitize_type(stype, cl->name->s);
+    if(stype != cl->name->s) {
       source_classes.push_back(dxc_copy_str(cl->name));
       dest_classes.push_back(dxc_induct_str(stype.c_str()));
     }
     for(int iter = 0; iter < 2; iter++)
     for(DexField* fld = iter ? cl->static_fields : cl->instance_fields;
         !dxc_is_sentinel_field(fld); ++fld) {
-      string sfield = sanitize_identifier(fld->name->s);
+      sanitize_identifier(sfield, fld->name->s);
       if(sfield != fld->name->s) {
         ref_field rfld, dfld;
         rfld.defining_class = dxc_copy_str(cl->name);
@@ -274,18 +427,18 @@ void prep_classes(DexFile* dxfile, std::vector<dasmcl>& clist,
     for(int iter = 0; iter < 2; iter++)
     for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
         !dxc_is_sentinel_method(mtd); ++mtd) {
-      string smethod = sanitize_identifier(mtd->name->s);
+      sanitize_identifier(smethod, mtd->name->s);
 
       /* This isn't 100% correct.  I'm trying to deal with synthetic methods
        * that get inserted by javac in relation to varargs methods.  Really I
        * should be checking the SYNTHETIC flag. */
-      string params;
+      params.clear();
       for(ref_str** para = mtd->prototype->s + 1; *para; ++para) {
         params += (*para)->s[0];
       }
       if(!params.empty() && params[params.size() - 1] == '[') {
         for(int i = 0; !method_names.insert(smethod + params).second; i++) {
-          smethod = sanitize_identifier(mtd->name->s, -i - 2);
+          sanitize_identifier(smethod, mtd->name->s, -i - 2);
         }
       }
 
@@ -303,36 +456,27 @@ void prep_classes(DexFile* dxfile, std::vector<dasmcl>& clist,
       }
     }
   }
-  dxc_rename_identifiers(dxfile,
-      source_fields.size(), &source_fields[0], &dest_fields[0],
-      source_methods.size(), &source_methods[0], &dest_methods[0],
-      source_classes.size(), &source_classes[0], &dest_classes[0]);
-  for(int i = 0; i < source_classes.size(); i++) {
-    dxc_free_str(source_classes[i]);
-    dxc_free_str(dest_classes[i]);
-  }
-  for(int i = 0; i < source_fields.size(); i++) {
-    dxc_free_str(source_fields[i].defining_class);
-    dxc_free_str(source_fields[i].name);
-    dxc_free_str(source_fields[i].type);
-    dxc_free_str(dest_fields[i].defining_class);
-    dxc_free_str(dest_fields[i].name);
-    dxc_free_str(dest_fields[i].type);
+  if(keep) {
+    // The rename tables above still cover every class so references into the
+    // dropped classes come out the same as in a full run.
+    DexClass* out = dxfile->classes;
+    for(DexClass* cl = dxfile->classes; !dxc_is_sentinel_class(cl); ++cl) {
+      if(keep->find(cl->name->s) != keep->end()) *out++ = *cl;
+    }
+    dxc_make_sentinel_class(out);
   }
-  for(int i = 0; i < source_methods.size(); i++) {
-    dxc_free_str(source_methods[i].defining_class);
-    dxc_free_str(source_methods[i].name);
-    dxc_free_strstr(source_methods[i].prototype);
-    dxc_free_str(dest_methods[i].defining_class);
-    dxc_free_str(dest_methods[i].name);
-    dxc_free_strstr(dest_methods[i].prototype);
+  vector<string> dex_names;
+  for(DexClass* cl = dxfile->classes; !dxc_is_sentinel_class(cl); ++cl) {
+    dex_names.push_back(cl->name->s);
   }
+  rename_identifiers(dxfile, tables);
 
   // Create class mapping and table.
   clist.clear();
   clmap.clear();
   for(DexClass* cl = dxfile->classes; !dxc_is_sentinel_class(cl); ++cl) {
     clist.push_back(dasmcl(cl));
+    clist.back().dex_name = dex_names[cl - dxfile->classes];
   }
   for(DexClass* cl = dxfile->classes; !dxc_is_sentinel_class(cl); ++cl) {
     clmap[cl->name->s] = &clist[cl - dxfile->classes];
@@ -358,144 +502,356 @@ void prep_classes(DexFile* dxfile, std::vector<dasmcl>& clist,
   for(int i = 0; i < clist.size(); i++) {
     if(!clist[i].outer_class) {
       build_import_table(&clist[i]);
-      build_alias_tables(&clist[i]);
+      if(!lazy) build_alias_tables(&clist[i], tables.symbols);
+    }
+  }
+
+  if(lazy) {
+    for(size_t i = 0; i < source_classes.size(); i++) {
+      tables.class_index[source_classes[i]->s] = i;
     }
+    for(size_t i = 0; i < source_fields.size(); i++) {
+      tables.field_index[source_fields[i].defining_class->s].push_back(i);
+    }
+    for(size_t i = 0; i < source_methods.size(); i++) {
+      tables.method_index[source_methods[i].defining_class->s].push_back(i);
+    }
+  }
+}
+
+static void collect_nest(dasmcl* dcl, vector<DexClass*>& nest) {
+  nest.push_back(dcl->cl);
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    collect_nest(dcl->inner_classes[i], nest);
   }
 }
 
-string get_import_name(dasmcl* referer, const string& cldesc) {
-  if(referer->import_table.find(strip_array(cldesc.c_str())) ==
-     referer->import_table.end()) {
-    string result = dxc_type_nice(cldesc.c_str());
-    for(int i = 0; i < result.size(); i++) {
-      if(result[i] == '$') {
-        result[i] = '.';
+/* The classes a nest mentions, which are all a rename can apply to.  Every
+ * string that dxc_rename_identifiers() may rename is looked at. */
+typedef unordered_set<string> MentionedClasses;
+
+static void mention_type(MentionedClasses& m, const char* type) {
+  if(!type) return;
+  type = strip_array(type);
+  if(*type == 'L') m.insert(type);
+}
+
+static void mention_types(MentionedClasses& m, ref_strstr* types) {
+  if(!types) return;
+  for(ref_str** t = types->s; *t; ++t) mention_type(m, (*t)->s);
+}
+
+static void mention_annotations(MentionedClasses& m, DexAnnotation* annons);
+
+static void mention_value(MentionedClasses& m, DexValue* val) {
+  switch(val->type) {
+    case VALUE_TYPE:
+      mention_type(m, val->value.val_type->s);
+      break;
+    case VALUE_FIELD:
+    case VALUE_ENUM: {
+      ref_field* fld = val->type == VALUE_FIELD ? val->value.val_field :
+                                                  val->value.val_enum;
+      mention_type(m, fld->defining_class->s);
+      mention_type(m, fld->type->s);
+      break;
+    } case VALUE_METHOD:
+      mention_type(m, val->value.val_method->defining_class->s);
+      mention_types(m, val->value.val_method->prototype);
+      break;
+    case VALUE_ARRAY:
+      for(DexValue* v = val->value.val_array; !dxc_is_sentinel_value(v); ++v) {
+        mention_value(m, v);
       }
+      break;
+    case VALUE_ANNOTATION:
+      mention_annotations(m, val->value.val_annotation);
+      break;
+    default:
+      break;
+  }
+}
+
+static void mention_annotations(MentionedClasses& m, DexAnnotation* annons) {
+  if(!annons) return;
+  for(; !dxc_is_sentinel_annotation(annons); ++annons) {
+    mention_type(m, annons->type->s);
+    for(DexNameValuePair* p = annons->parameters;
+        !dxc_is_sentinel_parameter(p); ++p) {
+      mention_value(m, &p->value);
     }
-    return result;
-  } else {
-    return type_brief(cldesc);
   }
 }
 
-void strip_classes(DexFile* dxfile) {
-  vector<ref_field> source_fields; vector<ref_field> dest_fields;
-  vector<ref_method> source_methods; vector<ref_method> dest_methods;
-  vector<ref_str*> source_classes; vector<ref_str*> dest_classes;
-  source_classes.push_back(dxc_induct_str("Lorg/dxcut/dxdasm/DxdasmEnum;"));
-  dest_classes.push_back(dxc_induct_str("Ljava/lang/Enum;"));
-  DexClass* pos = dxfile->classes;
+static void mention_code(MentionedClasses& m, DexCode* code) {
+  if(!code) return;
+  for(dx_uint i = 0; i < code->insns_count; i++) {
+    DexInstruction* in = code->insns + i;
+    if(in->opcode == OP_PSUEDO && in->hi_byte) continue;
+    switch(dex_opcode_formats[in->opcode].specialType) {
+      case SPECIAL_TYPE:
+        mention_type(m, in->special.type->s);
+        break;
+      case SPECIAL_FIELD:
+        mention_type(m, in->special.field.defining_class->s);
+        mention_type(m, in->special.field.type->s);
+        break;
+      case SPECIAL_METHOD:
+        mention_type(m, in->special.method.defining_class->s);
+        mention_types(m, in->special.method.prototype);
+        break;
+    }
+  }
+  for(DexTryBlock* tb = code->tries; !dxc_is_sentinel_try_block(tb); ++tb) {
+    for(DexHandler* hndlr = tb->handlers; !dxc_is_sentinel_handler(hndlr);
+        ++hndlr) {
+      if(hndlr->type) mention_type(m, hndlr->type->s);
+    }
+  }
+  if(code->debug_information) {
+    for(DexDebugInstruction* insn = code->debug_information->insns;
+        insn->opcode != DBG_END_SEQUENCE; insn++) {
+      if((insn->opcode == DBG_START_LOCAL ||
+          insn->opcode == DBG_START_LOCAL_EXTENDED) &&
+         insn->p.start_local->type) {
+        mention_type(m, insn->p.start_local->type->s);
+      }
+    }
+  }
+}
 
-  for(DexClass* cl = dxfile->classes; !dxc_is_sentinel_class(cl); ++cl) {
-    string type = cl->name->s;
-    string stype = desanitize_type(type);
-    string tbrief = type_brief(type);
-    string package = get_package_name(dxc_type_nice(cl->name->s));
-    
-    if(package == "org.dxcut.dxdasm") {
-      dxc_free_class(cl);
-      continue;
+static void mention_class(MentionedClasses& m, DexClass* cl) {
+  mention_type(m, cl->name->s);
+  if(cl->super_class) mention_type(m, cl->super_class->s);
+  mention_types(m, cl->interfaces);
+  mention_annotations(m, cl->annotations);
+  if(cl->static_values) {
+    for(DexValue* val = cl->static_values; !dxc_is_sentinel_value(val);
+        ++val) {
+      mention_value(m, val);
     }
+  }
+  for(int iter = 0; iter < 2; iter++)
+  for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
+      !dxc_is_sentinel_field(fld); ++fld) {
+    mention_type(m, fld->type->s);
+    mention_annotations(m, fld->annotations);
+  }
+  for(int iter = 0; iter < 2; iter++)
+  for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
+      !dxc_is_sentinel_method(mtd); ++mtd) {
+    mention_types(m, mtd->prototype);
+    mention_annotations(m, mtd->annotations);
+    if(mtd->parameter_annotations) {
+      for(DexAnnotation** pa = mtd->parameter_annotations; *pa; ++pa) {
+        mention_annotations(m, *pa);
+      }
+    }
+    mention_code(m, mtd->code_body);
+  }
+}
 
-    if(type != stype) {
-      source_classes.push_back(dxc_copy_str(cl->name));
-      dest_classes.push_back(dxc_induct_str(stype.c_str()));
+void prep_class_bodies(DexFile* dxfile, dasmcl* dcl, RenameTables& tables) {
+  // Rename through a DexFile holding just this nest, with just the renames
+  // for the classes it mentions, so the cost is proportional to the classes
+  // being emitted rather than to the whole dex.
+  vector<DexClass*> nest;
+  collect_nest(dcl, nest);
+  MentionedClasses mentioned;
+  for(int i = 0; i < nest.size(); i++) mention_class(mentioned, nest[i]);
+
+  vector<ref_field> source_fields, dest_fields;
+  vector<ref_method> source_methods, dest_methods;
+  vector<ref_str*> source_classes, dest_classes;
+  for(typeof(mentioned.begin()) it = mentioned.begin();
+      it != mentioned.end(); ++it) {
+    typeof(tables.class_index.begin()) ct = tables.class_index.find(*it);
+    if(ct != tables.class_index.end()) {
+      source_classes.push_back(tables.source_classes[ct->second]);
+      dest_classes.push_back(tables.dest_classes[ct->second]);
     }
-    for(int iter = 0; iter < 2; iter++)
-    for(DexField* fld = iter ? cl->static_fields : cl->instance_fields;
-        !dxc_is_sentinel_field(fld); ++fld) {
-      string sfield = desanitize_identifier(fld->name->s);
-      if(sfield != fld->name->s) {
-        ref_field rfld, dfld;
-        rfld.defining_class = dxc_copy_str(cl->name);
-        rfld.name = dxc_copy_str(fld->name);
-        rfld.type = dxc_copy_str(fld->type);
-        dfld.defining_class = dxc_copy_str(cl->name);
-        dfld.name = dxc_induct_str(sfield.c_str());
-        dfld.type = dxc_copy_str(fld->type);
-        source_fields.push_back(rfld);
-        dest_fields.push_back(dfld);
+    typeof(tables.field_index.begin()) ft = tables.field_index.find(*it);
+    if(ft != tables.field_index.end()) {
+      for(int i = 0; i < ft->second.size(); i++) {
+        source_fields.push_back(tables.source_fields[ft->second[i]]);
+        dest_fields.push_back(tables.dest_fields[ft->second[i]]);
       }
     }
+    typeof(tables.method_index.begin()) mt = tables.method_index.find(*it);
+    if(mt != tables.method_index.end()) {
+      for(int i = 0; i < mt->second.size(); i++) {
+        source_methods.push_back(tables.source_methods[mt->second[i]]);
+        dest_methods.push_back(tables.dest_methods[mt->second[i]]);
+      }
+    }
+  }
 
-    map<ref_method, DexMethod*, RefMethodCompare> clobber_map;
-    for(int iter = 0; iter < 2; iter++) {
-      DexMethod* mtdpos = iter ? cl->direct_methods : cl->virtual_methods;
-      for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
-          !dxc_is_sentinel_method(mtd); ++mtd) {
-        ref_method rmtd, dmtd;
-        bool name_change = false;
-        string smethod = desanitize_identifier(mtd->name->s);
-        if(string("dxdasm_static") == mtd->name->s) {
-          smethod = "<clinit>";
+  vector<DexClass> classes(nest.size() + 1);
+  for(int i = 0; i < nest.size(); i++) classes[i] = *nest[i];
+  dxc_make_sentinel_class(&classes[nest.size()]);
+  DexFile sub = *dxfile;
+  sub.classes = &classes[0];
+  dxc_rename_identifiers(&sub,
+      source_fields.size(), &source_fields[0], &dest_fields[0],
+      source_methods.size(), &source_methods[0], &dest_methods[0],
+      source_classes.size(), &source_classes[0], &dest_classes[0]);
+  for(int i = 0; i < nest.size(); i++) *nest[i] = classes[i];
+
+  build_alias_tables(dcl, tables.symbols);
+}
+
+void release_class_bodies(dasmcl* dcl) {
+  // The alias tables point into the loaded code.
+  dcl->import_names.clear();
+  dcl->method_aliases.clear();
+  dcl->field_aliases.clear();
+  dcl->insn_aliases.clear();
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    release_class_bodies(dcl->inner_classes[i]);
+  }
+}
+
+const string& get_import_name(dasmcl* referer, const char* cldesc) {
+  // Inner classes are emitted with the import table of their top-level class.
+  dasmcl* top = referer;
+  while(top->outer_class) top = top->outer_class;
+  ImportNames& cache = top->import_names;
+  typeof(cache.names.begin()) it = cache.names.find(cldesc);
+  if(it != cache.names.end()) return it->second;
+
+  string result;
+  if(!top->imports->contains(strip_array(cldesc))) {
+    append_type_name(result, cldesc, true);
+  } else {
+    append_type_brief(result, cldesc);
+  }
+  cache.descs.push_back(cldesc);
+  string& name = cache.names[cache.descs.back().c_str()];
+  name.swap(result);
+  return name;
+}
+
+bool is_dxdasm_class(const char* type) {
+  string package;
+  append_package_name(package, type);
+  return package == "org.dxcut.dxdasm";
+}
+
+/* Adds the renames undoing the sanitizing of 'cl'.  With 'modify' the class
+ * itself gets fixed up as well: static initializers get their flag back and
+ * methods javac duplicated are dropped.  Returns false for dxdasm's own
+ * classes, which are left alone. */
+static bool strip_class(RenameTables& r, DexClass* cl, bool modify) {
+  if(is_dxdasm_class(cl->name->s)) {
+    return false;
+  }
+  string stype;
+  desanitize_type(stype, cl->name->s);
+
+  if(stype != cl->name->s) {
+    r.source_classes.push_back(dxc_copy_str(cl->name));
+    r.dest_classes.push_back(dxc_induct_str(stype.c_str()));
+  }
+  for(int iter = 0; iter < 2; iter++)
+  for(DexField* fld = iter ? cl->static_fields : cl->instance_fields;
+      !dxc_is_sentinel_field(fld); ++fld) {
+    const char* sfield = desanitize_identifier(fld->name->s,
+                                               strlen(fld->name->s));
+    if(sfield != fld->name->s) {
+      ref_field rfld, dfld;
+      rfld.defining_class = dxc_copy_str(cl->name);
+      rfld.name = dxc_copy_str(fld->name);
+      rfld.type = dxc_copy_str(fld->type);
+      dfld.defining_class = dxc_copy_str(cl->name);
+      dfld.name = dxc_induct_str(sfield);
+      dfld.type = dxc_copy_str(fld->type);
+      r.source_fields.push_back(rfld);
+      r.dest_fields.push_back(dfld);
+    }
+  }
+
+  map<ref_method, DexMethod*, RefMethodCompare> clobber_map;
+  for(int iter = 0; iter < 2; iter++) {
+    DexMethod* mtdpos = iter ? cl->direct_methods : cl->virtual_methods;
+    for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
+        !dxc_is_sentinel_method(mtd); ++mtd) {
+      ref_method rmtd, dmtd;
+      bool name_change = false;
+      const char* smethod = desanitize_identifier(mtd->name->s,
+                                                  strlen(mtd->name->s));
+      if(!strcmp("dxdasm_static", mtd->name->s)) {
+        smethod = "<clinit>";
+        if(modify) {
           mtd->access_flags =
               (DexAccessFlags)(mtd->access_flags | ACC_CONSTRUCTOR);
         }
-        if(smethod != mtd->name->s && strcmp("<init>", mtd->name->s)) {
-          name_change = true;
-          rmtd.defining_class = dxc_copy_str(cl->name);
-          rmtd.name = dxc_copy_str(mtd->name);
-          rmtd.prototype = dxc_copy_strstr(mtd->prototype);
-          dmtd.defining_class = dxc_copy_str(cl->name);
-          dmtd.name = dxc_induct_str(smethod.c_str());
-          dmtd.prototype = dxc_copy_strstr(mtd->prototype);
-        } else {
-          dmtd.defining_class = cl->name;
-          dmtd.name = mtd->name;
-          dmtd.prototype = mtd->prototype;
-        }
+      }
+      if(smethod != mtd->name->s && strcmp("<init>", mtd->name->s)) {
+        name_change = true;
+        rmtd.defining_class = dxc_copy_str(cl->name);
+        rmtd.name = dxc_copy_str(mtd->name);
+        rmtd.prototype = dxc_copy_strstr(mtd->prototype);
+        dmtd.defining_class = dxc_copy_str(cl->name);
+        dmtd.name = dxc_induct_str(smethod);
+        dmtd.prototype = dxc_copy_strstr(mtd->prototype);
+      } else {
+        dmtd.defining_class = cl->name;
+        dmtd.name = mtd->name;
+        dmtd.prototype = mtd->prototype;
+      }
 
-        /* Sometimes javac inserts methods that were already present and
-         * handled.  If two function names collide we take the one that wasn't
-         * synthetic.  This also happens with static initializers which we
-         * rename dxdasm_static. */
-        DexMethod*& clobber = clobber_map[dmtd];
-        if(clobber) {
-          if(!strcmp(mtd->name->s, "<clinit>") ||
-             (smethod != "<clinit>" && (mtd->access_flags & ACC_SYNTHETIC))) {
-            continue;
-          } else {
-            *clobber = *mtd;
-          }
-        } else {
-          clobber = mtdpos;
-          (*mtdpos++) = *mtd;
+      /* Sometimes javac inserts methods that were already present and
+       * handled.  If two function names collide we take the one that wasn't
+       * synthetic.  This also happens with static initializers which we
+       * rename dxdasm_static. */
+      DexMethod*& clobber = clobber_map[dmtd];
+      if(clobber) {
+        if(!strcmp(mtd->name->s, "<clinit>") ||
+           (strcmp(smethod, "<clinit>") &&
+            (mtd->access_flags & ACC_SYNTHETIC))) {
+          continue;
+        } else if(modify) {
+          *clobber = *mtd;
         }
+      } else if(modify) {
+        clobber = mtdpos;
+        (*mtdpos++) = *mtd;
+      } else {
+        clobber = mtd;
+      }
 
-        if(name_change) {
-          source_methods.push_back(rmtd);
-          dest_methods.push_back(dmtd);
-        }
+      if(name_change) {
+        r.source_methods.push_back(rmtd);
+        r.dest_methods.push_back(dmtd);
       }
+    }
+    if(modify) {
       dxc_make_sentinel_method(mtdpos);
     }
-    *(pos++) = *cl;
   }
-  dxc_make_sentinel_class(pos);
+  return true;
+}
 
-  dxc_rename_identifiers(dxfile,
-      source_fields.size(), &source_fields[0], &dest_fields[0],
-      source_methods.size(), &source_methods[0], &dest_methods[0],
-      source_classes.size(), &source_classes[0], &dest_classes[0]);
-  for(int i = 0; i < source_classes.size(); i++) {
-    dxc_free_str(source_classes[i]);
-    dxc_free_str(dest_classes[i]);
-  }
-  for(int i = 0; i < source_fields.size(); i++) {
-    dxc_free_str(source_fields[i].defining_class);
-    dxc_free_str(source_fields[i].name);
-    dxc_free_str(source_fields[i].type);
-    dxc_free_str(dest_fields[i].defining_class);
-    dxc_free_str(dest_fields[i].name);
-    dxc_free_str(dest_fields[i].type);
+void strip_classes(DexFile* dxfile, DexFile* context) {
+  RenameTables r;
+  r.source_classes.push_back(dxc_induct_str("Lorg/dxcut/dxdasm/DxdasmEnum;"));
+  r.dest_classes.push_back(dxc_induct_str("Ljava/lang/Enum;"));
+
+  if(context) {
+    for(DexClass* cl = context->classes; !dxc_is_sentinel_class(cl); ++cl) {
+      strip_class(r, cl, false);
+    }
   }
-  for(int i = 0; i < source_methods.size(); i++) {
-    dxc_free_str(source_methods[i].defining_class);
-    dxc_free_str(source_methods[i].name);
-    dxc_free_strstr(source_methods[i].prototype);
-    dxc_free_str(dest_methods[i].defining_class);
-    dxc_free_str(dest_methods[i].name);
-    dxc_free_strstr(dest_methods[i].prototype);
+  DexClass* pos = dxfile->classes;
+  for(DexClass* cl = dxfile->classes; !dxc_is_sentinel_class(cl); ++cl) {
+    if(!strip_class(r, cl, true)) {
+      dxc_free_class(cl);
+      continue;
+    }
+    *(pos++) = *cl;
   }
+  dxc_make_sentinel_class(pos);
+
+  rename_identifiers(dxfile, r);
 }
 
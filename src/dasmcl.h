@@ -1,13 +1,20 @@
 #ifndef DASMCL_H
 #define DASMCL_H
 
+#include <deque>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <dxcut/dxcut.h>
 
+#include "symtab.h"
+
 typedef struct RefMethodCompare {
   bool operator()(ref_method a, ref_method b) const {
     return (*this)(&a, &b);
@@ -21,7 +28,7 @@ typedef struct RefMethodCompare {
     for(; !r && *pa && *pb; ++pa, ++pb)  {
       r = strcmp((*pa)->s, (*pb)->s);
     }
-    if(!r) r = pa - pb;
+    if(!r) r = (*pa != NULL) - (*pb != NULL);
     return r < 0;
   }
 } RefMethodCompare;
@@ -35,28 +42,150 @@ typedef struct RefFieldCompare {
   }
 } RefFieldCompare;
 
+// Aliases for the field or method references made by the code of a class,
+// in the order they were first used.
+template<typename Ref>
+struct AliasTable {
+  std::vector<std::pair<Ref*, std::string> > entries;
+  // Position in 'entries' by SymbolTable id.
+  std::unordered_map<dx_uint, int> by_symbol;
+
+  void clear() {
+    entries.clear();
+    by_symbol.clear();
+  }
+};
+
+// The classes a top-level class imports, by descriptor.  Built once per
+// top-level class and shared, read only, by its inner classes.
+struct ImportTable {
+  // Sorted, the order of the import list.
+  std::vector<std::string> descs;
+  // Points into 'descs'.
+  std::unordered_set<const char*, CStrHash, CStrEqual> lookup;
+
+  bool contains(const char* desc) const {
+    return lookup.find(desc) != lookup.end();
+  }
+};
+
+// The names types are written as in the code of one top-level class and its
+// inner classes, by descriptor.
+struct ImportNames {
+  // Owns the keys of 'names'.
+  std::deque<std::string> descs;
+  std::unordered_map<const char*, std::string, CStrHash, CStrEqual> names;
+
+  void clear() {
+    names.clear();
+    descs.clear();
+  }
+};
+
 struct dasmcl {
   dasmcl(DexClass* cl) : cl(cl), outer_class(NULL) {}
 
   DexClass* cl;
+  // Descriptor of the class before sanitizing, as it appears in the dex.
+  std::string dex_name;
   
   dasmcl* outer_class;
   std::vector<dasmcl*> inner_classes;
 
-  std::set<std::string> import_table;
-  std::map<ref_method*, std::string, RefMethodCompare> method_alias_map;
-  std::map<ref_field*, std::string, RefFieldCompare> field_alias_map;
+  std::shared_ptr<const ImportTable> imports;
+  // Filled in by get_import_name() on top-level classes while they are
+  // emitted.
+  ImportNames import_names;
+  AliasTable<ref_method> method_aliases;
+  AliasTable<ref_field> field_aliases;
+  // The alias table entry of each field and method instruction.
+  std::unordered_map<const DexInstruction*, int> insn_aliases;
+};
+
+// The identifier renames prep_classes() hands to dxc_rename_identifiers(),
+// and the symbols prep_class_bodies() keys the alias tables on.
+struct RenameTables {
+  ~RenameTables();
+
+  std::vector<ref_field> source_fields, dest_fields;
+  std::vector<ref_method> source_methods, dest_methods;
+  std::vector<ref_str*> source_classes, dest_classes;
+
+  // Ids for the references the class bodies make, shared by every nest.
+  SymbolTable symbols;
+
+  // Set up by prep_classes() when the bodies are left for
+  // prep_class_bodies(): the renames above by the class they rename or that
+  // declares the field or method, so each nest is only handed the renames
+  // it can hit.
+  std::unordered_map<std::string, size_t> class_index;
+  std::unordered_map<std::string, std::vector<size_t> > field_index;
+  std::unordered_map<std::string, std::vector<size_t> > method_index;
 };
 
-void strip_classes(DexFile* dxfile);
+// Undoes what dxdasm did to names and drops its own classes.  References to
+// the classes in 'context' are renamed too, though the classes themselves
+// are left alone; pass the rest of the file when only some of it is
+// stripped.
+void strip_classes(DexFile* dxfile, DexFile* context = NULL);
 
+// Whether 'type' is one of dxdasm's own classes, which strip_classes() drops.
+bool is_dxdasm_class(const char* type);
+
+// Sanitizes identifiers and builds the class nesting, import and alias
+// tables.  If 'keep' is given every class not named in it is dropped from
+// dxfile first, so only the kept classes pay for renaming and table building.
+//
+// If 'lazy' is given the class bodies haven't been loaded yet.  The rename
+// tables are handed back through it and the alias tables are left for
+// prep_class_bodies().
 void prep_classes(DexFile* dxfile, std::vector<dasmcl>& clist,
-                  std::map<std::string, dasmcl*>& clmap);
+                  std::map<std::string, dasmcl*>& clmap,
+                  const std::set<std::string>* keep = NULL,
+                  RenameTables* lazy = NULL);
+
+// Finishes a top-level class and its inner classes once their bodies have
+// been loaded: sanitizes the identifiers in the bodies and builds the alias
+// tables.  release_class_bodies() drops the alias tables again before the
+// bodies are freed.
+void prep_class_bodies(DexFile* dxfile, dasmcl* dcl, RenameTables& tables);
+
+void release_class_bodies(dasmcl* dcl);
+
+// libdxcut formats into static buffers.  These copy the result out while
+// holding a lock so the emitter can run on several threads at once.
+std::string type_nice(const char* type);
+
+std::string access_flags_nice(DexAccessFlags flags);
+
+std::string value_nice(DexValue* value);
+
+// Descriptor helpers.  They read the descriptor in place and append to a
+// buffer the caller reuses, so they don't allocate once it has grown.  Class
+// and primitive types are formatted here rather than by type_nice() to stay
+// clear of its lock as well.
+
+// The element type of an array descriptor; 'type' itself otherwise.
+const char* strip_array(const char* type);
+
+// Appends the Java name of 'type' ("java.util.Map$Entry[]", "int"), with '$'
+// turned into '.' if 'dots' is set.
+void append_type_name(std::string& out, const char* type, bool dots = false);
+
+// Appends the simple name of 'type' ("Entry[]").
+void append_type_brief(std::string& out, const char* type);
 
-std::string get_package_name(const std::string& name);
+// The simple name of class descriptor 'type' as a pointer into it, with its
+// length in *len.
+const char* class_brief(const char* type, size_t* len);
 
-std::string type_brief(const std::string& type);
+// Appends the package of 'type' in dotted form, nothing for the default
+// package.
+void append_package_name(std::string& out, const char* type);
 
-std::string get_import_name(dasmcl* referer, const std::string& cldesc);
+// How 'cldesc' is written in the code of 'referer': its simple name if the
+// top-level class imports it, its qualified name otherwise.  Resolved once per
+// top-level class; the result stays valid until release_class_bodies().
+const std::string& get_import_name(dasmcl* referer, const char* cldesc);
 
 #endif
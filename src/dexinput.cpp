@@ -0,0 +1,341 @@
+#include "dexinput.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+
+#define ZIP_LOCAL_SIG 0x04034b50U
+#define ZIP_CENTRAL_SIG 0x02014b50U
+#define ZIP_END_SIG 0x06054b50U
+
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+struct DexEntry {
+  string name;
+  int number;
+  const unsigned char* data;
+  dx_uint method;
+  dx_uint crc;
+  dx_uint comp_size;
+  dx_uint size;
+};
+
+static dx_uint get_u16(const unsigned char* p) {
+  return p[0] | p[1] << 8;
+}
+
+static dx_uint get_u32(const unsigned char* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (dx_uint)p[3] << 24;
+}
+
+static bool entry_order(const DexEntry& a, const DexEntry& b) {
+  return a.number < b.number;
+}
+
+// Returns the position of name in the multi-dex sequence (classes.dex is 1,
+// classes2.dex is 2, ...) or 0 if it isn't a top-level dex entry.
+static int dex_number(const string& name) {
+  if(name.compare(0, 7, "classes") || name.size() < 11 ||
+     name.compare(name.size() - 4, 4, ".dex")) {
+    return 0;
+  }
+  string num = name.substr(7, name.size() - 11);
+  if(num.empty()) return 1;
+  if(num[0] == '0' || num.size() > 6) return 0;
+  for(int i = 0; i < num.size(); i++) {
+    if(num[i] < '0' || num[i] > '9') return 0;
+  }
+  int n = atoi(num.c_str());
+  return n >= 2 ? n : 0;
+}
+
+static bool list_dex_entries(const char* path, const unsigned char* base,
+                             size_t size, vector<DexEntry>& entries) {
+  // The end of central directory record is followed by at most a 64k comment.
+  const unsigned char* end = NULL;
+  if(size >= 22) {
+    for(size_t i = size - 22; ; i--) {
+      if(get_u32(base + i) == ZIP_END_SIG) {
+        end = base + i;
+        break;
+      }
+      if(i == 0 || size - i > 0xFFFF + 22) break;
+    }
+  }
+  if(!end) {
+    fprintf(stderr, "%s: could not find zip central directory\n", path);
+    return false;
+  }
+
+  dx_uint count = get_u16(end + 10);
+  size_t off = get_u32(end + 16);
+  if(count == 0xFFFF || off == 0xFFFFFFFFU) {
+    fprintf(stderr, "%s: zip64 archives are not supported\n", path);
+    return false;
+  }
+  for(dx_uint i = 0; i < count; i++) {
+    if(off + 46 > size || get_u32(base + off) != ZIP_CENTRAL_SIG) {
+      fprintf(stderr, "%s: corrupt zip central directory\n", path);
+      return false;
+    }
+    const unsigned char* cd = base + off;
+    dx_uint name_len = get_u16(cd + 28);
+    dx_uint extra_len = get_u16(cd + 30);
+    dx_uint comment_len = get_u16(cd + 32);
+    if(off + 46 + name_len > size) {
+      fprintf(stderr, "%s: corrupt zip central directory\n", path);
+      return false;
+    }
+    string name((const char*)cd + 46, name_len);
+    off += 46 + name_len + extra_len + comment_len;
+
+    int number = dex_number(name);
+    if(!number) continue;
+
+    DexEntry entry;
+    entry.name = name;
+    entry.number = number;
+    entry.method = get_u16(cd + 10);
+    entry.crc = get_u32(cd + 16);
+    entry.comp_size = get_u32(cd + 20);
+    entry.size = get_u32(cd + 24);
+
+    // The local header may carry a different extra field so the data offset
+    // has to come from there.
+    size_t loff = get_u32(cd + 42);
+    if(loff + 30 > size || get_u32(base + loff) != ZIP_LOCAL_SIG) {
+      fprintf(stderr, "%s: corrupt zip entry %s\n", path, name.c_str());
+      return false;
+    }
+    loff += 30 + get_u16(base + loff + 26) + get_u16(base + loff + 28);
+    if(loff + entry.comp_size > size) {
+      fprintf(stderr, "%s: truncated zip entry %s\n", path, name.c_str());
+      return false;
+    }
+    entry.data = base + loff;
+    entries.push_back(entry);
+  }
+  sort(entries.begin(), entries.end(), entry_order);
+  return true;
+}
+
+static unsigned char* inflate_entry(const char* path, const DexEntry& entry) {
+  unsigned char* buf = (unsigned char*)malloc(entry.size ? entry.size : 1);
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if(!buf || inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+    fprintf(stderr, "%s: out of memory inflating %s\n", path,
+            entry.name.c_str());
+    free(buf);
+    return NULL;
+  }
+  strm.next_in = (Bytef*)entry.data;
+  strm.avail_in = entry.comp_size;
+  strm.next_out = buf;
+  strm.avail_out = entry.size;
+  int ret = inflate(&strm, Z_FINISH);
+  inflateEnd(&strm);
+  if(ret != Z_STREAM_END || strm.total_out != entry.size ||
+     crc32(crc32(0, NULL, 0), buf, entry.size) != entry.crc) {
+    fprintf(stderr, "%s: failed to inflate %s\n", path, entry.name.c_str());
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+// Decodes the class definitions of an in-memory dex image and registers its
+// reader with 'input'.
+static DexFile* read_dex_memory(DexInput& input, const string& name,
+                                const unsigned char* data, size_t size) {
+  DexReader* rd = dex_reader_open(name.c_str(), data, size);
+  if(!rd) return NULL;
+  input.readers.push_back(rd);
+  return dex_reader_classes(rd);
+}
+
+// Records where each class of 'dx' has to be loaded from.  Classes already
+// known come from an earlier dex and are left alone.
+static void add_defs(DexInput& input, DexFile* dx) {
+  DexReader* rd = input.readers.back();
+  dx_uint def = 0;
+  for(DexClass* cl = dx->classes; !dxc_is_sentinel_class(cl); ++cl, ++def) {
+    input.defs.insert(make_pair(string(cl->name->s), make_pair(rd, def)));
+  }
+}
+
+// Appends the classes of 'src' to 'dst'.  'owner' maps every class already in
+// 'dst' to the entry it came from and is used to report duplicates.
+static void merge_classes(DexFile* dst, DexFile* src, const string& src_name,
+                          map<string, string>& owner) {
+  size_t size = 0;
+  for(DexClass* cl = dst->classes; !dxc_is_sentinel_class(cl); ++cl) size++;
+  size_t add = 0;
+  for(DexClass* cl = src->classes; !dxc_is_sentinel_class(cl); ++cl) add++;
+
+  dst->classes = (DexClass*)realloc(dst->classes,
+                                    (size + add + 1) * sizeof(DexClass));
+  for(DexClass* cl = src->classes; !dxc_is_sentinel_class(cl); ++cl) {
+    string& first = owner[cl->name->s];
+    if(!first.empty()) {
+      fprintf(stderr, "Duplicate definition of %s in %s, keeping the one "
+                      "from %s\n", cl->name->s, src_name.c_str(),
+              first.c_str());
+      continue;
+    }
+    first = src_name;
+    dst->classes[size++] = *cl;
+  }
+  dxc_make_sentinel_class(dst->classes + size);
+}
+
+static DexFile* read_dex_archive(DexInput& input, const char* path,
+                                 const unsigned char* base, size_t size) {
+  vector<DexEntry> entries;
+  if(!list_dex_entries(path, base, size, entries)) return NULL;
+  if(entries.empty()) {
+    fprintf(stderr, "%s: no classes.dex in archive\n", path);
+    return NULL;
+  }
+
+  DexFile* result = NULL;
+  map<string, string> owner;
+  for(int i = 0; i < entries.size(); i++) {
+    DexEntry& entry = entries[i];
+    DexFile* dx;
+    if(entry.method == ZIP_STORED) {
+      if(entry.comp_size != entry.size) {
+        fprintf(stderr, "%s: corrupt zip entry %s\n", path,
+                entry.name.c_str());
+        return NULL;
+      }
+      dx = read_dex_memory(input, entry.name, entry.data, entry.size);
+    } else if(entry.method == ZIP_DEFLATED) {
+      unsigned char* buf = inflate_entry(path, entry);
+      if(!buf) return NULL;
+      input.buffers.push_back(buf);
+      dx = read_dex_memory(input, entry.name, buf, entry.size);
+    } else {
+      fprintf(stderr, "%s: %s uses unsupported compression method %u\n",
+              path, entry.name.c_str(), entry.method);
+      return NULL;
+    }
+    if(!dx) {
+      fprintf(stderr, "%s: failed to parse %s\n", path, entry.name.c_str());
+      return NULL;
+    }
+    add_defs(input, dx);
+
+    if(!result) {
+      result = dx;
+      for(DexClass* cl = dx->classes; !dxc_is_sentinel_class(cl); ++cl) {
+        owner[cl->name->s] = entry.name;
+      }
+    } else {
+      // The class structures now belong to 'result' so the rest of 'dx' is
+      // intentionally leaked rather than freed.
+      merge_classes(result, dx, entry.name, owner);
+    }
+  }
+  return result;
+}
+
+DexInput::DexInput() : map(MAP_FAILED), map_size(0) {
+}
+
+DexInput::~DexInput() {
+  for(int i = 0; i < readers.size(); i++) dex_reader_close(readers[i]);
+  for(int i = 0; i < buffers.size(); i++) free(buffers[i]);
+  if(map != MAP_FAILED) munmap(map, map_size);
+}
+
+bool DexInput::load(const string& dex_name, DexClass* cl) {
+  typeof(defs.begin()) it = defs.find(dex_name);
+  if(it == defs.end()) return true;
+  return dex_reader_load(it->second.first, it->second.second, cl);
+}
+
+void DexInput::unload(const string& dex_name, DexClass* cl) {
+  if(defs.find(dex_name) != defs.end()) dex_reader_unload(cl);
+}
+
+dx_uint DexInput::code_size(const string& dex_name) {
+  typeof(defs.begin()) it = defs.find(dex_name);
+  if(it == defs.end()) return 0;
+  return dex_reader_code_size(it->second.first, it->second.second);
+}
+
+// Reads all of 'fd' into memory for inputs that can't be mapped.
+static unsigned char* read_all(int fd, size_t& size) {
+  size_t cap = 1 << 16;
+  unsigned char* buf = (unsigned char*)malloc(cap);
+  size = 0;
+  for(;;) {
+    if(size == cap) {
+      cap *= 2;
+      buf = (unsigned char*)realloc(buf, cap);
+    }
+    ssize_t amt = read(fd, buf + size, cap - size);
+    if(amt == 0) break;
+    if(amt < 0) {
+      free(buf);
+      return NULL;
+    }
+    size += amt;
+  }
+  return buf;
+}
+
+DexFile* read_dex_input(const char* path, DexInput& input) {
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    perror(path);
+    return NULL;
+  }
+  struct stat st;
+  const unsigned char* base;
+  size_t size;
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    input.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if(input.map != MAP_FAILED) {
+    base = (const unsigned char*)input.map;
+    size = input.map_size = st.st_size;
+    // Class definitions are decoded front to back; bodies are loaded later
+    // in whatever order the classes get emitted.
+    madvise(input.map, size, MADV_SEQUENTIAL);
+  } else {
+    unsigned char* buf = read_all(fd, size);
+    if(!buf) {
+      perror(path);
+      close(fd);
+      return NULL;
+    }
+    input.buffers.push_back(buf);
+    base = buf;
+  }
+  close(fd);
+
+  DexFile* dx;
+  if(size >= 4 && get_u32(base) == ZIP_LOCAL_SIG) {
+    dx = read_dex_archive(input, path, base, size);
+  } else {
+    dx = read_dex_memory(input, path, base, size);
+    if(dx) add_defs(input, dx);
+  }
+  if(input.map != MAP_FAILED) madvise(input.map, size, MADV_RANDOM);
+  return dx;
+}
@@ -0,0 +1,42 @@
+#ifndef DEXINPUT_H
+#define DEXINPUT_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dxcut/dxcut.h>
+
+#include "dexreader.h"
+
+// Owns the mapped input and a reader for each dex image in it.  Class bodies
+// are decoded from the mapping on demand so it has to outlive the DexFile
+// returned by read_dex_input().
+struct DexInput {
+  DexInput();
+  ~DexInput();
+
+  // Decodes the body of 'cl', the class read_dex_input() returned under the
+  // descriptor 'dex_name'.  The body is freed again by unload().
+  bool load(const std::string& dex_name, DexClass* cl);
+  void unload(const std::string& dex_name, DexClass* cl);
+
+  // Code units in the methods of 'dex_name', without decoding them.
+  dx_uint code_size(const std::string& dex_name);
+
+  void* map;
+  size_t map_size;
+  std::vector<unsigned char*> buffers;
+  std::vector<DexReader*> readers;
+  std::map<std::string, std::pair<DexReader*, dx_uint> > defs;
+};
+
+// Reads a single .dex file, or every classes.dex, classes2.dex, ... entry of
+// an APK/ZIP archive.  Only class definitions are decoded here; bodies stay
+// in the mapped file until DexInput::load() asks for them.  The classes of
+// all dex files are merged into the first one.  Duplicate class definitions
+// are reported and the first definition is kept.
+DexFile* read_dex_input(const char* path, DexInput& input);
+
+#endif // DEXINPUT_H
@@ -0,0 +1,1121 @@
+#include "dexreader.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+#define NO_INDEX 0xFFFFFFFFU
+#define ENDIAN_CONSTANT 0x12345678U
+
+struct DexReader {
+  string name;
+  const unsigned char* data;
+  size_t size;
+  // Set by any out of bounds read.  Sticky, checked at the end of each entry
+  // point.
+  bool failed;
+
+  dx_uint string_ids_size, string_ids_off;
+  dx_uint type_ids_size, type_ids_off;
+  dx_uint proto_ids_size, proto_ids_off;
+  dx_uint field_ids_size, field_ids_off;
+  dx_uint method_ids_size, method_ids_off;
+  dx_uint class_defs_size, class_defs_off;
+
+  // Inducted on first use.  Every user gets its own reference.
+  vector<ref_str*> strings;
+  vector<ref_strstr*> protos;
+};
+
+// Instruction formats from the Dalvik bytecode spec.  The name gives the
+// width in code units, the register count and the kind of extra operand.
+enum InsnFormat {
+  F10x, F12x, F11n, F11x, F10t, F20t, F22x, F21t, F21s, F21h, F21c, F23x,
+  F22b, F22t, F22s, F22c, F32x, F30t, F31t, F31i, F31c, F35c, F3rc, F51l,
+  FBAD
+};
+
+static InsnFormat insn_format(int op) {
+  switch(op) {
+    case 0x00: case 0x0e: return F10x;
+    case 0x01: case 0x04: case 0x07: case 0x21: return F12x;
+    case 0x02: case 0x05: case 0x08: return F22x;
+    case 0x03: case 0x06: case 0x09: return F32x;
+    case 0x0a ... 0x0d: case 0x0f ... 0x11: return F11x;
+    case 0x1d: case 0x1e: case 0x27: return F11x;
+    case 0x12: return F11n;
+    case 0x13: case 0x16: return F21s;
+    case 0x14: case 0x17: return F31i;
+    case 0x15: case 0x19: return F21h;
+    case 0x18: return F51l;
+    case 0x1a: case 0x1c: case 0x1f: case 0x22: return F21c;
+    case 0x60 ... 0x6d: return F21c;
+    case 0x1b: return F31c;
+    case 0x20: case 0x23: return F22c;
+    case 0x52 ... 0x5f: return F22c;
+    case 0x24: case 0x6e ... 0x72: return F35c;
+    case 0x25: case 0x74 ... 0x78: return F3rc;
+    case 0x26: case 0x2b: case 0x2c: return F31t;
+    case 0x28: return F10t;
+    case 0x29: return F20t;
+    case 0x2a: return F30t;
+    case 0x2d ... 0x31: return F23x;
+    case 0x44 ... 0x51: return F23x;
+    case 0x90 ... 0xaf: return F23x;
+    case 0x32 ... 0x37: return F22t;
+    case 0x38 ... 0x3d: return F21t;
+    case 0x7b ... 0x8f: return F12x;
+    case 0xb0 ... 0xcf: return F12x;
+    case 0xd0 ... 0xd7: return F22s;
+    case 0xd8 ... 0xe2: return F22b;
+  }
+  return FBAD;
+}
+
+static dx_uint get_u8(DexReader* rd, size_t off) {
+  if(off >= rd->size) {
+    rd->failed = true;
+    return 0;
+  }
+  return rd->data[off];
+}
+
+static dx_uint get_u16(DexReader* rd, size_t off) {
+  if(off + 2 > rd->size) {
+    rd->failed = true;
+    return 0;
+  }
+  return rd->data[off] | rd->data[off + 1] << 8;
+}
+
+static dx_uint get_u32(DexReader* rd, size_t off) {
+  return get_u16(rd, off) | get_u16(rd, off + 2) << 16;
+}
+
+static dx_uint get_uleb(DexReader* rd, size_t& off) {
+  dx_uint result = 0;
+  for(int shift = 0; shift < 35; shift += 7) {
+    dx_uint b = get_u8(rd, off++);
+    result |= (b & 0x7F) << shift;
+    if(!(b & 0x80)) return result;
+  }
+  rd->failed = true;
+  return 0;
+}
+
+static dx_int get_sleb(DexReader* rd, size_t& off) {
+  dx_uint result = 0;
+  for(int shift = 0; shift < 35; shift += 7) {
+    dx_uint b = get_u8(rd, off++);
+    result |= (b & 0x7F) << shift;
+    if(!(b & 0x80)) {
+      if(shift < 25 && (b & 0x40)) result |= ~0U << (shift + 7);
+      return (dx_int)result;
+    }
+  }
+  rd->failed = true;
+  return 0;
+}
+
+// Guards allocations sized by counts read from the file.  Each element takes
+// at least 'width' bytes so anything larger than the file is corrupt.
+static bool check_count(DexReader* rd, dx_ulong count, size_t width) {
+  if(count * width > rd->size) rd->failed = true;
+  return !rd->failed;
+}
+
+static bool check_table(DexReader* rd, dx_uint count, dx_uint off,
+                        size_t width) {
+  if((dx_ulong)off + (dx_ulong)count * width > rd->size) rd->failed = true;
+  return !rd->failed;
+}
+
+static ref_str* get_string(DexReader* rd, dx_uint idx) {
+  if(idx >= rd->string_ids_size) {
+    rd->failed = true;
+    return dxc_induct_str("");
+  }
+  ref_str*& str = rd->strings[idx];
+  if(!str) {
+    size_t off = get_u32(rd, rd->string_ids_off + (size_t)idx * 4);
+    get_uleb(rd, off);
+    if(off >= rd->size || !memchr(rd->data + off, 0, rd->size - off)) {
+      rd->failed = true;
+      return dxc_induct_str("");
+    }
+    str = dxc_induct_str((const char*)rd->data + off);
+  }
+  return dxc_copy_str(str);
+}
+
+// uleb128p1 encoded string index, NO_INDEX meaning none.
+static ref_str* get_opt_string(DexReader* rd, size_t& off, bool empty) {
+  dx_uint idx = get_uleb(rd, off) - 1;
+  if(idx == NO_INDEX) return empty ? dxc_induct_str("") : NULL;
+  return get_string(rd, idx);
+}
+
+static ref_str* get_type(DexReader* rd, dx_uint idx) {
+  if(idx >= rd->type_ids_size) {
+    rd->failed = true;
+    return dxc_induct_str("");
+  }
+  return get_string(rd, get_u32(rd, rd->type_ids_off + (size_t)idx * 4));
+}
+
+static ref_strstr* get_type_list(DexReader* rd, dx_uint off, dx_uint extra) {
+  dx_uint size = off ? get_u32(rd, off) : 0;
+  if(!check_count(rd, size, 2)) size = 0;
+  ref_strstr* list = dxc_create_strstr(size + extra);
+  for(dx_uint i = 0; i < size; i++) {
+    list->s[i + extra] = get_type(rd, get_u16(rd, off + 4 + i * 2));
+  }
+  return list;
+}
+
+static ref_strstr* get_proto(DexReader* rd, dx_uint idx) {
+  if(idx >= rd->proto_ids_size) {
+    rd->failed = true;
+    return dxc_create_strstr(0);
+  }
+  ref_strstr*& proto = rd->protos[idx];
+  if(!proto) {
+    size_t off = rd->proto_ids_off + (size_t)idx * 12;
+    proto = get_type_list(rd, get_u32(rd, off + 8), 1);
+    proto->s[0] = get_type(rd, get_u32(rd, off + 4));
+  }
+  return dxc_copy_strstr(proto);
+}
+
+static void get_field_ref(DexReader* rd, dx_uint idx, ref_field* fld) {
+  if(idx >= rd->field_ids_size) rd->failed = true;
+  size_t off = rd->field_ids_off + (size_t)idx * 8;
+  fld->defining_class = get_type(rd, get_u16(rd, off));
+  fld->type = get_type(rd, get_u16(rd, off + 2));
+  fld->name = get_string(rd, get_u32(rd, off + 4));
+}
+
+static void get_method_ref(DexReader* rd, dx_uint idx, ref_method* mtd) {
+  if(idx >= rd->method_ids_size) rd->failed = true;
+  size_t off = rd->method_ids_off + (size_t)idx * 8;
+  mtd->defining_class = get_type(rd, get_u16(rd, off));
+  mtd->prototype = get_proto(rd, get_u16(rd, off + 2));
+  mtd->name = get_string(rd, get_u32(rd, off + 4));
+}
+
+static void release_str(ref_str* s) {
+  if(s) dxc_free_str(s);
+}
+
+static DexAnnotation* new_empty_annotations() {
+  DexAnnotation* set = (DexAnnotation*)malloc(sizeof(DexAnnotation));
+  dxc_make_sentinel_annotation(set);
+  return set;
+}
+
+// Bodies that haven't been loaded point at these.
+static DexAnnotation* empty_annotations() {
+  static DexAnnotation* empty = new_empty_annotations();
+  return empty;
+}
+
+static DexAnnotation** empty_parameter_annotations() {
+  static DexAnnotation* empty[1] = {NULL};
+  return empty;
+}
+
+/* Encoded values and annotations. */
+
+static void decode_annotation(DexReader* rd, size_t& off, DexAnnotation* annon);
+
+static DexValue* decode_array(DexReader* rd, size_t& off);
+
+static dx_ulong get_sized(DexReader* rd, size_t& off, int n) {
+  dx_ulong v = 0;
+  for(int i = 0; i < n; i++) {
+    v |= (dx_ulong)get_u8(rd, off++) << (8 * i);
+  }
+  return v;
+}
+
+static dx_long sign_extend(dx_ulong v, int n) {
+  int shift = 64 - 8 * n;
+  return (dx_long)(v << shift) >> shift;
+}
+
+static void decode_value(DexReader* rd, size_t& off, DexValue* val) {
+  dx_uint b = get_u8(rd, off++);
+  int type = b & 0x1F;
+  int n = (b >> 5) + 1;
+  memset(val, 0, sizeof(*val));
+  val->type = (DexValueType)type;
+
+  int max_size = 0;
+  switch(type) {
+    case VALUE_BYTE: max_size = 1; break;
+    case VALUE_SHORT: case VALUE_CHAR: max_size = 2; break;
+    case VALUE_INT: case VALUE_FLOAT: case VALUE_STRING: case VALUE_TYPE:
+    case VALUE_FIELD: case VALUE_METHOD: case VALUE_ENUM: max_size = 4; break;
+    case VALUE_LONG: case VALUE_DOUBLE: max_size = 8; break;
+    case VALUE_ARRAY: case VALUE_ANNOTATION: case VALUE_NULL:
+    case VALUE_BOOLEAN: max_size = 8; break;
+  }
+  if(n > max_size) {
+    rd->failed = true;
+    val->type = VALUE_NULL;
+    return;
+  }
+
+  switch(type) {
+    case VALUE_BYTE:
+      val->value.val_byte = (dx_byte)get_sized(rd, off, n);
+      break;
+    case VALUE_SHORT:
+      val->value.val_short = sign_extend(get_sized(rd, off, n), n);
+      break;
+    case VALUE_CHAR:
+      val->value.val_char = get_sized(rd, off, n);
+      break;
+    case VALUE_INT:
+      val->value.val_int = sign_extend(get_sized(rd, off, n), n);
+      break;
+    case VALUE_LONG:
+      val->value.val_long = sign_extend(get_sized(rd, off, n), n);
+      break;
+    case VALUE_FLOAT: {
+      // Floating point values are zero extended to the right.
+      dx_uint bits = get_sized(rd, off, n) << (8 * (4 - n));
+      memcpy(&val->value.val_float, &bits, sizeof(bits));
+      break;
+    } case VALUE_DOUBLE: {
+      dx_ulong bits = get_sized(rd, off, n) << (8 * (8 - n));
+      memcpy(&val->value.val_double, &bits, sizeof(bits));
+      break;
+    } case VALUE_STRING:
+      val->value.val_str = get_string(rd, get_sized(rd, off, n));
+      break;
+    case VALUE_TYPE:
+      val->value.val_type = get_type(rd, get_sized(rd, off, n));
+      break;
+    case VALUE_FIELD:
+    case VALUE_ENUM: {
+      ref_field* fld = (ref_field*)malloc(sizeof(ref_field));
+      get_field_ref(rd, get_sized(rd, off, n), fld);
+      if(type == VALUE_FIELD) {
+        val->value.val_field = fld;
+      } else {
+        val->value.val_enum = fld;
+      }
+      break;
+    } case VALUE_METHOD:
+      val->value.val_method = (ref_method*)malloc(sizeof(ref_method));
+      get_method_ref(rd, get_sized(rd, off, n), val->value.val_method);
+      break;
+    case VALUE_ARRAY:
+      val->value.val_array = decode_array(rd, off);
+      break;
+    case VALUE_ANNOTATION:
+      val->value.val_annotation =
+          (DexAnnotation*)calloc(1, sizeof(DexAnnotation));
+      decode_annotation(rd, off, val->value.val_annotation);
+      break;
+    case VALUE_NULL:
+      break;
+    case VALUE_BOOLEAN:
+      val->value.val_boolean = n - 1;
+      break;
+    default:
+      rd->failed = true;
+      val->type = VALUE_NULL;
+  }
+}
+
+static DexValue* decode_array(DexReader* rd, size_t& off) {
+  dx_uint size = get_uleb(rd, off);
+  if(!check_count(rd, size, 1)) size = 0;
+  DexValue* vals = (DexValue*)malloc((size + 1) * sizeof(DexValue));
+  dx_uint i;
+  for(i = 0; i < size && !rd->failed; i++) {
+    decode_value(rd, off, vals + i);
+  }
+  dxc_make_sentinel_value(vals + i);
+  return vals;
+}
+
+// An encoded_annotation, without the visibility byte.
+static void decode_annotation(DexReader* rd, size_t& off,
+                              DexAnnotation* annon) {
+  annon->type = get_type(rd, get_uleb(rd, off));
+  dx_uint size = get_uleb(rd, off);
+  if(!check_count(rd, size, 2)) size = 0;
+  annon->parameters =
+      (DexNameValuePair*)malloc((size + 1) * sizeof(DexNameValuePair));
+  dx_uint i;
+  for(i = 0; i < size && !rd->failed; i++) {
+    annon->parameters[i].name = get_string(rd, get_uleb(rd, off));
+    decode_value(rd, off, &annon->parameters[i].value);
+  }
+  dxc_make_sentinel_parameter(annon->parameters + i);
+}
+
+static DexAnnotation* decode_annotation_set(DexReader* rd, dx_uint off) {
+  dx_uint size = off ? get_u32(rd, off) : 0;
+  if(!check_count(rd, size, 4)) size = 0;
+  DexAnnotation* set =
+      (DexAnnotation*)malloc((size + 1) * sizeof(DexAnnotation));
+  dx_uint i;
+  for(i = 0; i < size && !rd->failed; i++) {
+    size_t item = get_u32(rd, off + 4 + i * 4);
+    set[i].visibility = get_u8(rd, item++);
+    decode_annotation(rd, item, set + i);
+  }
+  dxc_make_sentinel_annotation(set + i);
+  return set;
+}
+
+static DexAnnotation** decode_parameter_annotations(DexReader* rd,
+                                                    dx_uint off) {
+  dx_uint size = get_u32(rd, off);
+  if(!check_count(rd, size, 4)) size = 0;
+  DexAnnotation** params =
+      (DexAnnotation**)malloc((size + 1) * sizeof(DexAnnotation*));
+  for(dx_uint i = 0; i < size; i++) {
+    params[i] = decode_annotation_set(rd, get_u32(rd, off + 4 + i * 4));
+  }
+  params[size] = NULL;
+  return params;
+}
+
+/* Code. */
+
+static dx_uint decode_payload(DexReader* rd, size_t off, DexInstruction* in) {
+  in->opcode = OP_PSUEDO;
+  in->hi_byte = get_u16(rd, off) >> 8;
+  switch(in->hi_byte) {
+    case PSUEDO_OP_PACKED_SWITCH: {
+      dx_uint size = get_u16(rd, off + 2);
+      in->special.packed_switch.size = size;
+      in->special.packed_switch.first_key = get_u32(rd, off + 4);
+      in->special.packed_switch.targets =
+          (dx_int*)malloc((size ? size : 1) * sizeof(dx_int));
+      for(dx_uint i = 0; i < size; i++) {
+        in->special.packed_switch.targets[i] = get_u32(rd, off + 8 + i * 4);
+      }
+      return 4 + size * 2;
+    } case PSUEDO_OP_SPARSE_SWITCH: {
+      dx_uint size = get_u16(rd, off + 2);
+      in->special.sparse_switch.size = size;
+      in->special.sparse_switch.keys =
+          (dx_int*)malloc((size ? size : 1) * sizeof(dx_int));
+      in->special.sparse_switch.targets =
+          (dx_int*)malloc((size ? size : 1) * sizeof(dx_int));
+      for(dx_uint i = 0; i < size; i++) {
+        in->special.sparse_switch.keys[i] = get_u32(rd, off + 4 + i * 4);
+        in->special.sparse_switch.targets[i] =
+            get_u32(rd, off + 4 + size * 4 + i * 4);
+      }
+      return 2 + size * 4;
+    } case PSUEDO_OP_FILL_DATA_ARRAY: {
+      dx_uint width = get_u16(rd, off + 2);
+      dx_uint size = get_u32(rd, off + 4);
+      dx_ulong bytes = (dx_ulong)width * size;
+      if(off + 8 + bytes > rd->size) {
+        rd->failed = true;
+        return 0;
+      }
+      in->special.fill_data_array.element_width = width;
+      in->special.fill_data_array.size = size;
+      in->special.fill_data_array.data =
+          (dx_ubyte*)malloc(bytes ? bytes : 1);
+      memcpy(in->special.fill_data_array.data, rd->data + off + 8, bytes);
+      return 4 + (bytes + 1) / 2;
+    }
+  }
+  rd->failed = true;
+  return 0;
+}
+
+// Decodes the instruction at 'off' and returns its width in code units, or 0
+// if it can't be decoded.
+static dx_uint decode_insn(DexReader* rd, size_t off, DexInstruction* in) {
+  dx_uint op = get_u8(rd, off);
+  dx_uint hi = get_u8(rd, off + 1);
+  InsnFormat fmt = insn_format(op);
+  dx_uint u1 = 0, u2 = 0;
+  if(fmt != F10x && fmt != F12x && fmt != F11n && fmt != F11x &&
+     fmt != F10t) {
+    u1 = get_u16(rd, off + 2);
+  }
+  if(fmt == F32x || fmt == F30t || fmt == F31t || fmt == F31i ||
+     fmt == F31c || fmt == F35c || fmt == F3rc || fmt == F51l) {
+    u2 = get_u16(rd, off + 4);
+  }
+
+  in->opcode = op;
+  dx_uint regs[5];
+  dx_uint nregs = 0;
+  dx_long lit = 0;
+  dx_uint width = 2;
+  bool range = false;
+  switch(fmt) {
+    case F10x: width = 1; break;
+    case F12x: regs[nregs++] = hi & 0xF; regs[nregs++] = hi >> 4;
+               width = 1; break;
+    case F11n: regs[nregs++] = hi & 0xF; lit = (dx_byte)hi >> 4;
+               width = 1; break;
+    case F11x: regs[nregs++] = hi; width = 1; break;
+    case F10t: lit = (dx_byte)hi; width = 1; break;
+    case F20t: lit = (dx_short)u1; break;
+    case F22x: regs[nregs++] = hi; regs[nregs++] = u1; break;
+    case F21t: case F21s: regs[nregs++] = hi; lit = (dx_short)u1; break;
+    // Like libdxcut, keep the high16 literal as stored, unshifted.
+    case F21h: regs[nregs++] = hi; lit = u1; break;
+    case F21c: regs[nregs++] = hi; lit = u1; break;
+    case F23x: regs[nregs++] = hi; regs[nregs++] = u1 & 0xFF;
+               regs[nregs++] = u1 >> 8; break;
+    case F22b: regs[nregs++] = hi; regs[nregs++] = u1 & 0xFF;
+               lit = (dx_byte)(u1 >> 8); break;
+    case F22t: case F22s: regs[nregs++] = hi & 0xF; regs[nregs++] = hi >> 4;
+                          lit = (dx_short)u1; break;
+    case F22c: regs[nregs++] = hi & 0xF; regs[nregs++] = hi >> 4;
+               lit = u1; break;
+    case F32x: regs[nregs++] = u1; regs[nregs++] = u2; width = 3; break;
+    case F30t: lit = (dx_int)(u1 | u2 << 16); width = 3; break;
+    case F31t: case F31i: regs[nregs++] = hi; lit = (dx_int)(u1 | u2 << 16);
+                          width = 3; break;
+    case F31c: regs[nregs++] = hi; lit = u1 | u2 << 16; width = 3; break;
+    case F35c: {
+      dx_uint u3 = get_u16(rd, off + 4);
+      dx_uint count = hi >> 4;
+      if(count > 5) return 0;
+      dx_uint all[5] = {u3 & 0xF, u3 >> 4 & 0xF, u3 >> 8 & 0xF, u3 >> 12,
+                        hi & 0xF};
+      for(nregs = 0; nregs < count; nregs++) regs[nregs] = all[nregs];
+      lit = u1;
+      width = 3;
+      break;
+    } case F3rc:
+      nregs = hi;
+      regs[0] = u2;
+      range = true;
+      lit = u1;
+      width = 3;
+      break;
+    case F51l:
+      regs[nregs++] = hi;
+      lit = (dx_long)(u1 | (dx_ulong)u2 << 16 |
+                      (dx_ulong)get_u16(rd, off + 6) << 32 |
+                      (dx_ulong)get_u16(rd, off + 8) << 48);
+      width = 5;
+      break;
+    default:
+      return 0;
+  }
+
+  dxc_set_num_registers(in, nregs);
+  for(dx_uint j = 0; j < nregs && j < (range ? 1 : 5); j++) {
+    if(dxc_set_register(in, j, regs[j]) == -1) return 0;
+  }
+
+  switch(dex_opcode_formats[op].specialType) {
+    case SPECIAL_CONSTANT:
+      in->special.constant = lit;
+      break;
+    case SPECIAL_TARGET:
+      in->special.target = (dx_int)lit;
+      break;
+    case SPECIAL_STRING:
+      in->special.str = get_string(rd, lit);
+      break;
+    case SPECIAL_TYPE:
+      in->special.type = get_type(rd, lit);
+      break;
+    case SPECIAL_FIELD:
+      get_field_ref(rd, lit, &in->special.field);
+      break;
+    case SPECIAL_METHOD:
+      get_method_ref(rd, lit, &in->special.method);
+      break;
+  }
+  return width;
+}
+
+static DexDebugInfo* decode_debug(DexReader* rd, size_t off) {
+  DexDebugInfo* dbg = (DexDebugInfo*)calloc(1, sizeof(DexDebugInfo));
+  dbg->line_start = get_uleb(rd, off);
+  dx_uint nparams = get_uleb(rd, off);
+  if(!check_count(rd, nparams, 1)) nparams = 0;
+  dbg->parameter_names = dxc_create_strstr(nparams);
+  for(dx_uint i = 0; i < nparams; i++) {
+    dbg->parameter_names->s[i] = get_opt_string(rd, off, true);
+  }
+
+  vector<DexDebugInstruction> insns;
+  for(;;) {
+    DexDebugInstruction insn;
+    memset(&insn, 0, sizeof(insn));
+    insn.opcode = rd->failed ? DBG_END_SEQUENCE : get_u8(rd, off++);
+    switch(insn.opcode) {
+      case DBG_ADVANCE_PC:
+        insn.p.addr_diff = get_uleb(rd, off);
+        break;
+      case DBG_ADVANCE_LINE:
+        insn.p.line_diff = get_sleb(rd, off);
+        break;
+      case DBG_START_LOCAL:
+      case DBG_START_LOCAL_EXTENDED: {
+        DexDebugStartLocal* local =
+            (DexDebugStartLocal*)calloc(1, sizeof(DexDebugStartLocal));
+        local->register_num = get_uleb(rd, off);
+        local->name = get_opt_string(rd, off, true);
+        dx_uint type = get_uleb(rd, off) - 1;
+        local->type = type == NO_INDEX ? dxc_induct_str("") :
+                                         get_type(rd, type);
+        if(insn.opcode == DBG_START_LOCAL_EXTENDED) {
+          local->sig = get_opt_string(rd, off, false);
+        }
+        insn.p.start_local = local;
+        break;
+      } case DBG_END_LOCAL:
+      case DBG_RESTART_LOCAL:
+        insn.p.register_num = get_uleb(rd, off);
+        break;
+      case DBG_SET_FILE:
+        insn.p.name = get_opt_string(rd, off, false);
+        break;
+    }
+    insns.push_back(insn);
+    if(insn.opcode == DBG_END_SEQUENCE) break;
+  }
+  dbg->insns = (DexDebugInstruction*)malloc(insns.size() *
+                                            sizeof(DexDebugInstruction));
+  memcpy(dbg->insns, &insns[0], insns.size() * sizeof(DexDebugInstruction));
+  return dbg;
+}
+
+static void decode_handlers(DexReader* rd, size_t off, DexTryBlock* tb) {
+  dx_int size = get_sleb(rd, off);
+  dx_uint count = size < 0 ? -(dx_long)size : size;
+  if(!check_count(rd, count, 2)) count = 0;
+  tb->handlers = (DexHandler*)malloc((count + 1) * sizeof(DexHandler));
+  for(dx_uint i = 0; i < count; i++) {
+    tb->handlers[i].type = get_type(rd, get_uleb(rd, off));
+    tb->handlers[i].addr = get_uleb(rd, off);
+  }
+  dxc_make_sentinel_handler(tb->handlers + count);
+  tb->catch_all_handler = NULL;
+  if(size <= 0) {
+    tb->catch_all_handler = (DexHandler*)calloc(1, sizeof(DexHandler));
+    tb->catch_all_handler->addr = get_uleb(rd, off);
+  }
+}
+
+static DexCode* decode_code(DexReader* rd, size_t off) {
+  DexCode* code = (DexCode*)calloc(1, sizeof(DexCode));
+  code->registers_size = get_u16(rd, off);
+  code->ins_size = get_u16(rd, off + 2);
+  code->outs_size = get_u16(rd, off + 4);
+  dx_uint tries_size = get_u16(rd, off + 6);
+  dx_uint debug_off = get_u32(rd, off + 8);
+  dx_uint units = get_u32(rd, off + 12);
+  size_t insns_off = off + 16;
+  if(!check_count(rd, units, 2)) units = 0;
+
+  vector<DexInstruction> insns;
+  for(dx_uint pos = 0; pos < units && !rd->failed; ) {
+    DexInstruction in;
+    memset(&in, 0, sizeof(in));
+    size_t ioff = insns_off + (size_t)pos * 2;
+    dx_uint width;
+    if(get_u8(rd, ioff) == OP_NOP && get_u8(rd, ioff + 1) != PSUEDO_OP_NOP) {
+      width = decode_payload(rd, ioff, &in);
+    } else {
+      width = decode_insn(rd, ioff, &in);
+    }
+    if(!width || pos + width > units) {
+      fprintf(stderr, "%s: bad instruction at code offset 0x%x\n",
+              rd->name.c_str(), (dx_uint)ioff);
+      rd->failed = true;
+      break;
+    }
+    insns.push_back(in);
+    pos += width;
+  }
+  code->insns_count = insns.size();
+  code->insns = (DexInstruction*)malloc((insns.size() + 1) *
+                                        sizeof(DexInstruction));
+  if(!insns.empty()) {
+    memcpy(code->insns, &insns[0], insns.size() * sizeof(DexInstruction));
+  }
+
+  size_t tries_off = insns_off + (size_t)units * 2;
+  if(tries_size && (units & 1)) tries_off += 2;
+  size_t handlers_off = tries_off + tries_size * 8;
+  code->tries = (DexTryBlock*)malloc((tries_size + 1) * sizeof(DexTryBlock));
+  dx_uint i;
+  for(i = 0; i < tries_size && !rd->failed; i++) {
+    DexTryBlock* tb = code->tries + i;
+    tb->start_addr = get_u32(rd, tries_off + i * 8);
+    tb->insn_count = get_u16(rd, tries_off + i * 8 + 4);
+    decode_handlers(rd, handlers_off + get_u16(rd, tries_off + i * 8 + 6),
+                    tb);
+  }
+  dxc_make_sentinel_try_block(code->tries + i);
+
+  code->debug_information = debug_off ? decode_debug(rd, debug_off) : NULL;
+  return code;
+}
+
+/* Freeing loaded bodies. */
+
+static void free_annotation_contents(DexAnnotation* annon);
+
+static void free_ref_field(ref_field* fld) {
+  release_str(fld->defining_class);
+  release_str(fld->name);
+  release_str(fld->type);
+}
+
+static void free_ref_method(ref_method* mtd) {
+  release_str(mtd->defining_class);
+  release_str(mtd->name);
+  if(mtd->prototype) dxc_free_strstr(mtd->prototype);
+}
+
+static void free_value_contents(DexValue* val) {
+  switch(val->type) {
+    case VALUE_STRING:
+      release_str(val->value.val_str);
+      break;
+    case VALUE_TYPE:
+      release_str(val->value.val_type);
+      break;
+    case VALUE_FIELD:
+    case VALUE_ENUM: {
+      ref_field* fld = val->type == VALUE_FIELD ? val->value.val_field :
+                                                  val->value.val_enum;
+      free_ref_field(fld);
+      free(fld);
+      break;
+    } case VALUE_METHOD:
+      free_ref_method(val->value.val_method);
+      free(val->value.val_method);
+      break;
+    case VALUE_ARRAY:
+      for(DexValue* v = val->value.val_array; !dxc_is_sentinel_value(v);
+          ++v) {
+        free_value_contents(v);
+      }
+      free(val->value.val_array);
+      break;
+    case VALUE_ANNOTATION:
+      free_annotation_contents(val->value.val_annotation);
+      free(val->value.val_annotation);
+      break;
+    default:
+      break;
+  }
+}
+
+static void free_annotation_contents(DexAnnotation* annon) {
+  release_str(annon->type);
+  for(DexNameValuePair* p = annon->parameters;
+      !dxc_is_sentinel_parameter(p); ++p) {
+    release_str(p->name);
+    free_value_contents(&p->value);
+  }
+  free(annon->parameters);
+}
+
+static void free_annotation_set(DexAnnotation* set) {
+  if(set == empty_annotations()) return;
+  for(DexAnnotation* annon = set; !dxc_is_sentinel_annotation(annon);
+      ++annon) {
+    free_annotation_contents(annon);
+  }
+  free(set);
+}
+
+static void free_code(DexCode* code) {
+  for(dx_uint i = 0; i < code->insns_count; i++) {
+    DexInstruction* in = code->insns + i;
+    if(in->opcode == OP_PSUEDO && in->hi_byte != PSUEDO_OP_NOP) {
+      switch(in->hi_byte) {
+        case PSUEDO_OP_PACKED_SWITCH:
+          free(in->special.packed_switch.targets);
+          break;
+        case PSUEDO_OP_SPARSE_SWITCH:
+          free(in->special.sparse_switch.keys);
+          free(in->special.sparse_switch.targets);
+          break;
+        case PSUEDO_OP_FILL_DATA_ARRAY:
+          free(in->special.fill_data_array.data);
+          break;
+      }
+      continue;
+    }
+    switch(dex_opcode_formats[in->opcode].specialType) {
+      case SPECIAL_STRING: release_str(in->special.str); break;
+      case SPECIAL_TYPE: release_str(in->special.type); break;
+      case SPECIAL_FIELD: free_ref_field(&in->special.field); break;
+      case SPECIAL_METHOD: free_ref_method(&in->special.method); break;
+    }
+  }
+  free(code->insns);
+
+  for(DexTryBlock* tb = code->tries; !dxc_is_sentinel_try_block(tb); ++tb) {
+    for(DexHandler* hndlr = tb->handlers; !dxc_is_sentinel_handler(hndlr);
+        ++hndlr) {
+      release_str(hndlr->type);
+    }
+    free(tb->handlers);
+    free(tb->catch_all_handler);
+  }
+  free(code->tries);
+
+  DexDebugInfo* dbg = code->debug_information;
+  if(dbg) {
+    dxc_free_strstr(dbg->parameter_names);
+    for(DexDebugInstruction* insn = dbg->insns; ; ++insn) {
+      if(insn->opcode == DBG_START_LOCAL ||
+         insn->opcode == DBG_START_LOCAL_EXTENDED) {
+        release_str(insn->p.start_local->name);
+        release_str(insn->p.start_local->type);
+        release_str(insn->p.start_local->sig);
+        free(insn->p.start_local);
+      } else if(insn->opcode == DBG_SET_FILE) {
+        release_str(insn->p.name);
+      } else if(insn->opcode == DBG_END_SEQUENCE) {
+        break;
+      }
+    }
+    free(dbg->insns);
+    free(dbg);
+  }
+  free(code);
+}
+
+/* Classes. */
+
+struct EncodedMember {
+  dx_uint idx;
+  dx_uint access_flags;
+  dx_uint code_off;
+};
+
+// The static fields, instance fields, direct methods and virtual methods of
+// a class_data_item, with the index deltas resolved.
+struct ClassData {
+  vector<EncodedMember> members[4];
+};
+
+static void read_class_data(DexReader* rd, dx_uint off, ClassData& cd) {
+  if(!off) return;
+  size_t pos = off;
+  dx_uint sizes[4];
+  for(int i = 0; i < 4; i++) {
+    sizes[i] = get_uleb(rd, pos);
+    if(!check_count(rd, sizes[i], 2)) return;
+  }
+  for(int i = 0; i < 4; i++) {
+    dx_uint idx = 0;
+    for(dx_uint j = 0; j < sizes[i] && !rd->failed; j++) {
+      EncodedMember m;
+      idx += get_uleb(rd, pos);
+      m.idx = idx;
+      m.access_flags = get_uleb(rd, pos);
+      m.code_off = i >= 2 ? get_uleb(rd, pos) : 0;
+      cd.members[i].push_back(m);
+    }
+  }
+}
+
+static DexField* build_fields(DexReader* rd, vector<EncodedMember>& members) {
+  DexField* flds = (DexField*)calloc(members.size() + 1, sizeof(DexField));
+  for(int i = 0; i < members.size(); i++) {
+    ref_field ref;
+    get_field_ref(rd, members[i].idx, &ref);
+    release_str(ref.defining_class);
+    flds[i].access_flags = (DexAccessFlags)members[i].access_flags;
+    flds[i].name = ref.name;
+    flds[i].type = ref.type;
+    flds[i].annotations = empty_annotations();
+  }
+  dxc_make_sentinel_field(flds + members.size());
+  return flds;
+}
+
+static DexMethod* build_methods(DexReader* rd,
+                                vector<EncodedMember>& members) {
+  DexMethod* mtds = (DexMethod*)calloc(members.size() + 1, sizeof(DexMethod));
+  for(int i = 0; i < members.size(); i++) {
+    ref_method ref;
+    get_method_ref(rd, members[i].idx, &ref);
+    release_str(ref.defining_class);
+    mtds[i].access_flags = (DexAccessFlags)members[i].access_flags;
+    mtds[i].name = ref.name;
+    mtds[i].prototype = ref.prototype;
+    mtds[i].annotations = empty_annotations();
+    mtds[i].parameter_annotations = empty_parameter_annotations();
+    mtds[i].code_body = NULL;
+  }
+  dxc_make_sentinel_method(mtds + members.size());
+  return mtds;
+}
+
+DexReader* dex_reader_open(const char* name, const unsigned char* data,
+                           size_t size) {
+  DexReader* rd = new DexReader();
+  rd->name = name;
+  rd->data = data;
+  rd->size = size;
+  rd->failed = false;
+
+  if(size < 0x70 || memcmp(data, "dex\n0", 5) || data[7] != 0) {
+    fprintf(stderr, "%s: not a dex file\n", name);
+    delete rd;
+    return NULL;
+  }
+  if(get_u32(rd, 40) != ENDIAN_CONSTANT) {
+    fprintf(stderr, "%s: unsupported byte order\n", name);
+    delete rd;
+    return NULL;
+  }
+  rd->string_ids_size = get_u32(rd, 56);
+  rd->string_ids_off = get_u32(rd, 60);
+  rd->type_ids_size = get_u32(rd, 64);
+  rd->type_ids_off = get_u32(rd, 68);
+  rd->proto_ids_size = get_u32(rd, 72);
+  rd->proto_ids_off = get_u32(rd, 76);
+  rd->field_ids_size = get_u32(rd, 80);
+  rd->field_ids_off = get_u32(rd, 84);
+  rd->method_ids_size = get_u32(rd, 88);
+  rd->method_ids_off = get_u32(rd, 92);
+  rd->class_defs_size = get_u32(rd, 96);
+  rd->class_defs_off = get_u32(rd, 100);
+  if(!check_table(rd, rd->string_ids_size, rd->string_ids_off, 4) ||
+     !check_table(rd, rd->type_ids_size, rd->type_ids_off, 4) ||
+     !check_table(rd, rd->proto_ids_size, rd->proto_ids_off, 12) ||
+     !check_table(rd, rd->field_ids_size, rd->field_ids_off, 8) ||
+     !check_table(rd, rd->method_ids_size, rd->method_ids_off, 8) ||
+     !check_table(rd, rd->class_defs_size, rd->class_defs_off, 32)) {
+    fprintf(stderr, "%s: corrupt dex header\n", name);
+    delete rd;
+    return NULL;
+  }
+  rd->strings.resize(rd->string_ids_size);
+  rd->protos.resize(rd->proto_ids_size);
+  return rd;
+}
+
+void dex_reader_close(DexReader* rd) {
+  for(int i = 0; i < rd->strings.size(); i++) release_str(rd->strings[i]);
+  for(int i = 0; i < rd->protos.size(); i++) {
+    if(rd->protos[i]) dxc_free_strstr(rd->protos[i]);
+  }
+  delete rd;
+}
+
+// Frees what dex_reader_classes() built for a class.
+static void free_class_skeleton(DexClass* cl) {
+  release_str(cl->name);
+  release_str(cl->super_class);
+  if(cl->interfaces) dxc_free_strstr(cl->interfaces);
+  release_str(cl->source_file);
+  for(int iter = 0; iter < 2; iter++) {
+    DexField* flds = iter ? cl->instance_fields : cl->static_fields;
+    for(DexField* fld = flds; !dxc_is_sentinel_field(fld); ++fld) {
+      release_str(fld->name);
+      release_str(fld->type);
+    }
+    free(flds);
+  }
+  for(int iter = 0; iter < 2; iter++) {
+    DexMethod* mtds = iter ? cl->virtual_methods : cl->direct_methods;
+    for(DexMethod* mtd = mtds; !dxc_is_sentinel_method(mtd); ++mtd) {
+      release_str(mtd->name);
+      dxc_free_strstr(mtd->prototype);
+    }
+    free(mtds);
+  }
+}
+
+DexFile* dex_reader_classes(DexReader* rd) {
+  dx_uint count = rd->class_defs_size;
+  DexFile* dx = (DexFile*)calloc(1, sizeof(DexFile));
+  dx->classes = (DexClass*)calloc(count + 1, sizeof(DexClass));
+  dx_uint built = 0;
+  for(; built < count && !rd->failed; built++) {
+    DexClass* cl = dx->classes + built;
+    size_t off = rd->class_defs_off + (size_t)built * 32;
+    cl->name = get_type(rd, get_u32(rd, off));
+    cl->access_flags = (DexAccessFlags)get_u32(rd, off + 4);
+    dx_uint super = get_u32(rd, off + 8);
+    cl->super_class = super == NO_INDEX ? NULL : get_type(rd, super);
+    cl->interfaces = get_type_list(rd, get_u32(rd, off + 12), 0);
+    dx_uint source = get_u32(rd, off + 16);
+    cl->source_file = source == NO_INDEX ? NULL : get_string(rd, source);
+    cl->annotations = empty_annotations();
+    cl->static_values = NULL;
+
+    ClassData cd;
+    read_class_data(rd, get_u32(rd, off + 24), cd);
+    cl->static_fields = build_fields(rd, cd.members[0]);
+    cl->instance_fields = build_fields(rd, cd.members[1]);
+    cl->direct_methods = build_methods(rd, cd.members[2]);
+    cl->virtual_methods = build_methods(rd, cd.members[3]);
+  }
+  if(rd->failed) {
+    fprintf(stderr, "%s: corrupt class definitions\n", rd->name.c_str());
+    for(dx_uint i = 0; i < built; i++) free_class_skeleton(dx->classes + i);
+    free(dx->classes);
+    free(dx);
+    return NULL;
+  }
+  dxc_make_sentinel_class(dx->classes + count);
+  return dx;
+}
+
+bool dex_reader_load(DexReader* rd, dx_uint def, DexClass* cl) {
+  // Only this class is reported when its data is corrupt; later loads get
+  // a fresh start.
+  rd->failed = false;
+  size_t off = rd->class_defs_off + (size_t)def * 32;
+  dx_uint annotations_off = get_u32(rd, off + 20);
+  dx_uint static_values_off = get_u32(rd, off + 28);
+
+  if(static_values_off) {
+    size_t pos = static_values_off;
+    cl->static_values = decode_array(rd, pos);
+  }
+
+  ClassData cd;
+  read_class_data(rd, get_u32(rd, off + 24), cd);
+  map<dx_uint, DexField*> fields;
+  map<dx_uint, DexMethod*> methods;
+  for(int i = 0; i < 4; i++) {
+    vector<EncodedMember>& members = cd.members[i];
+    for(int j = 0; j < members.size(); j++) {
+      if(i < 2) {
+        fields[members[j].idx] = (i ? cl->instance_fields :
+                                      cl->static_fields) + j;
+        continue;
+      }
+      DexMethod* mtd = (i == 2 ? cl->direct_methods :
+                                 cl->virtual_methods) + j;
+      methods[members[j].idx] = mtd;
+      if(members[j].code_off) {
+        mtd->code_body = decode_code(rd, members[j].code_off);
+      }
+    }
+  }
+
+  if(annotations_off) {
+    dx_uint class_off = get_u32(rd, annotations_off);
+    dx_uint counts[3];
+    for(int i = 0; i < 3; i++) {
+      counts[i] = get_u32(rd, annotations_off + 4 + i * 4);
+      if(!check_count(rd, counts[i], 8)) counts[i] = 0;
+    }
+    if(class_off) cl->annotations = decode_annotation_set(rd, class_off);
+
+    size_t pos = annotations_off + 16;
+    for(int i = 0; i < 3; i++) {
+      for(dx_uint j = 0; j < counts[i] && !rd->failed; j++, pos += 8) {
+        dx_uint idx = get_u32(rd, pos);
+        dx_uint item = get_u32(rd, pos + 4);
+        if(i == 0) {
+          map<dx_uint, DexField*>::iterator it = fields.find(idx);
+          if(it == fields.end()) {
+            rd->failed = true;
+          } else if(it->second->annotations == empty_annotations()) {
+            it->second->annotations = decode_annotation_set(rd, item);
+          }
+          continue;
+        }
+        map<dx_uint, DexMethod*>::iterator it = methods.find(idx);
+        if(it == methods.end()) {
+          rd->failed = true;
+        } else if(i == 1 &&
+                  it->second->annotations == empty_annotations()) {
+          it->second->annotations = decode_annotation_set(rd, item);
+        } else if(i == 2 && it->second->parameter_annotations ==
+                            empty_parameter_annotations()) {
+          it->second->parameter_annotations =
+              decode_parameter_annotations(rd, item);
+        }
+      }
+    }
+  }
+
+  if(rd->failed) {
+    fprintf(stderr, "%s: corrupt data for class %s\n", rd->name.c_str(),
+            cl->name->s);
+    return false;
+  }
+  return true;
+}
+
+void dex_reader_unload(DexClass* cl) {
+  free_annotation_set(cl->annotations);
+  cl->annotations = empty_annotations();
+  if(cl->static_values) {
+    for(DexValue* val = cl->static_values; !dxc_is_sentinel_value(val);
+        ++val) {
+      free_value_contents(val);
+    }
+    free(cl->static_values);
+    cl->static_values = NULL;
+  }
+  for(int iter = 0; iter < 2; iter++)
+  for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
+      !dxc_is_sentinel_field(fld); ++fld) {
+    free_annotation_set(fld->annotations);
+    fld->annotations = empty_annotations();
+  }
+  for(int iter = 0; iter < 2; iter++)
+  for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
+      !dxc_is_sentinel_method(mtd); ++mtd) {
+    free_annotation_set(mtd->annotations);
+    mtd->annotations = empty_annotations();
+    if(mtd->parameter_annotations != empty_parameter_annotations()) {
+      for(DexAnnotation** set = mtd->parameter_annotations; *set; ++set) {
+        free_annotation_set(*set);
+      }
+      free(mtd->parameter_annotations);
+      mtd->parameter_annotations = empty_parameter_annotations();
+    }
+    if(mtd->code_body) {
+      free_code(mtd->code_body);
+      mtd->code_body = NULL;
+    }
+  }
+}
+
+void dex_reader_free_classes(DexFile* dx) {
+  for(DexClass* cl = dx->classes; !dxc_is_sentinel_class(cl); ++cl) {
+    free_class_skeleton(cl);
+  }
+  free(dx->classes);
+  free(dx);
+}
+
+dx_uint dex_reader_code_size(DexReader* rd, dx_uint def) {
+  ClassData cd;
+  read_class_data(rd, get_u32(rd, rd->class_defs_off + (size_t)def * 32 + 24),
+                  cd);
+  dx_uint units = 0;
+  for(int i = 2; i < 4; i++) {
+    for(int j = 0; j < cd.members[i].size(); j++) {
+      if(cd.members[i][j].code_off) {
+        units += get_u32(rd, cd.members[i][j].code_off + 12);
+      }
+    }
+  }
+  return units;
+}
@@ -0,0 +1,46 @@
+#ifndef DEXREADER_H
+#define DEXREADER_H
+
+#include <cstddef>
+
+#include <dxcut/dxcut.h>
+
+// Decodes dex images straight out of memory into libdxcut structures.  Class
+// definitions and their field and method lists are decoded up front by
+// dex_reader_classes().  Static values, annotations and code are only
+// decoded when dex_reader_load() is called for a class, and can be released
+// again with dex_reader_unload() once the class has been written out.
+//
+// None of these functions are thread safe since they go through libdxcut's
+// string table.
+struct DexReader;
+
+// Checks the header and id tables of the image at 'data'.  Returns NULL after
+// printing a message if the image is malformed.  'data' has to stay valid for
+// as long as the reader is used.
+DexReader* dex_reader_open(const char* name, const unsigned char* data,
+                           size_t size);
+
+void dex_reader_close(DexReader* rd);
+
+// Builds a DexFile holding every class definition of the image.  The i-th
+// class comes from class_def i.  Bodies start out empty.
+DexFile* dex_reader_classes(DexReader* rd);
+
+// Decodes the static values, annotations and code of class_def 'def' into
+// 'cl', which has to be the class dex_reader_classes() built for it.
+bool dex_reader_load(DexReader* rd, dx_uint def, DexClass* cl);
+
+// Frees everything dex_reader_load() attached to 'cl' and puts the empty
+// placeholders back.
+void dex_reader_unload(DexClass* cl);
+
+// Frees a DexFile of classes from dex_reader_classes(), none of which may
+// still be loaded.  The classes may have come from several readers.
+void dex_reader_free_classes(DexFile* dx);
+
+// Number of code units in the method bodies of class_def 'def', found
+// without decoding any of them.
+dx_uint dex_reader_code_size(DexReader* rd, dx_uint def);
+
+#endif // DEXREADER_H
@@ -1,10 +1,18 @@
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <map>
+#include <set>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -14,6 +22,14 @@
 #include "annotations.h"
 #include "mutf8.h"
 #include "javarules.h"
+#include "writer.h"
+#include "classcache.h"
+#include "codeindex.h"
+#include "dexinput.h"
+#include "archive.h"
+#include "filter.h"
+#include "timing.h"
+#include "serve.h"
 
 using namespace std;
 using namespace dxcut;
@@ -21,7 +37,7 @@ using namespace dxcut;
 #define STANDARD_FLAGS (ACC_PUBLIC | ACC_PRIVATE | ACC_STATIC | \
                         ACC_FINAL | ACC_CONSTRUCTOR | ACC_INTERFACE)
 
-string get_zero_literal(char type) {
+const char* get_zero_literal(char type) {
   switch(type) {
     case 'Z': return "false";
     case 'B': return "(byte)0";
@@ -37,49 +53,75 @@ string get_zero_literal(char type) {
   return "";
 }
 
+static void encode_code_point(ClassWriter& out, unsigned int code_point) {
+  switch(code_point) {
+    case '\t':
+      out << "\\t";
+      break;
+    case '\r':
+      out << "\\r";
+      break;
+    case '\n':
+      out << "\\n";
+      break;
+    case '\v':
+      out << "\\v";
+      break;
+    case '\"':
+      out << "\\\"";
+      break;
+    case '\\':
+      out << "\\\\";
+      break;
+    default:
+      if(32 <= code_point && code_point < 128) {
+        out << (char)code_point;
+      } else if(code_point >= 0x10000) {
+        // Java escapes are UTF-16 code units.
+        code_point -= 0x10000;
+        out << "\\u" << Hex(0xD800 + (code_point >> 10), 4)
+            << "\\u" << Hex(0xDC00 + (code_point & 0x3FF), 4);
+      } else {
+        out << "\\u" << Hex(code_point, 4);
+      }
+  }
+}
+
 // The string is encoded in mutf8 so we need to actually extract out the code
-// points.
-string encode_string(const char* s) {
-  string ret;
-  while(*s) {
-    int code_point = mutf8NextCodePoint(&s);
-    switch(code_point) {
-      case '\t':
-        ret += "\\t";
-        break;
-      case '\r':
-        ret += "\\r";
-        break;
-      case '\n':
-        ret += "\\n";
-        break;
-      case '\v':
-        ret += "\\v";
-        break;
-      case '\"':
-        ret += "\\\"";
-        break;
-      case '\\':
-        ret += "\\\\";
-        break;
-      default:
-        if(32 <= code_point && code_point < 128) {
-          ret += (char)code_point;
-        } else {
-          char buf[16];
-          sprintf(buf, "\\u%04X", code_point);
-          ret += buf;
-        }
+// points.  Runs of ASCII are found in bulk and copied out between the
+// characters that need escaping.
+void encode_string(ClassWriter& out, const char* s) {
+  size_t n = strlen(s);
+  size_t pos = 0;
+  while(pos < n) {
+    size_t end = pos + mutf8_ascii_prefix(s + pos, n - pos);
+    while(pos < end) {
+      size_t start = pos;
+      while(pos < end && s[pos] >= 32 && s[pos] != '"' && s[pos] != '\\') {
+        pos++;
+      }
+      out.append(s + start, pos - start);
+      if(pos < end) encode_code_point(out, s[pos++]);
+    }
+    if(pos == n) break;
+
+    unsigned int code_point;
+    Mutf8Error error;
+    if(!mutf8_decode_one(s, n, &pos, &code_point, &error)) {
+      // Keep the bad byte so nothing is silently lost.
+      fprintf(stderr, "warning: bad MUTF-8 string at byte %zu: %s\n",
+              error.pos, error.reason);
+      code_point = (unsigned char)s[pos++];
     }
+    encode_code_point(out, code_point);
   }
-  return ret;
 }
 
-void dump_debug(DexDebugInfo* dbg, int depth) {
-  string tabbing = string(depth * 2, ' ');
+void dump_debug(ClassWriter& out, DexDebugInfo* dbg, int depth) {
   dx_uint line = dbg->line_start;
   dx_uint addr = 0;
   map<dx_uint, pair<pair<string, string>, dx_uint> > reg_map;
+  string brief;
   for(DexDebugInstruction* insn = dbg->insns;
       insn->opcode != DBG_END_SEQUENCE; insn++) {
     switch(insn->opcode) {
@@ -97,11 +139,23 @@ void dump_debug(DexDebugInfo* dbg, int depth) {
         break;
       case DBG_END_LOCAL: {
         dx_uint reg = insn->p.register_num;
-        printf("%s// %s %s > v%.4X [%.4x, %.4x)\n", tabbing.c_str(),
-            reg_map[reg].first.second.empty() ? "unknown" :
-            type_brief(reg_map[reg].first.second).c_str(),
-            reg_map[reg].first.first.empty() ? "unknown" :
-            reg_map[reg].first.first.c_str(), reg, reg_map[reg].second, addr);
+        out.indent(depth) << "// ";
+        if(reg_map[reg].first.second.empty()) {
+          out << "unknown";
+        } else {
+          brief.clear();
+          append_type_brief(brief, reg_map[reg].first.second.c_str());
+          out << brief;
+        }
+        out << ' ';
+        if(reg_map[reg].first.first.empty()) {
+          out << "unknown";
+        } else {
+          out << reg_map[reg].first.first;
+        }
+        out << " > v" << Hex(reg, 4) << " ["
+            << Hex(reg_map[reg].second, 4, false) << ", "
+            << Hex(addr, 4, false) << ")\n";
         break;
       } case DBG_RESTART_LOCAL:
         reg_map[insn->p.register_num].second = addr;
@@ -119,318 +173,372 @@ void dump_debug(DexDebugInfo* dbg, int depth) {
   }
 }
 
-void decompile_dalvik(dasmcl* dcl, DexInstruction* insns, dx_uint count,
-                      DexTryBlock* tries, int depth) {
-  vector<int> ins_offset;
-  vector<DexInstruction*> ins;
-  vector<DexInstruction*> tables;
-  map<int, int> offset_mp;
+static void write_label(ClassWriter& out, int insn) {
+  out << "\"L" << Dec(insn, 2) << '"';
+}
+
+// Label of the instruction at code unit 'off'.  Targets that don't land on
+// an instruction fall back to the first one.
+static int label_at(const CodeIndex& index, long long off) {
+  return max(index.insn_at(off), 0);
+}
+
+// The payload tables of a method, numbered in the order the instructions
+// that use them come up.
+struct CodeTables {
+  explicit CodeTables(const CodeIndex& index)
+      : fill_data_ids(index.payloads.size(), -1) {}
 
-  int pos = 0;
-  for(int i = 0; i < count; i++) {
-    DexInstruction* in = insns + i;
-    if(in->opcode == OP_PSUEDO &&
-       in->hi_byte != PSUEDO_OP_NOP) {
-      offset_mp[pos] = tables.size();
-      tables.push_back(in);
-    } else {
-      offset_mp[pos] = ins.size();
-      ins.push_back(in);
-      ins_offset.push_back(pos);
-    }
-    pos += dxc_insn_width(in);
-  }
-  
   vector<DexInstruction*> fill_data_tables;
+  // Position in fill_data_tables of each payload, -1 if not used yet.
+  vector<int> fill_data_ids;
+  // Code unit of the switch instruction and its payload.
   vector<pair<int, DexInstruction*> > sparse_switch_tables;
   vector<pair<int, DexInstruction*> > packed_switch_tables;
+};
 
-  string tabbing = string(depth * 2, ' ');
-  printf("%sinsns = {\n", tabbing.c_str());
-  for(int i = 0; i < ins.size(); i++) {
-    DexInstruction* in = ins[i];
-    DexOpFormat fmt = dex_opcode_formats[in->opcode];
+// Writes instruction 'i' as dxreasm reads it, "L03: op v00 ...", without
+// quotes.  Payloads it uses are added to 'tables'.
+static void write_insn(ClassWriter& out, dasmcl* dcl, const CodeIndex& index,
+                       int i, CodeTables& tables) {
+  DexInstruction* in = index.insns[i];
+  DexOpFormat fmt = dex_opcode_formats[in->opcode];
 
-    printf("%s  ", tabbing.c_str());
-    printf("\"L%02d: %s", i, fmt.name);
+  out << 'L' << Dec(i, 2) << ": " << fmt.name;
 
-    for(int j = 0; j < dxc_num_registers(in); j++) {
-      char format[] = " v%.?X";
-      format[4] = '0' + dxc_register_width(in, j);
-      printf(format, dxc_get_register(in, j));
-    }
+  for(int j = 0; j < dxc_num_registers(in); j++) {
+    out << " v" << Hex(dxc_get_register(in, j), dxc_register_width(in, j));
+  }
 
-    switch(fmt.specialType) {
-      case SPECIAL_CONSTANT:
-        printf(" #%lld", in->special.constant);
-/*
-        if(in->opcode == OP_CONST_WIDE) {
-          double x = 0;
-          memcpy(&x, &in->special.constant, 8);
-          printf(" #(double %.11g)", x);
-        } else if(in->opcode == OP_CONST_WIDE_HIGH16) {
-          double x = 0;
-          dx_ulong v = in->special.constant << 48;
-          memcpy(&x, &v, 8);
-          printf(" #(double %.11g)", x);
-        }
-*/
-        break;
-      case SPECIAL_TARGET:
-        if(in->opcode == OP_FILL_ARRAY_DATA) {
-          DexInstruction* fill_data_table =
-              tables[offset_mp[ins_offset[i] + in->special.target]];
-          int ind = find(fill_data_tables.begin(), fill_data_tables.end(),
-                         fill_data_table) - fill_data_tables.begin();
-          if(ind == fill_data_tables.size()) {
-            fill_data_tables.push_back(fill_data_table);
+  switch(fmt.specialType) {
+    case SPECIAL_CONSTANT:
+      out << " #" << (long long)in->special.constant;
+      break;
+    case SPECIAL_TARGET: {
+      long long target = (long long)index.insn_offsets[i] + in->special.target;
+      int payload = index.payload_at(target);
+      if(in->opcode == OP_FILL_ARRAY_DATA) {
+        // Point bad targets at a table that doesn't exist so dxreasm
+        // rejects them.
+        int ind = -1;
+        if(payload != -1) {
+          if(tables.fill_data_ids[payload] == -1) {
+            tables.fill_data_ids[payload] = tables.fill_data_tables.size();
+            tables.fill_data_tables.push_back(index.payloads[payload]);
           }
-          printf(" data@%d", ind);
-        } else if(in->opcode == OP_PACKED_SWITCH) {
-          printf(" packed@%d", packed_switch_tables.size());
-          packed_switch_tables.push_back(make_pair(ins_offset[i],
-              tables[offset_mp[ins_offset[i] + in->special.target]]));
-        } else if(in->opcode == OP_SPARSE_SWITCH) {
-          printf(" sparse@%d", sparse_switch_tables.size());
-          sparse_switch_tables.push_back(make_pair(ins_offset[i],
-              tables[offset_mp[ins_offset[i] + in->special.target]]));
+          ind = tables.fill_data_ids[payload];
+        }
+        out << " data@" << ind;
+      } else if(in->opcode == OP_PACKED_SWITCH) {
+        if(payload == -1) {
+          out << " packed@-1";
         } else {
-          printf(" insn@L%02d", offset_mp[ins_offset[i] + in->special.target]);
+          out << " packed@" << tables.packed_switch_tables.size();
+          tables.packed_switch_tables.push_back(make_pair(
+              index.insn_offsets[i], index.payloads[payload]));
         }
-        break;
-      case SPECIAL_STRING: {
-        printf(" string@%s", encode_string(in->special.str->s).c_str());
-        break;
-      } case SPECIAL_TYPE: {
-        printf(" type@%s", dxc_type_nice(in->special.type->s));
-        break;
-      } case SPECIAL_FIELD: {
-        printf(" field@%s", dcl->field_alias_map[&in->special.field].c_str());
-        break;
-      } case SPECIAL_METHOD: {
-        printf(" method@%s",
-               dcl->method_alias_map[&in->special.method].c_str());
-        break;
+      } else if(in->opcode == OP_SPARSE_SWITCH) {
+        if(payload == -1) {
+          out << " sparse@-1";
+        } else {
+          out << " sparse@" << tables.sparse_switch_tables.size();
+          tables.sparse_switch_tables.push_back(make_pair(
+              index.insn_offsets[i], index.payloads[payload]));
+        }
+      } else {
+        out << " insn@L" << Dec(label_at(index, target), 2);
       }
+      break;
     }
-    printf("\"%s\n", i + 1 < ins.size() ? "," : "");
+    case SPECIAL_STRING: {
+      out << " string@";
+      encode_string(out, in->special.str->s);
+      break;
+    } case SPECIAL_TYPE: {
+      out << " type@" << type_nice(in->special.type->s);
+      break;
+    } case SPECIAL_FIELD: {
+      out << " field@"
+          << dcl->field_aliases.entries[dcl->insn_aliases[in]].second;
+      break;
+    } case SPECIAL_METHOD: {
+      out << " method@"
+          << dcl->method_aliases.entries[dcl->insn_aliases[in]].second;
+      break;
+    }
+  }
+}
+
+// Element 'j' of a fill-array-data payload.
+static unsigned long long fill_data_element(DexInstruction* in, int j) {
+  int width = in->special.fill_data_array.element_width;
+  const char* p = (const char*)in->special.fill_data_array.data + j * width;
+  switch(width) {
+    case 1: return *(unsigned char*)p;
+    case 2: return *(unsigned short*)p;
+    case 4: return *(unsigned int*)p;
+    case 8: return *(unsigned long long*)p;
   }
-  
-  printf("%s},\n", tabbing.c_str());
+  return 0;
+}
+
+void decompile_dalvik(ClassWriter& out, dasmcl* dcl, DexInstruction* insns,
+                      dx_uint count, DexTryBlock* tries, int depth) {
+  CodeIndex index;
+  index.build(insns, count);
+  CodeTables tables(index);
+  vector<DexInstruction*>& fill_data_tables = tables.fill_data_tables;
+  vector<pair<int, DexInstruction*> >& sparse_switch_tables =
+      tables.sparse_switch_tables;
+  vector<pair<int, DexInstruction*> >& packed_switch_tables =
+      tables.packed_switch_tables;
+
+  out.indent(depth) << "insns = {\n";
+  for(int i = 0; i < index.insns.size(); i++) {
+    out.indent(depth + 1) << '"';
+    write_insn(out, dcl, index, i, tables);
+    out << '"' << (i + 1 < index.insns.size() ? "," : "") << '\n';
+  }
+
+  out.indent(depth) << "},\n";
 
   // Output packed switch tables.
-  printf("%spackedSwitches = {\n", tabbing.c_str());
+  out.indent(depth) << "packedSwitches = {\n";
   for(int i = 0; i < packed_switch_tables.size(); i++) {
     int off = packed_switch_tables[i].first;
     DexInstruction* in = packed_switch_tables[i].second;
-    printf("%s  @%s(\n", tabbing.c_str(),
-           get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmPacked;").c_str());
-    printf("%s    firstKey = %d,\n", tabbing.c_str(),
-           in->special.packed_switch.first_key);
-    printf("%s    targets = {\n", tabbing.c_str());
+    out.indent(depth + 1) << '@'
+        << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmPacked;") << "(\n";
+    out.indent(depth + 2) << "firstKey = "
+        << in->special.packed_switch.first_key << ",\n";
+    out.indent(depth + 2) << "targets = {\n";
     for(int j = 0; j < in->special.packed_switch.size; j++) {
-      printf("%s      \"L%02d\"%s\n", tabbing.c_str(),
-             offset_mp[off + in->special.packed_switch.targets[j]],
-             j + 1 < in->special.packed_switch.size ? "," : "");
+      out.indent(depth + 3);
+      write_label(out, label_at(index,
+          (long long)off + in->special.packed_switch.targets[j]));
+      out << (j + 1 < in->special.packed_switch.size ? "," : "") << '\n';
     }
-    printf("%s    }\n", tabbing.c_str());
-    printf("%s  )%s\n", tabbing.c_str(),
-           i + 1 < packed_switch_tables.size() ? "," : "");
+    out.indent(depth + 2) << "}\n";
+    out.indent(depth + 1) << ')'
+        << (i + 1 < packed_switch_tables.size() ? "," : "") << '\n';
   }
-  printf("%s},\n", tabbing.c_str());
+  out.indent(depth) << "},\n";
 
   // Output sparse switch tables.
-  printf("%ssparseSwitches = {\n", tabbing.c_str());
+  out.indent(depth) << "sparseSwitches = {\n";
   for(int i = 0; i < sparse_switch_tables.size(); i++) {
     int off = sparse_switch_tables[i].first;
     DexInstruction* in = sparse_switch_tables[i].second;
-    printf("%s  @%s(\n", tabbing.c_str(),
-           get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmSparse;").c_str());
-    printf("%s    keys = {\n", tabbing.c_str());
+    out.indent(depth + 1) << '@'
+        << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmSparse;") << "(\n";
+    out.indent(depth + 2) << "keys = {\n";
     for(int j = 0; j < in->special.sparse_switch.size; j++) {
-      printf("%s      %d%s\n", tabbing.c_str(),
-             in->special.sparse_switch.keys[j],
-             j + 1 < in->special.sparse_switch.size ? "," : "");
+      out.indent(depth + 3) << in->special.sparse_switch.keys[j]
+          << (j + 1 < in->special.sparse_switch.size ? "," : "") << '\n';
     }
-    printf("%s    },\n", tabbing.c_str());
-    printf("%s    targets = {\n", tabbing.c_str());
+    out.indent(depth + 2) << "},\n";
+    out.indent(depth + 2) << "targets = {\n";
     for(int j = 0; j < in->special.sparse_switch.size; j++) {
-      printf("%s      \"L%02d\"%s\n", tabbing.c_str(),
-             offset_mp[off + in->special.sparse_switch.targets[j]],
-             j + 1 < in->special.sparse_switch.size ? "," : "");
+      out.indent(depth + 3);
+      write_label(out, label_at(index,
+          (long long)off + in->special.sparse_switch.targets[j]));
+      out << (j + 1 < in->special.sparse_switch.size ? "," : "") << '\n';
     }
-    printf("%s    }\n", tabbing.c_str());
-    printf("%s  )%s\n", tabbing.c_str(),
-           i + 1 < sparse_switch_tables.size() ? "," : "");
+    out.indent(depth + 2) << "}\n";
+    out.indent(depth + 1) << ')'
+        << (i + 1 < sparse_switch_tables.size() ? "," : "") << '\n';
   }
-  printf("%s},\n", tabbing.c_str());
+  out.indent(depth) << "},\n";
 
   // Output fill data tables.
-  printf("%sdataArrays = {\n", tabbing.c_str());
+  out.indent(depth) << "dataArrays = {\n";
   for(int i = 0; i < fill_data_tables.size(); i++) {
     DexInstruction* in = fill_data_tables[i];
-    printf("%s  @%s(\n", tabbing.c_str(),
-           get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmData;").c_str());
+    out.indent(depth + 1) << '@'
+        << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmData;") << "(\n";
     int width = in->special.fill_data_array.element_width;
-    printf("%s    elementWidth = %d,\n", tabbing.c_str(), width);
-    printf("%s    data = {\n", tabbing.c_str());
-    char* array = (char*)in->special.fill_data_array.data;
+    out.indent(depth + 2) << "elementWidth = " << width << ",\n";
+    out.indent(depth + 2) << "data = {\n";
     for(int j = 0; j < in->special.fill_data_array.size; j++) {
-      unsigned long long val = 0;
-      switch(width) {
-        case 1: val = *(unsigned char*)array; break;
-        case 2: val = *(unsigned short*)array; break;
-        case 4: val = *(unsigned int*)array; break;
-        case 8: val = *(unsigned long long*)array; break;
-      }
-      array += width;
-      printf("%s      0x%llX%s%s\n", tabbing.c_str(), val,
-             val > 0xFFFFFFFFU ? "L" : "",
-             j + 1 < in->special.fill_data_array.size ? "," : "");
+      unsigned long long val = fill_data_element(in, j);
+      out.indent(depth + 3) << "0x" << Hex(val)
+          << (val > 0xFFFFFFFFU ? "L" : "")
+          << (j + 1 < in->special.fill_data_array.size ? "," : "") << '\n';
     }
-    printf("%s    }\n", tabbing.c_str());
-    printf("%s  )%s\n", tabbing.c_str(),
-           i + 1 < fill_data_tables.size() ? "," : "");
+    out.indent(depth + 2) << "}\n";
+    out.indent(depth + 1) << ')'
+        << (i + 1 < fill_data_tables.size() ? "," : "") << '\n';
   }
-  printf("%s},\n", tabbing.c_str());
+  out.indent(depth) << "},\n";
 
-  printf("%stryBlocks = {\n", tabbing.c_str());
+  out.indent(depth) << "tryBlocks = {\n";
   for(DexTryBlock* try_block = tries; !dxc_is_sentinel_try_block(try_block);
       try_block++) {
-    int startInsn = offset_mp[try_block->start_addr];
-    int endInsn = (--offset_mp.lower_bound(
-        try_block->start_addr + try_block->insn_count))->second;
-
-    printf("%s  @%s(\n", tabbing.c_str(),
-           get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmTry;").c_str());
-    printf("%s    startInsn = \"L%02d\",\n", tabbing.c_str(), startInsn);
-    printf("%s    insnLength = %d,\n", tabbing.c_str(),
-           endInsn - startInsn + 1);
-    printf("%s    handlers = {\n", tabbing.c_str());
+    int startInsn = label_at(index, try_block->start_addr);
+    int endInsn = max(index.insn_before((long long)try_block->start_addr +
+                                        try_block->insn_count), 0);
+
+    out.indent(depth + 1) << '@'
+        << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmTry;") << "(\n";
+    out.indent(depth + 2) << "startInsn = ";
+    write_label(out, startInsn);
+    out << ",\n";
+    out.indent(depth + 2) << "insnLength = " << endInsn - startInsn + 1
+                          << ",\n";
+    out.indent(depth + 2) << "handlers = {\n";
     for(DexHandler* hndlr = try_block->handlers;
         !dxc_is_sentinel_handler(hndlr); hndlr++) {
-      printf("%s      @%s(\n", tabbing.c_str(),
-             get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmHandler;").c_str());
-      printf("%s        catchType = %s.class,\n", tabbing.c_str(),
-             get_import_name(dcl, hndlr->type->s).c_str());
-      printf("%s        target = \"L%02d\"\n", tabbing.c_str(),
-             offset_mp[hndlr->addr]);
-      printf("%s      )%s\n", tabbing.c_str(),
-             dxc_is_sentinel_handler(hndlr + 1) ? "" : ",");
-    }
-    printf("%s    },\n", tabbing.c_str());
-    printf("%s    catchAllTarget = ", tabbing.c_str());
+      out.indent(depth + 3) << '@'
+          << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmHandler;")
+          << "(\n";
+      out.indent(depth + 4) << "catchType = "
+          << get_import_name(dcl, hndlr->type->s) << ".class,\n";
+      out.indent(depth + 4) << "target = ";
+      write_label(out, label_at(index, hndlr->addr));
+      out << '\n';
+      out.indent(depth + 3) << ')'
+          << (dxc_is_sentinel_handler(hndlr + 1) ? "" : ",") << '\n';
+    }
+    out.indent(depth + 2) << "},\n";
+    out.indent(depth + 2) << "catchAllTarget = ";
     if(try_block->catch_all_handler) {
-      printf("\"L%02d\"\n", offset_mp[try_block->catch_all_handler->addr]);
+      write_label(out, label_at(index, try_block->catch_all_handler->addr));
+      out << '\n';
     } else {
-      printf("\"\" // No catch all handler.\n");
+      out << "\"\" // No catch all handler.\n";
     }
-    printf("%s  )%s\n", tabbing.c_str(),
-           dxc_is_sentinel_try_block(try_block + 1) ? "" : ",");
+    out.indent(depth + 1) << ')'
+        << (dxc_is_sentinel_try_block(try_block + 1) ? "" : ",") << '\n';
   }
-  printf("%s}\n", tabbing.c_str());
+  out.indent(depth) << "}\n";
 }
 
-string convert_dollars(const string& s) {
-  string ret = s;
-  for(int i = 0; i < ret.size(); i++) {
-    if(ret[i] == '$') {
-      ret[i] = '.';
+void write_access_flags(ClassWriter& out, dasmcl* dcl, dx_uint depth,
+                        DexAccessFlags flags) {
+  if((flags & ~STANDARD_FLAGS) == 0) return;
+  out.indent(depth) << '@'
+      << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmAccess;") << "(\n";
+  out.indent(depth + 1) << "accessFlags = 0x" << Hex((dx_uint)flags) << '\n';
+  out.indent(depth) << ")\n";
+}
+
+template<typename Ref, typename Compare>
+struct AliasOrder {
+  const AliasTable<Ref>& table;
+  bool operator()(int a, int b) const {
+    return Compare()(table.entries[a].first, table.entries[b].first);
+  }
+};
+
+// Positions in 'table' ordered by reference, which keeps the annotation
+// stable however the code happens to use them.
+template<typename Compare, typename Ref>
+static vector<int> sorted_aliases(const AliasTable<Ref>& table) {
+  vector<int> order(table.entries.size());
+  for(int i = 0; i < order.size(); i++) order[i] = i;
+  AliasOrder<Ref, Compare> compare = {table};
+  sort(order.begin(), order.end(), compare);
+  return order;
+}
+
+void write_alias_table(ClassWriter& out, dasmcl* dcl, dx_uint depth) {
+  out.indent(depth) << '@'
+      << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmAliases;") << "(\n";
+  out.indent(depth + 1) << "methodAliases = {\n";
+  vector<int> order = sorted_aliases<RefMethodCompare>(dcl->method_aliases);
+  for(int i = 0; i < order.size(); i++) {
+    ref_method* mtd = dcl->method_aliases.entries[order[i]].first;
+    const string& alias = dcl->method_aliases.entries[order[i]].second;
+    out.indent(depth + 2) << '@'
+        << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmMethodAlias;")
+        << "(\n";
+    out.indent(depth + 3) << "alias = \"" << alias << "\",\n";
+    out.indent(depth + 3) << "clazz = "
+        << get_import_name(dcl, mtd->defining_class->s) << ".class,\n";
+    out.indent(depth + 3) << "name = \"" << mtd->name->s << "\",\n";
+    out.indent(depth + 3) << "prototype = {\n";
+    for(ref_str** proto = mtd->prototype->s; *proto; ) {
+      out.indent(depth + 4) << get_import_name(dcl, (*proto)->s) << ".class";
+      if(*++proto) out << ',';
+      out << '\n';
     }
+    out.indent(depth + 3) << "}\n";
+    out.indent(depth + 2) << ')';
+    if(i + 1 < order.size()) out << ',';
+    out << '\n';
+  }
+  out.indent(depth + 1) << "},\n";
+  out.indent(depth + 1) << "fieldAliases = {\n";
+  order = sorted_aliases<RefFieldCompare>(dcl->field_aliases);
+  for(int i = 0; i < order.size(); i++) {
+    ref_field* fld = dcl->field_aliases.entries[order[i]].first;
+    const string& alias = dcl->field_aliases.entries[order[i]].second;
+    out.indent(depth + 2) << '@'
+        << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmFieldAlias;")
+        << "(\n";
+    out.indent(depth + 3) << "alias = \"" << alias << "\",\n";
+    out.indent(depth + 3) << "clazz = "
+        << get_import_name(dcl, fld->defining_class->s) << ".class,\n";
+    out.indent(depth + 3) << "name = \"" << fld->name->s << "\",\n";
+    out.indent(depth + 3) << "type = "
+        << get_import_name(dcl, fld->type->s) << ".class\n";
+    out.indent(depth + 2) << ')';
+    if(i + 1 < order.size()) out << ',';
+    out << '\n';
   }
-  return ret;
+  out.indent(depth + 1) << "}\n";
+  out.indent(depth) << ")\n";
 }
 
-void write_access_flags(dasmcl* dcl, dx_uint depth, DexAccessFlags flags) {
-  if((flags & ~STANDARD_FLAGS) == 0) return;
-  string tabbing = string(depth * 2, ' ');
-  printf("%s@%s(\n", tabbing.c_str(),
-         get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmAccess;").c_str());
-  printf("%s  accessFlags = 0x%X\n", tabbing.c_str(), (dx_uint)flags);
-  printf("%s)\n", tabbing.c_str());
-}
-
-void write_alias_table(dasmcl* dcl, dx_uint depth) {
-  string tabbing = string(depth * 2, ' ');
-  printf("%s@%s(\n", tabbing.c_str(),
-         get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmAliases;").c_str());
-  printf("%s  methodAliases = {\n", tabbing.c_str());
-  for(typeof(dcl->method_alias_map.begin()) it = dcl->method_alias_map.begin();
-      it != dcl->method_alias_map.end(); ) {
-    printf("%s    @%s(\n", tabbing.c_str(),
-          get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmMethodAlias;").c_str());
-    printf("%s      alias = \"%s\",\n", tabbing.c_str(), it->second.c_str());
-    printf("%s      clazz = %s.class,\n", tabbing.c_str(),
-           get_import_name(dcl, it->first->defining_class->s).c_str());
-    printf("%s      name = \"%s\",\n", tabbing.c_str(), it->first->name->s);
-    printf("%s      prototype = {\n", tabbing.c_str());
-    for(ref_str** proto = it->first->prototype->s; *proto; ) {
-      printf("%s        %s.class", tabbing.c_str(),
-             get_import_name(dcl, (*proto)->s).c_str());
-      if(*++proto) printf(",");
-      printf("\n");
-    }
-    printf("%s      }\n", tabbing.c_str());
-    printf("%s    )", tabbing.c_str());
-
-    ++it;
-    if(it != dcl->method_alias_map.end()) printf(",");
-    printf("\n");
-  }
-  printf("%s  },\n", tabbing.c_str());
-  printf("%s  fieldAliases = {\n", tabbing.c_str());
-  for(typeof(dcl->field_alias_map.begin()) it = dcl->field_alias_map.begin();
-      it != dcl->field_alias_map.end(); ) {
-    printf("%s    @%s(\n", tabbing.c_str(),
-          get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmFieldAlias;").c_str());
-    printf("%s      alias = \"%s\",\n", tabbing.c_str(), it->second.c_str());
-    printf("%s      clazz = %s.class,\n", tabbing.c_str(),
-           get_import_name(dcl, it->first->defining_class->s).c_str());
-    printf("%s      name = \"%s\",\n", tabbing.c_str(), it->first->name->s);
-    printf("%s      type = %s.class\n", tabbing.c_str(),
-           get_import_name(dcl, it->first->type->s).c_str());
-    printf("%s    )", tabbing.c_str());
-
-    ++it;
-    if(it != dcl->field_alias_map.end()) printf(",");
-    printf("\n");
-  }
-  printf("%s  }\n", tabbing.c_str());
-  printf("%s)\n", tabbing.c_str());
-}
-
-void decompile_class(dasmcl* dcl, dx_uint depth) {
-  DexClass* cl = dcl->cl;
-  string name = dxc_type_nice(cl->name->s);
-  string package_name = get_package_name(name);
-  string tabbing = string(depth * 2, ' ');
-  if(depth == 0 && !package_name.empty()) {
-    printf("package %s;\n\n", package_name.c_str());
+static void write_parameter_comment(ClassWriter& out, dx_uint depth,
+                                    dx_uint reg, const char* name, int arg,
+                                    const char* suffix) {
+  out.indent(depth) << "// v" << Hex(reg, 4) << " -> ";
+  if(name) {
+    out << name;
+  } else {
+    out << "arg" << arg;
   }
+  out << suffix << '\n';
+}
+
+void decompile_class(ClassWriter& out, dasmcl* dcl, dx_uint depth) {
+  DexClass* cl = dcl->cl;
   if(depth == 0) {
+    string package_name;
+    append_package_name(package_name, cl->name->s);
+    if(!package_name.empty()) {
+      out << "package " << package_name << ";\n\n";
+    }
     bool has_imports = false;
-    set<string>& imps = dcl->import_table;
-    for(set<string>::iterator it = imps.begin(); it != imps.end(); ++it) {
-      string import_package = get_package_name(dxc_type_nice(it->c_str()));
+    string import_name;
+    const vector<string>& imps = dcl->imports->descs;
+    for(vector<string>::const_iterator it = imps.begin(); it != imps.end();
+        ++it) {
 /*
+      string import_package;
+      append_package_name(import_package, it->c_str());
       if(import_package == "java.lang" || import_package == package_name) {
-        if(is_toplevel_class(it->c_str()) ||
-           get_toplevel_class(cl->name->s) == get_toplevel_class(*it)) {
+        string top, import_top;
+        get_toplevel_class(top, cl->name->s);
+        get_toplevel_class(import_top, it->c_str());
+        if(is_toplevel_class(it->c_str()) || top == import_top) {
           continue;
         }
       }
 */
-      printf("import %s;\n",
-             convert_dollars(dxc_type_nice(it->c_str())).c_str());
+      import_name.clear();
+      append_type_name(import_name, it->c_str(), true);
+      out << "import " << import_name << ";\n";
       has_imports = true;
     }
     if(has_imports) {
-      printf("\n");
+      out << '\n';
     }
   }
-  write_access_flags(dcl, depth, cl->access_flags);
-  write_alias_table(dcl, depth);
-  
+  write_access_flags(out, dcl, depth, cl->access_flags);
+  write_alias_table(out, dcl, depth);
+
   DexAccessFlags nflags = cl->access_flags & ACC_INTERFACE ?
       (DexAccessFlags)(cl->access_flags & ~ACC_ABSTRACT) : cl->access_flags;
   // HACK: Sometimes some weird things go on where a class can't access another
@@ -453,28 +561,29 @@ void decompile_class(dasmcl* dcl, dx_uint depth) {
       nflags = (DexAccessFlags)(nflags | ACC_STATIC);
     }
   }
-  string flags = dxc_access_flags_nice(nflags);
+  string flags = access_flags_nice(nflags);
+  size_t brief_len;
+  const char* brief = class_brief(cl->name->s, &brief_len);
   if(flags.empty()) {
-    printf("%sclass %s ", tabbing.c_str(), type_brief(cl->name->s).c_str());
+    out.indent(depth) << "class ";
   } else {
-    printf("%s%s %s%s ", tabbing.c_str(), flags.c_str(),
-           cl->access_flags & ACC_INTERFACE ? "" : "class ",
-           type_brief(cl->name->s).c_str());
+    out.indent(depth) << flags << ' '
+        << (cl->access_flags & ACC_INTERFACE ? "" : "class ");
   }
+  out.append(brief, brief_len) << ' ';
   if(cl->super_class && strcmp("Ljava/lang/Object;", cl->super_class->s)) {
-    printf("extends %s ", get_import_name(dcl, cl->super_class->s).c_str());
+    out << "extends " << get_import_name(dcl, cl->super_class->s) << ' ';
   }
   if(cl->interfaces->s[0]) {
     ref_str** str;
-    printf(cl->access_flags & ACC_INTERFACE ? "extends " : "implements ");
+    out << (cl->access_flags & ACC_INTERFACE ? "extends " : "implements ");
     for(str = cl->interfaces->s; *str; ++str) {
-      if(str != cl->interfaces->s) printf(", ");
-      printf("%s", get_import_name(dcl, (*str)->s).c_str());
-      //printf("%s", dxc_type_nice((*str)->s));
+      if(str != cl->interfaces->s) out << ", ";
+      out << get_import_name(dcl, (*str)->s);
     }
-    printf(" ");
+    out << ' ';
   }
-  printf("{\n");
+  out << "{\n";
 
   bool noStaticInit = true;
   for(DexMethod* mtd = cl->direct_methods;
@@ -485,7 +594,7 @@ void decompile_class(dasmcl* dcl, dx_uint depth) {
 
   int feedLine = 0;
   for(int iter = 0; iter < 2; iter++) {
-    if(feedLine) printf("\n");
+    if(feedLine) out << '\n';
     feedLine = 0;
     DexValue* svalue = iter ? NULL : cl->static_values;
     for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
@@ -498,38 +607,38 @@ void decompile_class(dasmcl* dcl, dx_uint depth) {
       if((fld->access_flags & ACC_SYNTHETIC) ||
          (fld->access_flags & ACC_STATIC)) {
         nflags = (DexAccessFlags)(nflags & ~ACC_STATIC);
-        printf("%s  @%s(\n", tabbing.c_str(),
-            get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmSynthetic;").c_str());
-        printf("%s    access_flags = 0x%08X\n", tabbing.c_str(),
-               fld->access_flags);
-        printf("%s  )\n", tabbing.c_str());
+        out.indent(depth + 1) << '@'
+            << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmSynthetic;")
+            << "(\n";
+        out.indent(depth + 2) << "access_flags = 0x"
+            << Hex(fld->access_flags, 8) << '\n';
+        out.indent(depth + 1) << ")\n";
       }
 */
 
-      write_access_flags(dcl, depth + 1, nflags);
+      write_access_flags(out, dcl, depth + 1, nflags);
 
       feedLine = 1;
-      flags = dxc_access_flags_nice(nflags);
-      if(flags.empty()) {
-        printf("%s  %s %s", tabbing.c_str(),
-               get_import_name(dcl, fld->type->s).c_str(), fld->name->s);
-      } else {
-        printf("%s  %s %s %s", tabbing.c_str(), flags.c_str(),
-               get_import_name(dcl, fld->type->s).c_str(), fld->name->s);
+      flags = access_flags_nice(nflags);
+      out.indent(depth + 1);
+      if(!flags.empty()) {
+        out << flags << ' ';
       }
+      out << get_import_name(dcl, fld->type->s) << ' ' << fld->name->s;
       if(svalue) {
         if(svalue->type == VALUE_STRING) {
-          printf(" = \"%s\";\n",
-                 encode_string(svalue->value.val_str->s).c_str());
+          out << " = \"";
+          encode_string(out, svalue->value.val_str->s);
+          out << "\";\n";
         } else {
-          printf(" = %s;\n", dxc_value_nice(svalue));
+          out << " = " << value_nice(svalue) << ";\n";
         }
         fld->access_flags = (DexAccessFlags)(fld->access_flags | ACC_UNUSED);
       } else if((fld->access_flags & ACC_STATIC) && noStaticInit) {
-        printf(" = %s;\n", get_zero_literal(fld->type->s[0]).c_str());
+        out << " = " << get_zero_literal(fld->type->s[0]) << ";\n";
         fld->access_flags = (DexAccessFlags)(fld->access_flags | ACC_UNUSED);
       } else {
-        printf(";\n");
+        out << ";\n";
       }
     }
   }
@@ -537,20 +646,21 @@ void decompile_class(dasmcl* dcl, dx_uint depth) {
   for(int iter = 0; iter < 2; iter++)
   for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
       !dxc_is_sentinel_method(mtd); mtd++) {
-    if(feedLine) printf("\n");
+    if(feedLine) out << '\n';
     feedLine = 1;
 
-    write_access_flags(dcl, depth + 1, mtd->access_flags);
+    write_access_flags(out, dcl, depth + 1, mtd->access_flags);
 
     if(mtd->code_body) {
       DexCode& code = *mtd->code_body;
-      printf("%s  @%s(\n", tabbing.c_str(),
-             get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmMethod;").c_str());
-      printf("%s    registers = %d,\n", tabbing.c_str(), code.registers_size);
-      printf("%s    outsSize = %d,\n", tabbing.c_str(), code.outs_size);
-      decompile_dalvik(dcl, mtd->code_body->insns, mtd->code_body->insns_count,
-                       mtd->code_body->tries, depth + 2);
-      printf("%s  )\n", tabbing.c_str());
+      out.indent(depth + 1) << '@'
+          << get_import_name(dcl, "Lorg/dxcut/dxdasm/DxdasmMethod;") << "(\n";
+      out.indent(depth + 2) << "registers = " << code.registers_size << ",\n";
+      out.indent(depth + 2) << "outsSize = " << code.outs_size << ",\n";
+      decompile_dalvik(out, dcl, mtd->code_body->insns,
+                       mtd->code_body->insns_count, mtd->code_body->tries,
+                       depth + 2);
+      out.indent(depth + 1) << ")\n";
     }
 
     string throwsString;
@@ -570,95 +680,82 @@ void decompile_class(dasmcl* dcl, dx_uint depth) {
     }
 
     bool isclinit = false;
-    flags = dxc_access_flags_nice(
+    flags = access_flags_nice(
         (DexAccessFlags)(mtd->access_flags & ~(ACC_BRIDGE | ACC_VARARGS)));
+    out.indent(depth + 1);
     if(mtd->access_flags & ACC_CONSTRUCTOR) {
       if(mtd->access_flags & ACC_STATIC) {
         isclinit = true;
-        printf("%s  static void dxdasm_static(", tabbing.c_str());
+        out << "static void dxdasm_static(";
       } else if(flags.empty()) {
-        printf("%s  %s(", tabbing.c_str(),
-               type_brief(cl->name->s).c_str());
+        out.append(brief, brief_len) << '(';
       } else {
-        printf("%s  %s %s(", tabbing.c_str(), flags.c_str(),
-               type_brief(cl->name->s).c_str());
+        out << flags << ' ';
+        out.append(brief, brief_len) << '(';
       }
-    } else if(flags.empty()) {
-      printf("%s  %s %s(", tabbing.c_str(),
-          get_import_name(dcl, mtd->prototype->s[0]->s).c_str(), mtd->name->s);
     } else {
-      printf("%s  %s %s %s(", tabbing.c_str(), flags.c_str(),
-          get_import_name(dcl, mtd->prototype->s[0]->s).c_str(), mtd->name->s);
+      if(!flags.empty()) {
+        out << flags << ' ';
+      }
+      out << get_import_name(dcl, mtd->prototype->s[0]->s) << ' '
+          << mtd->name->s << '(';
     }
     if(mtd->code_body && mtd->code_body->debug_information) {
       ref_str** para = mtd->code_body->debug_information->parameter_names->s;
       for(int i = 1; mtd->prototype->s[i]; i++) {
-        if(i > 1) printf(", ");
-        string type_str;
+        if(i > 1) out << ", ";
         if(!mtd->prototype->s[i + 1] && (mtd->access_flags & ACC_VARARGS)) {
-          type_str = get_import_name(dcl, mtd->prototype->s[i]->s + 1) + "...";
+          out << get_import_name(dcl, mtd->prototype->s[i]->s + 1) << "...";
         } else {
-          type_str = get_import_name(dcl, mtd->prototype->s[i]->s);
+          out << get_import_name(dcl, mtd->prototype->s[i]->s);
         }
 
         if(*para && (*para)->s[0]) {
-          printf("%s %s", type_str.c_str(),
-                 (*para++)->s);
+          out << ' ' << (*para++)->s;
         } else {
-          printf("%s arg%d", type_str.c_str(), i);
+          out << " arg" << i;
         }
       }
-      printf(")%s {\n", throwsString.c_str());
-      
+      out << ')' << throwsString << " {\n";
+
       para = mtd->code_body->debug_information->parameter_names->s;
       dx_uint reg = mtd->code_body->registers_size - mtd->code_body->ins_size;
       if(!(mtd->access_flags & ACC_STATIC)) {
-        printf("%s    // v%.4X -> this\n", tabbing.c_str(), reg++);
+        out.indent(depth + 2) << "// v" << Hex(reg++, 4) << " -> this\n";
       }
       for(int i = 1; mtd->prototype->s[i]; i++) {
+        const char* name = NULL;
         if(*para && (*para)->s[0]) {
-          if(!strcmp(mtd->prototype->s[i]->s, "J") ||
-             !strcmp(mtd->prototype->s[i]->s, "D")) {
-            printf("%s    // v%.4X -> %s_lo\n", tabbing.c_str(),
-                   reg++, (*para)->s);
-            printf("%s    // v%.4X -> %s_hi\n", tabbing.c_str(),
-                   reg++, (*para)->s);
-          } else {
-            printf("%s    // v%.4X -> %s\n", tabbing.c_str(), reg++,
-                   (*para)->s);
-          }
+          name = (*para)->s;
           para++;
+        }
+        if(!strcmp(mtd->prototype->s[i]->s, "J") ||
+           !strcmp(mtd->prototype->s[i]->s, "D")) {
+          write_parameter_comment(out, depth + 2, reg++, name, i, "_lo");
+          write_parameter_comment(out, depth + 2, reg++, name, i, "_hi");
         } else {
-          if(!strcmp(mtd->prototype->s[i]->s, "J") ||
-             !strcmp(mtd->prototype->s[i]->s, "D")) {
-            printf("%s    // v%.4X -> arg%d_lo\n", tabbing.c_str(), reg++, i);
-            printf("%s    // v%.4X -> arg%d_hi\n", tabbing.c_str(), reg++, i);
-          } else {
-            printf("%s    // v%.4X -> arg%d\n", tabbing.c_str(), reg++, i);
-          }
+          write_parameter_comment(out, depth + 2, reg++, name, i, "");
         }
       }
     } else {
       for(int i = 1; mtd->prototype->s[i]; i++) {
-        string type_str;
+        if(i > 1) out << ", ";
         if(!mtd->prototype->s[i + 1] && (mtd->access_flags & ACC_VARARGS)) {
-          type_str = get_import_name(dcl, mtd->prototype->s[i]->s + 1) + "...";
+          out << get_import_name(dcl, mtd->prototype->s[i]->s + 1) << "...";
         } else {
-          type_str = get_import_name(dcl, mtd->prototype->s[i]->s);
+          out << get_import_name(dcl, mtd->prototype->s[i]->s);
         }
-
-        if(i > 1) printf(", ");
-        printf("%s arg%d", type_str.c_str(), i);
+        out << " arg" << i;
       }
       if(mtd->code_body) {
-        printf(")%s {\n", throwsString.c_str());
+        out << ')' << throwsString << " {\n";
       } else {
-        printf(")%s;\n", throwsString.c_str());
+        out << ')' << throwsString << ";\n";
       }
     }
     if(mtd->code_body) {
       if(mtd->code_body->debug_information) {
-        dump_debug(mtd->code_body->debug_information, depth + 2);
+        dump_debug(out, mtd->code_body->debug_information, depth + 2);
       }
       bool callsThis = false;
       if(cl->super_class && (mtd->access_flags & ACC_CONSTRUCTOR) &&
@@ -675,37 +772,37 @@ void decompile_class(dasmcl* dcl, dx_uint depth) {
             } else {
               if(!strcmp(in->special.method.defining_class->s, cl->name->s)) {
                 callsThis = true;
-                printf("%s    this(", tabbing.c_str());
+                out.indent(depth + 2) << "this(";
               } else if(!strcmp(in->special.method.defining_class->s,
                                 cl->super_class->s)) {
-                printf("%s    super(", tabbing.c_str());
+                out.indent(depth + 2) << "super(";
               } else {
                 continue;
               }
               bool first = true;
               for(ref_str** params = in->special.method.prototype->s + 1;
                   *params; params++) {
-                if(!first) printf(", ");
+                if(!first) out << ", ";
                 first = false;
                 if((*params)->s[0] == 'L' || (*params)->s[0] == '[') {
-                  printf("(%s)", get_import_name(dcl, (*params)->s).c_str());
+                  out << '(' << get_import_name(dcl, (*params)->s) << ')';
                 }
-                printf("%s", get_zero_literal((*params)->s[0]).c_str());
+                out << get_zero_literal((*params)->s[0]);
               }
-              printf(");\n");
+              out << ");\n";
             }
             found = true;
             break;
           }
         }
         if(!found) {
-          printf("%s    // Couldn't find super call.\n", tabbing.c_str());
+          out.indent(depth + 2) << "// Couldn't find super call.\n";
         }
       }
       if(isclinit) {
-        printf("%s  }\n", tabbing.c_str());
-        printf("%s  static {\n", tabbing.c_str());
-        printf("%s    // Edit me!\n", tabbing.c_str());
+        out.indent(depth + 1) << "}\n";
+        out.indent(depth + 1) << "static {\n";
+        out.indent(depth + 2) << "// Edit me!\n";
       }
       if((mtd->access_flags & ACC_CONSTRUCTOR) && !callsThis) {
         for(DexField* fld = (mtd->access_flags & ACC_STATIC) ?
@@ -713,80 +810,931 @@ void decompile_class(dasmcl* dcl, dx_uint depth) {
             !dxc_is_sentinel_field(fld); fld++) {
           if((fld->access_flags & ACC_FINAL) &&
              !(fld->access_flags & ACC_UNUSED)) {
-            printf("%s    %s%s = %s;\n", tabbing.c_str(),
-                   (mtd->access_flags & ACC_STATIC ? "" : "this."),
-                   fld->name->s, get_zero_literal(fld->type->s[0]).c_str());
+            out.indent(depth + 2)
+                << (mtd->access_flags & ACC_STATIC ? "" : "this.")
+                << fld->name->s << " = "
+                << get_zero_literal(fld->type->s[0]) << ";\n";
           }
         }
       }
       for(int i = 0; i < throwTypes.size(); i++) {
-        printf("%s    if(0==0) throw (%s)null;\n", tabbing.c_str(),
-               throwTypes[i].c_str());
+        out.indent(depth + 2) << "if(0==0) throw (" << throwTypes[i]
+                              << ")null;\n";
       }
       if(mtd->prototype->s[0]->s[0] != 'V') {
-        printf("%s    return %s;\n", tabbing.c_str(),
-               get_zero_literal(mtd->prototype->s[0]->s[0]).c_str());
+        out.indent(depth + 2) << "return "
+            << get_zero_literal(mtd->prototype->s[0]->s[0]) << ";\n";
       }
-      printf("%s  }\n", tabbing.c_str());
+      out.indent(depth + 1) << "}\n";
     }
   }
 
   vector<dasmcl*>& inner = dcl->inner_classes;
   for(int i = 0; i < inner.size(); i++) {
-    if(feedLine) printf("\n");
+    if(feedLine) out << '\n';
     feedLine = 1;
-    inner[i]->import_table = dcl->import_table;
-    decompile_class(inner[i], depth + 1);
+    decompile_class(out, inner[i], depth + 1);
+  }
+  out.indent(depth) << "}\n";
+}
+
+/* The dxasm format carries what the Dxdasm annotations of decompile_class()
+ * do, one directive or instruction to a line, with types as descriptors and
+ * none of the Java around it.  A nest goes into one file, each class after
+ * the one before:
+ *
+ *   .class Lcom/example/Main;
+ *   .access 0x1001
+ *   .method-alias Main.helper Lcom/example/Main; helper (IJ)I
+ *   .field-alias Main.x Lcom/example/Main; x I
+ *   .field _dxdasm_$VALUES [Lcom/example/Main;
+ *   .access 0x1008
+ *
+ *   .method run ()V
+ *   .registers 6
+ *   .outs 3
+ *     L00: packed-switch v00 packed@0
+ *     L01: const-string v01 string@tab\there
+ *     ...
+ *   .packed -1 L09 L13
+ *   .sparse 10 L07 1000 L13
+ *   .data 4 0x1 0xDEADBEEF 0x7
+ *   .try L05 3
+ *   .catch Ljava/lang/RuntimeException; L09
+ *   .catchall L13
+ *
+ * .access goes with the class, field or method above it.  Fields and methods
+ * are only listed when there's something to say about them.  Instructions are
+ * escaped the way they are inside the Java strings.  dxreasm --source reads
+ * it back, see javasource.cpp. */
+
+static void write_dxasm_access(ClassWriter& out, DexAccessFlags flags) {
+  if((flags & ~STANDARD_FLAGS) == 0) return;
+  out << ".access 0x" << Hex((dx_uint)flags) << '\n';
+}
+
+static void write_dxasm_proto(ClassWriter& out, ref_strstr* proto) {
+  out << '(';
+  for(ref_str** param = proto->s + 1; *param; ++param) {
+    out << (*param)->s;
+  }
+  out << ')' << proto->s[0]->s;
+}
+
+static void write_dxasm_label(ClassWriter& out, const CodeIndex& index,
+                              long long off) {
+  out << " L" << Dec(label_at(index, off), 2);
+}
+
+static void write_dxasm_code(ClassWriter& out, dasmcl* dcl, DexCode* code) {
+  CodeIndex index;
+  index.build(code->insns, code->insns_count);
+  CodeTables tables(index);
+  out << ".registers " << code->registers_size << '\n';
+  out << ".outs " << code->outs_size << '\n';
+  for(int i = 0; i < index.insns.size(); i++) {
+    out << "  ";
+    write_insn(out, dcl, index, i, tables);
+    out << '\n';
+  }
+
+  for(int i = 0; i < tables.packed_switch_tables.size(); i++) {
+    int off = tables.packed_switch_tables[i].first;
+    DexInstruction* in = tables.packed_switch_tables[i].second;
+    out << ".packed " << in->special.packed_switch.first_key;
+    for(int j = 0; j < in->special.packed_switch.size; j++) {
+      write_dxasm_label(out, index,
+                        (long long)off + in->special.packed_switch.targets[j]);
+    }
+    out << '\n';
+  }
+  for(int i = 0; i < tables.sparse_switch_tables.size(); i++) {
+    int off = tables.sparse_switch_tables[i].first;
+    DexInstruction* in = tables.sparse_switch_tables[i].second;
+    out << ".sparse";
+    for(int j = 0; j < in->special.sparse_switch.size; j++) {
+      out << ' ' << in->special.sparse_switch.keys[j];
+      write_dxasm_label(out, index,
+                        (long long)off + in->special.sparse_switch.targets[j]);
+    }
+    out << '\n';
+  }
+  for(int i = 0; i < tables.fill_data_tables.size(); i++) {
+    DexInstruction* in = tables.fill_data_tables[i];
+    out << ".data " << in->special.fill_data_array.element_width;
+    for(int j = 0; j < in->special.fill_data_array.size; j++) {
+      out << " 0x" << Hex(fill_data_element(in, j));
+    }
+    out << '\n';
+  }
+
+  for(DexTryBlock* try_block = code->tries;
+      !dxc_is_sentinel_try_block(try_block); try_block++) {
+    int startInsn = label_at(index, try_block->start_addr);
+    int endInsn = max(index.insn_before((long long)try_block->start_addr +
+                                        try_block->insn_count), 0);
+    out << ".try L" << Dec(startInsn, 2) << ' ' << endInsn - startInsn + 1
+        << '\n';
+    for(DexHandler* hndlr = try_block->handlers;
+        !dxc_is_sentinel_handler(hndlr); hndlr++) {
+      out << ".catch " << hndlr->type->s;
+      write_dxasm_label(out, index, hndlr->addr);
+      out << '\n';
+    }
+    if(try_block->catch_all_handler) {
+      out << ".catchall";
+      write_dxasm_label(out, index, try_block->catch_all_handler->addr);
+      out << '\n';
+    }
+  }
+}
+
+void decompile_class_dxasm(ClassWriter& out, dasmcl* dcl) {
+  DexClass* cl = dcl->cl;
+  out << ".class " << cl->name->s << '\n';
+  write_dxasm_access(out, cl->access_flags);
+
+  vector<int> order = sorted_aliases<RefMethodCompare>(dcl->method_aliases);
+  for(int i = 0; i < order.size(); i++) {
+    ref_method* mtd = dcl->method_aliases.entries[order[i]].first;
+    out << ".method-alias " << dcl->method_aliases.entries[order[i]].second
+        << ' ' << mtd->defining_class->s << ' ' << mtd->name->s << ' ';
+    write_dxasm_proto(out, mtd->prototype);
+    out << '\n';
+  }
+  order = sorted_aliases<RefFieldCompare>(dcl->field_aliases);
+  for(int i = 0; i < order.size(); i++) {
+    ref_field* fld = dcl->field_aliases.entries[order[i]].first;
+    out << ".field-alias " << dcl->field_aliases.entries[order[i]].second
+        << ' ' << fld->defining_class->s << ' ' << fld->name->s << ' '
+        << fld->type->s << '\n';
+  }
+
+  for(int iter = 0; iter < 2; iter++)
+  for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
+      !dxc_is_sentinel_field(fld); fld++) {
+    if((fld->access_flags & ~STANDARD_FLAGS) == 0) continue;
+    out << ".field " << fld->name->s << ' ' << fld->type->s << '\n';
+    write_dxasm_access(out, fld->access_flags);
+  }
+
+  for(int iter = 0; iter < 2; iter++)
+  for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
+      !dxc_is_sentinel_method(mtd); mtd++) {
+    if(!mtd->code_body && (mtd->access_flags & ~STANDARD_FLAGS) == 0) {
+      continue;
+    }
+    out << "\n.method " << mtd->name->s << ' ';
+    write_dxasm_proto(out, mtd->prototype);
+    out << '\n';
+    write_dxasm_access(out, mtd->access_flags);
+    if(mtd->code_body) write_dxasm_code(out, dcl, mtd->code_body);
+  }
+
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    out << '\n';
+    decompile_class_dxasm(out, dcl->inner_classes[i]);
+  }
+}
+
+// Rough measure of how long a top-level class and its inner classes take to
+// emit.  Used to start the largest classes first when running in parallel.
+static dx_uint class_weight(DexInput& input, dasmcl* dcl) {
+  DexClass* cl = dcl->cl;
+  dx_uint weight = 1 + input.code_size(dcl->dex_name);
+  for(int iter = 0; iter < 2; iter++)
+  for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
+      !dxc_is_sentinel_field(fld); ++fld) {
+    weight++;
+  }
+  for(int iter = 0; iter < 2; iter++)
+  for(DexMethod* mtd = iter ? cl->direct_methods : cl->virtual_methods;
+      !dxc_is_sentinel_method(mtd); ++mtd) {
+    weight += 4;
+  }
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    weight += class_weight(input, dcl->inner_classes[i]);
+  }
+  return weight;
+}
+
+// Packages with more top-level classes than this are split into hashed
+// subdirectories.  Zero disables sharding.
+static int shard_threshold = 0;
+
+// Set with --format=dxasm.
+static bool dxasm_output = false;
+
+// Name of the subdirectory a class in a sharded package goes into: two hex
+// digits of an FNV-1a hash of the class name.
+static string shard_dir(const string& name) {
+  dx_ulong h = 0xcbf29ce484222325ULL;
+  for(int i = 0; i < name.size(); i++) {
+    h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+  }
+  static const char digits[] = "0123456789abcdef";
+  string dir;
+  dir += digits[h >> 4 & 0xF];
+  dir += digits[h & 0xF];
+  return dir;
+}
+
+// Path of the file a top-level class is written to, relative to the output
+// directory.  'sharded' holds the packages that get split up.
+static string class_file(dasmcl* dcl, const set<string>& sharded) {
+  string name, package;
+  append_type_name(name, dcl->cl->name->s);
+  append_package_name(package, dcl->cl->name->s);
+  string path = name;
+  if(sharded.find(package) != sharded.end()) {
+    if(package.empty()) {
+      path = shard_dir(name) + "." + name;
+    } else {
+      string brief = name.substr(package.size() + 1);
+      path = package + "." + shard_dir(brief) + "." + brief;
+    }
+  }
+  for(int i = 0; i < path.size(); i++) {
+    if(path[i] == '.') path[i] = '/';
+  }
+  return path + (dxasm_output ? ".dxasm" : ".java");
+}
+
+// Directories known to exist below the output directory.  Shared by all
+// workers so each directory is only created once per run.
+struct DirCache {
+  mutex lock;
+  set<string> made;
+};
+
+// Creates every missing directory on the way to 'path'.  Directories up to
+// 'root' characters into the path are assumed to exist.
+static bool make_parent_dirs(DirCache* dirs, const string& path, size_t root) {
+  size_t pos = path.find_last_of('/');
+  if(pos == string::npos || pos <= root) return true;
+  string dir = path.substr(0, pos);
+
+  lock_guard<mutex> guard(dirs->lock);
+  if(dirs->made.find(dir) != dirs->made.end()) return true;
+  for(size_t end = path.find('/', root + 1); end <= pos;
+      end = path.find('/', end + 1)) {
+    string sub = path.substr(0, end);
+    if(dirs->made.find(sub) != dirs->made.end()) continue;
+    if(mkdir(sub.c_str(), 0777) == -1 && errno != EEXIST) {
+      fprintf(stderr, "Failed to create directory %s\n", sub.c_str());
+      perror("mkdir");
+      return false;
+    }
+    dirs->made.insert(sub);
+  }
+  return true;
+}
+
+static bool write_class(const ClassWriter& out, const char* output_dir,
+                        const string& file, DirCache* dirs) {
+  string path = string(output_dir) + "/" + file;
+  if(!make_parent_dirs(dirs, path, strlen(output_dir))) return false;
+  if(!out.write_file(path.c_str())) {
+    fprintf(stderr, "Failed to write %s\n", path.c_str());
+    perror("write");
+    return false;
+  }
+  return true;
+}
+
+struct EmitJob {
+  dasmcl* dcl;
+  string file;
+  // Position in the archive, which follows the class order of the dex file.
+  size_t seq;
+  dx_uint weight;
+  dx_ulong hash;
+  bool skipped;
+};
+
+struct EmitQueue {
+  vector<EmitJob> jobs;
+  atomic<size_t> next;
+  atomic<bool> failed;
+
+  // Set in incremental mode.  Only read while the workers are running.
+  const ClassCache* cache;
+  // Set when writing into an archive instead of a directory.
+  ArchiveWriter* archive;
+  DirCache dirs;
+
+  // Class bodies are loaded from 'input' as each job starts and freed again
+  // when it is done.
+  DexFile* dx;
+  DexInput* input;
+  RenameTables* tables;
+
+  // Set with --times or --stats.  Each worker merges its own laps in when it
+  // is done.
+  PhaseTimes* times;
+  // Set with --stats.
+  RunStats* stats;
+};
+
+// libdxcut's string table is shared by all classes so loading, renaming and
+// freeing class bodies is done under this lock.
+static mutex dxcut_lock;
+
+static bool load_nest(DexInput* input, dasmcl* dcl) {
+  if(!input->load(dcl->dex_name, dcl->cl)) return false;
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    if(!load_nest(input, dcl->inner_classes[i])) return false;
+  }
+  return true;
+}
+
+static void unload_nest(DexInput* input, dasmcl* dcl) {
+  input->unload(dcl->dex_name, dcl->cl);
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    unload_nest(input, dcl->inner_classes[i]);
+  }
+}
+
+// Counts the classes, methods and instructions of a loaded nest for --stats.
+static void count_nest(dasmcl* dcl, dx_ulong counts[3]) {
+  DexClass* cl = dcl->cl;
+  counts[0]++;
+  for(int i = 0; i < 2; i++) {
+    for(DexMethod* mtd = i ? cl->virtual_methods : cl->direct_methods;
+        !dxc_is_sentinel_method(mtd); mtd++) {
+      counts[1]++;
+      if(mtd->code_body) counts[2] += mtd->code_body->insns_count;
+    }
+  }
+  for(int i = 0; i < dcl->inner_classes.size(); i++) {
+    count_nest(dcl->inner_classes[i], counts);
+  }
+}
+
+static bool emit_job(EmitQueue* queue, EmitJob& job, ClassWriter& out,
+                     ArchiveEntry& entry, const char* output_dir,
+                     PhaseClock& clock) {
+  if(queue->cache) {
+    job.hash = hash_class(job.dcl);
+    bool current = queue->cache->is_current(output_dir, job.file, job.hash);
+    clock.lap("hash");
+    if(current) {
+      job.skipped = true;
+      return true;
+    }
+  }
+  out.clear();
+  if(dxasm_output) {
+    decompile_class_dxasm(out, job.dcl);
+  } else {
+    decompile_class(out, job.dcl, 0);
+  }
+  clock.lap("emit");
+  bool ok;
+  if(queue->archive) {
+    queue->archive->encode(job.file, out.str(), entry);
+    ok = queue->archive->add(job.seq, entry);
+  } else {
+    ok = write_class(out, output_dir, job.file, &queue->dirs);
+  }
+  clock.lap("write");
+  if(ok && queue->stats) {
+    queue->stats->count("bytes_written", out.str().size());
+    queue->stats->count(queue->archive ? "archive_entries" : "files_created",
+                        1);
+  }
+  return ok;
+}
+
+static void emit_worker(EmitQueue* queue, const char* output_dir) {
+  ClassWriter out;
+  ArchiveEntry entry;
+  PhaseTimes times;
+  PhaseClock clock(queue->times ? &times : NULL);
+  while(!queue->failed) {
+    size_t i = queue->next++;
+    if(i >= queue->jobs.size()) break;
+    EmitJob& job = queue->jobs[i];
+    double start = queue->stats ? wall_seconds() : 0;
+    dx_ulong counts[3] = {0, 0, 0};
+    {
+      lock_guard<mutex> guard(dxcut_lock);
+      if(!load_nest(queue->input, job.dcl)) {
+        queue->failed = true;
+        break;
+      }
+      prep_class_bodies(queue->dx, job.dcl, *queue->tables);
+    }
+    clock.lap("load");
+    if(queue->stats) count_nest(job.dcl, counts);
+    if(!emit_job(queue, job, out, entry, output_dir, clock)) {
+      queue->failed = true;
+    }
+    {
+      lock_guard<mutex> guard(dxcut_lock);
+      release_class_bodies(job.dcl);
+      unload_nest(queue->input, job.dcl);
+    }
+    clock.lap("unload");
+    if(queue->stats) {
+      queue->stats->count("classes", counts[0]);
+      queue->stats->count("methods", counts[1]);
+      queue->stats->count("instructions", counts[2]);
+      queue->stats->add_class(type_nice(job.dcl->dex_name.c_str()),
+                              wall_seconds() - start, counts[2]);
+    }
+  }
+  if(queue->times) queue->times->merge(times);
+}
+
+// Brings the cache up to date after a successful incremental run and removes
+// the output of classes that are no longer in the dex file.  Filtered runs
+// only saw part of the dex so they keep everything else as it was.
+static bool finish_incremental(EmitQueue& queue, ClassCache& cache,
+                               const char* output_dir, bool filtered) {
+  ClassCache next;
+  for(int i = 0; i < queue.jobs.size(); i++) {
+    EmitJob& job = queue.jobs[i];
+    if(job.skipped) {
+      next.entries[job.file] = cache.entries[job.file];
+    } else if(!next.update(output_dir, job.file, job.hash)) {
+      fprintf(stderr, "Failed to stat %s/%s\n", output_dir, job.file.c_str());
+      return false;
+    }
+  }
+  for(map<string, CacheEntry>::iterator it = cache.entries.begin();
+      it != cache.entries.end(); ++it) {
+    if(next.entries.find(it->first) != next.entries.end()) continue;
+    if(filtered) {
+      next.entries.insert(*it);
+      continue;
+    }
+    string path = string(output_dir) + "/" + it->first;
+    if(unlink(path.c_str()) == -1 && errno != ENOENT) {
+      fprintf(stderr, "Failed to remove stale %s\n", path.c_str());
+      perror("unlink");
+    }
+  }
+  cache.entries.swap(next.entries);
+  return cache.save(output_dir);
+}
+
+static bool heavier(const EmitJob& a, const EmitJob& b) {
+  return a.weight > b.weight;
+}
+
+/* dxdasm --serve=socket keeps a dex loaded and answers requests for single
+ * classes on a Unix socket, so tools that want a class at a time don't pay
+ * for reading and preparing the whole dex each time.  Requests are a line
+ * each:
+ *
+ *   class com.example.Main$Inner  the file dxdasm writes for the top-level
+ *                                 class, which can be given as a descriptor
+ *                                 or by its name before sanitizing
+ *   list com.example              the top-level classes of a package, one to
+ *                                 a line; "list" alone for the default one
+ *   reload                        reads the dex again
+ *   stats                         request and cache counts
+ *
+ * The answer is "ok <bytes>" on a line followed by that many bytes, or
+ * "error <message>" on a line.  A connection can carry any number of
+ * requests. */
+
+// A dex loaded for --serve.  Replaced as a whole on reload.
+struct ServedDex {
+  ServedDex() : dx(NULL) {}
+  ~ServedDex() {
+    if(dx) dex_reader_free_classes(dx);
+  }
+
+  DexInput input;
+  DexFile* dx;
+  vector<dasmcl> clist;
+  map<string, dasmcl*> clmap;
+  RenameTables tables;
+  // Every class by its descriptor both as sanitized and as in the dex.
+  map<string, dasmcl*> names;
+  // The Java names of the top-level classes of each package.
+  map<string, vector<string> > packages;
+};
+
+static ServedDex* load_served_dex(const char* path) {
+  ServedDex* sd = new ServedDex();
+  sd->dx = read_dex_input(path, sd->input);
+  if(!sd->dx) {
+    delete sd;
+    return NULL;
+  }
+  // Unlike a full run the annotation types aren't added.  They're only there
+  // to compile the Java and aren't from the reader, so couldn't be freed on
+  // reload.
+  prep_classes(sd->dx, sd->clist, sd->clmap, NULL, &sd->tables);
+  string name, package;
+  for(int i = 0; i < sd->clist.size(); i++) {
+    dasmcl* dcl = &sd->clist[i];
+    sd->names[dcl->cl->name->s] = dcl;
+    sd->names.insert(make_pair(dcl->dex_name, dcl));
+    if(dcl->outer_class) continue;
+    name.clear();
+    package.clear();
+    append_type_name(name, dcl->cl->name->s);
+    append_package_name(package, dcl->cl->name->s);
+    sd->packages[package].push_back(name);
+  }
+  return sd;
+}
+
+struct ClassServer {
+  ClassServer(const char* dex_path, ServedDex* dex, size_t cache_bytes)
+      : dex_path(dex_path), dex(dex), cache(cache_bytes), requests(0),
+        rendered(0) {}
+
+  // Answers a request line.  Called with 'lock' held.
+  void answer(const string& request, string& reply);
+  void render(dasmcl* dcl, string& reply);
+
+  const char* dex_path;
+  mutex lock;
+  ServedDex* dex;
+  RenderCache cache;
+  dx_ulong requests;
+  dx_ulong rendered;
+  // Reused between renders.
+  ClassWriter out;
+};
+
+static void reply_ok(string& reply, const string& body) {
+  char head[32];
+  snprintf(head, sizeof(head), "ok %zu\n", body.size());
+  reply = head;
+  reply += body;
+}
+
+static void reply_error(string& reply, const string& message) {
+  reply = "error " + message + "\n";
+}
+
+void ClassServer::render(dasmcl* dcl, string& reply) {
+  while(dcl->outer_class) dcl = dcl->outer_class;
+  const string* text = cache.find(dcl->cl->name->s);
+  if(text) {
+    reply_ok(reply, *text);
+    return;
+  }
+  if(!load_nest(&dex->input, dcl)) {
+    unload_nest(&dex->input, dcl);
+    reply_error(reply, "failed to load " + dcl->dex_name);
+    return;
+  }
+  prep_class_bodies(dex->dx, dcl, dex->tables);
+  out.clear();
+  if(dxasm_output) {
+    decompile_class_dxasm(out, dcl);
+  } else {
+    decompile_class(out, dcl, 0);
+  }
+  release_class_bodies(dcl);
+  unload_nest(&dex->input, dcl);
+  rendered++;
+  cache.insert(dcl->cl->name->s, out.str());
+  reply_ok(reply, out.str());
+}
+
+void ClassServer::answer(const string& request, string& reply) {
+  requests++;
+  size_t space = request.find(' ');
+  string command = request.substr(0, space);
+  string arg = space == string::npos ? "" : request.substr(space + 1);
+
+  if(command == "class" && !arg.empty()) {
+    string desc = arg;
+    if(desc[0] != 'L' || desc[desc.size() - 1] != ';') {
+      replace(desc.begin(), desc.end(), '.', '/');
+      desc = "L" + desc + ";";
+    }
+    typeof(dex->names.begin()) it = dex->names.find(desc);
+    if(it == dex->names.end()) {
+      reply_error(reply, "no class " + arg);
+    } else {
+      render(it->second, reply);
+    }
+  } else if(command == "list") {
+    typeof(dex->packages.begin()) it = dex->packages.find(arg);
+    if(it == dex->packages.end()) {
+      reply_error(reply, "no package " + arg);
+      return;
+    }
+    string body;
+    for(int i = 0; i < it->second.size(); i++) {
+      body += it->second[i];
+      body += '\n';
+    }
+    reply_ok(reply, body);
+  } else if(command == "reload" && arg.empty()) {
+    // The old dex keeps serving if the new one can't be read.
+    ServedDex* fresh = load_served_dex(dex_path);
+    if(!fresh) {
+      reply_error(reply, string("failed to read ") + dex_path);
+      return;
+    }
+    delete dex;
+    dex = fresh;
+    cache.clear();
+    char body[32];
+    snprintf(body, sizeof(body), "%zu classes\n", dex->clist.size());
+    reply_ok(reply, body);
+  } else if(command == "stats" && arg.empty()) {
+    char body[256];
+    snprintf(body, sizeof(body),
+             "classes %zu\nrequests %llu\nrendered %llu\ncached %zu\n"
+             "cached_bytes %zu\n", dex->clist.size(),
+             (unsigned long long)requests, (unsigned long long)rendered,
+             cache.size(), cache.bytes());
+    reply_ok(reply, body);
+  } else {
+    reply_error(reply, "bad request " + request);
+  }
+}
+
+static void serve_client(ClassServer* server, int fd) {
+  FILE* fin = fdopen(fd, "r");
+  if(!fin) {
+    close(fd);
+    return;
+  }
+  char* buf = NULL;
+  size_t size = 0;
+  ssize_t n;
+  string reply;
+  while((n = getline(&buf, &size, fin)) >= 0) {
+    string request(buf, n);
+    while(!request.empty() && (request[request.size() - 1] == '\n' ||
+                               request[request.size() - 1] == '\r')) {
+      request.resize(request.size() - 1);
+    }
+    {
+      lock_guard<mutex> guard(server->lock);
+      server->answer(request, reply);
+    }
+    if(!send_all(fd, reply.data(), reply.size())) break;
+  }
+  free(buf);
+  fclose(fin);
+}
+
+static int serve(const char* socket_path, const char* dex_path,
+                 size_t cache_bytes) {
+  ServedDex* dex = load_served_dex(dex_path);
+  if(!dex) {
+    fprintf(stderr, "Failed to open dex file\n");
+    return 1;
+  }
+  int sock = listen_unix(socket_path);
+  if(sock == -1) return 1;
+  fprintf(stderr, "Serving %zu classes on %s\n", dex->clist.size(),
+          socket_path);
+
+  // Requests are answered one at a time, but each client gets a thread so
+  // one that holds its connection open doesn't keep the others out.
+  ClassServer server(dex_path, dex, cache_bytes);
+  for(;;) {
+    int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if(fd == -1) {
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      return 1;
+    }
+    thread(serve_client, &server, fd).detach();
   }
-  printf("%s}\n", tabbing.c_str());
 }
 
+static void usage(const char* prog) {
+  fprintf(stderr, "Usage %s [options] classes.dex|app.apk [output_dir=out]\n",
+          prog);
+  fprintf(stderr, "      %s [options] -o out.tar|out.zip|- "
+                  "classes.dex|app.apk\n", prog);
+  fprintf(stderr, "      %s [--format=java|dxasm] [--serve-cache=mb] "
+                  "--serve=socket classes.dex|app.apk\n", prog);
+  fprintf(stderr, "Options:\n"
+                  "  -j threads\n"
+                  "  --format=java|dxasm  (annotated Java by default)\n"
+                  "  --incremental        (directory output only)\n"
+                  "  --shard=classes\n"
+                  "  --include=glob       (may be repeated)\n"
+                  "  --exclude=glob       (may be repeated)\n"
+                  "  --times=file\n"
+                  "  --stats[=file.json]  (report to stderr by default)\n"
+                  "  --stats-top=n        (slowest classes to list, 10)\n"
+                  "  --serve-cache=mb     (rendered classes kept, 64)\n");
+}
 
 int main(int argc, char** argv) {
-  if(argc != 2 && argc != 3) {
-    fprintf(stderr, "Usage %s classes.dex [output_dir=out]\n", *argv);
+  static const struct option long_options[] = {
+    {"incremental", no_argument, NULL, 'I'},
+    {"shard", required_argument, NULL, 'S'},
+    {"include", required_argument, NULL, 'i'},
+    {"exclude", required_argument, NULL, 'x'},
+    {"times", required_argument, NULL, 'T'},
+    {"stats", optional_argument, NULL, 's'},
+    {"stats-top", required_argument, NULL, 'n'},
+    {"format", required_argument, NULL, 'F'},
+    {"serve", required_argument, NULL, 'v'},
+    {"serve-cache", required_argument, NULL, 'c'},
+    {NULL, 0, NULL, 0}
+  };
+  int threads = 1;
+  bool incremental = false;
+  const char* archive_path = NULL;
+  const char* times_path = NULL;
+  bool stats = false;
+  const char* stats_path = NULL;
+  int stats_top = 10;
+  const char* serve_path = NULL;
+  int serve_cache = 64;
+  ClassFilter filter;
+  // The last option given that only applies to writing classes out, which
+  // --serve doesn't do.
+  const char* batch_option = NULL;
+  int opt;
+  while((opt = getopt_long(argc, argv, "j:o:", long_options, NULL)) != -1) {
+    switch(opt) {
+      case 'I':
+        incremental = true;
+        batch_option = "--incremental";
+        break;
+      case 'S':
+        shard_threshold = atoi(optarg);
+        batch_option = "--shard";
+        break;
+      case 'i':
+        filter.include.push_back(optarg);
+        batch_option = "--include";
+        break;
+      case 'x':
+        filter.exclude.push_back(optarg);
+        batch_option = "--exclude";
+        break;
+      case 'T':
+        times_path = optarg;
+        batch_option = "--times";
+        break;
+      case 's':
+        stats = true;
+        stats_path = optarg;
+        batch_option = "--stats";
+        break;
+      case 'n':
+        stats_top = max(atoi(optarg), 0);
+        batch_option = "--stats-top";
+        break;
+      case 'F':
+        if(!strcmp(optarg, "dxasm")) {
+          dxasm_output = true;
+        } else if(strcmp(optarg, "java")) {
+          fprintf(stderr, "Unknown format %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'v':
+        serve_path = optarg;
+        break;
+      case 'c':
+        serve_cache = max(atoi(optarg), 0);
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        if(threads <= 0) threads = thread::hardware_concurrency();
+        if(threads <= 0) threads = 1;
+        batch_option = "-j";
+        break;
+      case 'o':
+        archive_path = optarg;
+        batch_option = "-o";
+        break;
+      default:
+        usage(*argv);
+        return 1;
+    }
+  }
+  if(serve_path) {
+    if(argc - optind != 1) {
+      usage(*argv);
+      return 1;
+    }
+    if(batch_option) {
+      fprintf(stderr, "--serve can't be combined with %s\n", batch_option);
+      return 1;
+    }
+    return serve(serve_path, argv[optind], (size_t)serve_cache << 20);
+  }
+  if(argc - optind != 1 && (argc - optind != 2 || archive_path)) {
+    usage(*argv);
     return 1;
   }
-  const char* output_dir = argc >= 3 ? argv[2] : "out";
+  if(archive_path && incremental) {
+    fprintf(stderr, "--incremental needs a directory output\n");
+    return 1;
+  }
+  const char* output_dir = argc - optind >= 2 ? argv[optind + 1] : "out";
 
-  if(mkdir(output_dir, 0777) == -1 && errno != EEXIST) {
+  ArchiveWriter archive;
+  if(archive_path) {
+    if(!archive.open(archive_path)) return 1;
+  } else if(mkdir(output_dir, 0777) == -1 && errno != EEXIST) {
     fprintf(stderr, "Failed to create output directory %s\n", output_dir);
     return 1;
   }
 
-  FILE* fin = fopen(argv[1], "r");
-  DexFile* dx = dxc_read_file(fin);
+  // Machine readable phase times for benchmarking, see bench/bench.sh, and
+  // the --stats report.
+  PhaseTimes times;
+  RunStats run_stats(stats_top);
+  times.start("read");
+  DexInput input;
+  DexFile* dx = read_dex_input(argv[optind], input);
   if(!dx) {
     fprintf(stderr, "Failed to open dex file\n");
     return 1;
   }
-  add_dxdasm_annotations(dx);
+  // The annotation types are only needed to compile the Java.
+  if(!dxasm_output) {
+    times.start("annotate");
+    add_dxdasm_annotations(dx);
+  }
 
   vector<dasmcl> clist;
   map<string, dasmcl*> clmap;
-  prep_classes(dx, clist, clmap);
+  set<string> selected;
+  times.start("prep");
+  if(!filter.empty()) select_classes(dx, filter, selected);
+  RenameTables tables;
+  prep_classes(dx, clist, clmap, filter.empty() ? NULL : &selected, &tables);
 
+  // In incremental mode classes whose hash matches the cache from the last run
+  // and whose output is untouched are skipped.
+  ClassCache cache;
+  if(incremental) cache.load(output_dir);
+
+  set<string> sharded;
+  if(shard_threshold > 0) {
+    map<string, int> package_size;
+    string package;
+    for(int i = 0; i < clist.size(); i++) {
+      if(clist[i].outer_class) continue;
+      package.clear();
+      append_package_name(package, clist[i].cl->name->s);
+      if(++package_size[package] > shard_threshold) sharded.insert(package);
+    }
+  }
+
+  // Each job is a top-level class together with its inner classes.  In
+  // parallel mode the heaviest classes are handed out first so a single large
+  // class doesn't end up running alone at the end.
+  EmitQueue queue;
   for(int i = 0; i < clist.size(); i++) {
     if(clist[i].outer_class) continue;
-    dasmcl* dcl = &clist[i];
-    DexClass* cl = dcl->cl;
-    char path[256];
-    snprintf(path, sizeof(path), "%s/%s!java", output_dir,
-             dxc_type_nice(cl->name->s));
-    for(int j = 0; path[j]; j++) {
-      if(path[j] == '.') {
-        path[j] = 0;
-        if(mkdir(path, 0777) == -1 && errno != EEXIST) {
-          fprintf(stderr, "Failed to create directory %s\n", path);
-          perror("mkdir");
-          return 1;
-        }
-        path[j] = '/';
-      } else if(path[j] == '!') {
-        path[j] = '.';
-      }
-    }
-    FILE* ign = freopen(path, "w", stdout);
-    decompile_class(dcl, 0);
+    EmitJob job;
+    job.dcl = &clist[i];
+    job.file = class_file(job.dcl, sharded);
+    job.seq = queue.jobs.size();
+    job.weight = threads > 1 ? class_weight(input, job.dcl) : 0;
+    job.hash = 0;
+    job.skipped = false;
+    queue.jobs.push_back(job);
+  }
+  stable_sort(queue.jobs.begin(), queue.jobs.end(), heavier);
+  queue.next = 0;
+  queue.failed = false;
+  queue.cache = incremental ? &cache : NULL;
+  queue.archive = archive_path ? &archive : NULL;
+  queue.dx = dx;
+  queue.input = &input;
+  queue.tables = &tables;
+  queue.times = times_path || stats ? &times : NULL;
+  queue.stats = stats ? &run_stats : NULL;
+
+  if(threads > queue.jobs.size()) threads = max<size_t>(queue.jobs.size(), 1);
+  times.stop();
+  vector<thread> workers;
+  for(int i = 1; i < threads; i++) {
+    workers.push_back(thread(emit_worker, &queue, output_dir));
+  }
+  emit_worker(&queue, output_dir);
+  for(int i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  if(queue.failed) return 1;
+  times.start("finish");
+  if(archive_path) {
+    if(!archive.finish()) return 1;
+    if(strcmp(archive_path, "-")) run_stats.count("files_created", 1);
+  }
+  if(incremental &&
+     !finish_incremental(queue, cache, output_dir, !filter.empty())) {
+    return 1;
   }
+  times.stop();
+  if(times_path && !times.write(times_path)) return 1;
+  if(stats && !run_stats.write(stats_path, times)) return 1;
+  return 0;
 }
@@ -1,28 +1,137 @@
 #include <dxcut/cc.h>
 
 #include <algorithm>
-#include <vector>
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
 
+#include <getopt.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include "classcache.h"
+#include "codeindex.h"
 #include "dasmcl.h"
+#include "javasource.h"
+#include "symtab.h"
+#include "timing.h"
+#include "watch.h"
 
 using namespace std;
 using namespace dxcut;
 
-map<string, int> mnemonicMp;
+// libdxcut's string table is shared by all classes, so interning, copying and
+// freeing strings is done under this lock.  Everything else in reassembly
+// runs without it.
+static mutex dxcut_lock;
+
+// Mnemonic to opcode as a perfect hash over the names in dex_opcode_formats:
+// each name's bucket picks a seed for the second hash, chosen so that no two
+// names share a slot.  A lookup is two hashes of the mnemonic in place and one
+// compare.  The names come from libdxcut, so the seeds are searched for at
+// startup; that takes well under a millisecond.
+class MnemonicTable {
+ public:
+  void build();
+
+  // The opcode named by the 'n' characters at 's', or -1.
+  int find(const char* s, size_t n) const;
+
+ private:
+  enum { BUCKETS = 128, SLOTS = 512 };
+
+  static unsigned int hash(const char* s, size_t n, unsigned int seed);
+
+  unsigned short seeds[BUCKETS];
+  short opcodes[SLOTS];
+};
+
+struct FullerBucket {
+  const vector<vector<int> >& buckets;
+  explicit FullerBucket(const vector<vector<int> >& buckets)
+      : buckets(buckets) {}
+  bool operator()(int a, int b) const {
+    return buckets[a].size() > buckets[b].size();
+  }
+};
 
-static void computeMnemonicMap() {
+unsigned int MnemonicTable::hash(const char* s, size_t n, unsigned int seed) {
+  unsigned int h = 2166136261u ^ seed * 0x9E3779B9u;
+  for(size_t i = 0; i < n; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h ^ h >> 16;
+}
+
+void MnemonicTable::build() {
+  vector<vector<int> > buckets(BUCKETS);
   for(int i = 0; i < sizeof(dex_opcode_formats) / sizeof(DexOpFormat); i++) {
-    if(dex_opcode_formats[i].name) {
-      mnemonicMp[dex_opcode_formats[i].name] = i;
+    const char* name = dex_opcode_formats[i].name;
+    if(!name) continue;
+    vector<int>& bucket = buckets[hash(name, strlen(name), 0) % BUCKETS];
+    // A name used twice stands for the later opcode.
+    int j = 0;
+    while(j < bucket.size() && strcmp(dex_opcode_formats[bucket[j]].name,
+                                      name)) {
+      j++;
+    }
+    if(j == bucket.size()) bucket.push_back(i);
+    else bucket[j] = i;
+  }
+
+  // Place the fullest buckets first, while there is the most room.
+  vector<int> order(BUCKETS);
+  for(int b = 0; b < BUCKETS; b++) order[b] = b;
+  stable_sort(order.begin(), order.end(), FullerBucket(buckets));
+
+  fill(seeds, seeds + BUCKETS, 0);
+  fill(opcodes, opcodes + SLOTS, -1);
+  vector<unsigned int> slots;
+  for(int k = 0; k < BUCKETS && !buckets[order[k]].empty(); k++) {
+    const vector<int>& bucket = buckets[order[k]];
+    unsigned int seed = 1;
+    for(; seed <= 0xFFFF; seed++) {
+      slots.clear();
+      for(int j = 0; j < bucket.size(); j++) {
+        const char* name = dex_opcode_formats[bucket[j]].name;
+        unsigned int slot = hash(name, strlen(name), seed) % SLOTS;
+        if(opcodes[slot] != -1 ||
+           std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+          break;
+        }
+        slots.push_back(slot);
+      }
+      if(slots.size() == bucket.size()) break;
+    }
+    if(seed > 0xFFFF) {
+      fprintf(stderr, "Couldn't build the mnemonic table\n");
+      exit(1);
     }
+    seeds[order[k]] = seed;
+    for(int j = 0; j < bucket.size(); j++) opcodes[slots[j]] = bucket[j];
   }
 }
 
+int MnemonicTable::find(const char* s, size_t n) const {
+  unsigned int seed = seeds[hash(s, n, 0) % BUCKETS];
+  if(!seed) return -1;
+  int op = opcodes[hash(s, n, seed) % SLOTS];
+  if(op == -1) return -1;
+  const char* name = dex_opcode_formats[op].name;
+  return !strncmp(name, s, n) && !name[n] ? op : -1;
+}
+
+// Built before any worker starts and only read afterwards.
+static MnemonicTable mnemonics;
+
 DexValue* getParameter(DexAnnotation* annon, const char* name) {
   for(DexNameValuePair* param = annon->parameters;
       !dxc_is_sentinel_parameter(param); param++) {
@@ -33,16 +142,270 @@ DexValue* getParameter(DexAnnotation* annon, const char* name) {
   return NULL;
 }
 
-string strip(const string& s) {
-  int a = 0;
-  int b = s.size();
-  while(a < b && isspace(s[a])) a++;
-  while(a < b && isspace(s[b - 1])) b--;
-  return s.substr(a, b - a);
+// The DxdasmAliases annotation of a class compiled into hash tables from alias
+// to reference.  Every string is interned, so the instructions that use a
+// reference share its strings instead of each getting copies.
+//
+// Building and clearing the table interns and frees strings, so both are done
+// under dxcut_lock.
+class AliasSymbols {
+ public:
+  ~AliasSymbols();
+
+  void add_methods(DexValue* valArray);
+  void add_fields(DexValue* valArray);
+
+  // Drops the references to every string and empties the table.
+  void clear();
+
+  const ref_method* find_method(const char* alias) const;
+  const ref_field* find_field(const char* alias) const;
+
+ private:
+  ref_str* intern(const char* s);
+
+  // Keyed on the interned strings' own text.
+  unordered_map<const char*, ref_str*, CStrHash, CStrEqual> strings;
+  unordered_map<const char*, ref_method, CStrHash, CStrEqual> methods;
+  unordered_map<const char*, ref_field, CStrHash, CStrEqual> fields;
+};
+
+AliasSymbols::~AliasSymbols() {
+  clear();
+}
+
+void AliasSymbols::clear() {
+  for(typeof(methods.begin()) it = methods.begin(); it != methods.end();
+      ++it) {
+    dxc_free_strstr(it->second.prototype);
+  }
+  for(typeof(strings.begin()) it = strings.begin(); it != strings.end();
+      ++it) {
+    dxc_free_str(it->second);
+  }
+  methods.clear();
+  fields.clear();
+  strings.clear();
+}
+
+ref_str* AliasSymbols::intern(const char* s) {
+  typeof(strings.begin()) it = strings.find(s);
+  if(it != strings.end()) return it->second;
+  ref_str* str = dxc_induct_str(s);
+  strings[str->s] = str;
+  return str;
+}
+
+void AliasSymbols::add_methods(DexValue* valArray) {
+  if(!valArray) return;
+  for(DexValue* val = valArray->value.val_array;
+      !dxc_is_sentinel_value(val); ++val) {
+    DexValue* valAlias = getParameter(val->value.val_annotation, "alias");
+    DexValue* valClazz = getParameter(val->value.val_annotation, "clazz");
+    DexValue* valName = getParameter(val->value.val_annotation, "name");
+    DexValue* valPrototype = getParameter(val->value.val_annotation,
+                                          "prototype");
+
+    dx_uint count = 0;
+    for(DexValue* proto = valPrototype->value.val_array;
+        !dxc_is_sentinel_value(proto); ++proto) {
+      count++;
+    }
+    ref_method mtd;
+    mtd.name = intern(valName->value.val_str->s);
+    mtd.defining_class = intern(valClazz->value.val_type->s);
+    mtd.prototype = dxc_create_strstr(count);
+    for(dx_uint i = 0; i < count; i++) {
+      mtd.prototype->s[i] = dxc_copy_str(
+          intern(valPrototype->value.val_array[i].value.val_type->s));
+    }
+
+    // A repeated alias replaces the earlier one.
+    ref_method& slot = methods[intern(valAlias->value.val_str->s)->s];
+    if(slot.prototype) dxc_free_strstr(slot.prototype);
+    slot = mtd;
+  }
+}
+
+void AliasSymbols::add_fields(DexValue* valArray) {
+  if(!valArray) return;
+  for(DexValue* val = valArray->value.val_array;
+      !dxc_is_sentinel_value(val); ++val) {
+    DexValue* valAlias = getParameter(val->value.val_annotation, "alias");
+    DexValue* valClazz = getParameter(val->value.val_annotation, "clazz");
+    DexValue* valName = getParameter(val->value.val_annotation, "name");
+    DexValue* valType = getParameter(val->value.val_annotation, "type");
+
+    ref_field fld;
+    fld.name = intern(valName->value.val_str->s);
+    fld.defining_class = intern(valClazz->value.val_type->s);
+    fld.type = intern(valType->value.val_type->s);
+    fields[intern(valAlias->value.val_str->s)->s] = fld;
+  }
+}
+
+const ref_method* AliasSymbols::find_method(const char* alias) const {
+  typeof(methods.begin()) it = methods.find(alias);
+  return it == methods.end() ? NULL : &it->second;
+}
+
+const ref_field* AliasSymbols::find_field(const char* alias) const {
+  typeof(fields.begin()) it = fields.find(alias);
+  return it == fields.end() ? NULL : &it->second;
+}
+
+// The problems found in one class.  Reassembly carries on past each of them
+// so one run reports them all.  Every class has its own log, and the logs are
+// printed in dex file order once all classes are done, so the report doesn't
+// depend on how the classes were spread over threads.
+class ErrorLog {
+ public:
+  ErrorLog() : count(0) {}
+
+  // Adds a line of "Lclass;.method:" followed by the formatted message.
+  void report(DexClass* cl, DexMethod* method, const char* fmt, ...)
+      __attribute__((format(printf, 4, 5)));
+
+  int count;
+  string text;
+};
+
+void ErrorLog::report(DexClass* cl, DexMethod* method, const char* fmt, ...) {
+  text += cl->name->s;
+  text += '.';
+  text += method->name->s;
+  text += ':';
+  va_list ap;
+  va_start(ap, fmt);
+  char buf[256];
+  va_list again;
+  va_copy(again, ap);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  if(n >= (int)sizeof(buf)) {
+    size_t len = text.size();
+    text.resize(len + n + 1);
+    vsnprintf(&text[len], n + 1, fmt, again);
+    text.resize(len + n);
+  } else if(n > 0) {
+    text.append(buf, n);
+  }
+  va_end(again);
+  va_end(ap);
+  text += '\n';
+  count++;
+}
+
+// A cursor over the text of one instruction.  Tokens point into the
+// annotation's own string, so taking an instruction apart copies nothing.
+struct InsnText {
+  explicit InsnText(const char* s) : p(s) {}
+
+  void skip_space() {
+    while(isspace((unsigned char)*p)) p++;
+  }
+
+  // Returns the next whitespace delimited token and stores its length in 'n'.
+  const char* token(size_t* n) {
+    const char* s = p;
+    while(*p && !isspace((unsigned char)*p)) p++;
+    *n = p - s;
+    skip_space();
+    return s;
+  }
+
+  // Skips 'prefix' if the text continues with it.
+  bool operand(const char* prefix) {
+    size_t n = strlen(prefix);
+    if(strncmp(p, prefix, n)) return false;
+    p += n;
+    return true;
+  }
+
+  const char* p;
+};
+
+// Parses the 'n' digits at 's' in base 10 or 16.  Fails if there are no
+// digits or anything else is mixed in.
+static bool parse_number(const char* s, size_t n, int base,
+                         unsigned long long* x) {
+  if(n == 0) return false;
+  *x = 0;
+  for(size_t i = 0; i < n; i++) {
+    char ch = s[i];
+    int digit;
+    if('0' <= ch && ch <= '9') digit = ch - '0';
+    else if(base == 16 && 'a' <= ch && ch <= 'f') digit = 10 + ch - 'a';
+    else if(base == 16 && 'A' <= ch && ch <= 'F') digit = 10 + ch - 'A';
+    else return false;
+    *x = *x * base + digit;
+  }
+  return true;
+}
+
+// Parses the rest of the text as 'prefix' followed by the index of one of
+// 'count' payload annotations.  Returns the index, or -1.
+static int payload_ref(InsnText& text, const char* prefix, size_t count) {
+  unsigned long long x;
+  if(!text.operand(prefix) ||
+     !parse_number(text.p, strlen(text.p), 10, &x) || x >= count) {
+    return -1;
+  }
+  return x;
 }
 
+static dx_uint count_values(DexValue* val) {
+  dx_uint count = 0;
+  for(; !dxc_is_sentinel_value(val); ++val) count++;
+  return count;
+}
+
+// Takes the references the instructions and handlers of 'code' hold.  Until
+// now they only borrowed the strings of the alias table and the annotation,
+// and string and type literals are interned only now, so the string table is
+// touched once per method, under dxcut_lock.  'literals' holds the text of
+// each instruction's string or type literal, or NULL.
+static void own_strings(DexCode* code, const vector<const char*>& literals) {
+  for(int i = 0; i < literals.size(); i++) {
+    DexInstruction* in = code->insns + i;
+    switch(dex_opcode_formats[in->opcode].specialType) {
+      case SPECIAL_STRING:
+        if(literals[i]) in->special.str = dxc_induct_str(literals[i]);
+        break;
+      case SPECIAL_TYPE:
+        if(literals[i]) {
+          in->special.type = dxc_induct_str(dxc_type_name(literals[i]));
+        }
+        break;
+      case SPECIAL_FIELD: {
+        ref_field& fld = in->special.field;
+        if(!fld.name) break;
+        fld.defining_class = dxc_copy_str(fld.defining_class);
+        fld.name = dxc_copy_str(fld.name);
+        fld.type = dxc_copy_str(fld.type);
+      } break;
+      case SPECIAL_METHOD: {
+        ref_method& mtd = in->special.method;
+        if(!mtd.name) break;
+        mtd.defining_class = dxc_copy_str(mtd.defining_class);
+        mtd.name = dxc_copy_str(mtd.name);
+        mtd.prototype = dxc_copy_strstr(mtd.prototype);
+      } break;
+    }
+  }
+  for(DexTryBlock* tryb = code->tries; !dxc_is_sentinel_try_block(tryb);
+      ++tryb) {
+    if(!tryb->handlers) continue;
+    for(DexHandler* handler = tryb->handlers;
+        !dxc_is_sentinel_handler(handler); ++handler) {
+      handler->type = dxc_copy_str(handler->type);
+    }
+  }
+}
+
+// Errors are reported to 'log' and the instruction in question is skipped;
+// the caller has to check the log before using the code.
 DexCode* reassemble_code(DexClass* cl, DexMethod* method, DexAnnotation* annon,
-    map<string, ref_method> method_map, map<string, ref_field> field_map) {
+                         const AliasSymbols& aliases, ErrorLog& log) {
   DexCode* code = (DexCode*)calloc(1, sizeof(DexCode));
   code->registers_size = getParameter(annon, "registers")->value.val_int;
   code->outs_size = getParameter(annon, "outsSize")->value.val_int;
@@ -72,324 +435,261 @@ DexCode* reassemble_code(DexClass* cl, DexMethod* method, DexAnnotation* annon,
   }
 
   // Pass 1: Just figure out the opcodes and labels so we can do layout.
+  // 'operands' points at the text following each mnemonic, or is NULL if
+  // the mnemonic is unknown.
   int pos = 0;
-  map<string, int> insnLayout;
-  map<int, int> addrInsnLayout;
-  vector<int> insnAddr;
-  vector<string> strInsns;
+  CodeIndex index;
+  vector<const char*> operands;
+  vector<const char*> literals;
   vector<DexInstruction> insns;
   DexValue* valInsns = getParameter(annon, "insns")->value.val_array;
   for(DexValue* val = valInsns; !dxc_is_sentinel_value(val); ++val) {
     DexInstruction in;
     memset(&in, 0, sizeof(in));
-    string sin = val->value.val_str->s;
+    const char* sin = val->value.val_str->s;
+    InsnText text(sin);
 
     // Find and strip label if present.
-    int colonPos = sin.find(':');
-    int atPos = sin.find('@');
-    if(colonPos != -1 && (atPos == -1 || colonPos < atPos)) {
-      insnLayout[strip(sin.substr(0, colonPos))] = pos;
-      while(colonPos + 1 < sin.size() && isspace(sin[colonPos + 1])) colonPos++;
-      sin = sin.substr(colonPos + 1);
+    int insn = index.add_insn(pos);
+    const char* colon = strchr(sin, ':');
+    const char* at = strchr(sin, '@');
+    if(colon && (!at || colon < at)) {
+      const char* a = sin;
+      const char* b = colon;
+      while(a < b && isspace((unsigned char)*a)) a++;
+      while(a < b && isspace((unsigned char)b[-1])) b--;
+      index.add_label(a, b - a, insn);
+      text.p = colon + 1;
     }
-    addrInsnLayout[pos] = val - valInsns;
-    insnAddr.push_back(pos);
+    text.skip_space();
 
     // Find and map mnemonic to opcode.
-    int spacePos = 0;
-    while(spacePos < sin.size() && !isspace(sin[spacePos])) spacePos++;
-    string mnemonic = sin.substr(0, spacePos);
-    while(spacePos < sin.size() && isspace(sin[spacePos])) spacePos++;
-    sin = sin.substr(spacePos);
-
-    if(mnemonicMp.find(mnemonic) == mnemonicMp.end()) {
-      fprintf(stderr, "%s.%s:%d Unknown mnemonic %s\n", cl->name->s,
-              method->name->s, val - valInsns, mnemonic.c_str());
-      exit(1);
+    size_t n;
+    const char* name = text.token(&n);
+    int opcode = mnemonics.find(name, n);
+    if(opcode == -1) {
+      log.report(cl, method, "%d Unknown mnemonic %.*s", insn, (int)n, name);
+      operands.push_back(NULL);
+    } else {
+      in.opcode = opcode;
+      operands.push_back(text.p);
     }
-    in.opcode = mnemonicMp[mnemonic];
     pos += dxc_insn_width(&in);
-    strInsns.push_back(sin);
     insns.push_back(in);
   }
 
+  literals.resize(operands.size(), NULL);
   int curPos = 0;
-  for(int i = 0; i < strInsns.size(); i++) {
-    string& sin = strInsns[i];
-    bool isRange = *dex_opcode_formats[insns[i].opcode].format_id == 'r';
-    bool isVariable = *dex_opcode_formats[insns[i].opcode].format_id == '5';
+  for(int i = 0; i < operands.size(); i++) {
+    int insnPos = curPos;
+    curPos += dxc_insn_width(&insns[i]);
+    if(!operands[i]) continue;
+
+    InsnText text(operands[i]);
+    const char* format = dex_opcode_formats[insns[i].opcode].format_id;
+    bool isRange = *format == 'r';
+    bool isVariable = *format == '5';
 
     // Parse in the registers.
-    for(int j = 0; ((isVariable || isRange) && !sin.empty() && sin[0] == 'v') ||
-                   j < dxc_num_registers(&insns[i]); j++) {
+    bool ok = true;
+    for(int j = 0; ok && (((isVariable || isRange) && *text.p == 'v') ||
+                          j < dxc_num_registers(&insns[i])); j++) {
       dxc_set_num_registers(&insns[i], j + 1);
 
-      int spacePos = 0;
-      while(spacePos < sin.size() && !isspace(sin[spacePos])) spacePos++;
-      string sreg = sin.substr(0, spacePos);
-      while(spacePos < sin.size() && isspace(sin[spacePos])) spacePos++;
-      sin = sin.substr(spacePos);
-
-      bool ok = sreg.size() > 1 && sreg[0] == 'v';
-      int reg = 0;
-      for(int k = 1; ok && k < sreg.size(); k++) {
-        char ch = sreg[k];
-        reg *= 16;
-        if('0' <= ch && ch <= '9') reg += ch - '0';
-        else if('a' <= ch && ch <= 'f') reg += 10 + ch - 'a';
-        else if('A' <= ch && ch <= 'F') reg += 10 + ch - 'A';
-        else ok = false;
-      }
-      if(!ok) {
-        fprintf(stderr, "%s.%s:%d Failed to find register %d\n", cl->name->s,
-                method->name->s, i, j);
-        exit(1);
-      }
-      if(isRange && j != 0) {
+      size_t n;
+      const char* sreg = text.token(&n);
+      unsigned long long reg;
+      if(n < 2 || *sreg != 'v' || !parse_number(sreg + 1, n - 1, 16, &reg)) {
+        log.report(cl, method, "%d Failed to find register %d", i, j);
+        ok = false;
+      } else if(isRange && j != 0) {
         if(reg != dxc_get_register(&insns[i], 0) + j) {
-          fprintf(stderr, "%s.%s:%d Range registers must be consecutive\n",
-                  cl->name->s, method->name->s, i);
-          exit(1);
+          log.report(cl, method, "%d Range registers must be consecutive", i);
+          ok = false;
         }
-      } else if(dxc_set_register(&insns[i], j, reg) == -1) {
-        fprintf(stderr, "%s.%s:%d Couldn't encode register v%X in slot %d\n",
-                cl->name->s, method->name->s, i, reg, j);
-        exit(1);
+      } else if(reg > 0xFFFF || dxc_set_register(&insns[i], j, reg) == -1) {
+        log.report(cl, method, "%d Couldn't encode register v%llX in slot %d",
+                   i, reg, j);
+        ok = false;
       }
     }
+    if(!ok) continue;
 
     // Handler special types.
     switch(dex_opcode_formats[insns[i].opcode].specialType) {
       case SPECIAL_CONSTANT: {
-        unsigned long long x = 0;
-        bool ok = sin.size() > 1 && sin[0] == '#';
-        bool neg = ok && sin[1] == '-' && sin.size() > 2;
-        for(int j = neg ? 2 : 1; ok && j < sin.size(); j++) {
-          x *= 10;
-          if('0' <= sin[j] && sin[j] <= '9') x += sin[j] - '0';
-          else ok = false;
-        }
-        if(!ok) {
-          fprintf(stderr, "%s.%s:%d Expected numeric literal\n",
-                  cl->name->s, method->name->s, i);
-          exit(1);
+        unsigned long long x;
+        bool hash = text.operand("#");
+        bool neg = hash && text.operand("-");
+        if(!hash || !parse_number(text.p, strlen(text.p), 10, &x)) {
+          log.report(cl, method, "%d Expected numeric literal", i);
+          break;
         }
         insns[i].special.constant = neg ? -x : x;
       } break;
       case SPECIAL_TARGET: {
         if(insns[i].opcode == OP_FILL_ARRAY_DATA) {
-          if(sin.size() < 6 || sin.substr(0, 5) != "data@") {
-            fprintf(stderr, "%s.%s:%d Expected data\n",
-                    cl->name->s, method->name->s, i);
-            exit(1);
+          int x = payload_ref(text, "data@", dataVals.size());
+          if(x == -1) {
+            log.report(cl, method, "%d Expected data", i);
+            break;
           }
-          int x = 0;
-          bool ok = true;
-          for(int j = 5; j < sin.size(); j++) {
-            x *= 10;
-            if('0' <= sin[j] && sin[j] <= '9') x += sin[j] - '0';
-            else ok = false;
-          }
-          if(!ok || x < 0 || x >= dataVals.size()) {
-            fprintf(stderr, "%s.%s:%d Expected data\n",
-                    cl->name->s, method->name->s, i);
-            exit(1);
-          }
-          vector<dx_ulong> data;
-          for(DexValue* val =
+          DexValue* valData =
               getParameter(dataVals[x], "data")->value.val_array;
-              !dxc_is_sentinel_value(val); ++val) {
-            data.push_back(val->value.val_long);
-          }
+          dx_uint count = count_values(valData);
           DexInstruction tin;
           tin.opcode = OP_PSUEDO;
           tin.hi_byte = PSUEDO_OP_FILL_DATA_ARRAY;
           int elementWidth = tin.special.fill_data_array.element_width =
               getParameter(dataVals[x], "elementWidth")->value.val_int;
-          tin.special.fill_data_array.size = data.size();
+          tin.special.fill_data_array.size = count;
           dx_ubyte* arr = tin.special.fill_data_array.data = (dx_ubyte*)
-              malloc(elementWidth * data.size());
-          for(int j = 0; j < data.size(); j++) {
+              malloc(elementWidth * count);
+          for(dx_uint j = 0; j < count; j++) {
+            dx_ulong data = valData[j].value.val_long;
             switch(elementWidth) {
-              case 1: *arr = (dx_ubyte)data[j]; break;
-              case 2: *(dx_ushort*)arr = (dx_ushort)data[j]; break;
-              case 4: *(dx_uint*)arr = (dx_uint)data[j]; break;
-              case 8: *(dx_ulong*)arr = (dx_ulong)data[j]; break;
+              case 1: *arr = (dx_ubyte)data; break;
+              case 2: *(dx_ushort*)arr = (dx_ushort)data; break;
+              case 4: *(dx_uint*)arr = (dx_uint)data; break;
+              case 8: *(dx_ulong*)arr = (dx_ulong)data; break;
             }
             arr += elementWidth;
           }
           insns.push_back(tin);
-          insns[i].special.target = pos - curPos;
+          insns[i].special.target = pos - insnPos;
           pos += dxc_insn_width(&tin);
         } else if(insns[i].opcode == OP_PACKED_SWITCH) {
-          if(sin.size() < 8 || sin.substr(0, 7) != "packed@") {
-            fprintf(stderr, "%s.%s:%d Expected packed\n",
-                    cl->name->s, method->name->s, i);
-            exit(1);
-          }
-          int x = 0;
-          bool ok = true;
-          for(int j = 7; j < sin.size(); j++) {
-            x *= 10;
-            if('0' <= sin[j] && sin[j] <= '9') x += sin[j] - '0';
-            else ok = false;
+          int x = payload_ref(text, "packed@", packedSwitchVals.size());
+          if(x == -1) {
+            log.report(cl, method, "%d Expected packed", i);
+            break;
           }
-          if(!ok || x < 0 || x >= packedSwitchVals.size()) {
-            fprintf(stderr, "%s.%s:%d Expected packed\n",
-                    cl->name->s, method->name->s, i);
-            exit(1);
-          }
-          vector<string> targets;
-          for(DexValue* val =
+          DexValue* valTargets =
               getParameter(packedSwitchVals[x], "targets")->value.val_array;
-              !dxc_is_sentinel_value(val); ++val) {
-            targets.push_back(val->value.val_str->s);
-          }
+          dx_uint count = count_values(valTargets);
           DexInstruction tin;
           tin.opcode = OP_PSUEDO;
           tin.hi_byte = PSUEDO_OP_PACKED_SWITCH;
-          tin.special.packed_switch.size = targets.size();
+          tin.special.packed_switch.size = count;
           tin.special.packed_switch.first_key =
               getParameter(packedSwitchVals[x], "firstKey")->value.val_int;
           tin.special.packed_switch.targets =
-              (dx_int*)malloc(targets.size() * sizeof(dx_int));
-          for(int j = 0; j < targets.size(); j++) {
-            typeof(insnLayout.begin()) it = insnLayout.find(targets[j]);
-            if(it == insnLayout.end()) {
-              fprintf(stderr, "%s.%s:%d Couldn't find label %s\n",
-                      cl->name->s, method->name->s, i, targets[j].c_str());
-              exit(1);
+              (dx_int*)malloc(count * sizeof(dx_int));
+          for(dx_uint j = 0; j < count; j++) {
+            const char* label = valTargets[j].value.val_str->s;
+            int target = index.find_label(label);
+            if(target == -1) {
+              log.report(cl, method, "%d Couldn't find label %s", i, label);
+              ok = false;
+              continue;
             }
-            tin.special.packed_switch.targets[j] = it->second - curPos;
+            tin.special.packed_switch.targets[j] =
+                index.insn_offsets[target] - insnPos;
+          }
+          if(!ok) {
+            free(tin.special.packed_switch.targets);
+            break;
           }
           insns.push_back(tin);
-          insns[i].special.target = pos - curPos;
+          insns[i].special.target = pos - insnPos;
           pos += dxc_insn_width(&tin);
         } else if(insns[i].opcode == OP_SPARSE_SWITCH) {
-          if(sin.size() < 8 || sin.substr(0, 7) != "sparse@") {
-            fprintf(stderr, "%s.%s:%d Expected sparse\n",
-                    cl->name->s, method->name->s, i);
-            exit(1);
-          }
-          int x = 0;
-          bool ok = true;
-          for(int j = 7; j < sin.size(); j++) {
-            x *= 10;
-            if('0' <= sin[j] && sin[j] <= '9') x += sin[j] - '0';
-            else ok = false;
+          int x = payload_ref(text, "sparse@", sparseSwitchVals.size());
+          if(x == -1) {
+            log.report(cl, method, "%d Expected sparse", i);
+            break;
           }
-          if(!ok || x < 0 || x >= sparseSwitchVals.size()) {
-            fprintf(stderr, "%s.%s:%d Expected sparse\n",
-                    cl->name->s, method->name->s, i);
-            exit(1);
-          }
-          vector<int> keys;
-          vector<string> targets;
-          for(DexValue* val =
+          DexValue* valKeys =
               getParameter(sparseSwitchVals[x], "keys")->value.val_array;
-              !dxc_is_sentinel_value(val); ++val) {
-            keys.push_back(val->value.val_int);
-          }
-          for(DexValue* val =
+          DexValue* valTargets =
               getParameter(sparseSwitchVals[x], "targets")->value.val_array;
-              !dxc_is_sentinel_value(val); ++val) {
-            targets.push_back(val->value.val_str->s);
-          }
-          if(keys.size() != targets.size()) {
-            fprintf(stderr, "%s.%s:%d Keys and targets of different length\n",
-                    cl->name->s, method->name->s, i);
-            exit(1);
+          dx_uint count = count_values(valKeys);
+          if(count != count_values(valTargets)) {
+            log.report(cl, method, "%d Keys and targets of different length",
+                       i);
+            break;
           }
           DexInstruction tin;
           tin.opcode = OP_PSUEDO;
           tin.hi_byte = PSUEDO_OP_SPARSE_SWITCH;
-          tin.special.sparse_switch.size = keys.size();
+          tin.special.sparse_switch.size = count;
           tin.special.sparse_switch.keys =
-              (dx_int*)malloc(keys.size() * sizeof(dx_int));
+              (dx_int*)malloc(count * sizeof(dx_int));
           tin.special.sparse_switch.targets =
-              (dx_int*)malloc(targets.size() * sizeof(dx_int));
-          for(int j = 0; j < keys.size(); j++) {
-            tin.special.sparse_switch.keys[j] = keys[j];
-            typeof(insnLayout.begin()) it = insnLayout.find(targets[j]);
-            if(it == insnLayout.end()) {
-              fprintf(stderr, "%s.%s:%d Couldn't find label %s\n",
-                      cl->name->s, method->name->s, i, targets[j].c_str());
-              exit(1);
+              (dx_int*)malloc(count * sizeof(dx_int));
+          for(dx_uint j = 0; j < count; j++) {
+            tin.special.sparse_switch.keys[j] = valKeys[j].value.val_int;
+            const char* label = valTargets[j].value.val_str->s;
+            int target = index.find_label(label);
+            if(target == -1) {
+              log.report(cl, method, "%d Couldn't find label %s", i, label);
+              ok = false;
+              continue;
             }
-            tin.special.sparse_switch.targets[j] = it->second - curPos;
+            tin.special.sparse_switch.targets[j] =
+                index.insn_offsets[target] - insnPos;
+          }
+          if(!ok) {
+            free(tin.special.sparse_switch.keys);
+            free(tin.special.sparse_switch.targets);
+            break;
           }
           insns.push_back(tin);
-          insns[i].special.target = pos - curPos;
+          insns[i].special.target = pos - insnPos;
           pos += dxc_insn_width(&tin);
         } else {
-          if(sin.size() < 5 || sin.substr(0, 5) != "insn@") {
-            fprintf(stderr, "%s.%s:%d Expected label\n",
-                    cl->name->s, method->name->s, i);
-            exit(1);
+          if(!text.operand("insn@")) {
+            log.report(cl, method, "%d Expected label", i);
+            break;
           }
-          typeof(insnLayout.begin()) it = insnLayout.find(sin.substr(5));
-          if(it == insnLayout.end()) {
-            fprintf(stderr, "%s.%s:%d Couldn't find label %s\n",
-                    cl->name->s, method->name->s, i, sin.substr(5).c_str());
-            exit(1);
+          int target = index.find_label(text.p);
+          if(target == -1) {
+            log.report(cl, method, "%d Couldn't find label %s", i, text.p);
+            break;
           }
-          insns[i].special.target = it->second - curPos;
+          insns[i].special.target = index.insn_offsets[target] - insnPos;
         }
       } break;
       case SPECIAL_STRING: {
-        if(sin.size() < 7 || sin.substr(0, 7) != "string@") {
-          fprintf(stderr, "%s.%s:%d Expected string literal\n",
-                  cl->name->s, method->name->s, i);
-          exit(1);
+        if(!text.operand("string@")) {
+          log.report(cl, method, "%d Expected string literal", i);
+          break;
         }
-        insns[i].special.str = dxc_induct_str(sin.substr(7).c_str());
+        literals[i] = text.p;
       } break;
       case SPECIAL_TYPE: {
-        if(sin.size() < 5 || sin.substr(0, 5) != "type@") {
-          fprintf(stderr, "%s.%s:%d Expected type literal\n",
-                  cl->name->s, method->name->s, i);
-          exit(1);
+        if(!text.operand("type@")) {
+          log.report(cl, method, "%d Expected type literal", i);
+          break;
         }
-        insns[i].special.type =
-            dxc_induct_str(dxc_type_name(sin.substr(5).c_str()));
+        literals[i] = text.p;
       } break;
       case SPECIAL_FIELD: {
-        if(sin.size() < 6 || sin.substr(0, 6) != "field@") {
-          fprintf(stderr, "%s.%s:%d Expected field\n",
-                  cl->name->s, method->name->s, i);
-          exit(1);
+        if(!text.operand("field@")) {
+          log.report(cl, method, "%d Expected field", i);
+          break;
         }
-        typeof(field_map.begin()) it = field_map.find(sin.substr(6));
-        if(it == field_map.end()) {
-          fprintf(stderr, "%s.%s:%d Couldn't find field alias %s\n",
-                  cl->name->s, method->name->s, i, sin.substr(6).c_str());
-          exit(1);
+        const ref_field* fld = aliases.find_field(text.p);
+        if(!fld) {
+          log.report(cl, method, "%d Couldn't find field alias %s", i, text.p);
+          break;
         }
-        insns[i].special.field.defining_class =
-            dxc_copy_str(it->second.defining_class);
-        insns[i].special.field.name = dxc_copy_str(it->second.name);
-        insns[i].special.field.type = dxc_copy_str(it->second.type);
+        insns[i].special.field = *fld;
       } break;
       case SPECIAL_METHOD: {
-        if(sin.size() < 7 || sin.substr(0, 7) != "method@") {
-          fprintf(stderr, "%s.%s:%d Expected method\n",
-                  cl->name->s, method->name->s, i);
-          exit(1);
+        if(!text.operand("method@")) {
+          log.report(cl, method, "%d Expected method", i);
+          break;
         }
-        typeof(method_map.begin()) it = method_map.find(sin.substr(7));
-        if(it == method_map.end()) {
-          fprintf(stderr, "%s.%s:%d Couldn't find method alias %s\n",
-                  cl->name->s, method->name->s, i, sin.substr(7).c_str());
-          exit(1);
+        const ref_method* mtd = aliases.find_method(text.p);
+        if(!mtd) {
+          log.report(cl, method, "%d Couldn't find method alias %s", i,
+                     text.p);
+          break;
         }
-        insns[i].special.method.defining_class =
-            dxc_copy_str(it->second.defining_class);
-        insns[i].special.method.name = dxc_copy_str(it->second.name);
-        insns[i].special.method.prototype =
-            dxc_copy_strstr(it->second.prototype);
+        insns[i].special.method = *mtd;
       } break;
     }
-    curPos += dxc_insn_width(&insns[i]);
   }
   code->insns_count = insns.size();
   code->insns = (DexInstruction*)malloc(insns.size() * sizeof(DexInstruction));
@@ -399,121 +699,67 @@ DexCode* reassemble_code(DexClass* cl, DexMethod* method, DexAnnotation* annon,
   for(int i = 0; i < tryBlocks.size(); i++) {
     DexAnnotation* tannon = tryBlocks[i];
     DexTryBlock* tryb = code->tries + i;
-    string startInsn = getParameter(tannon, "startInsn")->value.val_str->s;
-    typeof(insnLayout.begin()) it = insnLayout.find(startInsn);
-    if(it == insnLayout.end()) {
-      fprintf(stderr, "%s.%s:try:%d Couldn't find label %s\n",
-              cl->name->s, method->name->s, i, startInsn.c_str());
-      exit(1);
+    const char* startInsn =
+        getParameter(tannon, "startInsn")->value.val_str->s;
+    int firstIn = index.find_label(startInsn);
+    if(firstIn == -1) {
+      log.report(cl, method, "try:%d Couldn't find label %s", i, startInsn);
+      continue;
     }
-    tryb->start_addr = it->second;
+    tryb->start_addr = index.insn_offsets[firstIn];
 
     int insnLength = getParameter(tannon, "insnLength")->value.val_int;
     if(insnLength <= 0) {
-      fprintf(stderr, "%s.%s:try:%d Expected positive insnLength\n",
-              cl->name->s, method->name->s, i);
-      exit(1);
+      log.report(cl, method, "try:%d Expected positive insnLength", i);
+      continue;
     }
-    int lastIn = addrInsnLayout[tryb->start_addr] + insnLength - 1;
-    tryb->insn_count = insnAddr[lastIn] + dxc_insn_width(&insns[lastIn]) -
-                       tryb->start_addr;
-
-    vector<DexAnnotation*> handlerVals;
-    for(DexValue* val = getParameter(tannon, "handlers")->value.val_array;
-        !dxc_is_sentinel_value(val); ++val) {
-      handlerVals.push_back(val->value.val_annotation);
-    }
-    tryb->handlers = (DexHandler*)malloc(sizeof(DexHandler) *
-                                         (handlerVals.size() + 1));
-    for(int j = 0; j < handlerVals.size(); j++) {
-      tryb->handlers[j].type = dxc_copy_str(
-          getParameter(handlerVals[j], "catchType")->value.val_type);
-      string target = getParameter(handlerVals[j], "target")->value.val_str->s;
-      it = insnLayout.find(target);
-      if(it == insnLayout.end()) {
-        fprintf(stderr, "%s.%s:try:%d;handler:%d Couldn't find label %s\n",
-                cl->name->s, method->name->s, i, j, target.c_str());
-        exit(1);
+    int lastIn = firstIn + insnLength - 1;
+    if(lastIn >= operands.size()) {
+      log.report(cl, method, "try:%d insnLength runs past the code", i);
+      continue;
+    }
+    tryb->insn_count = index.insn_offsets[lastIn] +
+                       dxc_insn_width(&insns[lastIn]) - tryb->start_addr;
+
+    DexValue* valHandlers = getParameter(tannon, "handlers")->value.val_array;
+    dx_uint count = count_values(valHandlers);
+    tryb->handlers = (DexHandler*)malloc(sizeof(DexHandler) * (count + 1));
+    for(dx_uint j = 0; j < count; j++) {
+      DexAnnotation* hannon = valHandlers[j].value.val_annotation;
+      tryb->handlers[j].type =
+          getParameter(hannon, "catchType")->value.val_type;
+      const char* target = getParameter(hannon, "target")->value.val_str->s;
+      int targetIn = index.find_label(target);
+      if(targetIn == -1) {
+        log.report(cl, method, "try:%d;handler:%d Couldn't find label %s",
+                   i, j, target);
+        continue;
       }
-      tryb->handlers[j].addr = it->second;
+      tryb->handlers[j].addr = index.insn_offsets[targetIn];
     }
-    dxc_make_sentinel_handler(tryb->handlers + handlerVals.size());
+    dxc_make_sentinel_handler(tryb->handlers + count);
 
-    string catchAllTarget =
+    const char* catchAllTarget =
         getParameter(tannon, "catchAllTarget")->value.val_str->s;
-    if(!catchAllTarget.empty()) {
-      it = insnLayout.find(catchAllTarget);
-      if(it == insnLayout.end()) {
-        fprintf(stderr, "%s.%s:try:%d Couldn't find label %s\n",
-                cl->name->s, method->name->s, i, catchAllTarget.c_str());
-        exit(1);
+    if(*catchAllTarget) {
+      int targetIn = index.find_label(catchAllTarget);
+      if(targetIn == -1) {
+        log.report(cl, method, "try:%d Couldn't find label %s", i,
+                   catchAllTarget);
+        continue;
       }
       tryb->catch_all_handler = (DexHandler*)malloc(sizeof(DexHandler));
       tryb->catch_all_handler->type = NULL;
-      tryb->catch_all_handler->addr = it->second;
+      tryb->catch_all_handler->addr = index.insn_offsets[targetIn];
     } else {
       tryb->catch_all_handler = NULL;
     }
   }
   dxc_make_sentinel_try_block(code->tries + tryBlocks.size());
-  
-  return code;
-}
 
-map<string, ref_method> build_method_alias_map(DexValue* valArray) {
-  map<string, ref_method> ret;
-  if(valArray)
-  for(DexValue* val = valArray->value.val_array;
-      !dxc_is_sentinel_value(val); ++val) {
-    DexValue* valAlias = getParameter(val->value.val_annotation, "alias");
-    DexValue* valClazz = getParameter(val->value.val_annotation, "clazz");
-    DexValue* valName = getParameter(val->value.val_annotation, "name");
-    DexValue* valPrototype = getParameter(val->value.val_annotation,
-                                          "prototype");
-
-    string alias = valAlias->value.val_str->s;
-    string clazz = valClazz->value.val_type->s;
-    string name = valName->value.val_str->s;
-    vector<string> prototype;
-    for(DexValue* proto = valPrototype->value.val_array;
-        !dxc_is_sentinel_value(proto); ++proto) {
-      prototype.push_back(proto->value.val_type->s);
-    }
-
-    ref_method mtd;
-    mtd.name = dxc_induct_str(name.c_str());
-    mtd.defining_class = dxc_induct_str(clazz.c_str());
-    mtd.prototype = dxc_create_strstr(prototype.size());
-    for(int i = 0; i < prototype.size(); i++) {
-      mtd.prototype->s[i] = dxc_induct_str(prototype[i].c_str());
-    }
-    ret[alias] = mtd;
-  }
-  return ret;
-}
-
-map<string, ref_field> build_field_alias_map(DexValue* valArray) {
-  map<string, ref_field> ret;
-  if(valArray)
-  for(DexValue* val = valArray->value.val_array;
-      !dxc_is_sentinel_value(val); ++val) {
-    DexValue* valAlias = getParameter(val->value.val_annotation, "alias");
-    DexValue* valClazz = getParameter(val->value.val_annotation, "clazz");
-    DexValue* valName = getParameter(val->value.val_annotation, "name");
-    DexValue* valType = getParameter(val->value.val_annotation, "type");
-
-    string alias = valAlias->value.val_str->s;
-    string clazz = valClazz->value.val_type->s;
-    string name = valName->value.val_str->s;
-    string type = valType->value.val_type->s;
-
-    ref_field fld;
-    fld.name = dxc_induct_str(name.c_str());
-    fld.defining_class = dxc_induct_str(clazz.c_str());
-    fld.type = dxc_induct_str(type.c_str());
-    ret[alias] = fld;
-  }
-  return ret;
+  lock_guard<mutex> guard(dxcut_lock);
+  own_strings(code, literals);
+  return code;
 }
 
 static void removeAnnotationAndDelete(DexAnnotation* annon) {
@@ -524,21 +770,23 @@ static void removeAnnotationAndDelete(DexAnnotation* annon) {
   dxc_make_sentinel_annotation(--annon);
 }
 
-void reassemble_class(DexClass* cl) {
-  map<string, ref_method> method_alias_map;
-  map<string, ref_field> field_alias_map;
-  for(DexAnnotation* annon = cl->annotations;
-      !dxc_is_sentinel_annotation(annon); ++annon) {
-    if(!strcmp("Lorg/dxcut/dxdasm/DxdasmAliases;", annon->type->s)) {
-      method_alias_map = build_method_alias_map(
-          getParameter(annon, "methodAliases"));
-      field_alias_map = build_field_alias_map(
-          getParameter(annon, "fieldAliases"));
-      removeAnnotationAndDelete(annon--);
-    } else if(!strcmp("Lorg/dxcut/dxdasm/DxdasmAccess;", annon->type->s)) {
-      cl->access_flags = (DexAccessFlags)
-          getParameter(annon, "accessFlags")->value.val_int;
-      removeAnnotationAndDelete(annon--);
+// Classes don't depend on each other, so several can be reassembled at once.
+// Only the steps touching libdxcut's string table take dxcut_lock.
+void reassemble_class(DexClass* cl, ErrorLog& log) {
+  AliasSymbols aliases;
+  {
+    lock_guard<mutex> guard(dxcut_lock);
+    for(DexAnnotation* annon = cl->annotations;
+        !dxc_is_sentinel_annotation(annon); ++annon) {
+      if(!strcmp("Lorg/dxcut/dxdasm/DxdasmAliases;", annon->type->s)) {
+        aliases.add_methods(getParameter(annon, "methodAliases"));
+        aliases.add_fields(getParameter(annon, "fieldAliases"));
+        removeAnnotationAndDelete(annon--);
+      } else if(!strcmp("Lorg/dxcut/dxdasm/DxdasmAccess;", annon->type->s)) {
+        cl->access_flags = (DexAccessFlags)
+            getParameter(annon, "accessFlags")->value.val_int;
+        removeAnnotationAndDelete(annon--);
+      }
     }
   }
   for(DexAnnotation* annon = cl->annotations;
@@ -555,15 +803,16 @@ void reassemble_class(DexClass* cl) {
     for(DexAnnotation* annon = mtd->annotations;
         !dxc_is_sentinel_annotation(annon); ++annon) {
       if(!strcmp("Lorg/dxcut/dxdasm/DxdasmMethod;", annon->type->s)) {
-        DexCode* old_code = mtd->code_body;
-        mtd->code_body = reassemble_code(cl, mtd, annon,
-            method_alias_map, field_alias_map);
-        mtd->code_body->ins_size = old_code->ins_size;
-        dxc_free_code(old_code);
+        DexCode* code = reassemble_code(cl, mtd, annon, aliases, log);
+        lock_guard<mutex> guard(dxcut_lock);
+        code->ins_size = mtd->code_body->ins_size;
+        dxc_free_code(mtd->code_body);
+        mtd->code_body = code;
         removeAnnotationAndDelete(annon--);
       } else if(!strcmp("Lorg/dxcut/dxdasm/DxdasmAccess;", annon->type->s)) {
         mtd->access_flags = (DexAccessFlags)
             getParameter(annon, "accessFlags")->value.val_int;
+        lock_guard<mutex> guard(dxcut_lock);
         removeAnnotationAndDelete(annon--);
       }
     }
@@ -577,35 +826,553 @@ void reassemble_class(DexClass* cl) {
       if(!strcmp("Lorg/dxcut/dxdasm/DxdasmAccess;", annon->type->s)) {
         fld->access_flags = (DexAccessFlags)
             getParameter(annon, "accessFlags")->value.val_int;
+        lock_guard<mutex> guard(dxcut_lock);
         removeAnnotationAndDelete(annon--);
       }
     }
   }
+
+  lock_guard<mutex> guard(dxcut_lock);
+  aliases.clear();
 }
 
-int main(int argc, char** argv) {
-  if(argc != 3) {
-    fprintf(stderr, "Usage %s input.dex output.dex\n", *argv);
-    return 1;
+static void usage(const char* prog) {
+  fprintf(stderr, "Usage %s [-j threads] [--source=path]... [--watch] "
+                  "[--times=file] [--stats[=file.json]] [--stats-top=n] "
+                  "input.dex output.dex\n", prog);
+  fprintf(stderr, "  --source reads the Dxdasm annotations straight from the "
+                  "Java or dxasm\n"
+                  "  dxdasm wrote (a directory, .java or .dxasm file) instead "
+                  "of from input.dex,\n"
+                  "  which is then the dex dxdasm read.\n");
+  fprintf(stderr, "  --watch keeps running and rewrites output.dex whenever "
+                  "input.dex or the\n"
+                  "  source changes, redoing only the classes that "
+                  "changed.\n");
+}
+
+// Counts the methods and instructions of a class for --stats.
+static void count_class(DexClass* cl, dx_ulong& methods, dx_ulong& insns) {
+  for(int i = 0; i < 2; i++) {
+    for(DexMethod* mtd = i ? cl->virtual_methods : cl->direct_methods;
+        !dxc_is_sentinel_method(mtd); mtd++) {
+      methods++;
+      if(mtd->code_body) insns += mtd->code_body->insns_count;
+    }
+  }
+}
+
+// The instructions in the DxdasmMethod annotations of a class, used to hand
+// out the biggest classes first.
+static dx_uint class_weight(DexClass* cl) {
+  dx_uint weight = 0;
+  for(int i = 0; i < 2; i++) {
+    for(DexMethod* mtd = i ? cl->virtual_methods : cl->direct_methods;
+        !dxc_is_sentinel_method(mtd); mtd++) {
+      for(DexAnnotation* annon = mtd->annotations;
+          !dxc_is_sentinel_annotation(annon); ++annon) {
+        if(strcmp("Lorg/dxcut/dxdasm/DxdasmMethod;", annon->type->s)) {
+          continue;
+        }
+        DexValue* insns = getParameter(annon, "insns");
+        if(insns) weight += count_values(insns->value.val_array);
+      }
+    }
   }
-  computeMnemonicMap();
+  return weight;
+}
+
+struct ReasmJob {
+  DexClass* cl;
+  // Position in the dex file, which is the order errors are reported in.
+  size_t seq;
+  dx_uint weight;
+};
+
+struct ReasmQueue {
+  vector<ReasmJob> jobs;
+  atomic<size_t> next;
+  // One per class, in dex file order.
+  vector<ErrorLog> logs;
+  // Set with --stats.
+  RunStats* stats;
+};
+
+static void reassemble_worker(ReasmQueue* queue) {
+  while(true) {
+    size_t i = queue->next++;
+    if(i >= queue->jobs.size()) break;
+    ReasmJob& job = queue->jobs[i];
+    if(!queue->stats) {
+      reassemble_class(job.cl, queue->logs[job.seq]);
+      continue;
+    }
+    double start = wall_seconds();
+    reassemble_class(job.cl, queue->logs[job.seq]);
+    dx_ulong methods = 0, insns = 0;
+    count_class(job.cl, methods, insns);
+    queue->stats->count("classes", 1);
+    queue->stats->count("methods", methods);
+    queue->stats->count("instructions", insns);
+    queue->stats->add_class(type_nice(job.cl->name->s),
+                            wall_seconds() - start, insns);
+  }
+}
+
+static bool heavier(const ReasmJob& a, const ReasmJob& b) {
+  return a.weight > b.weight;
+}
+
+// What to reassemble, from the command line.
+struct ReasmConfig {
+  const char* input;
+  const char* output;
+  vector<const char*> sources;
+  int threads;
+  // Set with --stats.
+  bool stats;
+};
+
+// What --watch keeps of a class of the input between rebuilds.
+struct WatchedClass {
+  // hash_dex_class() and hash_declarations() of the class as read.
+  dx_ulong hash;
+  dx_ulong declarations;
+  // False for the classes strip_classes() drops.
+  bool kept;
+  // The class as last written, if kept.  Owned by WatchState::out.
+  DexClass out;
+};
+
+// The output --watch last wrote and what it was built from, so a rebuild
+// only has to redo the classes whose input changed.
+struct WatchState {
+  WatchState() : redone(0), out(NULL) {}
+  ~WatchState();
+
+  // The classes of the input dex in order, by their name in it.
+  vector<string> names;
+  map<string, WatchedClass> classes;
+  // With --source, the classes each file had annotations for.
+  map<string, vector<string> > file_classes;
+  // How many classes the last rebuild reassembled.
+  size_t redone;
+  DexFile* out;
+};
 
-  FILE* fin = fopen(argv[1], "r");
-  DexFile* dx = dxc_read_file(fin);
-  fclose(fin);
+WatchState::~WatchState() {
+  if(out) dxc_free_file(out);
+}
+
+static DexFile* read_input(const char* path) {
+  FILE* fin = fopen(path, "r");
+  DexFile* dx = fin ? dxc_read_file(fin) : NULL;
+  if(fin) fclose(fin);
   if(!dx) {
     fprintf(stderr, "Failed to open dex file\n");
-    return 1;
   }
+  return dx;
+}
 
-  for(DexClass* cl = dx->classes; !dxc_is_sentinel_class(cl); ++cl) {
-    reassemble_class(cl);
+// Frees a dex whose classes now belong to another one.
+static void free_dex_shell(DexFile* dx) {
+  dx->classes = (DexClass*)realloc(dx->classes, sizeof(DexClass));
+  dxc_make_sentinel_class(dx->classes);
+  dxc_free_file(dx);
+}
+
+// With --source the annotations javac would have carried over are read from
+// the Java instead.  The dex is sanitized the way dxdasm did it so its names
+// match the source's; strip_classes() undoes that again.  The classes each
+// file annotated are added to 'file_classes'.
+static bool merge_sources(DexFile* dx, const vector<string>& paths,
+                          map<string, vector<string> >& file_classes) {
+  vector<dasmcl> clist;
+  map<string, dasmcl*> clmap;
+  prep_classes(dx, clist, clmap);
+  JavaSourceMerger merger(dx, clmap);
+  bool merged = true;
+  for(int i = 0; i < paths.size(); i++) {
+    merged = merger.merge(paths[i].c_str()) && merged;
+  }
+  file_classes.insert(merger.file_classes.begin(),
+                      merger.file_classes.end());
+  return merged;
+}
+
+// Reassembles 'classes' and prints their errors in that order.  Returns how
+// many there were.
+static int reassemble_classes(const vector<DexClass*>& classes, int threads,
+                              RunStats* stats) {
+  // In parallel mode the heaviest classes are handed out first so a single
+  // large class doesn't end up running alone at the end.
+  ReasmQueue queue;
+  queue.next = 0;
+  queue.stats = stats;
+  for(int i = 0; i < classes.size(); i++) {
+    ReasmJob job;
+    job.cl = classes[i];
+    job.seq = queue.jobs.size();
+    job.weight = threads > 1 ? class_weight(classes[i]) : 0;
+    queue.jobs.push_back(job);
+  }
+  stable_sort(queue.jobs.begin(), queue.jobs.end(), heavier);
+  queue.logs.resize(queue.jobs.size());
+
+  if(threads > queue.jobs.size()) threads = max<size_t>(queue.jobs.size(), 1);
+  vector<thread> workers;
+  for(int i = 1; i < threads; i++) {
+    workers.push_back(thread(reassemble_worker, &queue));
+  }
+  reassemble_worker(&queue);
+  for(int i = 0; i < workers.size(); i++) {
+    workers[i].join();
   }
-  strip_classes(dx);
 
-  FILE* fout = fopen(argv[2], "w");
+  int errors = 0;
+  for(int i = 0; i < queue.logs.size(); i++) {
+    fputs(queue.logs[i].text.c_str(), stderr);
+    errors += queue.logs[i].count;
+  }
+  return errors;
+}
+
+static bool write_output(DexFile* dx, const char* path, RunStats& run_stats) {
+  FILE* fout = fopen(path, "w");
+  if(!fout) {
+    fprintf(stderr, "Failed to write %s\n", path);
+    return false;
+  }
   dxc_write_file(dx, fout);
+  run_stats.count("bytes_written", ftell(fout));
+  run_stats.count("files_created", 1);
   fclose(fout);
-  dxc_free_file(dx);
-  return 0;
+  return true;
+}
+
+// Reassembles all of 'dx' into the output and frees it.  With 'watch' the
+// output is kept there for reassemble_changed() instead, once it's written.
+static bool reassemble_all(const ReasmConfig& cfg, DexFile* dx,
+                           PhaseTimes& times, RunStats& run_stats,
+                           WatchState* watch) {
+  vector<string> names;
+  vector<WatchedClass> watched;
+  if(watch) {
+    for(DexClass* cl = dx->classes; !dxc_is_sentinel_class(cl); ++cl) {
+      WatchedClass wcl;
+      wcl.hash = hash_dex_class(cl);
+      wcl.declarations = hash_declarations(cl);
+      names.push_back(cl->name->s);
+      watched.push_back(wcl);
+    }
+  }
+
+  map<string, vector<string> > file_classes;
+  if(!cfg.sources.empty()) {
+    times.start("source");
+    vector<string> paths(cfg.sources.begin(), cfg.sources.end());
+    if(!merge_sources(dx, paths, file_classes)) {
+      fprintf(stderr, "%s not written\n", cfg.output);
+      dxc_free_file(dx);
+      return false;
+    }
+  }
+
+  times.start("reassemble");
+  vector<DexClass*> classes;
+  for(DexClass* cl = dx->classes; !dxc_is_sentinel_class(cl); ++cl) {
+    classes.push_back(cl);
+  }
+  int errors = reassemble_classes(classes, cfg.threads,
+                                  cfg.stats ? &run_stats : NULL);
+  if(errors) {
+    fprintf(stderr, "%d error%s, %s not written\n", errors,
+            errors == 1 ? "" : "s", cfg.output);
+    dxc_free_file(dx);
+    return false;
+  }
+  times.start("strip");
+  for(int i = 0; i < watched.size(); i++) {
+    watched[i].kept = !is_dxdasm_class(dx->classes[i].name->s);
+  }
+  strip_classes(dx);
+
+  times.start("write");
+  bool written = write_output(dx, cfg.output, run_stats);
+  times.stop();
+  if(!watch || !written) {
+    dxc_free_file(dx);
+    return written;
+  }
+
+  if(watch->out) dxc_free_file(watch->out);
+  watch->classes.clear();
+  DexClass* out = dx->classes;
+  for(int i = 0; i < names.size(); i++) {
+    if(watched[i].kept) watched[i].out = *out++;
+    watch->classes[names[i]] = watched[i];
+  }
+  watch->names.swap(names);
+  watch->file_classes.swap(file_classes);
+  watch->redone = watched.size();
+  watch->out = dx;
+  return true;
+}
+
+static bool is_source_file(const string& path) {
+  size_t dot = path.rfind('.');
+  if(dot == string::npos || path.find('/', dot) != string::npos) return false;
+  return !path.compare(dot, string::npos, ".java") ||
+         !path.compare(dot, string::npos, ".dxasm");
+}
+
+// Rewrites the output after the files in 'changed' changed, reassembling
+// only the classes they affect.  Those are stripped on their own, with the
+// rest of the dex for the renames of references into it.  The renames the
+// unchanged classes got last time depend on what every class declares, so
+// if any declarations changed, or there's no output yet, it all gets
+// reassembled instead.
+static bool reassemble_changed(const ReasmConfig& cfg,
+                               const set<string>& changed,
+                               PhaseTimes& times, RunStats& run_stats,
+                               WatchState& watch) {
+  // The dex is read again even if only the source changed, since the
+  // classes are needed as they were before reassembly and stripping.
+  times.start("read");
+  DexFile* dx = read_input(cfg.input);
+  if(!dx) return false;
+
+  vector<string> names;
+  vector<dx_ulong> hashes;
+  set<string> redo;
+  bool full = !watch.out ||
+              (!cfg.sources.empty() && changed.count(cfg.input));
+  for(DexClass* cl = dx->classes; !dxc_is_sentinel_class(cl); ++cl) {
+    names.push_back(cl->name->s);
+    hashes.push_back(hash_dex_class(cl));
+    typeof(watch.classes.begin()) it = watch.classes.find(names.back());
+    if(it == watch.classes.end() ||
+       it->second.declarations != hash_declarations(cl)) {
+      full = true;
+    } else if(it->second.hash != hashes.back()) {
+      redo.insert(names.back());
+    }
+  }
+  if(full || names != watch.names) {
+    return reassemble_all(cfg, dx, times, run_stats, &watch);
+  }
+
+  map<string, vector<string> > file_classes = watch.file_classes;
+  if(!cfg.sources.empty()) {
+    times.start("source");
+    vector<string> paths;
+    for(typeof(changed.begin()) it = changed.begin(); it != changed.end();
+        ++it) {
+      // What the file, or everything below the directory, annotated before
+      // is redone whether it's still there or not.
+      const string& path = *it;
+      for(typeof(file_classes.begin()) ft = file_classes.lower_bound(path);
+          ft != file_classes.end() &&
+          !ft->first.compare(0, path.size(), path); ) {
+        if(ft->first.size() == path.size() || ft->first[path.size()] == '/') {
+          redo.insert(ft->second.begin(), ft->second.end());
+          file_classes.erase(ft++);
+        } else {
+          ++ft;
+        }
+      }
+      struct stat st;
+      if(stat(path.c_str(), &st)) continue;
+      if(S_ISDIR(st.st_mode) || is_source_file(path) ||
+         find(cfg.sources.begin(), cfg.sources.end(), path) !=
+             cfg.sources.end()) {
+        paths.push_back(path);
+      }
+    }
+    map<string, vector<string> > merged;
+    if(!merge_sources(dx, paths, merged)) {
+      fprintf(stderr, "%s not written\n", cfg.output);
+      dxc_free_file(dx);
+      return false;
+    }
+    for(typeof(merged.begin()) it = merged.begin(); it != merged.end();
+        ++it) {
+      redo.insert(it->second.begin(), it->second.end());
+    }
+    file_classes.insert(merged.begin(), merged.end());
+  }
+  watch.redone = redo.size();
+  if(redo.empty()) {
+    times.stop();
+    dxc_free_file(dx);
+    watch.file_classes.swap(file_classes);
+    return true;
+  }
+
+  times.start("reassemble");
+  vector<DexClass*> classes;
+  for(int i = 0; i < names.size(); i++) {
+    if(redo.count(names[i])) classes.push_back(&dx->classes[i]);
+  }
+  int errors = reassemble_classes(classes, cfg.threads,
+                                  cfg.stats ? &run_stats : NULL);
+  if(errors) {
+    fprintf(stderr, "%d error%s, %s not written\n", errors,
+            errors == 1 ? "" : "s", cfg.output);
+    dxc_free_file(dx);
+    return false;
+  }
+
+  times.start("strip");
+  vector<DexClass> part, rest;
+  vector<bool> kept(names.size());
+  for(int i = 0; i < names.size(); i++) {
+    kept[i] = !is_dxdasm_class(dx->classes[i].name->s);
+    (redo.count(names[i]) ? part : rest).push_back(dx->classes[i]);
+  }
+  part.resize(part.size() + 1);
+  dxc_make_sentinel_class(&part.back());
+  rest.resize(rest.size() + 1);
+  dxc_make_sentinel_class(&rest.back());
+  DexFile part_dx = *dx;
+  DexFile rest_dx = *dx;
+  part_dx.classes = &part[0];
+  rest_dx.classes = &rest[0];
+  strip_classes(&part_dx, &rest_dx);
+
+  // The output takes the stripped classes redone and the unchanged ones as
+  // they were written last time.  The unchanged classes just read go.
+  times.start("write");
+  DexClass* read_classes = dx->classes;
+  dx->classes = (DexClass*)malloc((names.size() + 1) * sizeof(DexClass));
+  DexClass* out = dx->classes;
+  DexClass* stripped = part_dx.classes;
+  for(int i = 0; i < names.size(); i++) {
+    const WatchedClass& wcl = watch.classes[names[i]];
+    if(redo.count(names[i])) {
+      if(kept[i]) *out++ = *stripped++;
+    } else if(wcl.kept) {
+      *out++ = wcl.out;
+    }
+  }
+  dxc_make_sentinel_class(out);
+  bool written = write_output(dx, cfg.output, run_stats);
+  times.stop();
+
+  for(int i = 0; i < names.size(); i++) {
+    if(!redo.count(names[i])) dxc_free_class(&read_classes[i]);
+  }
+  free(read_classes);
+  if(!written) {
+    for(DexClass* cl = part_dx.classes; !dxc_is_sentinel_class(cl); ++cl) {
+      dxc_free_class(cl);
+    }
+    free_dex_shell(dx);
+    return false;
+  }
+
+  stripped = part_dx.classes;
+  for(int i = 0; i < names.size(); i++) {
+    if(!redo.count(names[i])) continue;
+    WatchedClass& wcl = watch.classes[names[i]];
+    if(wcl.kept) dxc_free_class(&wcl.out);
+    wcl.hash = hashes[i];
+    wcl.kept = kept[i];
+    if(wcl.kept) wcl.out = *stripped++;
+  }
+  free_dex_shell(watch.out);
+  watch.out = dx;
+  watch.file_classes.swap(file_classes);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  static const struct option long_options[] = {
+    {"times", required_argument, NULL, 'T'},
+    {"stats", optional_argument, NULL, 's'},
+    {"stats-top", required_argument, NULL, 'n'},
+    {"source", required_argument, NULL, 'S'},
+    {"watch", no_argument, NULL, 'w'},
+    {NULL, 0, NULL, 0}
+  };
+  ReasmConfig cfg;
+  cfg.threads = 1;
+  cfg.stats = false;
+  const char* times_path = NULL;
+  const char* stats_path = NULL;
+  int stats_top = 10;
+  bool watch = false;
+  int opt;
+  while((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+    switch(opt) {
+      case 'T':
+        times_path = optarg;
+        break;
+      case 's':
+        cfg.stats = true;
+        stats_path = optarg;
+        break;
+      case 'n':
+        stats_top = max(atoi(optarg), 0);
+        break;
+      case 'S':
+        cfg.sources.push_back(optarg);
+        break;
+      case 'w':
+        watch = true;
+        break;
+      case 'j':
+        cfg.threads = atoi(optarg);
+        if(cfg.threads <= 0) cfg.threads = thread::hardware_concurrency();
+        if(cfg.threads <= 0) cfg.threads = 1;
+        break;
+      default:
+        usage(*argv);
+        return 1;
+    }
+  }
+  if(argc - optind != 2) {
+    usage(*argv);
+    return 1;
+  }
+  cfg.input = argv[optind];
+  cfg.output = argv[optind + 1];
+  mnemonics.build();
+
+  if(!watch) {
+    PhaseTimes times;
+    RunStats run_stats(stats_top);
+    times.start("read");
+    DexFile* dx = read_input(cfg.input);
+    if(!dx || !reassemble_all(cfg, dx, times, run_stats, NULL)) return 1;
+    if(times_path && !times.write(times_path)) return 1;
+    if(cfg.stats && !run_stats.write(stats_path, times)) return 1;
+    return 0;
+  }
+
+  // The watches go in first so changes made during a rebuild aren't missed.
+  // A failed rebuild keeps what changed for the next try.
+  FileWatcher watcher;
+  bool watching = watcher.add(cfg.input);
+  for(int i = 0; i < cfg.sources.size(); i++) {
+    watching = watcher.add(cfg.sources[i]) && watching;
+  }
+  if(!watching) return 1;
+  WatchState state;
+  set<string> changed;
+  while(true) {
+    PhaseTimes times;
+    RunStats run_stats(stats_top);
+    if(reassemble_changed(cfg, changed, times, run_stats, state)) {
+      changed.clear();
+      if(state.redone) {
+        fprintf(stderr, "%s written, %zu of %zu classes reassembled\n",
+                cfg.output, state.redone, state.names.size());
+      }
+      if(times_path) times.write(times_path);
+      if(cfg.stats) run_stats.write(stats_path, times);
+    }
+    // Quiet for a tenth of a second before a rebuild starts.
+    if(!watcher.wait(changed, 100)) return 1;
+  }
 }
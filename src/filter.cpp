@@ -0,0 +1,68 @@
+#include "filter.h"
+
+#include <map>
+#include <cstring>
+
+#include "dasmcl.h"
+
+using namespace std;
+
+static bool glob_match(const char* p, const char* s) {
+  for(; *p; p++, s++) {
+    if(*p == '*') {
+      bool cross = p[1] == '*';
+      if(cross) p++;
+      for(;; s++) {
+        if(glob_match(p + 1, s)) return true;
+        if(!*s || (!cross && *s == '.')) return false;
+      }
+    }
+    if(!*s || (*p == '?' ? *s == '.' : *p != *s)) return false;
+  }
+  return !*s;
+}
+
+bool ClassFilter::matches(const string& name) const {
+  bool included = include.empty();
+  for(int i = 0; !included && i < include.size(); i++) {
+    included = glob_match(include[i].c_str(), name.c_str());
+  }
+  if(!included) return false;
+  for(int i = 0; i < exclude.size(); i++) {
+    if(glob_match(exclude[i].c_str(), name.c_str())) return false;
+  }
+  return true;
+}
+
+void select_classes(DexFile* dxfile, const ClassFilter& filter,
+                    set<string>& selected) {
+  set<string> names;
+  for(DexClass* cl = dxfile->classes; !dxc_is_sentinel_class(cl); ++cl) {
+    names.insert(cl->name->s);
+  }
+
+  // Group every class under its outermost enclosing class, following the
+  // same '$' rule prep_classes uses to nest classes.
+  map<string, vector<string> > nests;
+  set<string> wanted;
+  for(set<string>::iterator it = names.begin(); it != names.end(); ++it) {
+    string top = *it;
+    for(;;) {
+      int pos = top.find_last_of('$');
+      if(pos == -1) break;
+      string outer = top.substr(0, pos) + ";";
+      if(names.find(outer) == names.end()) break;
+      top = outer;
+    }
+    nests[top].push_back(*it);
+    if(!strncmp(it->c_str(), "Lorg/dxcut/dxdasm/", 18) ||
+       filter.matches(type_nice(it->c_str()))) {
+      wanted.insert(top);
+    }
+  }
+
+  for(set<string>::iterator it = wanted.begin(); it != wanted.end(); ++it) {
+    vector<string>& nest = nests[*it];
+    selected.insert(nest.begin(), nest.end());
+  }
+}
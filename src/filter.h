@@ -0,0 +1,30 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <dxcut/dxcut.h>
+
+// Include/exclude globs on dotted class names.  '*' and '?' stay within one
+// package component while '**' also crosses dots, so "com.ourco.**" selects
+// everything below com.ourco.
+struct ClassFilter {
+  std::vector<std::string> include;
+  std::vector<std::string> exclude;
+
+  bool empty() const { return include.empty() && exclude.empty(); }
+
+  // 'name' is a dotted class name such as "com.foo.Bar$Inner".
+  bool matches(const std::string& name) const;
+};
+
+// Fills 'selected' with the descriptors of every class that has to be emitted
+// for 'filter'.  A top-level class is selected, together with all of its
+// inner classes, when any class in that nest matches.  The dxdasm annotation
+// classes are always selected.
+void select_classes(DexFile* dxfile, const ClassFilter& filter,
+                    std::set<std::string>& selected);
+
+#endif // FILTER_H
@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+# Writes javaident_tables.h, the code point ranges javarules.cpp builds its
+# identifier bitmaps from, using the Unicode database of the running Python.
+#
+# Usage: gen_javaident_tables.py > javaident_tables.h
+#
+# The classes follow Character.isJavaIdentifierStart/Part restricted to the
+# BMP, minus '$' (dxdasm renames synthetic names) and the ignorable control
+# characters, which no one wants to see in a source file.
+
+import sys
+import unicodedata
+
+START = {'Lu', 'Ll', 'Lt', 'Lm', 'Lo', 'Nl', 'Sc', 'Pc'}
+PART = START | {'Nd', 'Mn', 'Mc', 'Cf'}
+
+
+def wanted(cp, cats):
+  if cp == 0x24 or 0xD800 <= cp < 0xE000:
+    return False
+  return unicodedata.category(chr(cp)) in cats
+
+
+def ranges(cats):
+  result = []
+  lo = None
+  for cp in range(0x10001):
+    ok = cp < 0x10000 and wanted(cp, cats)
+    if ok and lo is None:
+      lo = cp
+    elif not ok and lo is not None:
+      result.append((lo, cp - 1))
+      lo = None
+  return result
+
+
+def write_table(out, name, table):
+  out.write('static constexpr JavaIdentRange %s[] = {\n' % name)
+  for i in range(0, len(table), 4):
+    row = table[i:i + 4]
+    out.write('  ' + ' '.join('{0x%04X, 0x%04X},' % r for r in row) + '\n')
+  out.write('};\n')
+
+
+def main():
+  out = sys.stdout
+  out.write('// Generated by gen_javaident_tables.py from Unicode %s.  Do not '
+            'edit.\n' % unicodedata.unidata_version)
+  out.write('#ifndef JAVAIDENT_TABLES_H\n#define JAVAIDENT_TABLES_H\n\n')
+  out.write('struct JavaIdentRange {\n  unsigned int lo, hi;\n};\n\n')
+  write_table(out, 'java_ident_start_ranges', ranges(START))
+  out.write('\n')
+  write_table(out, 'java_ident_part_ranges', ranges(PART))
+  out.write('\n#endif // JAVAIDENT_TABLES_H\n')
+
+
+if __name__ == '__main__':
+  main()
@@ -3,12 +3,15 @@
 #include <cstring>
 #include <cstdio>
 
+#include "javaident_tables.h"
 #include "mutf8.h"
 
 using namespace std;
 
-const char* java_keywords[] = {
+static constexpr const char* java_keywords[] = {
+  "_",
   "abstract",
+  "assert",
   "boolean",
   "break",
   "byte",
@@ -22,7 +25,9 @@ const char* java_keywords[] = {
   "do",
   "double",
   "else",
+  "enum",
   "extends",
+  "false",
   "final",
   "finally",
   "float",
@@ -37,6 +42,7 @@ const char* java_keywords[] = {
   "long",
   "native",
   "new",
+  "null",
   "package",
   "private",
   "protected",
@@ -52,56 +58,182 @@ const char* java_keywords[] = {
   "throw",
   "throws",
   "transient",
+  "true",
   "try",
   "void",
   "volatile",
   "while",
 };
 
+static constexpr int num_keywords =
+    sizeof(java_keywords) / sizeof(java_keywords[0]);
+
+static constexpr size_t const_strlen(const char* s) {
+  size_t n = 0;
+  while(s[n]) n++;
+  return n;
+}
+
+// Perfect hash of the keywords.  The multipliers were found by search; the
+// static_assert below catches a collision if the keyword list changes.
+static constexpr unsigned int keyword_hash(const char* s, size_t n) {
+  return ((unsigned char)s[0] + (n > 1 ? (unsigned char)s[1] * 9u : 0u) +
+          (unsigned char)s[n - 1] * 29u + n) & 0xFF;
+}
+
+struct KeywordSlots {
+  // One more than the index of the keyword hashing to each slot, or 0.
+  unsigned char slot[256];
+  bool perfect;
+};
+
+static constexpr KeywordSlots build_keyword_slots() {
+  KeywordSlots t{};
+  t.perfect = true;
+  for(int i = 0; i < num_keywords; i++) {
+    const char* kw = java_keywords[i];
+    unsigned int h = keyword_hash(kw, const_strlen(kw));
+    if(t.slot[h]) t.perfect = false;
+    t.slot[h] = i + 1;
+  }
+  return t;
+}
+
+static constexpr KeywordSlots keyword_slots = build_keyword_slots();
+static_assert(keyword_slots.perfect, "keyword_hash has collisions");
+
+bool is_java_keyword(const char* s, size_t n) {
+  if(n == 0 || n > 12) return false;
+  int i = keyword_slots.slot[keyword_hash(s, n)];
+  if(!i) return false;
+  const char* kw = java_keywords[i - 1];
+  return !strncmp(s, kw, n) && kw[n] == '\0';
+}
+
 bool is_java_keyword(const char* s) {
-  int lo = 0;
-  int hi = sizeof(java_keywords) / sizeof(const char*);
-  while(lo < hi) {
-    int md = lo + (hi - lo) / 2;
-    int cmp = strcmp(s, java_keywords[md]);
-    if(!cmp) {
-      return true;
-    } else if(cmp < 0) {
-      hi = md;
-    } else {
-      lo = md + 1;
+  return is_java_keyword(s, strlen(s));
+}
+
+// Identifier classes as two level bitmaps over the BMP: each page of 256 code
+// points maps to a block of four 64 bit words, and identical blocks (mostly
+// all clear or all set) are stored once and shared between both classes.
+enum { IDENT_START, IDENT_PART, IDENT_CLASSES };
+
+static constexpr int ident_pages = 256;
+static constexpr int ident_words = 0x10000 / 64;
+
+struct IdentBits {
+  unsigned long long w[IDENT_CLASSES][ident_words];
+};
+
+static constexpr void set_ranges(unsigned long long* w,
+                                 const JavaIdentRange* r, size_t n) {
+  for(size_t i = 0; i < n; i++) {
+    for(unsigned int word = r[i].lo / 64; word <= r[i].hi / 64; word++) {
+      unsigned int lo = word * 64 < r[i].lo ? r[i].lo % 64 : 0;
+      unsigned int hi = word * 64 + 63 > r[i].hi ? r[i].hi % 64 : 63;
+      w[word] |= ~0ull >> (63 - hi) & ~0ull << lo;
     }
   }
-  return false;
 }
 
-bool is_java_identifier_start(unsigned int cp) {
-  if(cp < 64) {
-    return false; // Disclude synthetic identifiers with $
-  } else if(cp < 128) {
-    return (0x7FFFFFE87FFFFFEll & 1ll << cp - 64) != 0;
-  } else {
-    return true; // This isn't strictly true but the rules seemed sufficiently
-                 // complicated that I didn't want to implement it for the rare
-                 // cases this isn't correct.
+static constexpr IdentBits build_ident_bits() {
+  IdentBits b{};
+  set_ranges(b.w[IDENT_START], java_ident_start_ranges,
+             sizeof(java_ident_start_ranges) / sizeof(JavaIdentRange));
+  set_ranges(b.w[IDENT_PART], java_ident_part_ranges,
+             sizeof(java_ident_part_ranges) / sizeof(JavaIdentRange));
+  return b;
+}
+
+template<int N>
+struct IdentTables {
+  unsigned char index[IDENT_CLASSES][ident_pages];
+  unsigned long long blocks[N][4];
+};
+
+// Fills in 't' and returns the number of distinct blocks.  Called once with
+// room for every page to find N and once more to build the real table.
+template<int N>
+static constexpr int pack_ident_blocks(const IdentBits& bits,
+                                       IdentTables<N>& t) {
+  int count = 0;
+  for(int c = 0; c < IDENT_CLASSES; c++) {
+    for(int p = 0; p < ident_pages; p++) {
+      const unsigned long long* page = bits.w[c] + p * 4;
+      int b = 0;
+      for(; b < count; b++) {
+        if(t.blocks[b][0] == page[0] && t.blocks[b][1] == page[1] &&
+           t.blocks[b][2] == page[2] && t.blocks[b][3] == page[3]) {
+          break;
+        }
+      }
+      if(b == count) {
+        for(int i = 0; i < 4; i++) t.blocks[b][i] = page[i];
+        count++;
+      }
+      t.index[c][p] = b;
+    }
   }
+  return count;
+}
+
+static constexpr int count_ident_blocks() {
+  IdentTables<IDENT_CLASSES * ident_pages> t{};
+  IdentBits bits = build_ident_bits();
+  return pack_ident_blocks(bits, t);
+}
+
+static constexpr int ident_blocks = count_ident_blocks();
+static_assert(ident_blocks <= 256, "block numbers must fit in a byte");
+
+static constexpr IdentTables<ident_blocks> build_ident_tables() {
+  IdentTables<ident_blocks> t{};
+  IdentBits bits = build_ident_bits();
+  pack_ident_blocks(bits, t);
+  return t;
+}
+
+static constexpr IdentTables<ident_blocks> ident_tables =
+    build_ident_tables();
+
+static inline bool ident_class(int c, unsigned int cp) {
+  // Supplementary characters are left out; such names just get renamed.
+  if(cp > 0xFFFF) return false;
+  return ident_tables.blocks[ident_tables.index[c][cp >> 8]][cp >> 6 & 3] >>
+         (cp & 63) & 1;
+}
+
+bool is_java_identifier_start(unsigned int cp) {
+  return ident_class(IDENT_START, cp);
 }
 
 bool is_java_identifier_part(unsigned int cp) {
-  return is_java_identifier_start(cp) || '0' <= cp && cp <= '9';
+  return ident_class(IDENT_PART, cp);
 }
 
-bool is_java_identifier(const char* s) {
-  if(is_java_keyword(s)) return false;
-  if(!is_java_identifier_start(mutf8NextCodePoint(&s))) return false;
-  while(*s) {
-    if(!is_java_identifier_part(mutf8NextCodePoint(&s))) {
-      return false;
+bool is_java_identifier(const char* s, size_t n) {
+  if(n == 0 || is_java_keyword(s, n)) return false;
+  size_t pos = 0;
+  while(pos < n) {
+    int c = pos ? IDENT_PART : IDENT_START;
+    unsigned char ch = s[pos];
+    if(ch < 0x80) {
+      if(!ident_class(c, ch)) return false;
+      pos++;
+      continue;
     }
+    unsigned int cp;
+    if(!mutf8_decode_one(s, n, &pos, &cp)) return false;
+    if(!ident_class(c, cp)) return false;
   }
   return true;
 }
 
+bool is_java_identifier(const char* s) {
+  return is_java_identifier(s, strlen(s));
+}
+
 bool is_toplevel_class(const char* s) {
   bool result = true;
   for(; *s; ++s) {
@@ -114,10 +246,13 @@ bool is_toplevel_class(const char* s) {
   return result;
 }
 
-string get_toplevel_class(const string& s) {
-  int pos = s.find_last_of('/');
-  pos = s.find('$', pos + 1);
-  if(pos == -1) return s;
-  string res = s.substr(0, pos) + ";";
-  return res;
+void get_toplevel_class(string& out, const char* s) {
+  const char* slash = strrchr(s, '/');
+  const char* dollar = strchr(slash ? slash : s, '$');
+  if(!dollar) {
+    out = s;
+    return;
+  }
+  out.assign(s, dollar - s);
+  out += ';';
 }
@@ -1,18 +1,26 @@
 #ifndef JAVARULES_H
 #define JAVARULES_H
 
+#include <cstddef>
 #include <string>
 
+// True for the reserved words and literals of Java, including "_".
 bool is_java_keyword(const char* s);
+bool is_java_keyword(const char* s, size_t n);
 
-bool is_java_identifier_start(int cp);
+// Character.isJavaIdentifierStart/Part for BMP code points, except that '$'
+// and the ignorable control characters are not accepted.  Table lookups.
+bool is_java_identifier_start(unsigned int cp);
 
-bool is_java_identifier_part(int cp);
+bool is_java_identifier_part(unsigned int cp);
 
+// Whether the MUTF-8 string s can be used unchanged as a Java identifier.
 bool is_java_identifier(const char* s);
+bool is_java_identifier(const char* s, size_t n);
 
 bool is_toplevel_class(const char* s);
 
-std::string get_toplevel_class(const std::string& s);
+// The descriptor of the top-level class enclosing class descriptor 's'.
+void get_toplevel_class(std::string& out, const char* s);
 
 #endif // JAVARULES_H
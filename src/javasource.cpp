@@ -0,0 +1,1755 @@
+#include "javasource.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static void report(const string& path, int line, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void report(const string& path, int line, const char* fmt, ...) {
+  fprintf(stderr, "%s:%d: ", path.c_str(), line);
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+/* Values built from the source.  They're allocated the way libdxcut's reader
+ * allocates them so the dex can take them over as they are. */
+
+static void free_annotation_contents(DexAnnotation* annon);
+
+static void free_value_contents(DexValue* val) {
+  switch(val->type) {
+    case VALUE_STRING:
+      dxc_free_str(val->value.val_str);
+      break;
+    case VALUE_TYPE:
+      dxc_free_str(val->value.val_type);
+      break;
+    case VALUE_ARRAY:
+      for(DexValue* v = val->value.val_array; !dxc_is_sentinel_value(v);
+          ++v) {
+        free_value_contents(v);
+      }
+      free(val->value.val_array);
+      break;
+    case VALUE_ANNOTATION:
+      free_annotation_contents(val->value.val_annotation);
+      free(val->value.val_annotation);
+      break;
+    default:
+      break;
+  }
+}
+
+static void free_annotation_contents(DexAnnotation* annon) {
+  dxc_free_str(annon->type);
+  for(DexNameValuePair* p = annon->parameters;
+      !dxc_is_sentinel_parameter(p); ++p) {
+    dxc_free_str(p->name);
+    free_value_contents(&p->value);
+  }
+  free(annon->parameters);
+}
+
+static void free_annotations(vector<DexAnnotation>& annons) {
+  for(int i = 0; i < annons.size(); i++) {
+    free_annotation_contents(&annons[i]);
+  }
+  annons.clear();
+}
+
+static DexValue make_int(dx_int v) {
+  DexValue val;
+  val.type = VALUE_INT;
+  val.value.val_int = v;
+  return val;
+}
+
+static DexValue make_long(dx_long v) {
+  DexValue val;
+  val.type = VALUE_LONG;
+  val.value.val_long = v;
+  return val;
+}
+
+static DexValue make_string(const string& s) {
+  DexValue val;
+  val.type = VALUE_STRING;
+  val.value.val_str = dxc_induct_str(s.c_str());
+  return val;
+}
+
+static DexValue make_type(const string& desc) {
+  DexValue val;
+  val.type = VALUE_TYPE;
+  val.value.val_type = dxc_induct_str(desc.c_str());
+  return val;
+}
+
+// An array value that takes over the values in 'vals'.
+static DexValue make_array(const vector<DexValue>& vals) {
+  DexValue val;
+  val.type = VALUE_ARRAY;
+  val.value.val_array = (DexValue*)malloc((vals.size() + 1) *
+                                          sizeof(DexValue));
+  if(!vals.empty()) {
+    memcpy(val.value.val_array, &vals[0], vals.size() * sizeof(DexValue));
+  }
+  dxc_make_sentinel_value(val.value.val_array + vals.size());
+  return val;
+}
+
+static DexNameValuePair make_param(const char* name, const DexValue& val) {
+  DexNameValuePair pair;
+  pair.name = dxc_induct_str(name);
+  pair.value = val;
+  return pair;
+}
+
+// An annotation that takes over the parameters in 'params'.
+static DexAnnotation make_annotation(const string& type,
+                                     const vector<DexNameValuePair>& params) {
+  DexAnnotation annon;
+  annon.visibility = 0;
+  annon.type = dxc_induct_str(type.c_str());
+  annon.parameters = (DexNameValuePair*)
+      malloc((params.size() + 1) * sizeof(DexNameValuePair));
+  if(!params.empty()) {
+    memcpy(annon.parameters, &params[0],
+           params.size() * sizeof(DexNameValuePair));
+  }
+  dxc_make_sentinel_parameter(annon.parameters + params.size());
+  return annon;
+}
+
+static DexValue make_annotation_value(const DexAnnotation& annon) {
+  DexValue val;
+  val.type = VALUE_ANNOTATION;
+  val.value.val_annotation = (DexAnnotation*)malloc(sizeof(DexAnnotation));
+  *val.value.val_annotation = annon;
+  return val;
+}
+
+// The parameters of each Dxdasm annotation and their kinds: 'I' int, 'J'
+// long, 'S' string, 'T' type and '@' annotation, preceded by '[' for arrays.
+// Reassembly takes these for granted; javac checks them in the usual route.
+static const struct {
+  const char* type;
+  const char* params;
+} dxdasm_annotations[] = {
+  {"Lorg/dxcut/dxdasm/DxdasmAccess;", "accessFlags:I"},
+  {"Lorg/dxcut/dxdasm/DxdasmAliases;", "methodAliases:[@ fieldAliases:[@"},
+  {"Lorg/dxcut/dxdasm/DxdasmMethodAlias;",
+   "alias:S clazz:T name:S prototype:[T"},
+  {"Lorg/dxcut/dxdasm/DxdasmFieldAlias;", "alias:S clazz:T name:S type:T"},
+  {"Lorg/dxcut/dxdasm/DxdasmMethod;",
+   "registers:I outsSize:I insns:[S packedSwitches:[@ sparseSwitches:[@ "
+   "dataArrays:[@ tryBlocks:[@"},
+  {"Lorg/dxcut/dxdasm/DxdasmPacked;", "firstKey:I targets:[S"},
+  {"Lorg/dxcut/dxdasm/DxdasmSparse;", "keys:[I targets:[S"},
+  {"Lorg/dxcut/dxdasm/DxdasmData;", "elementWidth:I data:[J"},
+  {"Lorg/dxcut/dxdasm/DxdasmTry;",
+   "startInsn:S insnLength:I handlers:[@ catchAllTarget:S"},
+  {"Lorg/dxcut/dxdasm/DxdasmHandler;", "catchType:T target:S"},
+};
+
+static const char dxdasm_package[] = "Lorg/dxcut/dxdasm/";
+
+static bool is_dxdasm_type(const char* type) {
+  return !strncmp(type, dxdasm_package, sizeof(dxdasm_package) - 1);
+}
+
+static bool value_has_kind(DexValue* val, char kind) {
+  switch(kind) {
+    case 'I': return val->type == VALUE_INT;
+    case 'J': return val->type == VALUE_LONG;
+    case 'S': return val->type == VALUE_STRING;
+    case 'T': return val->type == VALUE_TYPE;
+    case '@': return val->type == VALUE_ANNOTATION;
+  }
+  return false;
+}
+
+// Checks a Dxdasm annotation against dxdasm_annotations.  Returns NULL if it
+// matches, and what's wrong otherwise with the parameter in 'problem'.
+static const char* check_dxdasm_annotation(DexAnnotation* annon,
+                                           string& problem) {
+  const char* spec = NULL;
+  for(int i = 0; i < sizeof(dxdasm_annotations) /
+                     sizeof(*dxdasm_annotations); i++) {
+    if(!strcmp(annon->type->s, dxdasm_annotations[i].type)) {
+      spec = dxdasm_annotations[i].params;
+    }
+  }
+  if(!spec) return NULL;
+
+  int count = 0;
+  while(*spec) {
+    const char* colon = strchr(spec, ':');
+    const char* kind = colon + 1;
+    bool array = *kind == '[';
+    if(array) kind++;
+    problem.assign(spec, colon);
+    count++;
+    spec = kind[1] ? kind + 2 : kind + 1;
+
+    DexNameValuePair* param = annon->parameters;
+    while(!dxc_is_sentinel_parameter(param) && problem != param->name->s) {
+      param++;
+    }
+    if(dxc_is_sentinel_parameter(param)) return "is missing";
+    if(array) {
+      if(param->value.type != VALUE_ARRAY) return "should be an array";
+      for(DexValue* v = param->value.value.val_array;
+          !dxc_is_sentinel_value(v); ++v) {
+        if(!value_has_kind(v, *kind)) return "has an element of the wrong type";
+      }
+    } else if(!value_has_kind(&param->value, *kind)) {
+      return "has the wrong type";
+    }
+  }
+  for(DexNameValuePair* param = annon->parameters;
+      !dxc_is_sentinel_parameter(param); ++param) {
+    count--;
+  }
+  if(count < 0) {
+    problem.clear();
+    return "has unknown parameters";
+  }
+  return NULL;
+}
+
+/* Scanning. */
+
+// A token of Java source, pointing into the file's text.  Strings and
+// characters keep their quotes.
+struct JavaToken {
+  enum Kind { END, IDENT, NUMBER, STRING, CHAR, PUNCT };
+
+  Kind kind;
+  const char* s;
+  size_t n;
+  int line;
+
+  bool is(const char* text) const {
+    return kind != END && !strncmp(s, text, n) && !text[n];
+  }
+};
+
+static bool is_ident_char(unsigned char c) {
+  return isalnum(c) || c == '_' || c == '$' || c >= 0x80;
+}
+
+class JavaLexer {
+ public:
+  JavaLexer(const char* s, size_t n) : p(s), end(s + n), line(1) {}
+
+  // The next token.  Anything that isn't Java comes back as a single
+  // character PUNCT token for the parser to reject.
+  JavaToken next();
+
+ private:
+  void skip_space();
+
+  const char* p;
+  const char* end;
+  int line;
+};
+
+void JavaLexer::skip_space() {
+  while(p < end) {
+    if(*p == '\n') {
+      line++;
+      p++;
+    } else if(isspace((unsigned char)*p)) {
+      p++;
+    } else if(*p == '/' && p + 1 < end && p[1] == '/') {
+      while(p < end && *p != '\n') p++;
+    } else if(*p == '/' && p + 1 < end && p[1] == '*') {
+      for(p += 2; p < end && !(*p == '*' && p + 1 < end && p[1] == '/'); p++) {
+        if(*p == '\n') line++;
+      }
+      p = min(p + 2, end);
+    } else {
+      break;
+    }
+  }
+}
+
+JavaToken JavaLexer::next() {
+  skip_space();
+  JavaToken tok;
+  tok.s = p;
+  tok.line = line;
+  if(p == end) {
+    tok.kind = JavaToken::END;
+    tok.n = 0;
+    return tok;
+  }
+
+  unsigned char c = *p;
+  if(isdigit(c)) {
+    tok.kind = JavaToken::NUMBER;
+    while(p < end && (isalnum((unsigned char)*p) || *p == '.' || *p == '_')) {
+      p++;
+    }
+  } else if(is_ident_char(c)) {
+    tok.kind = JavaToken::IDENT;
+    while(p < end && is_ident_char(*p)) p++;
+  } else if(c == '"' || c == '\'') {
+    tok.kind = c == '"' ? JavaToken::STRING : JavaToken::CHAR;
+    for(p++; p < end && *p != c && *p != '\n'; p++) {
+      if(*p == '\\' && p + 1 < end) p++;
+    }
+    if(p < end && *p == c) {
+      p++;
+    } else {
+      tok.kind = JavaToken::PUNCT;
+      p = tok.s + 1;
+    }
+  } else if(c == '.' && end - p >= 3 && p[1] == '.' && p[2] == '.') {
+    tok.kind = JavaToken::PUNCT;
+    p += 3;
+  } else {
+    tok.kind = JavaToken::PUNCT;
+    p++;
+  }
+  tok.n = p - tok.s;
+  return tok;
+}
+
+// Appends UTF-16 code unit 'u' in MUTF-8.
+static void append_mutf8(string& out, unsigned int u) {
+  if(u && u < 0x80) {
+    out += (char)u;
+  } else if(u < 0x800) {
+    out += (char)(0xC0 | u >> 6);
+    out += (char)(0x80 | (u & 0x3F));
+  } else {
+    out += (char)(0xE0 | u >> 12);
+    out += (char)(0x80 | (u >> 6 & 0x3F));
+    out += (char)(0x80 | (u & 0x3F));
+  }
+}
+
+// Decodes the text between the quotes of a string literal into MUTF-8.  The
+// file is taken to be UTF-8, which only differs from MUTF-8 in NUL and the
+// code points past U+FFFF.
+static bool decode_string(const char* s, size_t n, string& out) {
+  out.clear();
+  for(size_t i = 0; i < n; i++) {
+    unsigned char c = s[i];
+    if(c == '\\') {
+      if(++i == n) return false;
+      switch(s[i]) {
+        case 'b': out += '\b'; break;
+        case 't': out += '\t'; break;
+        case 'n': out += '\n'; break;
+        case 'f': out += '\f'; break;
+        case 'r': out += '\r'; break;
+        // Not Java, but dxdasm has always written it.
+        case 'v': out += '\v'; break;
+        case 's': out += ' '; break;
+        case '"': case '\'': case '\\': out += s[i]; break;
+        case 'u': {
+          while(i < n && s[i] == 'u') i++;
+          if(n - i < 4) return false;
+          char hex[5] = {0};
+          memcpy(hex, s + i, 4);
+          char* end;
+          unsigned int u = strtoul(hex, &end, 16);
+          if(end != hex + 4 || !isxdigit((unsigned char)hex[0])) return false;
+          i += 3;
+          append_mutf8(out, u);
+          break;
+        } default: {
+          if(s[i] < '0' || s[i] > '7') return false;
+          unsigned int u = 0;
+          int digits = s[i] <= '3' ? 3 : 2;
+          for(; digits && i < n && s[i] >= '0' && s[i] <= '7'; digits--, i++) {
+            u = u << 3 | (s[i] - '0');
+          }
+          i--;
+          append_mutf8(out, u);
+        }
+      }
+    } else if(c >= 0xF0 && n - i >= 4) {
+      unsigned int cp = (c & 0x07) << 18 | (s[i + 1] & 0x3F) << 12 |
+                        (s[i + 2] & 0x3F) << 6 | (s[i + 3] & 0x3F);
+      cp -= 0x10000;
+      append_mutf8(out, 0xD800 + (cp >> 10));
+      append_mutf8(out, 0xDC00 + (cp & 0x3FF));
+      i += 3;
+    } else if(!c) {
+      append_mutf8(out, 0);
+    } else {
+      out += c;
+    }
+  }
+  return true;
+}
+
+/* Parsing. */
+
+// A field or method declaration and the annotations on it.
+struct SourceMember {
+  int line;
+  bool method;
+  string name;
+  // Descriptors.  'type' is the field type or the return type, "V" for
+  // constructors.
+  string type;
+  vector<string> params;
+  vector<DexAnnotation> annotations;
+};
+
+struct SourceClass {
+  int line;
+  string name;
+  vector<DexAnnotation> annotations;
+  vector<SourceMember> members;
+  vector<SourceClass> inner;
+};
+
+static void free_class(SourceClass& scl) {
+  free_annotations(scl.annotations);
+  for(int i = 0; i < scl.members.size(); i++) {
+    free_annotations(scl.members[i].annotations);
+  }
+  for(int i = 0; i < scl.inner.size(); i++) {
+    free_class(scl.inner[i]);
+  }
+}
+
+static bool is_modifier(const JavaToken& tok) {
+  static const char* const modifiers[] = {
+    "public", "protected", "private", "static", "final", "abstract",
+    "native", "synchronized", "transient", "volatile", "strictfp",
+    "default"
+  };
+  for(int i = 0; i < sizeof(modifiers) / sizeof(*modifiers); i++) {
+    if(tok.is(modifiers[i])) return true;
+  }
+  return false;
+}
+
+static bool is_type_keyword(const JavaToken& tok) {
+  return tok.is("class") || tok.is("interface") || tok.is("enum");
+}
+
+class JavaParser {
+ public:
+  JavaParser(const JavaSourceMerger& merger, const string& path,
+             const char* text, size_t n);
+
+  // Parses the whole file into 'classes'.  Stops at the first error.
+  bool parse(vector<SourceClass>& classes);
+
+  // Dotted.
+  string package;
+
+ private:
+  bool parse_class(SourceClass& scl);
+  bool parse_member(SourceClass& scl, vector<DexAnnotation>& annons);
+  bool parse_method(SourceMember& member);
+  bool parse_modifiers(vector<DexAnnotation>& annons);
+  bool parse_annotation(DexAnnotation& annon);
+  bool parse_value(DexValue& val);
+  bool parse_number(DexValue& val);
+  bool parse_name(string& name);
+  bool parse_type(string& name, int& dims);
+  bool skip_block();
+  bool skip_to(const char* stop);
+
+  void advance() { tok = lex.next(); }
+  JavaToken peek() const;
+  bool accept(const char* text);
+  bool expect(const char* text);
+  bool unexpected();
+
+  string descriptor(const string& name, int dims) const {
+    return merger.descriptor(name, dims, package, imports);
+  }
+
+  const JavaSourceMerger& merger;
+  const string& path;
+  JavaLexer lex;
+  JavaToken tok;
+  // Simple name to qualified name.
+  map<string, string> imports;
+};
+
+JavaParser::JavaParser(const JavaSourceMerger& merger, const string& path,
+                       const char* text, size_t n)
+    : merger(merger), path(path), lex(text, n) {
+  advance();
+}
+
+JavaToken JavaParser::peek() const {
+  JavaLexer ahead = lex;
+  return ahead.next();
+}
+
+bool JavaParser::accept(const char* text) {
+  if(!tok.is(text)) return false;
+  advance();
+  return true;
+}
+
+bool JavaParser::expect(const char* text) {
+  if(accept(text)) return true;
+  unexpected();
+  return false;
+}
+
+bool JavaParser::unexpected() {
+  if(tok.kind == JavaToken::END) {
+    report(path, tok.line, "unexpected end of file");
+  } else {
+    report(path, tok.line, "unexpected '%.*s'", (int)min<size_t>(tok.n, 40),
+           tok.s);
+  }
+  return false;
+}
+
+bool JavaParser::parse(vector<SourceClass>& classes) {
+  if(accept("package")) {
+    if(!parse_name(package) || !expect(";")) return false;
+  }
+  while(accept("import")) {
+    bool is_static = accept("static");
+    string name;
+    if(!parse_name(name)) return false;
+    if(accept(".")) {
+      // On demand imports give nothing to resolve against.
+      if(!expect("*")) return false;
+    } else if(!is_static) {
+      imports[name.substr(name.rfind('.') + 1)] = name;
+    }
+    if(!expect(";")) return false;
+  }
+  while(tok.kind != JavaToken::END) {
+    if(accept(";")) continue;
+    vector<DexAnnotation> annons;
+    classes.push_back(SourceClass());
+    SourceClass& scl = classes.back();
+    if(!parse_modifiers(annons)) {
+      free_annotations(annons);
+      return false;
+    }
+    scl.annotations.swap(annons);
+    if(!parse_class(scl)) return false;
+  }
+  return true;
+}
+
+// From the class keyword on.
+bool JavaParser::parse_class(SourceClass& scl) {
+  scl.line = tok.line;
+  if(accept("@")) {
+    if(!expect("interface")) return false;
+  } else if(tok.is("enum")) {
+    // dxdasm writes enums as classes extending DxdasmEnum.
+    report(path, tok.line, "enum declarations aren't supported");
+    return false;
+  } else if(!accept("class") && !expect("interface")) {
+    return false;
+  }
+  if(tok.kind != JavaToken::IDENT) return unexpected();
+  scl.name.assign(tok.s, tok.n);
+  advance();
+  // The supertypes come from the dex.
+  while(!tok.is("{")) {
+    if(tok.kind == JavaToken::END) return unexpected();
+    advance();
+  }
+
+  advance();
+  while(!accept("}")) {
+    if(tok.kind == JavaToken::END) return unexpected();
+    if(accept(";")) continue;
+    vector<DexAnnotation> annons;
+    if(!parse_modifiers(annons) || !parse_member(scl, annons)) {
+      free_annotations(annons);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Takes over 'annons' if it succeeds.
+bool JavaParser::parse_member(SourceClass& scl,
+                              vector<DexAnnotation>& annons) {
+  if(tok.is("{")) {
+    // An initializer.  The code comes from the DxdasmMethod annotation on
+    // dxdasm_static() or the constructors.
+    free_annotations(annons);
+    return skip_block();
+  }
+  if(is_type_keyword(tok) || tok.is("@")) {
+    scl.inner.push_back(SourceClass());
+    SourceClass& inner = scl.inner.back();
+    inner.annotations.swap(annons);
+    return parse_class(inner);
+  }
+
+  SourceMember member;
+  member.line = tok.line;
+  string type;
+  int dims;
+  if(!parse_type(type, dims)) return false;
+  if(tok.is("(")) {
+    if(type != scl.name || dims) {
+      report(path, tok.line, "method is missing a return type");
+      return false;
+    }
+    member.name = "<init>";
+    member.type = "V";
+  } else {
+    if(tok.kind != JavaToken::IDENT) return unexpected();
+    member.name.assign(tok.s, tok.n);
+    member.type = descriptor(type, dims);
+    advance();
+  }
+  member.method = tok.is("(");
+  if(member.method) {
+    if(!parse_method(member)) return false;
+  } else if(!skip_to(";")) {
+    return false;
+  }
+  member.annotations.swap(annons);
+  scl.members.push_back(member);
+  return true;
+}
+
+// From the parameter list on.
+bool JavaParser::parse_method(SourceMember& member) {
+  if(!expect("(")) return false;
+  while(!accept(")")) {
+    vector<DexAnnotation> annons;
+    bool ok = parse_modifiers(annons);
+    free_annotations(annons);
+    string type;
+    int dims;
+    if(!ok || !parse_type(type, dims)) return false;
+    if(tok.kind != JavaToken::IDENT) return unexpected();
+    advance();
+    while(accept("[")) {
+      if(!expect("]")) return false;
+      dims++;
+    }
+    member.params.push_back(descriptor(type, dims));
+    if(!tok.is(")") && !expect(",")) return false;
+  }
+  if(accept("throws")) {
+    string name;
+    do {
+      if(!parse_name(name)) return false;
+    } while(accept(","));
+  }
+  if(accept("default")) return skip_to(";");
+  return tok.is("{") ? skip_block() : expect(";");
+}
+
+bool JavaParser::parse_modifiers(vector<DexAnnotation>& annons) {
+  while(true) {
+    if(tok.is("@")) {
+      if(peek().is("interface")) return true;
+      DexAnnotation annon;
+      if(!parse_annotation(annon)) return false;
+      annons.push_back(annon);
+    } else if(is_modifier(tok)) {
+      advance();
+    } else {
+      return true;
+    }
+  }
+}
+
+bool JavaParser::parse_annotation(DexAnnotation& annon) {
+  int line = tok.line;
+  string name;
+  if(!expect("@") || !parse_name(name)) return false;
+  string type = descriptor(name, 0);
+
+  vector<DexNameValuePair> params;
+  bool ok = true;
+  if(accept("(") && !accept(")")) {
+    do {
+      string param = "value";
+      if(tok.kind == JavaToken::IDENT && peek().is("=")) {
+        param.assign(tok.s, tok.n);
+        advance();
+        advance();
+      }
+      DexValue val;
+      ok = parse_value(val);
+      if(!ok) break;
+      params.push_back(make_param(param.c_str(), val));
+    } while(accept(","));
+    ok = ok && expect(")");
+  }
+
+  annon = make_annotation(type, params);
+  if(!ok) {
+    free_annotation_contents(&annon);
+    return false;
+  }
+  if(!is_dxdasm_type(type.c_str())) return true;
+
+  if(type == "Lorg/dxcut/dxdasm/DxdasmData;") {
+    // The data is a long[], which javac would have widened the int literals
+    // in it to.
+    for(DexNameValuePair* p = annon.parameters;
+        !dxc_is_sentinel_parameter(p); ++p) {
+      if(strcmp(p->name->s, "data") || p->value.type != VALUE_ARRAY) continue;
+      for(DexValue* v = p->value.value.val_array; !dxc_is_sentinel_value(v);
+          ++v) {
+        if(v->type != VALUE_INT) continue;
+        v->type = VALUE_LONG;
+        v->value.val_long = v->value.val_int;
+      }
+    }
+  }
+  string problem;
+  const char* error = check_dxdasm_annotation(&annon, problem);
+  if(error) {
+    if(problem.empty()) {
+      report(path, line, "@%s %s", name.c_str(), error);
+    } else {
+      report(path, line, "@%s parameter %s %s", name.c_str(),
+             problem.c_str(), error);
+    }
+    free_annotation_contents(&annon);
+    return false;
+  }
+  return true;
+}
+
+bool JavaParser::parse_value(DexValue& val) {
+  val.type = VALUE_NULL;
+  if(tok.kind == JavaToken::STRING) {
+    string s;
+    if(!decode_string(tok.s + 1, tok.n - 2, s)) {
+      report(path, tok.line, "bad escape in string");
+      return false;
+    }
+    val = make_string(s);
+    advance();
+    return true;
+  }
+  if(tok.kind == JavaToken::NUMBER || tok.is("-")) return parse_number(val);
+  if(tok.is("true") || tok.is("false")) {
+    val.type = VALUE_BOOLEAN;
+    val.value.val_boolean = tok.is("true");
+    advance();
+    return true;
+  }
+  if(tok.is("@")) {
+    DexAnnotation* annon = (DexAnnotation*)calloc(1, sizeof(DexAnnotation));
+    if(!parse_annotation(*annon)) {
+      free(annon);
+      return false;
+    }
+    val.type = VALUE_ANNOTATION;
+    val.value.val_annotation = annon;
+    return true;
+  }
+  if(accept("{")) {
+    vector<DexValue> vals;
+    bool ok = true;
+    while(!tok.is("}")) {
+      DexValue v;
+      ok = parse_value(v);
+      if(!ok) break;
+      vals.push_back(v);
+      if(!accept(",")) break;
+    }
+    ok = ok && expect("}");
+    val = make_array(vals);
+    if(!ok) {
+      free_value_contents(&val);
+      val.type = VALUE_NULL;
+    }
+    return ok;
+  }
+
+  // What's left is a class literal.
+  string name;
+  int dims = 0;
+  if(!parse_name(name)) return false;
+  while(accept("[")) {
+    if(!expect("]")) return false;
+    dims++;
+  }
+  if(!expect(".") || !expect("class")) return false;
+  val = make_type(descriptor(name, dims));
+  return true;
+}
+
+bool JavaParser::parse_number(DexValue& val) {
+  bool neg = accept("-");
+  if(tok.kind != JavaToken::NUMBER) return unexpected();
+  string text;
+  for(size_t i = 0; i < tok.n; i++) {
+    if(tok.s[i] != '_') text += tok.s[i];
+  }
+  bool wide = text[text.size() - 1] == 'L' || text[text.size() - 1] == 'l';
+  if(wide) text.resize(text.size() - 1);
+  int base = 10;
+  size_t start = 0;
+  if(text.size() > 2 && text[0] == '0' && (text[1] | 0x20) == 'x') {
+    base = 16;
+    start = 2;
+  } else if(text.size() > 2 && text[0] == '0' && (text[1] | 0x20) == 'b') {
+    base = 2;
+    start = 2;
+  } else if(text.size() > 1 && text[0] == '0') {
+    base = 8;
+    start = 1;
+  }
+
+  errno = 0;
+  char* end;
+  unsigned long long v = strtoull(text.c_str() + start, &end, base);
+  // Decimal literals only reach the most negative value with a minus sign;
+  // the others cover the whole unsigned range.
+  unsigned long long limit = wide ? ~0ULL : 0xFFFFFFFFULL;
+  if(base == 10) limit = (limit >> 1) + neg;
+  if(*end || start == text.size() || errno == ERANGE || v > limit) {
+    report(path, tok.line, "bad %s literal %.*s", wide ? "long" : "int",
+           (int)tok.n, tok.s);
+    return false;
+  }
+  if(neg) v = 0 - v;
+  val = wide ? make_long((dx_long)v) : make_int((dx_int)(dx_uint)v);
+  advance();
+  return true;
+}
+
+// A dotted name.  Stops before ".class".
+bool JavaParser::parse_name(string& name) {
+  if(tok.kind != JavaToken::IDENT) return unexpected();
+  name.assign(tok.s, tok.n);
+  advance();
+  while(tok.is(".")) {
+    JavaToken next = peek();
+    if(next.kind != JavaToken::IDENT || next.is("class")) break;
+    advance();
+    name += '.';
+    name.append(tok.s, tok.n);
+    advance();
+  }
+  return true;
+}
+
+// A type as written in a declaration, with its array dimensions counted in
+// 'dims'.  A varargs "..." counts as one.
+bool JavaParser::parse_type(string& name, int& dims) {
+  if(!parse_name(name)) return false;
+  if(accept("<")) {
+    // Type arguments don't make it into the descriptor.
+    for(int depth = 1; depth; advance()) {
+      if(tok.kind == JavaToken::END) return unexpected();
+      if(tok.is("<")) depth++;
+      if(tok.is(">")) depth--;
+    }
+  }
+  for(dims = 0; accept("["); dims++) {
+    if(!expect("]")) return false;
+  }
+  if(accept("...")) dims++;
+  return true;
+}
+
+bool JavaParser::skip_block() {
+  if(!expect("{")) return false;
+  for(int depth = 1; depth; advance()) {
+    if(tok.kind == JavaToken::END) return unexpected();
+    if(tok.is("{")) depth++;
+    if(tok.is("}")) depth--;
+  }
+  return true;
+}
+
+// Skips past the next 'stop' outside of brackets.
+bool JavaParser::skip_to(const char* stop) {
+  for(int depth = 0; depth || !tok.is(stop); advance()) {
+    if(tok.kind == JavaToken::END) return unexpected();
+    if(tok.is("{") || tok.is("(") || tok.is("[")) depth++;
+    if(tok.is("}") || tok.is(")") || tok.is("]")) {
+      if(!depth) return unexpected();
+      depth--;
+    }
+  }
+  advance();
+  return true;
+}
+
+/* Merging. */
+
+// Hands the Dxdasm annotations in 'annons' over to the annotation set at
+// '*set' and frees the rest.  Anything else the source says about annotations
+// is already in the dex.
+static void attach_annotations(DexAnnotation** set,
+                               vector<DexAnnotation>& annons) {
+  size_t n = 0;
+  while(!dxc_is_sentinel_annotation(*set + n)) n++;
+  size_t added = 0;
+  for(int i = 0; i < annons.size(); i++) {
+    added += is_dxdasm_type(annons[i].type->s);
+  }
+  if(added) {
+    *set = (DexAnnotation*)realloc(*set,
+                                   (n + added + 1) * sizeof(DexAnnotation));
+  }
+  for(int i = 0; i < annons.size(); i++) {
+    if(is_dxdasm_type(annons[i].type->s)) {
+      (*set)[n++] = annons[i];
+    } else {
+      free_annotation_contents(&annons[i]);
+    }
+  }
+  if(added) dxc_make_sentinel_annotation(*set + n);
+  annons.clear();
+}
+
+static bool has_annotation(const vector<DexAnnotation>& annons,
+                           const char* type) {
+  for(int i = 0; i < annons.size(); i++) {
+    if(!strcmp(annons[i].type->s, type)) return true;
+  }
+  return false;
+}
+
+static DexField* find_field(DexClass* cl, const SourceMember& member) {
+  for(int iter = 0; iter < 2; iter++)
+  for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
+      !dxc_is_sentinel_field(fld); ++fld) {
+    if(member.name == fld->name->s && member.type == fld->type->s) {
+      return fld;
+    }
+  }
+  return NULL;
+}
+
+static DexMethod* find_method(DexClass* cl, const char* name,
+                              const SourceMember& member) {
+  for(int iter = 0; iter < 2; iter++)
+  for(DexMethod* mtd = iter ? cl->virtual_methods : cl->direct_methods;
+      !dxc_is_sentinel_method(mtd); ++mtd) {
+    if(strcmp(name, mtd->name->s)) continue;
+    ref_str** proto = mtd->prototype->s;
+    if(member.type != proto[0]->s) continue;
+    int i = 0;
+    while(i < member.params.size() && proto[i + 1] &&
+          member.params[i] == proto[i + 1]->s) {
+      i++;
+    }
+    if(i == member.params.size() && !proto[i + 1]) return mtd;
+  }
+  return NULL;
+}
+
+// Attaches the annotations read for a class and its inner classes.  The dex
+// names of the classes are added to 'merged'.
+static bool merge_class(const string& path, dasmcl* dcl, SourceClass& scl,
+                        vector<string>& merged) {
+  DexClass* cl = dcl->cl;
+  bool ok = true;
+  merged.push_back(dcl->dex_name);
+  attach_annotations(&cl->annotations, scl.annotations);
+  for(int i = 0; i < scl.members.size(); i++) {
+    SourceMember& member = scl.members[i];
+    DexAnnotation** set = NULL;
+    if(!member.method) {
+      DexField* fld = find_field(cl, member);
+      if(fld) set = &fld->annotations;
+    } else {
+      // dxdasm writes the static initializer as dxdasm_static().
+      DexMethod* mtd = NULL;
+      if(member.name == "dxdasm_static") {
+        mtd = find_method(cl, "<clinit>", member);
+      }
+      if(!mtd) mtd = find_method(cl, member.name.c_str(), member);
+      if(mtd && !mtd->code_body &&
+         has_annotation(member.annotations,
+                        "Lorg/dxcut/dxdasm/DxdasmMethod;")) {
+        report(path, member.line, "%s has no code in the dex to replace",
+               member.name.c_str());
+        ok = false;
+        free_annotations(member.annotations);
+        continue;
+      }
+      if(mtd) set = &mtd->annotations;
+    }
+    if(!set) {
+      report(path, member.line, "%s %s isn't in the dex",
+             member.method ? "method" : "field", member.name.c_str());
+      ok = false;
+      free_annotations(member.annotations);
+      continue;
+    }
+    attach_annotations(set, member.annotations);
+  }
+
+  for(int i = 0; i < scl.inner.size(); i++) {
+    SourceClass& inner = scl.inner[i];
+    dasmcl* idcl = NULL;
+    for(int j = 0; j < dcl->inner_classes.size() && !idcl; j++) {
+      size_t len;
+      const char* brief =
+          class_brief(dcl->inner_classes[j]->cl->name->s, &len);
+      if(!inner.name.compare(0, string::npos, brief, len)) {
+        idcl = dcl->inner_classes[j];
+      }
+    }
+    if(!idcl) {
+      report(path, inner.line, "class %s isn't in the dex",
+             inner.name.c_str());
+      ok = false;
+      free_class(inner);
+      continue;
+    }
+    ok = merge_class(path, idcl, inner, merged) && ok;
+  }
+  return ok;
+}
+
+/* Reading dxasm.  See decompile_class_dxasm() for the format. */
+
+// The length of the descriptor at the start of 's', or 0 if there isn't one.
+static size_t descriptor_length(const char* s) {
+  const char* p = s;
+  while(*p == '[') p++;
+  if(*p == 'L') {
+    const char* semi = strchr(p, ';');
+    return semi && semi > p + 1 ? semi + 1 - s : 0;
+  }
+  return *p && strchr("ZBCSIJFDV", *p) ? p + 1 - s : 0;
+}
+
+static bool is_descriptor(const string& s) {
+  return !s.empty() && descriptor_length(s.c_str()) == s.size();
+}
+
+// Splits "(params)ret" into descriptors, the return type first.
+static bool split_prototype(const string& proto, vector<string>& types) {
+  if(proto.empty() || proto[0] != '(') return false;
+  types.assign(1, "");
+  const char* s = proto.c_str() + 1;
+  while(*s != ')') {
+    size_t n = descriptor_length(s);
+    if(!n) return false;
+    types.push_back(string(s, n));
+    s += n;
+  }
+  size_t n = descriptor_length(++s);
+  if(!n || s[n]) return false;
+  types[0].assign(s, n);
+  return true;
+}
+
+// All of 'word' as a decimal number in [lo, hi].
+static bool parse_decimal(const string& word, long long lo, long long hi,
+                          long long& v) {
+  errno = 0;
+  char* end;
+  v = strtoll(word.c_str(), &end, 10);
+  return !word.empty() && !*end && errno != ERANGE && lo <= v && v <= hi;
+}
+
+// All of 'word' as a 0x prefixed hex number no more than 'hi'.
+static bool parse_hex(const string& word, unsigned long long hi,
+                      unsigned long long& v) {
+  if(word.size() < 3 || word.compare(0, 2, "0x")) return false;
+  errno = 0;
+  char* end;
+  v = strtoull(word.c_str() + 2, &end, 16);
+  return !*end && errno != ERANGE && v <= hi;
+}
+
+static void free_values(vector<DexValue>& vals) {
+  for(int i = 0; i < vals.size(); i++) {
+    free_value_contents(&vals[i]);
+  }
+  vals.clear();
+}
+
+// Reads dxasm a line at a time and merges each class as soon as the next one
+// starts, so only one class's annotations are held at once.  Problems are
+// reported and the reading goes on.
+class DxasmReader {
+ public:
+  DxasmReader(const map<string, dasmcl*>& clmap, const string& path,
+              vector<string>& merged);
+
+  bool read(FILE* fin);
+
+ private:
+  void read_line(const char* s, const char* end);
+  bool read_directive(const vector<string>& words);
+  bool read_code(const vector<string>& words);
+  bool start_class(const vector<string>& words);
+  void finish_class();
+  bool start_member(const vector<string>& words);
+  void finish_member();
+  void finish_try();
+  void clear_code();
+  bool arguments(const vector<string>& words, int count);
+
+  const map<string, dasmcl*>& clmap;
+  const string& path;
+  vector<string>& merged;
+  int line;
+  bool ok;
+
+  // The class being read.  NULL before the first one and while skipping one
+  // that can't be merged.
+  dasmcl* dcl;
+  bool skipping;
+  SourceClass scl;
+  vector<DexValue> method_aliases;
+  vector<DexValue> field_aliases;
+
+  // The field or method being read.
+  bool have_member;
+  SourceMember member;
+  bool have_code;
+  long long registers;
+  long long outs;
+  vector<DexValue> insns;
+  vector<DexValue> packed;
+  vector<DexValue> sparse;
+  vector<DexValue> data;
+  vector<DexValue> tries;
+
+  // The try block being read.
+  bool have_try;
+  string try_start;
+  long long try_length;
+  vector<DexValue> handlers;
+  bool have_catch_all;
+  string catch_all;
+};
+
+DxasmReader::DxasmReader(const map<string, dasmcl*>& clmap,
+                         const string& path, vector<string>& merged)
+    : clmap(clmap), path(path), merged(merged), line(0), ok(true), dcl(NULL),
+      skipping(false), have_member(false), have_code(false),
+      have_try(false) {
+}
+
+bool DxasmReader::read(FILE* fin) {
+  char* buf = NULL;
+  size_t size = 0;
+  ssize_t n;
+  while((n = getline(&buf, &size, fin)) >= 0) {
+    line++;
+    read_line(buf, buf + n);
+  }
+  free(buf);
+  finish_class();
+  if(ferror(fin)) {
+    fprintf(stderr, "Failed to read %s\n", path.c_str());
+    ok = false;
+  }
+  return ok;
+}
+
+void DxasmReader::read_line(const char* s, const char* end) {
+  if(end > s && end[-1] == '\n') end--;
+  if(end > s && end[-1] == '\r') end--;
+  while(s < end && (*s == ' ' || *s == '\t')) s++;
+  if(s == end || *s == '#') return;
+
+  vector<string> words;
+  if(*s == '.') {
+    for(const char* p = s; p < end; ) {
+      const char* q = p;
+      while(q < end && *q != ' ' && *q != '\t') q++;
+      if(q > p) words.push_back(string(p, q));
+      p = q + 1;
+    }
+    if(words[0] == ".class") {
+      ok = start_class(words) && ok;
+      return;
+    }
+  }
+  if(skipping) return;
+  if(!dcl) {
+    report(path, line, "expected .class");
+    ok = false;
+    return;
+  }
+
+  if(!words.empty()) {
+    ok = read_directive(words) && ok;
+    return;
+  }
+  // The instruction is escaped the way it is in a Java string, and taken up
+  // to the end of the line.
+  string insn;
+  if(!have_code) {
+    report(path, line, "instruction outside of a method's code");
+    ok = false;
+  } else if(!decode_string(s, end - s, insn)) {
+    report(path, line, "bad escape in instruction");
+    ok = false;
+  } else {
+    insns.push_back(make_string(insn));
+  }
+}
+
+bool DxasmReader::arguments(const vector<string>& words, int count) {
+  if(words.size() == count + 1) return true;
+  report(path, line, "%s takes %d argument%s", words[0].c_str(), count,
+         count == 1 ? "" : "s");
+  return false;
+}
+
+bool DxasmReader::read_directive(const vector<string>& words) {
+  const string& dir = words[0];
+  if(dir == ".access") {
+    vector<DexAnnotation>& annons =
+        have_member ? member.annotations : scl.annotations;
+    unsigned long long flags;
+    if(!arguments(words, 1)) return false;
+    if(!parse_hex(words[1], 0xFFFFFFFFULL, flags)) {
+      report(path, line, "bad access flags %s", words[1].c_str());
+      return false;
+    }
+    if(has_annotation(annons, "Lorg/dxcut/dxdasm/DxdasmAccess;")) {
+      report(path, line, "duplicate .access");
+      return false;
+    }
+    vector<DexNameValuePair> params;
+    params.push_back(make_param("accessFlags",
+                                make_int((dx_int)(dx_uint)flags)));
+    annons.push_back(make_annotation("Lorg/dxcut/dxdasm/DxdasmAccess;",
+                                     params));
+    return true;
+  }
+  if(dir == ".method-alias" || dir == ".field-alias") {
+    bool method = dir == ".method-alias";
+    vector<string> proto;
+    if(!arguments(words, 4)) return false;
+    if(have_member) {
+      report(path, line, "%s after the members", dir.c_str());
+      return false;
+    }
+    if(!is_descriptor(words[2]) ||
+       (method ? !split_prototype(words[4], proto) :
+                 !is_descriptor(words[4]))) {
+      report(path, line, "bad %s", dir.c_str());
+      return false;
+    }
+    vector<DexNameValuePair> params;
+    params.push_back(make_param("alias", make_string(words[1])));
+    params.push_back(make_param("clazz", make_type(words[2])));
+    params.push_back(make_param("name", make_string(words[3])));
+    if(method) {
+      vector<DexValue> types;
+      for(int i = 0; i < proto.size(); i++) {
+        types.push_back(make_type(proto[i]));
+      }
+      params.push_back(make_param("prototype", make_array(types)));
+      method_aliases.push_back(make_annotation_value(make_annotation(
+          "Lorg/dxcut/dxdasm/DxdasmMethodAlias;", params)));
+    } else {
+      params.push_back(make_param("type", make_type(words[4])));
+      field_aliases.push_back(make_annotation_value(make_annotation(
+          "Lorg/dxcut/dxdasm/DxdasmFieldAlias;", params)));
+    }
+    return true;
+  }
+  if(dir == ".field" || dir == ".method") return start_member(words);
+  return read_code(words);
+}
+
+bool DxasmReader::read_code(const vector<string>& words) {
+  const string& dir = words[0];
+  if(dir == ".registers") {
+    if(!arguments(words, 1)) return false;
+    if(!have_member || !member.method || have_code) {
+      report(path, line, ".registers should start a method's code");
+      return false;
+    }
+    if(!parse_decimal(words[1], 0, 0xFFFF, registers)) {
+      report(path, line, "bad register count %s", words[1].c_str());
+      return false;
+    }
+    have_code = true;
+    outs = -1;
+    return true;
+  }
+  if(dir != ".outs" && dir != ".packed" && dir != ".sparse" &&
+     dir != ".data" && dir != ".try" && dir != ".catch" &&
+     dir != ".catchall") {
+    report(path, line, "unknown directive %s", dir.c_str());
+    return false;
+  }
+  if(!have_code) {
+    report(path, line, "%s outside of a method's code", dir.c_str());
+    return false;
+  }
+
+  vector<DexNameValuePair> params;
+  if(dir == ".outs") {
+    if(!arguments(words, 1)) return false;
+    if(!parse_decimal(words[1], 0, 0xFFFF, outs)) {
+      report(path, line, "bad outs size %s", words[1].c_str());
+      return false;
+    }
+  } else if(dir == ".packed") {
+    long long first_key;
+    if(words.size() < 2 ||
+       !parse_decimal(words[1], INT_MIN, INT_MAX, first_key)) {
+      report(path, line, "bad .packed");
+      return false;
+    }
+    vector<DexValue> targets;
+    for(int i = 2; i < words.size(); i++) {
+      targets.push_back(make_string(words[i]));
+    }
+    params.push_back(make_param("firstKey", make_int((dx_int)first_key)));
+    params.push_back(make_param("targets", make_array(targets)));
+    packed.push_back(make_annotation_value(make_annotation(
+        "Lorg/dxcut/dxdasm/DxdasmPacked;", params)));
+  } else if(dir == ".sparse") {
+    vector<DexValue> keys;
+    vector<DexValue> targets;
+    for(int i = 1; i + 1 < words.size(); i += 2) {
+      long long key;
+      if(!parse_decimal(words[i], INT_MIN, INT_MAX, key)) break;
+      keys.push_back(make_int((dx_int)key));
+      targets.push_back(make_string(words[i + 1]));
+    }
+    if(keys.size() * 2 + 1 != words.size()) {
+      report(path, line, "bad .sparse");
+      free_values(keys);
+      free_values(targets);
+      return false;
+    }
+    params.push_back(make_param("keys", make_array(keys)));
+    params.push_back(make_param("targets", make_array(targets)));
+    sparse.push_back(make_annotation_value(make_annotation(
+        "Lorg/dxcut/dxdasm/DxdasmSparse;", params)));
+  } else if(dir == ".data") {
+    long long width;
+    if(words.size() < 2 || !parse_decimal(words[1], 1, 8, width)) {
+      report(path, line, "bad .data");
+      return false;
+    }
+    vector<DexValue> elements;
+    for(int i = 2; i < words.size(); i++) {
+      unsigned long long v;
+      if(!parse_hex(words[i], ~0ULL, v)) {
+        report(path, line, "bad data element %s", words[i].c_str());
+        free_values(elements);
+        return false;
+      }
+      elements.push_back(make_long((dx_long)v));
+    }
+    params.push_back(make_param("elementWidth", make_int((dx_int)width)));
+    params.push_back(make_param("data", make_array(elements)));
+    data.push_back(make_annotation_value(make_annotation(
+        "Lorg/dxcut/dxdasm/DxdasmData;", params)));
+  } else if(dir == ".try") {
+    finish_try();
+    if(!arguments(words, 2)) return false;
+    if(!parse_decimal(words[2], 0, INT_MAX, try_length)) {
+      report(path, line, "bad try length %s", words[2].c_str());
+      return false;
+    }
+    have_try = true;
+    try_start = words[1];
+    have_catch_all = false;
+  } else if(!have_try) {
+    report(path, line, "%s outside of a .try", dir.c_str());
+    return false;
+  } else if(dir == ".catch") {
+    if(!arguments(words, 2)) return false;
+    if(!is_descriptor(words[1])) {
+      report(path, line, "bad catch type %s", words[1].c_str());
+      return false;
+    }
+    params.push_back(make_param("catchType", make_type(words[1])));
+    params.push_back(make_param("target", make_string(words[2])));
+    handlers.push_back(make_annotation_value(make_annotation(
+        "Lorg/dxcut/dxdasm/DxdasmHandler;", params)));
+  } else {
+    if(!arguments(words, 1)) return false;
+    if(have_catch_all) {
+      report(path, line, "duplicate .catchall");
+      return false;
+    }
+    have_catch_all = true;
+    catch_all = words[1];
+  }
+  return true;
+}
+
+bool DxasmReader::start_class(const vector<string>& words) {
+  finish_class();
+  skipping = true;
+  if(!arguments(words, 1)) return false;
+  const string& desc = words[1];
+  if(is_dxdasm_type(desc.c_str())) {
+    // dxdasm's own annotation types, which strip_classes() would drop.
+    return true;
+  }
+  typeof(clmap.begin()) it = clmap.find(desc);
+  if(it == clmap.end()) {
+    report(path, line, "class %s isn't in the dex", desc.c_str());
+    return false;
+  }
+  skipping = false;
+  dcl = it->second;
+  scl.line = line;
+  scl.name = desc;
+  return true;
+}
+
+void DxasmReader::finish_class() {
+  finish_member();
+  if(!dcl) return;
+  vector<DexNameValuePair> params;
+  params.push_back(make_param("methodAliases", make_array(method_aliases)));
+  params.push_back(make_param("fieldAliases", make_array(field_aliases)));
+  scl.annotations.push_back(make_annotation(
+      "Lorg/dxcut/dxdasm/DxdasmAliases;", params));
+  method_aliases.clear();
+  field_aliases.clear();
+
+  ok = merge_class(path, dcl, scl, merged) && ok;
+  scl.annotations.clear();
+  scl.members.clear();
+  dcl = NULL;
+}
+
+bool DxasmReader::start_member(const vector<string>& words) {
+  finish_member();
+  if(!arguments(words, 2)) return false;
+  member.line = line;
+  member.method = words[0] == ".method";
+  member.name = words[1];
+  member.params.clear();
+  if(member.method) {
+    vector<string> proto;
+    if(!split_prototype(words[2], proto)) {
+      report(path, line, "bad prototype %s", words[2].c_str());
+      return false;
+    }
+    member.type = proto[0];
+    member.params.assign(proto.begin() + 1, proto.end());
+  } else {
+    if(!is_descriptor(words[2])) {
+      report(path, line, "bad field type %s", words[2].c_str());
+      return false;
+    }
+    member.type = words[2];
+  }
+  have_member = true;
+  return true;
+}
+
+void DxasmReader::finish_member() {
+  if(!have_member) return;
+  finish_try();
+  if(have_code && outs < 0) {
+    report(path, member.line, "method %s has no .outs", member.name.c_str());
+    ok = false;
+    clear_code();
+  } else if(have_code) {
+    vector<DexNameValuePair> params;
+    params.push_back(make_param("registers", make_int((dx_int)registers)));
+    params.push_back(make_param("outsSize", make_int((dx_int)outs)));
+    params.push_back(make_param("insns", make_array(insns)));
+    params.push_back(make_param("packedSwitches", make_array(packed)));
+    params.push_back(make_param("sparseSwitches", make_array(sparse)));
+    params.push_back(make_param("dataArrays", make_array(data)));
+    params.push_back(make_param("tryBlocks", make_array(tries)));
+    member.annotations.push_back(make_annotation(
+        "Lorg/dxcut/dxdasm/DxdasmMethod;", params));
+    insns.clear();
+    packed.clear();
+    sparse.clear();
+    data.clear();
+    tries.clear();
+  }
+  scl.members.push_back(member);
+  member.annotations.clear();
+  have_member = false;
+  have_code = false;
+}
+
+void DxasmReader::finish_try() {
+  if(!have_try) return;
+  vector<DexNameValuePair> params;
+  params.push_back(make_param("startInsn", make_string(try_start)));
+  params.push_back(make_param("insnLength", make_int((dx_int)try_length)));
+  params.push_back(make_param("handlers", make_array(handlers)));
+  params.push_back(make_param("catchAllTarget",
+                              make_string(have_catch_all ? catch_all : "")));
+  tries.push_back(make_annotation_value(make_annotation(
+      "Lorg/dxcut/dxdasm/DxdasmTry;", params)));
+  handlers.clear();
+  have_try = false;
+}
+
+void DxasmReader::clear_code() {
+  free_values(insns);
+  free_values(packed);
+  free_values(sparse);
+  free_values(data);
+  free_values(tries);
+}
+
+JavaSourceMerger::JavaSourceMerger(DexFile* dx,
+                                   const map<string, dasmcl*>& clmap)
+    : clmap(clmap) {
+  for(DexClass* cl = dx->classes; !dxc_is_sentinel_class(cl); ++cl) {
+    add_known(cl->name);
+    add_known(cl->super_class);
+    for(ref_str** s = cl->interfaces ? cl->interfaces->s : NULL; s && *s;
+        ++s) {
+      add_known(*s);
+    }
+    for(int iter = 0; iter < 2; iter++)
+    for(DexField* fld = iter ? cl->instance_fields : cl->static_fields;
+        !dxc_is_sentinel_field(fld); ++fld) {
+      add_known(fld->type);
+    }
+    for(int iter = 0; iter < 2; iter++)
+    for(DexMethod* mtd = iter ? cl->virtual_methods : cl->direct_methods;
+        !dxc_is_sentinel_method(mtd); ++mtd) {
+      for(ref_str** s = mtd->prototype->s; *s; ++s) {
+        add_known(*s);
+      }
+      if(mtd->code_body) add_known_code(mtd->code_body);
+    }
+  }
+}
+
+void JavaSourceMerger::add_known(ref_str* type) {
+  if(!type) return;
+  const char* s = strip_array(type->s);
+  if(*s == 'L') known_types.insert(s);
+}
+
+void JavaSourceMerger::add_known_code(DexCode* code) {
+  for(dx_uint i = 0; i < code->insns_count; i++) {
+    DexInstruction* in = code->insns + i;
+    if(in->opcode == OP_PSUEDO) continue;
+    switch(dex_opcode_formats[in->opcode].specialType) {
+      case SPECIAL_TYPE:
+        add_known(in->special.type);
+        break;
+      case SPECIAL_FIELD:
+        add_known(in->special.field.defining_class);
+        add_known(in->special.field.type);
+        break;
+      case SPECIAL_METHOD:
+        add_known(in->special.method.defining_class);
+        for(ref_str** s = in->special.method.prototype->s; *s; ++s) {
+          add_known(*s);
+        }
+        break;
+    }
+  }
+  for(DexTryBlock* tb = code->tries; !dxc_is_sentinel_try_block(tb); ++tb) {
+    for(DexHandler* h = tb->handlers; !dxc_is_sentinel_handler(h); ++h) {
+      add_known(h->type);
+    }
+  }
+}
+
+string JavaSourceMerger::descriptor(const string& name, int dims,
+                                    const string& package,
+                                    const map<string, string>& imports) const {
+  static const char* const primitives[][2] = {
+    {"boolean", "Z"}, {"byte", "B"}, {"char", "C"}, {"short", "S"},
+    {"int", "I"}, {"long", "J"}, {"float", "F"}, {"double", "D"},
+    {"void", "V"}
+  };
+  string desc(dims, '[');
+  for(int i = 0; i < sizeof(primitives) / sizeof(*primitives); i++) {
+    if(name == primitives[i][0]) return desc + primitives[i][1];
+  }
+
+  // Qualify the name through the imports, which go by the first part of it.
+  string qualified = name;
+  size_t dot = name.find('.');
+  typeof(imports.begin()) it = imports.find(name.substr(0, dot));
+  if(it != imports.end()) {
+    qualified = it->second;
+    if(dot != string::npos) qualified.append(name, dot, string::npos);
+  } else if(dot == string::npos) {
+    // Not imported, so in the same package or java.lang.
+    string same = "L" + package + "." + name + ";";
+    if(package.empty()) same.erase(1, 1);
+    replace(same.begin(), same.end(), '.', '/');
+    string lang = "Ljava/lang/" + name + ";";
+    if(!known_types.count(same) && known_types.count(lang)) {
+      return desc + lang;
+    }
+    return desc + same;
+  }
+
+  // The dots in the qualified name separate packages up to some point and
+  // nested classes after it.  Try the places that could be from the right,
+  // so packages win, and take the first the dex knows.
+  vector<size_t> dots;
+  for(size_t i = 0; i < qualified.size(); i++) {
+    if(qualified[i] == '.') dots.push_back(i);
+  }
+  string cand = "L" + qualified + ";";
+  replace(cand.begin(), cand.end(), '.', '/');
+  string first = cand;
+  for(int i = dots.size(); i >= 0; i--) {
+    if(i < dots.size()) cand[dots[i] + 1] = '$';
+    if(known_types.count(cand)) return desc + cand;
+  }
+
+  // Otherwise go by the convention that packages are lower case and classes
+  // upper case.
+  bool nested = isupper((unsigned char)qualified[0]);
+  for(int i = 0; i < dots.size(); i++) {
+    if(nested) first[dots[i] + 1] = '$';
+    nested = nested || isupper((unsigned char)qualified[dots[i] + 1]);
+  }
+  return desc + first;
+}
+
+static bool read_file(const string& path, string& text) {
+  FILE* fin = fopen(path.c_str(), "rb");
+  if(!fin) return false;
+  char buf[1 << 16];
+  size_t n;
+  text.clear();
+  while((n = fread(buf, 1, sizeof(buf), fin)) > 0) {
+    text.append(buf, n);
+  }
+  bool ok = !ferror(fin);
+  fclose(fin);
+  return ok;
+}
+
+static bool has_suffix(const string& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  return s.size() > n && !s.compare(s.size() - n, n, suffix);
+}
+
+bool JavaSourceMerger::merge_file(const string& path) {
+  // A file named directly as well as through its directory is only merged
+  // once.
+  char* real = realpath(path.c_str(), NULL);
+  if(real) {
+    bool first = merged_files.insert(real).second;
+    free(real);
+    if(!first) return true;
+  }
+
+  vector<string>& merged = file_classes[path];
+  if(has_suffix(path, ".dxasm")) {
+    FILE* fin = fopen(path.c_str(), "r");
+    if(!fin) {
+      fprintf(stderr, "Failed to read %s\n", path.c_str());
+      return false;
+    }
+    DxasmReader reader(clmap, path, merged);
+    bool ok = reader.read(fin);
+    fclose(fin);
+    return ok;
+  }
+
+  string text;
+  if(!read_file(path, text)) {
+    fprintf(stderr, "Failed to read %s\n", path.c_str());
+    return false;
+  }
+  vector<SourceClass> classes;
+  JavaParser parser(*this, path, text.data(), text.size());
+  if(!parser.parse(classes)) {
+    for(int i = 0; i < classes.size(); i++) {
+      free_class(classes[i]);
+    }
+    return false;
+  }
+
+  bool ok = true;
+  for(int i = 0; i < classes.size(); i++) {
+    string desc = "L" + parser.package + "/" + classes[i].name + ";";
+    if(parser.package.empty()) desc.erase(1, 1);
+    replace(desc.begin(), desc.end(), '.', '/');
+    if(is_dxdasm_type(desc.c_str())) {
+      // dxdasm's own annotation types, which strip_classes() would drop.
+      free_class(classes[i]);
+      continue;
+    }
+    typeof(clmap.begin()) it = clmap.find(desc);
+    if(it == clmap.end()) {
+      report(path, classes[i].line, "class %s isn't in the dex",
+             classes[i].name.c_str());
+      ok = false;
+      free_class(classes[i]);
+      continue;
+    }
+    ok = merge_class(path, it->second, classes[i], merged) && ok;
+  }
+  return ok;
+}
+
+bool JavaSourceMerger::merge_dir(const string& path) {
+  DIR* dir = opendir(path.c_str());
+  if(!dir) {
+    fprintf(stderr, "Failed to open %s\n", path.c_str());
+    return false;
+  }
+  // Sorted so errors come out in the same order every run.
+  vector<string> names;
+  for(struct dirent* ent; (ent = readdir(dir)); ) {
+    if(ent->d_name[0] != '.') names.push_back(ent->d_name);
+  }
+  closedir(dir);
+  sort(names.begin(), names.end());
+
+  bool ok = true;
+  for(int i = 0; i < names.size(); i++) {
+    string child = path + "/" + names[i];
+    struct stat st;
+    if(stat(child.c_str(), &st)) continue;
+    if(S_ISDIR(st.st_mode)) {
+      ok = merge_dir(child) && ok;
+    } else if(has_suffix(names[i], ".java") ||
+              has_suffix(names[i], ".dxasm")) {
+      ok = merge_file(child) && ok;
+    }
+  }
+  return ok;
+}
+
+bool JavaSourceMerger::merge(const char* path) {
+  struct stat st;
+  if(stat(path, &st)) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return false;
+  }
+  return S_ISDIR(st.st_mode) ? merge_dir(path) : merge_file(path);
+}
@@ -0,0 +1,65 @@
+#ifndef JAVASOURCE_H
+#define JAVASOURCE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <dxcut/dxcut.h>
+
+#include "dasmcl.h"
+
+// Reads the Dxdasm annotations back out of the Java dxdasm writes, so dxreasm
+// can work from the source tree without a javac and dx round trip.  Only the
+// Java dxdasm emits is understood: package and import statements, class
+// headers, field and method declarations and annotations with literal
+// values.  Method bodies and field initializers are skipped.
+//
+// The annotations are attached to the matching classes, fields and methods
+// of the dex the source was written from.  That dex has to have been through
+// prep_classes() so its names are sanitized the same way as the source's.
+// Everything else comes from the dex, so declarations the dex doesn't have
+// are reported rather than added.
+//
+// The .dxasm files of dxdasm --format=dxasm carry the same annotations and
+// are read the same way.
+class JavaSourceMerger {
+ public:
+  JavaSourceMerger(DexFile* dx, const std::map<std::string, dasmcl*>& clmap);
+
+  // Merges a .java or .dxasm file, or every one below a directory.  Problems
+  // are reported to stderr.  Returns false if there were any.
+  bool merge(const char* path);
+
+  // The descriptor of the Java type 'name' with 'dims' array dimensions, as
+  // written in a file of the given package (dotted) and imports (simple name
+  // to qualified name).  Qualified names are split into package and nested
+  // classes by the types the dex knows, and by the Java naming convention for
+  // the rest.
+  std::string descriptor(const std::string& name, int dims,
+                         const std::string& package,
+                         const std::map<std::string, std::string>& imports)
+      const;
+
+  // The classes each merged file had annotations for, by their name in the
+  // dex before sanitizing.  Keyed by the path as given or as found below a
+  // given directory.
+  std::map<std::string, std::vector<std::string> > file_classes;
+
+ private:
+  bool merge_file(const std::string& path);
+  bool merge_dir(const std::string& path);
+
+  void add_known(ref_str* type);
+  void add_known_code(DexCode* code);
+
+  const std::map<std::string, dasmcl*>& clmap;
+  // Every type the dex mentions, by descriptor.
+  std::unordered_set<std::string> known_types;
+  // Real paths of the files merged so far.
+  std::set<std::string> merged_files;
+};
+
+#endif // JAVASOURCE_H
@@ -1,39 +1,146 @@
 #include "mutf8.h"
 
-#include <cstdio>
-
-unsigned int mutf8NextCodePoint(char const** s) {
-  unsigned char head = *(*s)++;
-  if(head >> 7 == 0x00) {
-    // A single byte code point.
-    return head;
-  } else if(head >> 5 == 0x06) {
-    // Two byte code point.
-    unsigned char n1 = *(*s)++;
-    if(n1 >> 6 != 0x02) {
-      fprintf(stderr, "error decoding string\n");
-      fflush(stderr);
-      return 0;
-    }
-    return (head & 0x1F) << 6 | n1 & 0x3F;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MUTF8_X86
+#endif
+
+using namespace std;
+
+static size_t ascii_prefix_scalar(const char* s, size_t n) {
+  size_t i = 0;
+  while(i < n && (unsigned char)s[i] < 0x80) i++;
+  return i;
+}
+
+#ifdef MUTF8_X86
+__attribute__((target("sse2")))
+static size_t ascii_prefix_sse2(const char* s, size_t n) {
+  size_t i = 0;
+  for(; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    int mask = _mm_movemask_epi8(v);
+    if(mask) return i + __builtin_ctz(mask);
+  }
+  return i + ascii_prefix_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_prefix_avx2(const char* s, size_t n) {
+  size_t i = 0;
+  for(; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+    unsigned mask = _mm256_movemask_epi8(v);
+    if(mask) return i + __builtin_ctz(mask);
+  }
+  return i + ascii_prefix_sse2(s + i, n - i);
+}
+
+typedef size_t (*AsciiPrefixFn)(const char*, size_t);
+
+static AsciiPrefixFn pick_ascii_prefix() {
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) return ascii_prefix_avx2;
+  if(__builtin_cpu_supports("sse2")) return ascii_prefix_sse2;
+  return ascii_prefix_scalar;
+}
+#endif
+
+size_t mutf8_ascii_prefix(const char* s, size_t n) {
+  // Short strings are common (identifiers, type names) and not worth the
+  // dispatch.
+  if(n < 16) return ascii_prefix_scalar(s, n);
+#ifdef MUTF8_X86
+  static const AsciiPrefixFn fn = pick_ascii_prefix();
+  return fn(s, n);
+#else
+  return ascii_prefix_scalar(s, n);
+#endif
+}
+
+static bool fail(Mutf8Error* error, size_t pos, const char* reason) {
+  if(error) {
+    error->pos = pos;
+    error->reason = reason;
+  }
+  return false;
+}
+
+// Decodes a single one, two or three byte sequence without joining
+// surrogates.
+static bool decode_unit(const char* s, size_t n, size_t pos, size_t* len,
+                        unsigned int* unit, Mutf8Error* error) {
+  unsigned char head = s[pos];
+  if(head < 0x80) {
+    *unit = head;
+    *len = 1;
+    return true;
+  }
+  if(head >> 5 == 0x06) {
+    *len = 2;
   } else if(head >> 4 == 0x0E) {
-    // Three byte code point.
-    unsigned char n1 = *(*s)++;
-    if(n1 >> 6 != 0x02) {
-      fprintf(stderr, "error decoding string\n");
-      fflush(stderr);
-      return 0;
+    *len = 3;
+  } else {
+    return fail(error, pos, "invalid lead byte");
+  }
+  if(pos + *len > n) return fail(error, pos, "truncated sequence");
+  unsigned int cp = head & (*len == 2 ? 0x1F : 0x0F);
+  for(size_t i = 1; i < *len; i++) {
+    unsigned char next = s[pos + i];
+    if(next >> 6 != 0x02) return fail(error, pos, "bad continuation byte");
+    cp = (cp << 6) | (next & 0x3F);
+  }
+  *unit = cp;
+  return true;
+}
+
+bool mutf8_decode_one(const char* s, size_t n, size_t* pos, unsigned int* cp,
+                      Mutf8Error* error) {
+  size_t len;
+  unsigned int unit;
+  if(!decode_unit(s, n, *pos, &len, &unit, error)) return false;
+  if(0xD800 <= unit && unit < 0xDC00 && *pos + len < n) {
+    // A high surrogate.  Join it with a following low surrogate; unpaired
+    // surrogates are legal in Java strings and pass through as they are.
+    size_t len2;
+    unsigned int low;
+    if(decode_unit(s, n, *pos + len, &len2, &low, NULL) &&
+       0xDC00 <= low && low < 0xE000) {
+      *cp = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+      *pos += len + len2;
+      return true;
     }
-    unsigned char n2 = *(*s)++;
-    if(n2 >> 6 != 0x02) {
-      fprintf(stderr, "error decoding string\n");
-      fflush(stderr);
-      return 0;
+  }
+  *cp = unit;
+  *pos += len;
+  return true;
+}
+
+bool mutf8_decode(const char* s, size_t n, vector<unsigned int>& out,
+                  Mutf8Error* error) {
+  size_t pos = 0;
+  while(pos < n) {
+    size_t run = mutf8_ascii_prefix(s + pos, n - pos);
+    for(size_t end = pos + run; pos < end; pos++) {
+      out.push_back((unsigned char)s[pos]);
     }
-    return (head & 0x1F) << 12 | (n1 & 0x3F) << 6 | n2 & 0x3F;
-  } else {
-    fprintf(stderr, "error decoding string\n");
-    fflush(stderr);
-    return 0;
+    if(pos == n) break;
+    unsigned int cp;
+    if(!mutf8_decode_one(s, n, &pos, &cp, error)) return false;
+    out.push_back(cp);
+  }
+  return true;
+}
+
+bool mutf8_validate(const char* s, size_t n, Mutf8Error* error) {
+  size_t pos = 0;
+  while(pos < n) {
+    pos += mutf8_ascii_prefix(s + pos, n - pos);
+    if(pos == n) break;
+    size_t len;
+    unsigned int unit;
+    if(!decode_unit(s, n, pos, &len, &unit, error)) return false;
+    pos += len;
   }
+  return true;
 }
@@ -1,6 +1,33 @@
 #ifndef MUTF8_H
 #define MUTF8_H
 
-unsigned int mutf8NextCodePoint(char const** s);
+#include <cstddef>
+#include <vector>
+
+// Why and where a string failed to decode.  'pos' is the byte offset of the
+// start of the bad sequence.
+struct Mutf8Error {
+  size_t pos;
+  const char* reason;
+};
+
+// Number of leading bytes of s[0, n) below 0x80.  Scans 32 or 16 bytes at a
+// time with AVX2 or SSE2 where the CPU has them.
+size_t mutf8_ascii_prefix(const char* s, size_t n);
+
+// Decodes the code point starting at s[*pos] and moves *pos past it.  A
+// surrogate pair encoded as two three byte sequences comes back as a single
+// supplementary code point.  On malformed input returns false, fills in
+// 'error' if given and leaves *pos alone.
+bool mutf8_decode_one(const char* s, size_t n, size_t* pos, unsigned int* cp,
+                      Mutf8Error* error = NULL);
+
+// Appends the code points of s[0, n) to 'out'.  Stops at the first malformed
+// sequence.
+bool mutf8_decode(const char* s, size_t n, std::vector<unsigned int>& out,
+                  Mutf8Error* error = NULL);
+
+// Checks that s[0, n) is well formed without decoding it.
+bool mutf8_validate(const char* s, size_t n, Mutf8Error* error = NULL);
 
 #endif // MUTF8_H
@@ -0,0 +1,97 @@
+#include "serve.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+RenderCache::RenderCache(size_t max_bytes) : used(0), max_bytes(max_bytes) {
+}
+
+const string* RenderCache::find(const string& key) {
+  typeof(index.begin()) it = index.find(key);
+  if(it == index.end()) return NULL;
+  entries.splice(entries.begin(), entries, it->second);
+  return &it->second->second;
+}
+
+void RenderCache::insert(const string& key, const string& text) {
+  typeof(index.begin()) it = index.find(key);
+  if(it != index.end()) erase(it->second);
+  if(text.size() > max_bytes) return;
+  while(used + text.size() > max_bytes) erase(--entries.end());
+  entries.push_front(make_pair(key, text));
+  index[key] = entries.begin();
+  used += text.size();
+}
+
+void RenderCache::clear() {
+  entries.clear();
+  index.clear();
+  used = 0;
+}
+
+void RenderCache::erase(Entries::iterator it) {
+  used -= it->second.size();
+  index.erase(it->first);
+  entries.erase(it);
+}
+
+int listen_unix(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  struct stat st;
+  if(lstat(path, &st) == 0) {
+    if(!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s exists and isn't a socket\n", path);
+      close(fd);
+      return -1;
+    }
+    // Only take the socket over if nothing answers on it any more.
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+      fprintf(stderr, "Another server is listening on %s\n", path);
+      close(fd);
+      return -1;
+    }
+    unlink(path);
+  }
+  if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+     listen(fd, SOMAXCONN) == -1) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool send_all(int fd, const char* data, size_t n) {
+  while(n > 0) {
+    // MSG_NOSIGNAL so a client hanging up doesn't take the server with it.
+    ssize_t amt = send(fd, data, n, MSG_NOSIGNAL);
+    if(amt == -1) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    data += amt;
+    n -= amt;
+  }
+  return true;
+}
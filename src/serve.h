@@ -0,0 +1,48 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+// Rendered classes for dxdasm --serve, keyed by class, up to a total size in
+// bytes.  The least recently used are dropped first when it's full.  Not
+// thread safe.
+class RenderCache {
+ public:
+  explicit RenderCache(size_t max_bytes);
+
+  // The text cached for 'key' or NULL.  A hit makes it the most recently
+  // used.  The pointer is good until the next insert() or clear().
+  const std::string* find(const std::string& key);
+
+  // Text larger than the whole cache isn't kept.
+  void insert(const std::string& key, const std::string& text);
+  void clear();
+
+  size_t size() const { return index.size(); }
+  size_t bytes() const { return used; }
+
+ private:
+  typedef std::list<std::pair<std::string, std::string> > Entries;
+
+  void erase(Entries::iterator it);
+
+  // Most recently used first.
+  Entries entries;
+  std::map<std::string, Entries::iterator> index;
+  size_t used;
+  size_t max_bytes;
+};
+
+// Binds a Unix stream socket to 'path' and listens on it.  A socket file left
+// there by a server that's gone is replaced.  Returns the socket, or -1 after
+// reporting why not.
+int listen_unix(const char* path);
+
+// Writes all of 'n' bytes to a socket.  Returns false if the peer is gone.
+bool send_all(int fd, const char* data, size_t n);
+
+#endif // SERVE_H
@@ -0,0 +1,71 @@
+#include "symtab.h"
+
+#include <string.h>
+
+using namespace std;
+
+static size_t mix(size_t h, size_t v) {
+  return (h ^ v) * 0x100000001B3ull;
+}
+
+size_t CStrHash::operator()(const char* s) const {
+  size_t h = 0xCBF29CE484222325ull;
+  for(; *s; ++s) h = mix(h, (unsigned char)*s);
+  return h;
+}
+
+bool CStrEqual::operator()(const char* a, const char* b) const {
+  return !strcmp(a, b);
+}
+
+size_t SymbolTable::TripleHash::operator()(const Triple& t) const {
+  return mix(mix(mix(0xCBF29CE484222325ull, t.a), t.b), t.c);
+}
+
+size_t SymbolTable::IdsHash::operator()(const vector<dx_uint>& ids) const {
+  size_t h = 0xCBF29CE484222325ull;
+  for(int i = 0; i < ids.size(); i++) h = mix(h, ids[i]);
+  return h;
+}
+
+dx_uint SymbolTable::string_id(const char* s) {
+  typeof(string_ids.begin()) it = string_ids.find(s);
+  if(it != string_ids.end()) return it->second;
+  dx_uint id = strings.size();
+  strings.push_back(s);
+  string_ids[strings.back().c_str()] = id;
+  return id;
+}
+
+dx_uint SymbolTable::field_id(const ref_field* fld) {
+  Triple key = {string_id(fld->defining_class->s), string_id(fld->name->s),
+                string_id(fld->type->s)};
+  typeof(field_ids.begin()) it = field_ids.find(key);
+  if(it != field_ids.end()) return it->second;
+  dx_uint id = field_ids.size();
+  field_ids[key] = id;
+  return id;
+}
+
+dx_uint SymbolTable::method_id(const ref_method* mtd) {
+  prototype_key.clear();
+  for(ref_str** proto = mtd->prototype->s; *proto; ++proto) {
+    prototype_key.push_back(string_id((*proto)->s));
+  }
+  typeof(prototype_ids.begin()) pit = prototype_ids.find(prototype_key);
+  dx_uint proto;
+  if(pit != prototype_ids.end()) {
+    proto = pit->second;
+  } else {
+    proto = prototype_ids.size();
+    prototype_ids[prototype_key] = proto;
+  }
+
+  Triple key = {string_id(mtd->defining_class->s), string_id(mtd->name->s),
+                proto};
+  typeof(method_ids.begin()) it = method_ids.find(key);
+  if(it != method_ids.end()) return it->second;
+  dx_uint id = method_ids.size();
+  method_ids[key] = id;
+  return id;
+}
@@ -0,0 +1,59 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dxcut/dxcut.h>
+
+// Hashing and comparison of NUL terminated strings by content, for hash maps
+// looked up without building a std::string first.
+struct CStrHash {
+  size_t operator()(const char* s) const;
+};
+
+struct CStrEqual {
+  bool operator()(const char* a, const char* b) const;
+};
+
+// Dex-wide numbering of strings and of the field and method references made
+// by code, so references can be compared and hashed as integers.  Equal
+// references get the same id whichever copies of their strings they point
+// to, and ids stay the same as class bodies are loaded and freed.
+//
+// Strings, fields and methods are numbered separately from 0.  Not thread
+// safe.
+class SymbolTable {
+ public:
+  dx_uint string_id(const char* s);
+  dx_uint field_id(const ref_field* fld);
+  dx_uint method_id(const ref_method* mtd);
+
+ private:
+  struct Triple {
+    dx_uint a, b, c;
+    bool operator==(const Triple& o) const {
+      return a == o.a && b == o.b && c == o.c;
+    }
+  };
+  struct TripleHash {
+    size_t operator()(const Triple& t) const;
+  };
+  struct IdsHash {
+    size_t operator()(const std::vector<dx_uint>& ids) const;
+  };
+
+  // The ids point into 'strings', which never moves its elements.
+  std::deque<std::string> strings;
+  std::unordered_map<const char*, dx_uint, CStrHash, CStrEqual> string_ids;
+
+  std::unordered_map<std::vector<dx_uint>, dx_uint, IdsHash> prototype_ids;
+  std::vector<dx_uint> prototype_key;
+
+  std::unordered_map<Triple, dx_uint, TripleHash> field_ids;
+  std::unordered_map<Triple, dx_uint, TripleHash> method_ids;
+};
+
+#endif // SYMTAB_H
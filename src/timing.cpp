@@ -0,0 +1,227 @@
+#include "timing.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+using namespace std;
+
+static double clock_seconds(clockid_t id) {
+  struct timespec ts;
+  if(clock_gettime(id, &ts) == -1) return 0;
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double wall_seconds() {
+  return clock_seconds(CLOCK_MONOTONIC);
+}
+
+double process_cpu_seconds() {
+  return clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+double thread_cpu_seconds() {
+  return clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+PhaseTimes::PhaseTimes()
+    : created_wall(wall_seconds()), created_cpu(process_cpu_seconds()),
+      running(NULL), start_wall(0), start_cpu(0) {
+}
+
+void PhaseTimes::start(const char* phase) {
+  stop();
+  running = phase;
+  start_wall = wall_seconds();
+  start_cpu = process_cpu_seconds();
+}
+
+void PhaseTimes::stop() {
+  if(!running) return;
+  add(running, wall_seconds() - start_wall,
+      process_cpu_seconds() - start_cpu);
+  running = NULL;
+}
+
+void PhaseTimes::add(const char* phase, double wall, double cpu) {
+  for(int i = 0; i < phases.size(); i++) {
+    if(phases[i].name == phase) {
+      phases[i].wall += wall;
+      phases[i].cpu += cpu;
+      return;
+    }
+  }
+  Phase p;
+  p.name = phase;
+  p.wall = wall;
+  p.cpu = cpu;
+  phases.push_back(p);
+}
+
+void PhaseTimes::merge(const PhaseTimes& other) {
+  lock_guard<mutex> guard(lock);
+  for(int i = 0; i < other.phases.size(); i++) {
+    const Phase& p = other.phases[i];
+    add(p.name.c_str(), p.wall, p.cpu);
+  }
+}
+
+bool PhaseTimes::write(const char* path) const {
+  FILE* fout = strcmp(path, "-") ? fopen(path, "w") : stdout;
+  if(!fout) {
+    perror(path);
+    return false;
+  }
+  for(int i = 0; i < phases.size(); i++) {
+    fprintf(fout, "%s %.6f %.6f\n", phases[i].name.c_str(), phases[i].wall,
+            phases[i].cpu);
+  }
+  fprintf(fout, "total %.6f %.6f\n", wall_seconds() - created_wall,
+          process_cpu_seconds() - created_cpu);
+  if((fout == stdout ? fflush(fout) : fclose(fout)) != 0) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+PhaseClock::PhaseClock(PhaseTimes* times) : times(times), wall(0), cpu(0) {
+  if(times) {
+    wall = wall_seconds();
+    cpu = thread_cpu_seconds();
+  }
+}
+
+void PhaseClock::lap(const char* phase) {
+  if(!times) return;
+  double now_wall = wall_seconds();
+  double now_cpu = thread_cpu_seconds();
+  times->add(phase, now_wall - wall, now_cpu - cpu);
+  wall = now_wall;
+  cpu = now_cpu;
+}
+
+RunStats::RunStats(size_t top) : top(top) {
+  static const char* const standard[] = {
+    "classes", "methods", "instructions", "bytes_written", "files_created"
+  };
+  for(int i = 0; i < sizeof(standard) / sizeof(*standard); i++) {
+    Counter c;
+    c.name = standard[i];
+    c.value = 0;
+    counters.push_back(c);
+  }
+}
+
+void RunStats::count(const char* counter, unsigned long long n) {
+  lock_guard<mutex> guard(lock);
+  for(int i = 0; i < counters.size(); i++) {
+    if(counters[i].name == counter) {
+      counters[i].value += n;
+      return;
+    }
+  }
+  Counter c;
+  c.name = counter;
+  c.value = n;
+  counters.push_back(c);
+}
+
+void RunStats::add_class(const string& name, double wall,
+                         unsigned long long insns) {
+  if(!top) return;
+  lock_guard<mutex> guard(lock);
+  ClassTime ct;
+  ct.name = name;
+  ct.wall = wall;
+  ct.insns = insns;
+  slowest.push_back(ct);
+  // Sorting on every class would be quadratic; let the list grow to twice
+  // its size first.
+  if(slowest.size() >= 2 * top) trim();
+}
+
+void RunStats::trim() {
+  sort(slowest.begin(), slowest.end());
+  if(slowest.size() > top) slowest.resize(top);
+}
+
+static void write_json_string(FILE* fout, const string& s) {
+  fputc('"', fout);
+  for(int i = 0; i < s.size(); i++) {
+    unsigned char ch = s[i];
+    if(ch == '"' || ch == '\\') {
+      fprintf(fout, "\\%c", ch);
+    } else if(ch < 0x20) {
+      fprintf(fout, "\\u%04x", ch);
+    } else {
+      fputc(ch, fout);
+    }
+  }
+  fputc('"', fout);
+}
+
+bool RunStats::write(const char* path, const PhaseTimes& times) {
+  lock_guard<mutex> guard(lock);
+  trim();
+  double total_wall = wall_seconds() - times.created_wall;
+  double total_cpu = process_cpu_seconds() - times.created_cpu;
+  const vector<PhaseTimes::Phase>& phases = times.phases;
+
+  if(!path) {
+    fprintf(stderr, "%-12s %12s %12s\n", "phase", "wall", "cpu");
+    for(int i = 0; i < phases.size(); i++) {
+      fprintf(stderr, "%-12s %12.6f %12.6f\n", phases[i].name.c_str(),
+              phases[i].wall, phases[i].cpu);
+    }
+    fprintf(stderr, "%-12s %12.6f %12.6f\n", "total", total_wall, total_cpu);
+    fprintf(stderr, "\n");
+    for(int i = 0; i < counters.size(); i++) {
+      fprintf(stderr, "%-15s %llu\n", counters[i].name.c_str(),
+              counters[i].value);
+    }
+    if(!slowest.empty()) {
+      fprintf(stderr, "\nslowest classes:\n");
+    }
+    for(int i = 0; i < slowest.size(); i++) {
+      fprintf(stderr, "%12.6f %8llu insns  %s\n", slowest[i].wall,
+              slowest[i].insns, slowest[i].name.c_str());
+    }
+    return true;
+  }
+
+  FILE* fout = fopen(path, "w");
+  if(!fout) {
+    perror(path);
+    return false;
+  }
+  fprintf(fout, "{\n  \"phases\": [");
+  for(int i = 0; i < phases.size(); i++) {
+    fprintf(fout, "%s\n    {\"name\": ", i ? "," : "");
+    write_json_string(fout, phases[i].name);
+    fprintf(fout, ", \"wall_s\": %.6f, \"cpu_s\": %.6f}", phases[i].wall,
+            phases[i].cpu);
+  }
+  fprintf(fout, "\n  ],\n  \"total\": {\"wall_s\": %.6f, "
+                "\"cpu_s\": %.6f},\n  \"counters\": {", total_wall,
+          total_cpu);
+  for(int i = 0; i < counters.size(); i++) {
+    fprintf(fout, "%s\n    ", i ? "," : "");
+    write_json_string(fout, counters[i].name);
+    fprintf(fout, ": %llu", counters[i].value);
+  }
+  fprintf(fout, "\n  },\n  \"slowest_classes\": [");
+  for(int i = 0; i < slowest.size(); i++) {
+    fprintf(fout, "%s\n    {\"class\": ", i ? "," : "");
+    write_json_string(fout, slowest[i].name);
+    fprintf(fout, ", \"wall_s\": %.6f, \"instructions\": %llu}",
+            slowest[i].wall, slowest[i].insns);
+  }
+  fprintf(fout, "%s]\n}\n", slowest.empty() ? "" : "\n  ");
+  if(fclose(fout) != 0) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,105 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Wall clock and CPU seconds spent in each phase of a run, kept in the order
+// the phases first ran.  Phases run by worker threads are measured per
+// thread with PhaseClock and merged in, so their times add up the work of
+// every thread.
+class PhaseTimes {
+ public:
+  PhaseTimes();
+
+  // Ends the running phase, if any, and starts 'phase'.  Only for the main
+  // thread.
+  void start(const char* phase);
+  void stop();
+
+  // Not thread safe; workers keep their own PhaseTimes and merge() them.
+  void add(const char* phase, double wall, double cpu);
+  void merge(const PhaseTimes& other);
+
+  // Writes one "phase wall cpu" line per phase followed by a "total" line
+  // covering the whole run.  "-" writes to stdout.
+  bool write(const char* path) const;
+
+ private:
+  friend class RunStats;
+
+  struct Phase {
+    std::string name;
+    double wall;
+    double cpu;
+  };
+
+  std::mutex lock;
+  std::vector<Phase> phases;
+  double created_wall, created_cpu;
+  const char* running;
+  double start_wall, start_cpu;
+};
+
+// Laps of work done on the calling thread.  Does nothing when 'times' is
+// NULL so callers don't have to check.
+class PhaseClock {
+ public:
+  explicit PhaseClock(PhaseTimes* times);
+
+  // Charges everything since the previous lap to 'phase'.
+  void lap(const char* phase);
+
+ private:
+  PhaseTimes* times;
+  double wall, cpu;
+};
+
+// Counters and the slowest classes of a run, reported by --stats.  Thread
+// safe so workers can report each class as they finish it.
+class RunStats {
+ public:
+  // Keeps the 'top' slowest classes.
+  explicit RunStats(size_t top);
+
+  // Adds 'n' to a counter.  classes, methods, instructions, bytes_written
+  // and files_created always show up in the report, even if never counted.
+  void count(const char* counter, unsigned long long n);
+
+  void add_class(const std::string& name, double wall,
+                 unsigned long long insns);
+
+  // Writes 'times', the counters and the slowest classes as a table to
+  // stderr if 'path' is NULL, as a JSON object to 'path' otherwise.
+  bool write(const char* path, const PhaseTimes& times);
+
+ private:
+  struct Counter {
+    std::string name;
+    unsigned long long value;
+  };
+
+  struct ClassTime {
+    std::string name;
+    double wall;
+    unsigned long long insns;
+
+    bool operator<(const ClassTime& other) const {
+      return wall > other.wall;
+    }
+  };
+
+  void trim();
+
+  std::mutex lock;
+  size_t top;
+  std::vector<Counter> counters;
+  std::vector<ClassTime> slowest;
+};
+
+double wall_seconds();
+double process_cpu_seconds();
+double thread_cpu_seconds();
+
+#endif // TIMING_H
@@ -0,0 +1,152 @@
+#include "watch.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// A file counts as changed once it has been written and closed, so a rebuild
+// doesn't start on a half written file.  Moves are how most tools replace a
+// file in one step.
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                    IN_MOVED_TO)
+
+FileWatcher::FileWatcher() {
+  fd = inotify_init1(IN_CLOEXEC);
+  if(fd == -1) perror("inotify_init1");
+}
+
+FileWatcher::~FileWatcher() {
+  if(fd != -1) close(fd);
+}
+
+bool FileWatcher::add(const string& path) {
+  if(fd == -1) return false;
+  struct stat st;
+  if(stat(path.c_str(), &st)) {
+    fprintf(stderr, "Failed to open %s\n", path.c_str());
+    return false;
+  }
+  if(S_ISDIR(st.st_mode)) return add_dir(path);
+
+  // A file is watched through its directory so it can be replaced.
+  size_t slash = path.rfind('/');
+  string dir = ".";
+  string name = path;
+  if(slash != string::npos) {
+    dir = slash ? path.substr(0, slash) : "/";
+    name = path.substr(slash + 1);
+  }
+  int wd = inotify_add_watch(fd, dir.c_str(), WATCH_MASK);
+  if(wd == -1) {
+    perror(dir.c_str());
+    return false;
+  }
+  dirs.insert(make_pair(wd, dir));
+  files[wd][name] = path;
+  return true;
+}
+
+bool FileWatcher::add_dir(const string& path) {
+  int wd = inotify_add_watch(fd, path.c_str(), WATCH_MASK | IN_ONLYDIR);
+  if(wd == -1) {
+    perror(path.c_str());
+    return false;
+  }
+  dirs.insert(make_pair(wd, path));
+  trees.insert(wd);
+
+  DIR* dir = opendir(path.c_str());
+  if(!dir) {
+    fprintf(stderr, "Failed to open %s\n", path.c_str());
+    return false;
+  }
+  bool ok = true;
+  for(struct dirent* ent; (ent = readdir(dir)); ) {
+    if(ent->d_name[0] == '.') continue;
+    string child = path + "/" + ent->d_name;
+    struct stat st;
+    if(!stat(child.c_str(), &st) && S_ISDIR(st.st_mode)) {
+      ok = add_dir(child) && ok;
+    }
+  }
+  closedir(dir);
+  return ok;
+}
+
+bool FileWatcher::read_events(set<string>& changed) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n = read(fd, buf, sizeof(buf));
+  if(n == -1) {
+    if(errno == EINTR || errno == EAGAIN) return true;
+    perror("inotify");
+    return false;
+  }
+  for(char* p = buf; p < buf + n; ) {
+    struct inotify_event* ev = (struct inotify_event*)p;
+    p += sizeof(struct inotify_event) + ev->len;
+
+    if(ev->mask & IN_Q_OVERFLOW) {
+      // Events were lost, so anything could have changed.
+      for(typeof(files.begin()) it = files.begin(); it != files.end(); ++it) {
+        for(typeof(it->second.begin()) jt = it->second.begin();
+            jt != it->second.end(); ++jt) {
+          changed.insert(jt->second);
+        }
+      }
+      for(typeof(trees.begin()) it = trees.begin(); it != trees.end(); ++it) {
+        changed.insert(dirs[*it]);
+      }
+      continue;
+    }
+    if(ev->mask & IN_IGNORED) {
+      dirs.erase(ev->wd);
+      trees.erase(ev->wd);
+      files.erase(ev->wd);
+      continue;
+    }
+    if(!ev->len) continue;
+
+    const char* name = ev->name;
+    typeof(files.begin()) fit = files.find(ev->wd);
+    if(fit != files.end()) {
+      typeof(fit->second.begin()) it = fit->second.find(name);
+      if(it != fit->second.end()) changed.insert(it->second);
+    }
+    if(trees.count(ev->wd) && name[0] != '.') {
+      string path = dirs[ev->wd] + "/" + name;
+      changed.insert(path);
+      if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        add_dir(path);
+      }
+    }
+  }
+  return true;
+}
+
+bool FileWatcher::wait(set<string>& changed, int quiet_ms) {
+  if(fd == -1) return false;
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  int timeout = -1;
+  while(true) {
+    int ready = poll(&pfd, 1, timeout);
+    if(ready == -1) {
+      if(errno == EINTR) continue;
+      perror("poll");
+      return false;
+    }
+    if(ready == 0) return true;
+    if(!read_events(changed)) return false;
+    // Events for other files in a watched file's directory don't count.
+    if(!changed.empty()) timeout = quiet_ms;
+  }
+}
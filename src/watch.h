@@ -0,0 +1,39 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <map>
+#include <set>
+#include <string>
+
+// Waits for files to change, for dxreasm --watch.  Built on inotify, so
+// Linux only.  Not thread safe.
+class FileWatcher {
+ public:
+  FileWatcher();
+  ~FileWatcher();
+
+  // Watches a file, or a directory and everything that is or comes to be
+  // below it.  Reports why not and returns false if it can't be watched.
+  bool add(const std::string& path);
+
+  // Blocks until something watched changes, then until nothing has changed
+  // for 'quiet_ms' so a build writing many files is picked up in one go.
+  // The paths that were written, created, moved or deleted are added to
+  // 'changed', named as the file given to add() or as found below a given
+  // directory.  Returns false if watching failed.
+  bool wait(std::set<std::string>& changed, int quiet_ms);
+
+ private:
+  bool add_dir(const std::string& path);
+  bool read_events(std::set<std::string>& changed);
+
+  int fd;
+  // The directory each watch is on.
+  std::map<int, std::string> dirs;
+  // Watches on whole directories, as opposed to for the given files in them.
+  std::set<int> trees;
+  // The files given to add() by watch and name in the directory.
+  std::map<int, std::map<std::string, std::string> > files;
+};
+
+#endif // WATCH_H
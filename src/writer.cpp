@@ -0,0 +1,93 @@
+#include "writer.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char spaces[] =
+    "                                                                ";
+
+ClassWriter& ClassWriter::indent(int depth) {
+  for(int n = depth * 2; n > 0; ) {
+    int chunk = min(n, (int)sizeof(spaces) - 1);
+    buf.append(spaces, chunk);
+    n -= chunk;
+  }
+  return *this;
+}
+
+ClassWriter& ClassWriter::operator<<(long long v) {
+  unsigned long long mag = v;
+  if(v < 0) {
+    buf += '-';
+    mag = -mag;
+  }
+  return *this << mag;
+}
+
+ClassWriter& ClassWriter::operator<<(unsigned long long v) {
+  char tmp[24];
+  char* p = tmp + sizeof(tmp);
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while(v);
+  buf.append(p, tmp + sizeof(tmp) - p);
+  return *this;
+}
+
+ClassWriter& ClassWriter::operator<<(const Dec& v) {
+  unsigned long long mag = v.value;
+  int digits = v.digits;
+  if(v.value < 0) {
+    // Like printf the sign counts towards the field width.
+    buf += '-';
+    mag = -mag;
+    digits--;
+  }
+  char tmp[24];
+  char* p = tmp + sizeof(tmp);
+  do {
+    *--p = '0' + mag % 10;
+    mag /= 10;
+  } while(mag);
+  for(int n = digits - (tmp + sizeof(tmp) - p); n > 0; n--) buf += '0';
+  buf.append(p, tmp + sizeof(tmp) - p);
+  return *this;
+}
+
+ClassWriter& ClassWriter::operator<<(const Hex& v) {
+  const char* digits = v.upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  unsigned long long x = v.value;
+  char tmp[20];
+  char* p = tmp + sizeof(tmp);
+  do {
+    *--p = digits[x & 0xF];
+    x >>= 4;
+  } while(x);
+  for(int n = v.digits - (tmp + sizeof(tmp) - p); n > 0; n--) buf += '0';
+  buf.append(p, tmp + sizeof(tmp) - p);
+  return *this;
+}
+
+bool ClassWriter::write_file(const char* path) const {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd == -1) return false;
+  const char* p = buf.data();
+  size_t left = buf.size();
+  while(left) {
+    ssize_t amt = write(fd, p, left);
+    if(amt == -1) {
+      if(errno == EINTR) continue;
+      close(fd);
+      return false;
+    }
+    p += amt;
+    left -= amt;
+  }
+  return close(fd) == 0;
+}
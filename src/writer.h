@@ -0,0 +1,70 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <string>
+
+// Zero padded decimal, the equivalent of printf's "%0*d".
+struct Dec {
+  Dec(long long value, int digits) : value(value), digits(digits) {}
+
+  long long value;
+  int digits;
+};
+
+// Hexadecimal with at least 'digits' digits, the equivalent of "%.*X".
+struct Hex {
+  Hex(unsigned long long value, int digits = 1, bool upper = true)
+      : value(value), digits(digits), upper(upper) {}
+
+  unsigned long long value;
+  int digits;
+  bool upper;
+};
+
+// Accumulates the text of one output file in memory.  The buffer keeps its
+// capacity across clear() so a writer can be reused for many classes, and the
+// finished file is written out with a single write().
+class ClassWriter {
+ public:
+  ClassWriter& indent(int depth);
+
+  ClassWriter& operator<<(char c) {
+    buf += c;
+    return *this;
+  }
+  ClassWriter& operator<<(const char* s) {
+    buf += s;
+    return *this;
+  }
+  ClassWriter& operator<<(const std::string& s) {
+    buf += s;
+    return *this;
+  }
+  ClassWriter& append(const char* s, size_t n) {
+    buf.append(s, n);
+    return *this;
+  }
+  ClassWriter& operator<<(int v) { return *this << (long long)v; }
+  ClassWriter& operator<<(unsigned int v) {
+    return *this << (unsigned long long)v;
+  }
+  ClassWriter& operator<<(long v) { return *this << (long long)v; }
+  ClassWriter& operator<<(unsigned long v) {
+    return *this << (unsigned long long)v;
+  }
+  ClassWriter& operator<<(long long v);
+  ClassWriter& operator<<(unsigned long long v);
+  ClassWriter& operator<<(const Dec& v);
+  ClassWriter& operator<<(const Hex& v);
+
+  void clear() { buf.clear(); }
+  size_t size() const { return buf.size(); }
+  const std::string& str() const { return buf; }
+
+  bool write_file(const char* path) const;
+
+ private:
+  std::string buf;
+};
+
+#endif // WRITER_H